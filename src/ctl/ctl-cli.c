@@ -30,6 +30,8 @@
 #include <sys/wait.h>
 #include <systemd/sd-bus.h>
 #include "ctl.h"
+#include "loopstat.h"
+#include "metrics.h"
 #include "shl_macro.h"
 #include "shl_util.h"
 
@@ -117,6 +119,20 @@ int cli_help(const struct cli_cmd *cmds, int whitespace)
 	return 0;
 }
 
+/* metrics of this process, i.e. its RTSP buses */
+int cli_print_metrics(void)
+{
+	_shl_free_ char *dump = NULL;
+	int r;
+
+	r = metrics_format(&dump);
+	if (r < 0)
+		return cli_ERR(r);
+
+	cli_printf("%s", dump);
+	return 0;
+}
+
 int cli_do(const struct cli_cmd *cmds, char **args, unsigned int n)
 {
 	unsigned int i;
@@ -208,6 +224,7 @@ static int cli_stdin_fn(sd_event_source *source,
 			uint32_t mask,
 			void *data)
 {
+	LOOPSTAT("cli.stdin");
 	if (mask & EPOLLIN) {
 		rl_callback_read_char();
 		return 0;
@@ -223,9 +240,21 @@ static int cli_signal_fn(sd_event_source *source,
 			 const struct signalfd_siginfo *ssi,
 			 void *data)
 {
+	LOOPSTAT("cli.signal");
+	siginfo_t si;
+
 	if (ssi->ssi_signo == SIGCHLD) {
 		cli_debug("caught SIGCHLD for %d", (int)ssi->ssi_pid);
-		waitid(P_PID, ssi->ssi_pid, NULL, WNOHANG|WEXITED);
+
+		/* signals coalesce, reap every child that is gone */
+		for (;;) {
+			si.si_pid = 0;
+			if (waitid(P_ALL, 0, &si, WNOHANG|WEXITED) < 0 ||
+			    !si.si_pid)
+				break;
+
+			cli_fn_child_exited(si.si_pid);
+		}
 	} else if (ssi->ssi_signo == SIGINT) {
 		rl_replace_line("", 0);
 		rl_crlf();
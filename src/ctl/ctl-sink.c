@@ -18,6 +18,21 @@
  */
 
 #include "ctl-sink.h"
+#include "loopstat.h"
+#include "probes.h"
+#include "wfd-codec.h"
+
+/* compiled once, these run on every M3/M4 */
+static const struct rtsp_types sink_header_str = RTSP_TYPES('<', 's', '>');
+static const struct rtsp_types sink_param_has = RTSP_TYPES('{', '<', '>', '}');
+static const struct rtsp_types sink_param_line = RTSP_TYPES('{', '&', '}');
+static const struct rtsp_types sink_param_raw = RTSP_TYPES('{', '<', '&', '>', '}');
+static const struct rtsp_types sink_param_str = RTSP_TYPES('{', '<', 's', '>', '}');
+static const struct rtsp_types sink_param_fmt =
+	RTSP_TYPES('{', '<', '*', '*', '*', '*', 'h', 'h', 'h', '>', '}');
+
+/* HIDC devices we advertise, miracle-uibcctl refuses all others */
+#define SINK_HIDC_TYPES (1U << WFD_UIBC_KEYBOARD | 1U << WFD_UIBC_MOUSE)
 
 /*
  * RTSP Session
@@ -39,9 +54,9 @@ static void sink_handle_options(struct ctl_sink *s,
 	if (r < 0)
 		return cli_vERR(r);
 
-	r = rtsp_message_append(rep, "<s>",
-				"Public",
-				"org.wfa.wfd1.0, GET_PARAMETER, SET_PARAMETER");
+	r = rtsp_message_append_types(rep, &sink_header_str,
+				      "Public",
+				      "org.wfa.wfd1.0, GET_PARAMETER, SET_PARAMETER");
 	if (r < 0)
 		return cli_vERR(r);
 
@@ -62,9 +77,9 @@ static void sink_handle_options(struct ctl_sink *s,
 	if (r < 0)
 		return cli_vERR(r);
 
-	r = rtsp_message_append(rep, "<s>",
-				"Require",
-				"org.wfa.wfd1.0");
+	r = rtsp_message_append_types(rep, &sink_header_str,
+				      "Require",
+				      "org.wfa.wfd1.0");
 	if (r < 0)
 		return cli_vERR(r);
 
@@ -80,55 +95,90 @@ static void sink_handle_get_parameter(struct ctl_sink *s,
 				      struct rtsp_message *m)
 {
 	_rtsp_message_unref_ struct rtsp_message *rep = NULL;
-	int r;
+	char buf[512];
+	unsigned int i;
+	int n, r;
 
 	r = rtsp_message_new_reply_for(m, &rep, RTSP_CODE_OK, NULL);
 	if (r < 0)
 		return cli_vERR(r);
 
 	/* wfd_content_protection */
-	if (rtsp_message_read(m, "{<>}", "wfd_content_protection") >= 0) {
-		r = rtsp_message_append(rep, "{&}",
-					"wfd_content_protection: none");
+	if (rtsp_message_read_types(m, &sink_param_has,
+				    "wfd_content_protection") >= 0) {
+		r = rtsp_message_append_types(rep, &sink_param_line,
+					      "wfd_content_protection: none");
 		if (r < 0)
 			return cli_vERR(r);
 	}
 	/* wfd_video_formats */
-	if (rtsp_message_read(m, "{<>}", "wfd_video_formats") >= 0) {
-		char wfd_video_formats[128];
-		sprintf(wfd_video_formats,
-			"wfd_video_formats: 00 00 03 10 %08x %08x %08x 00 0000 0000 10 none none",
-			s->resolutions_cea, s->resolutions_vesa, s->resolutions_hh);
-		r = rtsp_message_append(rep, "{&}", wfd_video_formats);
+	if (rtsp_message_read_types(m, &sink_param_has, "wfd_video_formats") >= 0) {
+		struct wfd_video_formats v = {
+			.n_codecs = 1,
+			.codecs[0] = {
+				.profile = WFD_H264_CBP | WFD_H264_CHP,
+				.level = 0x10,
+				.cea = s->resolutions_cea,
+				.vesa = s->resolutions_vesa,
+				.hh = s->resolutions_hh,
+				.frame_rate_control = 0x10,
+			},
+		};
+
+		n = sprintf(buf, "wfd_video_formats: ");
+		r = wfd_video_formats_format(&v, buf + n, sizeof(buf) - n);
+		if (r < 0)
+			return cli_vERR(r);
+		r = rtsp_message_append_types(rep, &sink_param_line, buf);
 		if (r < 0)
 			return cli_vERR(r);
 	}
 	/* wfd_audio_codecs */
-	if (rtsp_message_read(m, "{<>}", "wfd_audio_codecs") >= 0) {
-		r = rtsp_message_append(rep, "{&}",
-					"wfd_audio_codecs: AAC 00000007 00");
+	if (rtsp_message_read_types(m, &sink_param_has, "wfd_audio_codecs") >= 0) {
+		r = rtsp_message_append_types(rep, &sink_param_line,
+					      "wfd_audio_codecs: AAC 00000007 00");
 		if (r < 0)
 			return cli_vERR(r);
 	}
 	/* wfd_client_rtp_ports */
-	if (rtsp_message_read(m, "{<>}", "wfd_client_rtp_ports") >= 0) {
-		char wfd_client_rtp_ports[128];
-		sprintf(wfd_client_rtp_ports,
-					"wfd_client_rtp_ports: RTP/AVP/UDP;unicast %d 0 mode=play", rstp_port);
-		r = rtsp_message_append(rep, "{&}",
-					wfd_client_rtp_ports);
+	if (rtsp_message_read_types(m, &sink_param_has, "wfd_client_rtp_ports") >= 0) {
+		struct wfd_client_rtp_ports p = {
+			.profile = WFD_RTP_UDP,
+			.port0 = rstp_port,
+		};
+
+		n = sprintf(buf, "wfd_client_rtp_ports: ");
+		r = wfd_client_rtp_ports_format(&p, buf + n, sizeof(buf) - n);
+		if (r < 0)
+			return cli_vERR(r);
+		r = rtsp_message_append_types(rep, &sink_param_line, buf);
 		if (r < 0)
 			return cli_vERR(r);
 	}
 
 	/* wfd_uibc_capability */
-	if (rtsp_message_read(m, "{<>}", "wfd_uibc_capability") >= 0 && uibc_option) {
-		char wfd_uibc_capability[512];
-		sprintf(wfd_uibc_capability,
-			"wfd_uibc_capability: input_category_list=GENERIC;"
-         "generic_cap_list=Mouse,SingleTouch;"
-         "hidc_cap_list=none;port=none");
-		r = rtsp_message_append(rep, "{&}", wfd_uibc_capability);
+	if (rtsp_message_read_types(m, &sink_param_has,
+				    "wfd_uibc_capability") >= 0 && uibc_option) {
+		struct wfd_uibc_capability u = {
+			.categories = WFD_UIBC_GENERIC,
+			.generic = 1U << WFD_UIBC_MOUSE |
+				   1U << WFD_UIBC_SINGLETOUCH,
+		};
+
+		/* HID reports are passed through from hidraw, see miracle-uibcctl */
+		if (uibc_hidc) {
+			u.categories |= WFD_UIBC_HIDC;
+			for (i = 0; i < WFD_UIBC_INPUT_CNT; ++i)
+				if (SINK_HIDC_TYPES & (1U << i))
+					u.hidc[u.n_hidc++] = (struct wfd_uibc_hidc){
+						i, WFD_UIBC_USB };
+		}
+
+		n = sprintf(buf, "wfd_uibc_capability: ");
+		r = wfd_uibc_capability_format(&u, buf + n, sizeof(buf) - n);
+		if (r < 0)
+			return cli_vERR(r);
+		r = rtsp_message_append_types(rep, &sink_param_line, buf);
 		if (r < 0)
 			return cli_vERR(r);
 	}
@@ -150,7 +200,7 @@ static int sink_setup_fn(struct rtsp *bus, struct rtsp_message *m, void *data)
 
 	cli_debug("INCOMING: %s\n", rtsp_message_get_raw(m));
 
-	r = rtsp_message_read(m, "<s>", "Session", &session);
+	r = rtsp_message_read_types(m, &sink_header_str, "Session", &session);
 	if (r < 0)
 		return cli_ERR(r);
 
@@ -172,7 +222,8 @@ static int sink_setup_fn(struct rtsp *bus, struct rtsp_message *m, void *data)
 	if (r < 0)
 		return cli_ERR(r);
 
-	r = rtsp_message_append(rep, "<s>", "Session", s->session);
+	r = rtsp_message_append_types(rep, &sink_header_str,
+				      "Session", s->session);
 	if (r < 0)
 		return cli_ERR(r);
 
@@ -207,16 +258,52 @@ static int sink_set_format(struct ctl_sink *s,
 	return -EINVAL;
 }
 
+/*
+ * Sources in the wild do not always follow the spec closely enough for the
+ * strict codec. Rather than dropping UIBC for them, only look for "none" or
+ * the first "port=" token, like sinks before the codec did.
+ */
+static void sink_uibc_fallback(const char *value)
+{
+	const char *t;
+	unsigned int port;
+
+	if (!strcasecmp(value, "none")) {
+		uibc_enabled = false;
+		uibc_hidc_types = 0;
+		return;
+	}
+
+	for (t = value; t; t = strchr(t, ';')) {
+		if (*t == ';')
+			++t;
+		t += strspn(t, " ");
+		if (sscanf(t, "port=%u", &port) == 1 && port && port <= 65535) {
+			uibc_port = port;
+			log_debug("UIBC port: %d\n", uibc_port);
+			if (uibc_option)
+				uibc_enabled = true;
+
+			/* nothing we can trust about the HIDC list */
+			uibc_hidc_types = 0;
+			return;
+		}
+	}
+}
+
 static void sink_handle_set_parameter(struct ctl_sink *s,
 				      struct rtsp_message *m)
 {
 	_rtsp_message_unref_ struct rtsp_message *rep = NULL;
+	struct wfd_presentation_url url;
+	struct wfd_uibc_capability uibc;
+	struct wfd_video_formats formats;
+	unsigned int cea_res, vesa_res, hh_res;
 	const char *trigger;
-	const char *url;
-	char *uibc_config;
+	const char *value;
 	const char *uibc_setting;
+	unsigned int i;
 	char *nu;
-	unsigned int cea_res, vesa_res, hh_res;
 	int r;
 
 	r = rtsp_message_new_reply_for(m, &rep, RTSP_CODE_OK, NULL);
@@ -234,10 +321,20 @@ static void sink_handle_set_parameter(struct ctl_sink *s,
 	rep = NULL;
 
 	/* M4 (or any other) can pass presentation URLs */
-	r = rtsp_message_read(m, "{<s>}", "wfd_presentation_URL", &url);
+	r = rtsp_message_read_types(m, &sink_param_raw,
+				    "wfd_presentation_URL", &value);
 	if (r >= 0) {
-		if (!s->url || strcmp(s->url, url)) {
-			nu = strdup(url);
+		/* fall back to the first token if the codec rejects it */
+		if (wfd_presentation_url_parse(&url, value) >= 0 && *url.url0)
+			value = url.url0;
+		else if (rtsp_message_read_types(m, &sink_param_str,
+						 "wfd_presentation_URL",
+						 &value) < 0)
+			value = "";
+	}
+	if (r >= 0 && *value) {
+		if (!s->url || strcmp(s->url, value)) {
+			nu = strdup(value);
 			if (!nu)
 				return cli_vENOMEM();
 
@@ -248,37 +345,45 @@ static void sink_handle_set_parameter(struct ctl_sink *s,
 	}
 
 	/* M4 (or any other) can pass presentation URLs */
-	r = rtsp_message_read(m, "{<&>}", "wfd_uibc_capability", &uibc_config);
+	r = rtsp_message_read_types(m, &sink_param_raw,
+				    "wfd_uibc_capability", &value);
 	if (r >= 0) {
-		if (!s->uibc_config || strcmp(s->uibc_config, uibc_config)) {
-            nu = strdup(uibc_config);
-            if (!nu)
-                return cli_vENOMEM();
-
-            free(s->uibc_config);
-            s->uibc_config = nu;
-
-            if (!strcasecmp(uibc_config, "none")) {
-                uibc_enabled = false;
-            } else {
-                char* token = strtok(uibc_config, ";");
-
-                while (token) {
-                    if (sscanf(token, "port=%d", &uibc_port)) {
-                        log_debug("UIBC port: %d\n", uibc_port);
-                        if (uibc_option) {
-                            uibc_enabled = true;
-                        }
-                        break;
-                    }
-                    token = strtok(0, ";");
-                }
-            }
+		if (!s->uibc_config || strcmp(s->uibc_config, value)) {
+			nu = strdup(value);
+			if (!nu)
+				return cli_vENOMEM();
+
+			free(s->uibc_config);
+			s->uibc_config = nu;
+
+			r = wfd_uibc_capability_parse(&uibc, value);
+			if (r < 0) {
+				cli_debug("lenient wfd_uibc_capability: %s\n",
+					  value);
+				sink_uibc_fallback(value);
+			} else if (uibc.none) {
+				uibc_enabled = false;
+				uibc_hidc_types = 0;
+			} else if (uibc.port) {
+				uibc_port = uibc.port;
+				log_debug("UIBC port: %d\n", uibc_port);
+				if (uibc_option)
+					uibc_enabled = true;
+
+				/* HIDC types we offered and the source took */
+				uibc_hidc_types = 0;
+				for (i = 0; i < uibc.n_hidc; ++i)
+					if (uibc.categories & WFD_UIBC_HIDC &&
+					    uibc.hidc[i].path == WFD_UIBC_USB)
+						uibc_hidc_types |= SINK_HIDC_TYPES &
+							(1U << uibc.hidc[i].input);
+			}
 		}
 	}
 
 	/* M4 (or any other) can pass presentation URLs */
-	r = rtsp_message_read(m, "{<s>}", "wfd_uibc_setting", &uibc_setting);
+	r = rtsp_message_read_types(m, &sink_param_str,
+				    "wfd_uibc_setting", &uibc_setting);
 	if (r >= 0) {
 		if (!s->uibc_setting || strcmp(s->uibc_setting, uibc_setting)) {
 			nu = strdup(uibc_setting);
@@ -291,16 +396,34 @@ static void sink_handle_set_parameter(struct ctl_sink *s,
 		}
 	}
 	/* M4 again */
-	r = rtsp_message_read(m, "{<****hhh>}", "wfd_video_formats",
-							&cea_res, &vesa_res, &hh_res);
-	if (r == 0) {
-		r = sink_set_format(s, cea_res, vesa_res, hh_res);
-		if (r)
-			return cli_vERR(r);
+	r = rtsp_message_read_types(m, &sink_param_raw,
+				    "wfd_video_formats", &value);
+	if (r >= 0) {
+		r = wfd_video_formats_parse(&formats, value);
+		if (r >= 0 && formats.n_codecs) {
+			cea_res = formats.codecs[0].cea;
+			vesa_res = formats.codecs[0].vesa;
+			hh_res = formats.codecs[0].hh;
+		} else {
+			/* only the first codec's bitmaps, ignore if unreadable */
+			r = rtsp_message_read_types(m, &sink_param_fmt,
+						    "wfd_video_formats",
+						    &cea_res, &vesa_res,
+						    &hh_res);
+			if (r < 0)
+				cli_debug("ignoring wfd_video_formats: %s\n",
+					  value);
+		}
+		if (r >= 0) {
+			r = sink_set_format(s, cea_res, vesa_res, hh_res);
+			if (r < 0)
+				return cli_vERR(r);
+		}
 	}
 
 	/* M5 */
-	r = rtsp_message_read(m, "{<s>}", "wfd_trigger_method", &trigger);
+	r = rtsp_message_read_types(m, &sink_param_str,
+				    "wfd_trigger_method", &trigger);
 	if (r < 0)
 		return;
 
@@ -319,7 +442,8 @@ static void sink_handle_set_parameter(struct ctl_sink *s,
 
 		char rtsp_setup[128];
 		sprintf(rtsp_setup, "RTP/AVP/UDP;unicast;client_port=%d", rstp_port);
-		r = rtsp_message_append(rep, "<s>", "Transport", rtsp_setup);
+		r = rtsp_message_append_types(rep, &sink_header_str,
+					      "Transport", rtsp_setup);
 		if (r < 0)
 			return cli_vERR(r);
 
@@ -343,6 +467,9 @@ static void sink_handle(struct ctl_sink *s,
 	if (!method)
 		return;
 
+	MIRACLE_PROBE3(sink_request, method, rtsp_message_get_body_size(m),
+		       rtsp_message_get_cookie(m));
+
 	if (!strcmp(method, "OPTIONS")) {
 		sink_handle_options(s, m);
 	} else if (!strcmp(method, "GET_PARAMETER")) {
@@ -350,6 +477,9 @@ static void sink_handle(struct ctl_sink *s,
 	} else if (!strcmp(method, "SET_PARAMETER")) {
 		sink_handle_set_parameter(s, m);
 	}
+
+	MIRACLE_PROBE3(sink_request_done, method, rtsp_message_get_body_size(m),
+		       rtsp_message_get_cookie(m));
 }
 
 static int sink_rtsp_fn(struct rtsp *bus,
@@ -443,6 +573,7 @@ static int sink_io_fn(sd_event_source *source,
 		      uint32_t mask,
 		      void *data)
 {
+	LOOPSTAT("sink.io");
 	sink_io(data, mask);
 	return 0;
 }
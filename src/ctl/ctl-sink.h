@@ -42,6 +42,8 @@
 extern int rstp_port;
 extern bool uibc_option;
 extern bool uibc_enabled;
+extern char *uibc_hidc;
+extern unsigned int uibc_hidc_types;
 extern int uibc_port;
 
 struct ctl_sink {
@@ -0,0 +1,1058 @@
+/*
+ * MiracleCast - Wifi-Display/Miracast Implementation
+ *
+ * MiracleCast is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * MiracleCast is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with MiracleCast; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * WFD Source
+ * This is the server side of the WFD RTSP exchange. We listen on the control
+ * port and run one session per connected sink, all on the same event loop.
+ * The source drives the setup: M1 (OPTIONS), M3 (GET_PARAMETER for the sink
+ * capabilities), M4 (SET_PARAMETER with the selected format) and M5 (trigger
+ * SETUP). The sink answers with M6 (SETUP) and M7 (PLAY), after which we keep
+ * the session alive with M16 and tear it down via M5/M8.
+ */
+
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include "ctl-src.h"
+#include "loopstat.h"
+#include "wfd-codec.h"
+
+static void src_session_free(struct ctl_src_session *ss);
+
+static const char *ctl_src_states[] = {
+	[CTL_SRC_OPTIONS]	= "options",
+	[CTL_SRC_CAPS]		= "caps",
+	[CTL_SRC_CONFIG]	= "config",
+	[CTL_SRC_TRIGGER]	= "trigger",
+	[CTL_SRC_SETUP]		= "setup",
+	[CTL_SRC_PLAYING]	= "playing",
+	[CTL_SRC_PAUSED]	= "paused",
+	[CTL_SRC_TEARDOWN]	= "teardown",
+};
+
+const char *ctl_src_state_to_name(unsigned int state)
+{
+	if (state >= SHL_ARRAY_LENGTH(ctl_src_states))
+		return NULL;
+
+	return ctl_src_states[state];
+}
+
+/*
+ * RTSP Session
+ */
+
+static void src_session_arm(struct ctl_src_session *ss, uint64_t usec)
+{
+	sd_event_source_set_time(ss->timer, shl_now(CLOCK_MONOTONIC) + usec);
+	sd_event_source_set_enabled(ss->timer, SD_EVENT_ONESHOT);
+}
+
+static int src_session_call(struct ctl_src_session *ss,
+			    struct rtsp_message *m,
+			    rtsp_callback_fn cb_fn)
+{
+	int r;
+
+	rtsp_message_seal(m);
+	cli_debug("OUTGOING: %s\n", rtsp_message_get_raw(m));
+
+	/* we never have more than one request in flight per session */
+	rtsp_call_async_cancel(ss->rtsp, ss->cookie);
+	ss->cookie = 0;
+
+	r = rtsp_call_async(ss->rtsp, m, cb_fn, ss, 0, &ss->cookie);
+	if (r < 0)
+		return cli_ERR(r);
+
+	return 0;
+}
+
+static int src_session_reply(struct ctl_src_session *ss,
+			     struct rtsp_message *m,
+			     unsigned int code,
+			     const char *header,
+			     const char *value)
+{
+	_rtsp_message_unref_ struct rtsp_message *rep = NULL;
+	int r;
+
+	r = rtsp_message_new_reply_for(m, &rep, code, NULL);
+	if (r < 0)
+		return cli_ERR(r);
+
+	if (header) {
+		r = rtsp_message_append(rep, "<s>", header, value);
+		if (r < 0)
+			return cli_ERR(r);
+	}
+
+	rtsp_message_seal(rep);
+	cli_debug("OUTGOING: %s\n", rtsp_message_get_raw(rep));
+
+	r = rtsp_send(ss->rtsp, rep);
+	if (r < 0)
+		return cli_ERR(r);
+
+	return 0;
+}
+
+/* returns true if the reply is a 200, otherwise marks the session dead */
+static bool src_session_check_reply(struct ctl_src_session *ss,
+				    struct rtsp_message *m,
+				    const char *what)
+{
+	if (!m) {
+		cli_notice("session %u: no reply to %s", ss->id, what);
+		ss->hup = true;
+		return false;
+	}
+
+	cli_debug("INCOMING: %s\n", rtsp_message_get_raw(m));
+
+	if (!rtsp_message_is_reply(m, RTSP_CODE_OK, NULL)) {
+		cli_notice("session %u: %s failed with %u %s", ss->id, what,
+			   rtsp_message_get_code(m),
+			   rtsp_message_get_phrase(m) ? : "");
+		ss->hup = true;
+		return false;
+	}
+
+	return true;
+}
+
+static int src_session_trigger(struct ctl_src_session *ss,
+			       const char *method,
+			       rtsp_callback_fn cb_fn)
+{
+	_rtsp_message_unref_ struct rtsp_message *m = NULL;
+	char trigger[64];
+	int r;
+
+	r = rtsp_message_new_request(ss->rtsp, &m, "SET_PARAMETER", ss->url);
+	if (r < 0)
+		return cli_ERR(r);
+
+	sprintf(trigger, "wfd_trigger_method: %s", method);
+	r = rtsp_message_append(m, "{&}", trigger);
+	if (r < 0)
+		return cli_ERR(r);
+
+	return src_session_call(ss, m, cb_fn);
+}
+
+static int src_m5_fn(struct rtsp *bus, struct rtsp_message *m, void *data)
+{
+	struct ctl_src_session *ss = data;
+
+	/* the sink follows up with M6, see src_handle_setup() */
+	ss->cookie = 0;
+	src_session_check_reply(ss, m, "M5");
+
+	if (ss->hup)
+		src_session_free(ss);
+
+	return 0;
+}
+
+static int src_m4_fn(struct rtsp *bus, struct rtsp_message *m, void *data)
+{
+	struct ctl_src_session *ss = data;
+	int r;
+
+	ss->cookie = 0;
+	if (src_session_check_reply(ss, m, "M4")) {
+		ss->state = CTL_SRC_TRIGGER;
+		r = src_session_trigger(ss, "SETUP", src_m5_fn);
+		if (r < 0)
+			ss->hup = true;
+	}
+
+	if (ss->hup)
+		src_session_free(ss);
+
+	return 0;
+}
+
+/*
+ * In fan-out mode all sinks are fed from one stream: narrow the offer to what
+ * every other sink takes. Sinks that already got M4 pin their chosen format.
+ * If nothing is left in common, the sink is offered its own format and the
+ * frontend has to encode for it separately.
+ */
+static void src_session_fanout_masks(struct ctl_src_session *ss,
+				     uint32_t *cea, uint32_t *vesa,
+				     uint32_t *hh)
+{
+	struct shl_dlist *i;
+	struct ctl_src_session *o;
+	uint32_t c = *cea, v = *vesa, h = *hh;
+
+	shl_dlist_for_each(i, &ss->src->sessions) {
+		o = session_from_dlist(i);
+		if (o == ss || o->state < CTL_SRC_CAPS ||
+		    o->state == CTL_SRC_TEARDOWN)
+			continue;
+
+		if (o->hres) {
+			c &= o->cea;
+			v &= o->vesa;
+			h &= o->hh;
+		} else if (o->sink_cea || o->sink_vesa || o->sink_hh) {
+			c &= o->sink_cea;
+			v &= o->sink_vesa;
+			h &= o->sink_hh;
+		}
+	}
+
+	if (!c && !v && !h) {
+		cli_notice("session %u: no format in common with other sinks, needs its own encode",
+			   ss->id);
+		return;
+	}
+
+	*cea = c;
+	*vesa = v;
+	*hh = h;
+}
+
+static int src_session_send_m4(struct ctl_src_session *ss)
+{
+	_rtsp_message_unref_ struct rtsp_message *m = NULL;
+	struct wfd_video_formats formats = { .n_codecs = 1 };
+	struct wfd_audio_codecs audio = { };
+	struct wfd_presentation_url url = { };
+	struct wfd_client_rtp_ports ports = { .profile = WFD_RTP_UDP };
+	char buf[WFD_URL_MAX + 64];
+	int n, r;
+
+	ss->cea = ss->sink_cea & ss->src->resolutions_cea;
+	ss->vesa = ss->sink_vesa & ss->src->resolutions_vesa;
+	ss->hh = ss->sink_hh & ss->src->resolutions_hh;
+	if (ss->src->fanout)
+		src_session_fanout_masks(ss, &ss->cea, &ss->vesa, &ss->hh);
+	r = vfd_select_resolution(&ss->cea, &ss->vesa, &ss->hh,
+				  &ss->hres, &ss->vres, &ss->fps);
+	if (r < 0) {
+		cli_notice("session %u: no common video format (sink %08x %08x %08x)",
+			   ss->id, ss->sink_cea, ss->sink_vesa, ss->sink_hh);
+		return r;
+	}
+
+	cli_debug("session %u: selected %dx%d@%d", ss->id,
+		  ss->hres, ss->vres, ss->fps);
+
+	/* highest level the sink claims, constrained baseline profile */
+	formats.codecs[0].profile = WFD_H264_CBP;
+	formats.codecs[0].level = ss->sink_level ?
+			1U << (31 - __builtin_clz(ss->sink_level)) : 1;
+	formats.codecs[0].cea = ss->cea;
+	formats.codecs[0].vesa = ss->vesa;
+	formats.codecs[0].hh = ss->hh;
+
+	r = rtsp_message_new_request(ss->rtsp, &m, "SET_PARAMETER",
+				     "rtsp://localhost/wfd1.0");
+	if (r < 0)
+		return cli_ERR(r);
+
+	n = sprintf(buf, "wfd_video_formats: ");
+	r = wfd_video_formats_format(&formats, buf + n, sizeof(buf) - n);
+	if (r < 0)
+		return cli_ERR(r);
+	r = rtsp_message_append(m, "{&}", buf);
+	if (r < 0)
+		return cli_ERR(r);
+
+	if (ss->sink_aac || ss->sink_lpcm) {
+		/* AAC 48kHz stereo, else LPCM 48kHz stereo */
+		audio.codecs[0].format = ss->sink_aac ? WFD_AUDIO_AAC :
+							WFD_AUDIO_LPCM;
+		audio.codecs[0].modes = ss->sink_aac ? 0x1 : 0x2;
+		audio.n_codecs = 1;
+
+		n = sprintf(buf, "wfd_audio_codecs: ");
+		r = wfd_audio_codecs_format(&audio, buf + n, sizeof(buf) - n);
+		if (r < 0)
+			return cli_ERR(r);
+		r = rtsp_message_append(m, "{&}", buf);
+		if (r < 0)
+			return cli_ERR(r);
+	}
+
+	if (strlen(ss->url) >= sizeof(url.url0))
+		return cli_ERR(-E2BIG);
+	strcpy(url.url0, ss->url);
+
+	n = sprintf(buf, "wfd_presentation_URL: ");
+	r = wfd_presentation_url_format(&url, buf + n, sizeof(buf) - n);
+	if (r < 0)
+		return cli_ERR(r);
+	r = rtsp_message_append(m, "{&}", buf);
+	if (r < 0)
+		return cli_ERR(r);
+
+	ports.port0 = ss->rtp_port;
+
+	n = sprintf(buf, "wfd_client_rtp_ports: ");
+	r = wfd_client_rtp_ports_format(&ports, buf + n, sizeof(buf) - n);
+	if (r < 0)
+		return cli_ERR(r);
+	r = rtsp_message_append(m, "{&}", buf);
+	if (r < 0)
+		return cli_ERR(r);
+
+	ss->state = CTL_SRC_CONFIG;
+	return src_session_call(ss, m, src_m4_fn);
+}
+
+static int src_m3_fn(struct rtsp *bus, struct rtsp_message *m, void *data)
+{
+	struct ctl_src_session *ss = data;
+	struct wfd_video_formats formats;
+	struct wfd_audio_codecs audio;
+	struct wfd_client_rtp_ports ports;
+	const char *value;
+	unsigned int i;
+	int r;
+
+	ss->cookie = 0;
+	if (!src_session_check_reply(ss, m, "M3"))
+		goto out;
+
+	r = rtsp_message_read(m, "{<&>}", "wfd_video_formats", &value);
+	if (r >= 0)
+		r = wfd_video_formats_parse(&formats, value);
+	if (r < 0 || !formats.n_codecs) {
+		cli_notice("session %u: sink sent no usable wfd_video_formats",
+			   ss->id);
+		ss->hup = true;
+		goto out;
+	}
+
+	/* we only encode baseline, merge all CBP entries */
+	ss->sink_level = 0;
+	ss->sink_cea = 0;
+	ss->sink_vesa = 0;
+	ss->sink_hh = 0;
+	for (i = 0; i < formats.n_codecs; ++i) {
+		if (!(formats.codecs[i].profile & WFD_H264_CBP))
+			continue;
+
+		ss->sink_level |= formats.codecs[i].level;
+		ss->sink_cea |= formats.codecs[i].cea;
+		ss->sink_vesa |= formats.codecs[i].vesa;
+		ss->sink_hh |= formats.codecs[i].hh;
+	}
+	if (!ss->sink_level) {
+		ss->sink_level = formats.codecs[0].level;
+		ss->sink_cea = formats.codecs[0].cea;
+		ss->sink_vesa = formats.codecs[0].vesa;
+		ss->sink_hh = formats.codecs[0].hh;
+	}
+
+	r = rtsp_message_read(m, "{<&>}", "wfd_audio_codecs", &value);
+	if (r >= 0 && wfd_audio_codecs_parse(&audio, value) >= 0) {
+		ss->sink_aac = !!wfd_audio_codecs_find(&audio, WFD_AUDIO_AAC);
+		ss->sink_lpcm = !!wfd_audio_codecs_find(&audio, WFD_AUDIO_LPCM);
+	}
+
+	r = rtsp_message_read(m, "{<&>}", "wfd_client_rtp_ports", &value);
+	if (r >= 0)
+		r = wfd_client_rtp_ports_parse(&ports, value);
+	if (r >= 0)
+		ss->rtp_port = ports.port0;
+	if (r < 0 || !ss->rtp_port) {
+		cli_notice("session %u: sink sent no wfd_client_rtp_ports",
+			   ss->id);
+		ss->hup = true;
+		goto out;
+	}
+
+	r = src_session_send_m4(ss);
+	if (r < 0)
+		ss->hup = true;
+
+out:
+	if (ss->hup)
+		src_session_free(ss);
+
+	return 0;
+}
+
+static int src_session_send_m3(struct ctl_src_session *ss)
+{
+	_rtsp_message_unref_ struct rtsp_message *m = NULL;
+	int r;
+
+	r = rtsp_message_new_request(ss->rtsp, &m, "GET_PARAMETER",
+				     "rtsp://localhost/wfd1.0");
+	if (r < 0)
+		return cli_ERR(r);
+
+	r = rtsp_message_append(m, "{&&&}",
+				"wfd_video_formats",
+				"wfd_audio_codecs",
+				"wfd_client_rtp_ports");
+	if (r < 0)
+		return cli_ERR(r);
+
+	ss->state = CTL_SRC_CAPS;
+	return src_session_call(ss, m, src_m3_fn);
+}
+
+/* M3 waits for both our M1 and the sink's M2 to complete */
+static void src_session_options_done(struct ctl_src_session *ss)
+{
+	int r;
+
+	if (!ss->m1_done || !ss->m2_done || ss->state != CTL_SRC_OPTIONS)
+		return;
+
+	r = src_session_send_m3(ss);
+	if (r < 0)
+		ss->hup = true;
+}
+
+static int src_m1_fn(struct rtsp *bus, struct rtsp_message *m, void *data)
+{
+	struct ctl_src_session *ss = data;
+
+	ss->cookie = 0;
+	if (src_session_check_reply(ss, m, "M1")) {
+		ss->m1_done = true;
+		src_session_options_done(ss);
+	}
+
+	if (ss->hup)
+		src_session_free(ss);
+
+	return 0;
+}
+
+static int src_session_send_m1(struct ctl_src_session *ss)
+{
+	_rtsp_message_unref_ struct rtsp_message *m = NULL;
+	int r;
+
+	r = rtsp_message_new_request(ss->rtsp, &m, "OPTIONS", "*");
+	if (r < 0)
+		return cli_ERR(r);
+
+	r = rtsp_message_append(m, "<s>", "Require", "org.wfa.wfd1.0");
+	if (r < 0)
+		return cli_ERR(r);
+
+	ss->state = CTL_SRC_OPTIONS;
+	return src_session_call(ss, m, src_m1_fn);
+}
+
+static int src_keepalive_fn(struct rtsp *bus, struct rtsp_message *m, void *data)
+{
+	struct ctl_src_session *ss = data;
+
+	ss->cookie = 0;
+	if (src_session_check_reply(ss, m, "M16"))
+		src_session_arm(ss, CTL_SRC_KEEPALIVE);
+
+	if (ss->hup)
+		src_session_free(ss);
+
+	return 0;
+}
+
+static int src_session_send_keepalive(struct ctl_src_session *ss)
+{
+	_rtsp_message_unref_ struct rtsp_message *m = NULL;
+	int r;
+
+	r = rtsp_message_new_request(ss->rtsp, &m, "GET_PARAMETER",
+				     "rtsp://localhost/wfd1.0");
+	if (r < 0)
+		return cli_ERR(r);
+
+	r = rtsp_message_append(m, "<s>", "Session", ss->session);
+	if (r < 0)
+		return cli_ERR(r);
+
+	return src_session_call(ss, m, src_keepalive_fn);
+}
+
+static bool src_session_match(struct ctl_src_session *ss,
+			      struct rtsp_message *m)
+{
+	const char *session;
+	size_t len;
+	int r;
+
+	r = rtsp_message_read(m, "<s>", "Session", &session);
+	if (r < 0)
+		return false;
+
+	len = strlen(ss->session);
+	return !strncmp(session, ss->session, len) &&
+	       (session[len] == '\0' || session[len] == ';');
+}
+
+static void src_handle_options(struct ctl_src_session *ss,
+			       struct rtsp_message *m)
+{
+	int r;
+
+	r = src_session_reply(ss, m, RTSP_CODE_OK, "Public",
+			      "org.wfa.wfd1.0, SETUP, TEARDOWN, PLAY, PAUSE, "
+			      "GET_PARAMETER, SET_PARAMETER");
+	if (r < 0) {
+		ss->hup = true;
+		return;
+	}
+
+	ss->m2_done = true;
+	src_session_options_done(ss);
+}
+
+static void src_handle_setup(struct ctl_src_session *ss,
+			     struct rtsp_message *m)
+{
+	_rtsp_message_unref_ struct rtsp_message *rep = NULL;
+	const char *transport, *t;
+	unsigned int port;
+	char buf[128];
+	char session[64];
+	int r;
+
+	if (ss->state != CTL_SRC_TRIGGER && ss->state != CTL_SRC_SETUP) {
+		src_session_reply(ss, m, RTSP_CODE_METHOD_NOT_VALID_IN_THIS_STATE,
+				  NULL, NULL);
+		return;
+	}
+
+	r = rtsp_message_read(m, "<s>", "Transport", &transport);
+	if (r < 0 || !(t = strstr(transport, "client_port=")) ||
+	    sscanf(t, "client_port=%u", &port) != 1 || !port) {
+		src_session_reply(ss, m, RTSP_CODE_UNSUPPORTED_TRANSPORT,
+				  NULL, NULL);
+		return;
+	}
+
+	ss->rtp_port = port;
+
+	if (ss->src->rtp_port)
+		sprintf(buf, "RTP/AVP/UDP;unicast;client_port=%u;server_port=%u",
+			port, ss->src->rtp_port);
+	else
+		sprintf(buf, "RTP/AVP/UDP;unicast;client_port=%u", port);
+
+	sprintf(session, "%s;timeout=%u", ss->session, CTL_SRC_SESSION_TIMEOUT);
+
+	r = rtsp_message_new_reply_for(m, &rep, RTSP_CODE_OK, NULL);
+	if (r < 0)
+		goto error;
+
+	r = rtsp_message_append(rep, "<s><s>",
+				"Session", session,
+				"Transport", buf);
+	if (r < 0)
+		goto error;
+
+	rtsp_message_seal(rep);
+	cli_debug("OUTGOING: %s\n", rtsp_message_get_raw(rep));
+
+	r = rtsp_send(ss->rtsp, rep);
+	if (r < 0)
+		goto error;
+
+	ss->state = CTL_SRC_SETUP;
+	return;
+
+error:
+	cli_vERR(r);
+	ss->hup = true;
+}
+
+static void src_handle_play(struct ctl_src_session *ss,
+			    struct rtsp_message *m)
+{
+	struct ctl_src *s = ss->src;
+	uint64_t t;
+	int r;
+
+	if (ss->state != CTL_SRC_SETUP && ss->state != CTL_SRC_PAUSED) {
+		src_session_reply(ss, m, RTSP_CODE_METHOD_NOT_VALID_IN_THIS_STATE,
+				  NULL, NULL);
+		return;
+	}
+	if (!src_session_match(ss, m)) {
+		src_session_reply(ss, m, RTSP_CODE_SESSION_NOT_FOUND,
+				  NULL, NULL);
+		return;
+	}
+
+	r = src_session_reply(ss, m, RTSP_CODE_OK, "Session", ss->session);
+	if (r < 0) {
+		ss->hup = true;
+		return;
+	}
+
+	if (ss->state == CTL_SRC_SETUP) {
+		ss->t_playing = shl_now(CLOCK_MONOTONIC);
+		t = ss->t_playing - ss->t_accept;
+
+		if (!s->setup_cnt || t < s->setup_min)
+			s->setup_min = t;
+		if (t > s->setup_max)
+			s->setup_max = t;
+		s->setup_sum += t;
+		++s->setup_cnt;
+
+		cli_debug("session %u: playing after %lluus", ss->id,
+			  (unsigned long long)t);
+	}
+
+	ss->state = CTL_SRC_PLAYING;
+	src_session_arm(ss, CTL_SRC_KEEPALIVE);
+
+	/* we are inside the RTSP callback; src_rtsp_fn() frees on hup */
+	if (ctl_fn_src_session_playing(ss) < 0) {
+		ss->state = CTL_SRC_TEARDOWN;
+		src_session_arm(ss, CTL_SRC_TEARDOWN_TIMEOUT);
+		if (src_session_trigger(ss, "TEARDOWN", NULL) < 0)
+			ss->hup = true;
+	}
+}
+
+static void src_handle_pause(struct ctl_src_session *ss,
+			     struct rtsp_message *m)
+{
+	if (ss->state != CTL_SRC_PLAYING) {
+		src_session_reply(ss, m, RTSP_CODE_METHOD_NOT_VALID_IN_THIS_STATE,
+				  NULL, NULL);
+		return;
+	}
+
+	if (src_session_reply(ss, m, RTSP_CODE_OK, "Session", ss->session) < 0) {
+		ss->hup = true;
+		return;
+	}
+
+	ss->state = CTL_SRC_PAUSED;
+	ctl_fn_src_session_paused(ss);
+}
+
+static void src_handle_teardown(struct ctl_src_session *ss,
+				struct rtsp_message *m)
+{
+	src_session_reply(ss, m, RTSP_CODE_OK, NULL, NULL);
+	ss->hup = true;
+}
+
+static void src_handle(struct ctl_src_session *ss,
+		       struct rtsp_message *m)
+{
+	const char *method;
+
+	cli_debug("INCOMING: %s\n", rtsp_message_get_raw(m));
+
+	method = rtsp_message_get_method(m);
+	if (!method)
+		return;
+
+	if (!strcmp(method, "OPTIONS")) {
+		src_handle_options(ss, m);
+	} else if (!strcmp(method, "SETUP")) {
+		src_handle_setup(ss, m);
+	} else if (!strcmp(method, "PLAY")) {
+		src_handle_play(ss, m);
+	} else if (!strcmp(method, "PAUSE")) {
+		src_handle_pause(ss, m);
+	} else if (!strcmp(method, "TEARDOWN")) {
+		src_handle_teardown(ss, m);
+	} else if (!strcmp(method, "GET_PARAMETER")) {
+		/* sink-initiated keepalive */
+		src_session_reply(ss, m, RTSP_CODE_OK, NULL, NULL);
+	} else {
+		src_session_reply(ss, m, RTSP_CODE_NOT_IMPLEMENTED, NULL, NULL);
+	}
+}
+
+static int src_rtsp_fn(struct rtsp *bus,
+		       struct rtsp_message *m,
+		       void *data)
+{
+	struct ctl_src_session *ss = data;
+
+	if (!m)
+		ss->hup = true;
+	else
+		src_handle(ss, m);
+
+	if (ss->hup)
+		src_session_free(ss);
+
+	return 0;
+}
+
+static void src_watermark_fn(struct rtsp *bus, bool high, void *data)
+{
+	struct ctl_src_session *ss = data;
+
+	cli_debug("session %u: outgoing queue %s (%zu bytes)", ss->id,
+		  high ? "congested" : "drained", rtsp_get_outgoing_size(bus));
+	ss->congested = high;
+}
+
+static int src_timer_fn(sd_event_source *source, uint64_t usec, void *data)
+{
+	LOOPSTAT("src.timer");
+	struct ctl_src_session *ss = data;
+
+	switch (ss->state) {
+	case CTL_SRC_PLAYING:
+	case CTL_SRC_PAUSED:
+		/* the sink is not reading; no point in queueing more */
+		if (ss->congested)
+			src_session_arm(ss, CTL_SRC_KEEPALIVE);
+		else if (src_session_send_keepalive(ss) < 0)
+			ss->hup = true;
+		break;
+	case CTL_SRC_TEARDOWN:
+		cli_debug("session %u: sink did not tear down, closing", ss->id);
+		ss->hup = true;
+		break;
+	default:
+		cli_notice("session %u: setup timed out in state %s", ss->id,
+			   ctl_src_state_to_name(ss->state));
+		ss->hup = true;
+		break;
+	}
+
+	if (ss->hup)
+		src_session_free(ss);
+
+	return 0;
+}
+
+static void src_session_free(struct ctl_src_session *ss)
+{
+	struct ctl_src *s;
+
+	if (!ss)
+		return;
+
+	s = ss->src;
+	if (!ss->t_playing)
+		++s->setup_failed;
+
+	if (ss->announced)
+		ctl_fn_src_session_free(ss);
+
+	shl_dlist_unlink(&ss->list);
+	--s->n_sessions;
+
+	if (ss->rtsp) {
+		rtsp_call_async_cancel(ss->rtsp, ss->cookie);
+		rtsp_remove_match(ss->rtsp, src_rtsp_fn, ss);
+		rtsp_detach_event(ss->rtsp);
+		rtsp_unref(ss->rtsp);
+	}
+
+	sd_event_source_unref(ss->timer);
+	if (ss->fd >= 0)
+		close(ss->fd);
+	free(ss->url);
+	free(ss);
+}
+
+static int src_session_new(struct ctl_src *s, int fd)
+{
+	struct ctl_src_session *ss;
+	struct sockaddr_in addr;
+	socklen_t len;
+	int r, val;
+
+	ss = calloc(1, sizeof(*ss));
+	if (!ss) {
+		close(fd);
+		return cli_ENOMEM();
+	}
+
+	ss->src = s;
+	ss->fd = fd;
+	ss->id = ++s->next_id;
+	ss->t_accept = shl_now(CLOCK_MONOTONIC);
+	sprintf(ss->session, "%08X",
+		(unsigned int)(ss->id * 2654435761U ^ ss->t_accept));
+	shl_dlist_link_tail(&s->sessions, &ss->list);
+	++s->n_sessions;
+
+	/* RTSP messages are small and latency-bound */
+	val = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+
+	len = sizeof(addr);
+	if (!getsockname(fd, (struct sockaddr*)&addr, &len))
+		inet_ntop(AF_INET, &addr.sin_addr, ss->local, sizeof(ss->local));
+	len = sizeof(addr);
+	if (!getpeername(fd, (struct sockaddr*)&addr, &len))
+		inet_ntop(AF_INET, &addr.sin_addr, ss->remote, sizeof(ss->remote));
+
+	r = asprintf(&ss->url, "rtsp://%s/wfd1.0/streamid=0",
+		     *ss->local ? ss->local : "localhost");
+	if (r < 0) {
+		ss->url = NULL;
+		r = cli_ENOMEM();
+		goto error;
+	}
+
+	r = sd_event_add_time(s->event,
+			      &ss->timer,
+			      CLOCK_MONOTONIC,
+			      ss->t_accept + CTL_SRC_SETUP_TIMEOUT,
+			      0,
+			      src_timer_fn,
+			      ss);
+	if (r < 0)
+		goto error;
+
+	r = rtsp_open(&ss->rtsp, fd);
+	if (r < 0)
+		goto error;
+
+	rtsp_set_watermark_fn(ss->rtsp, src_watermark_fn, ss);
+
+	r = rtsp_attach_event(ss->rtsp, s->event, 0);
+	if (r < 0)
+		goto error;
+
+	r = rtsp_add_match(ss->rtsp, src_rtsp_fn, ss);
+	if (r < 0)
+		goto error;
+
+	cli_debug("session %u: sink %s connected", ss->id, ss->remote);
+	ss->announced = true;
+	ctl_fn_src_session_new(ss);
+
+	r = src_session_send_m1(ss);
+	if (r < 0)
+		goto error;
+
+	return 0;
+
+error:
+	cli_vERR(r);
+	src_session_free(ss);
+	return r;
+}
+
+/*
+ * Source I/O
+ */
+
+static int src_io_fn(sd_event_source *source,
+		     int fd,
+		     uint32_t mask,
+		     void *data)
+{
+	LOOPSTAT("src.io");
+	struct ctl_src *s = data;
+	int nfd;
+
+	/* drain the backlog, a room full of sinks may connect at once */
+	for (;;) {
+		nfd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (nfd < 0) {
+			if (errno != EAGAIN && errno != EINTR &&
+			    errno != ECONNABORTED)
+				cli_vERRNO();
+			if (errno != EINTR && errno != ECONNABORTED)
+				break;
+			continue;
+		}
+
+		if (s->n_sessions >= s->max_sessions) {
+			cli_warning("session limit %u reached, rejecting sink",
+				    s->max_sessions);
+			close(nfd);
+			continue;
+		}
+
+		src_session_new(s, nfd);
+	}
+
+	return 0;
+}
+
+/*
+ * Source Management
+ */
+
+int ctl_src_new(struct ctl_src **out,
+		sd_event *event)
+{
+	struct ctl_src *s;
+
+	if (!out || !event)
+		return cli_EINVAL();
+
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return cli_ENOMEM();
+
+	s->event = sd_event_ref(event);
+	s->fd = -1;
+	s->max_sessions = CTL_SRC_DEFAULT_MAX_SESSIONS;
+	shl_dlist_init(&s->sessions);
+	s->resolutions_cea = wfd_supported_res_cea;
+	s->resolutions_vesa = wfd_supported_res_vesa;
+	s->resolutions_hh = wfd_supported_res_hh;
+
+	*out = s;
+	return 0;
+}
+
+void ctl_src_free(struct ctl_src *s)
+{
+	if (!s)
+		return;
+
+	ctl_src_close(s);
+	while (!shl_dlist_empty(&s->sessions))
+		src_session_free(session_from_dlist(s->sessions.next));
+	sd_event_unref(s->event);
+	free(s);
+}
+
+int ctl_src_listen(struct ctl_src *s, const char *local, unsigned int port)
+{
+	struct sockaddr_in addr = { };
+	int fd, r, val;
+
+	if (!s || s->fd >= 0)
+		return cli_EINVAL();
+
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port ? : CTL_SRC_DEFAULT_PORT);
+	if (local) {
+		r = inet_pton(AF_INET, local, &addr.sin_addr);
+		if (r != 1)
+			return cli_EINVAL();
+	} else {
+		addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	}
+
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	if (fd < 0)
+		return cli_ERRNO();
+
+	val = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+
+	r = bind(fd, (struct sockaddr*)&addr, sizeof(addr));
+	if (r < 0) {
+		r = cli_ERRNO();
+		goto err_close;
+	}
+
+	r = listen(fd, SOMAXCONN);
+	if (r < 0) {
+		r = cli_ERRNO();
+		goto err_close;
+	}
+
+	r = sd_event_add_io(s->event,
+			    &s->fd_source,
+			    fd,
+			    EPOLLIN,
+			    src_io_fn,
+			    s);
+	if (r < 0) {
+		cli_vERR(r);
+		goto err_close;
+	}
+
+	s->fd = fd;
+	s->port = ntohs(addr.sin_port);
+	return 0;
+
+err_close:
+	close(fd);
+	return r;
+}
+
+/* stops accepting new sinks, running sessions stay around */
+void ctl_src_close(struct ctl_src *s)
+{
+	if (!s || s->fd < 0)
+		return;
+
+	sd_event_source_unref(s->fd_source);
+	s->fd_source = NULL;
+	close(s->fd);
+	s->fd = -1;
+}
+
+bool ctl_src_is_listening(struct ctl_src *s)
+{
+	return s && s->fd >= 0;
+}
+
+struct ctl_src_session *ctl_src_find_session(struct ctl_src *s,
+					     unsigned int id)
+{
+	struct shl_dlist *i;
+	struct ctl_src_session *ss;
+
+	if (!s)
+		return NULL;
+
+	shl_dlist_for_each(i, &s->sessions) {
+		ss = session_from_dlist(i);
+		if (ss->id == id)
+			return ss;
+	}
+
+	return NULL;
+}
+
+/*
+ * Asks the sink to tear down via M5, it answers with M8. Sinks that never
+ * got that far, or that ignore the trigger, are closed after a grace period.
+ */
+int ctl_src_session_teardown(struct ctl_src_session *ss)
+{
+	int r;
+
+	if (!ss)
+		return cli_EINVAL();
+	if (ss->state == CTL_SRC_TEARDOWN)
+		return 0;
+
+	if (ss->state < CTL_SRC_TRIGGER) {
+		src_session_free(ss);
+		return 0;
+	}
+
+	ss->state = CTL_SRC_TEARDOWN;
+	src_session_arm(ss, CTL_SRC_TEARDOWN_TIMEOUT);
+
+	r = src_session_trigger(ss, "TEARDOWN", NULL);
+	if (r < 0) {
+		src_session_free(ss);
+		return r;
+	}
+
+	return 0;
+}
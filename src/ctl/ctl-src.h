@@ -0,0 +1,143 @@
+/*
+ * MiracleCast - Wifi-Display/Miracast Implementation
+ *
+ * MiracleCast is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * MiracleCast is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with MiracleCast; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CTL_SRC_H
+#define CTL_SRC_H
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <systemd/sd-event.h>
+#include <time.h>
+#include <unistd.h>
+#include "ctl.h"
+
+#include "rtsp.h"
+#include "shl_dlist.h"
+#include "shl_macro.h"
+#include "shl_util.h"
+#include "wfd.h"
+
+#define CTL_SRC_DEFAULT_PORT		7236
+#define CTL_SRC_DEFAULT_MAX_SESSIONS	64
+
+/* sinks get this long to get from accept() to PLAY */
+#define CTL_SRC_SETUP_TIMEOUT		(30 * 1000ULL * 1000ULL)
+/* advertised via Session: timeout=, M16 is sent a bit before it expires */
+#define CTL_SRC_SESSION_TIMEOUT		30
+#define CTL_SRC_KEEPALIVE		(25 * 1000ULL * 1000ULL)
+#define CTL_SRC_TEARDOWN_TIMEOUT	(5 * 1000ULL * 1000ULL)
+
+enum ctl_src_state {
+	CTL_SRC_OPTIONS,	/* M1/M2 in flight */
+	CTL_SRC_CAPS,		/* M3 sent, waiting for sink capabilities */
+	CTL_SRC_CONFIG,		/* M4 sent */
+	CTL_SRC_TRIGGER,	/* M5 sent, waiting for SETUP */
+	CTL_SRC_SETUP,		/* M6 answered, waiting for PLAY */
+	CTL_SRC_PLAYING,
+	CTL_SRC_PAUSED,
+	CTL_SRC_TEARDOWN,
+};
+
+struct ctl_src_session {
+	struct shl_dlist list;
+	struct ctl_src *src;
+	unsigned int id;
+	char session[16];
+
+	enum ctl_src_state state;
+	int fd;
+	struct rtsp *rtsp;
+	sd_event_source *timer;
+	uint64_t cookie;
+
+	char local[INET6_ADDRSTRLEN];
+	char remote[INET6_ADDRSTRLEN];
+	char *url;
+
+	bool m1_done : 1;
+	bool m2_done : 1;
+	bool hup : 1;
+	bool congested : 1;
+	bool announced : 1;		/* ctl_fn_src_session_new() was called */
+
+	/* sink capabilities from M3 */
+	uint32_t sink_cea;
+	uint32_t sink_vesa;
+	uint32_t sink_hh;
+	uint32_t sink_level;
+	bool sink_aac : 1;
+	bool sink_lpcm : 1;
+	unsigned int rtp_port;
+
+	/* negotiated in M4 */
+	uint32_t cea;
+	uint32_t vesa;
+	uint32_t hh;
+	int hres;
+	int vres;
+	int fps;
+
+	/* CLOCK_MONOTONIC usecs */
+	uint64_t t_accept;
+	uint64_t t_playing;
+
+	/* owned by the frontend, e.g. the media pipeline */
+	void *data;
+};
+
+#define session_from_dlist(_s) \
+	shl_dlist_entry((_s), struct ctl_src_session, list)
+
+struct ctl_src {
+	sd_event *event;
+
+	int fd;
+	sd_event_source *fd_source;
+	unsigned int port;
+
+	struct shl_dlist sessions;
+	unsigned int n_sessions;
+	unsigned int max_sessions;
+	unsigned int next_id;
+
+	/* what we are willing to encode */
+	uint32_t resolutions_cea;
+	uint32_t resolutions_vesa;
+	uint32_t resolutions_hh;
+	/* offer sinks a format all current sinks share, for one encode */
+	bool fanout;
+
+	/* our RTP port, 0 if not bound yet */
+	unsigned int rtp_port;
+
+	/* accept() to M7 reply */
+	uint64_t setup_cnt;
+	uint64_t setup_min;
+	uint64_t setup_max;
+	uint64_t setup_sum;
+	uint64_t setup_failed;
+};
+
+#endif /* CTL_SRC_H */
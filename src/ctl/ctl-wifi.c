@@ -17,17 +17,114 @@
  * along with MiracleCast; If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <ctype.h>
 #include <errno.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include <glib.h>
 #include <systemd/sd-bus.h>
 #include "ctl.h"
 #include "shl_dlist.h"
+#include "shl_htable.h"
 #include "shl_macro.h"
 #include "shl_util.h"
 #include "util.h"
 
+/*
+ * Indexes
+ * Links and peers stay on their lists so iteration order is stable, but all
+ * lookups go through hash-tables. An index stores a pointer to the key member
+ * of the object, hence keys must be dropped from an index before they are
+ * modified and re-added afterwards. Only linked objects are indexed.
+ */
+
+static size_t ctl_index_hash(const char *str)
+{
+	size_t hash = 5381;
+
+	for ( ; str && *str; ++str)
+		hash = (hash << 5) + hash + (size_t)tolower((unsigned char)*str);
+
+	return hash;
+}
+
+static bool ctl_index_compare(const void *a, const void *b)
+{
+	if (!*(char**)a || !*(char**)b)
+		return *(char**)a == *(char**)b;
+	else
+		return !strcasecmp(*(char**)a, *(char**)b);
+}
+
+static size_t ctl_index_rehash(const void *elem, void *priv)
+{
+	return ctl_index_hash(*(char**)elem);
+}
+
+static void ctl_index_init(struct shl_htable *ht)
+{
+	shl_htable_init(ht, ctl_index_compare, ctl_index_rehash, NULL);
+}
+
+static void ctl_index_add(struct shl_htable *ht, char **key)
+{
+	int r;
+
+	if (!*key)
+		return;
+
+	r = shl_htable_insert(ht, key, ht->htable.rehash(key, NULL));
+	if (r < 0)
+		cli_vERR(r);
+}
+
+static void ctl_index_remove(struct shl_htable *ht, char **key)
+{
+	if (!*key)
+		return;
+
+	shl_htable_remove_exact(ht, key, ht->htable.rehash(key, NULL));
+}
+
+static char **ctl_index_find(struct shl_htable *ht, const char *key)
+{
+	char **elem;
+
+	if (shl_isempty(key))
+		return NULL;
+
+	if (!shl_htable_lookup(ht, &key, ht->htable.rehash(&key, NULL),
+			       (void**)&elem))
+		return NULL;
+
+	return elem;
+}
+
+static struct ctl_link *ctl_wifi_find_link_by_path(struct ctl_wifi *w,
+						   const char *path)
+{
+	char **elem;
+
+	elem = ctl_index_find(&w->links_by_path, path);
+	if (!elem)
+		return NULL;
+
+	return link_from_htable(elem, path);
+}
+
+static struct ctl_peer *ctl_wifi_find_peer_by_path(struct ctl_wifi *w,
+						   const char *path)
+{
+	char **elem;
+
+	elem = ctl_index_find(&w->peers_by_path, path);
+	if (!elem)
+		return NULL;
+
+	return peer_from_htable(elem, path);
+}
+
 /*
  * Peers
  */
@@ -37,9 +134,15 @@ static void ctl_peer_free(struct ctl_peer *p)
 	if (!p)
 		return;
 
-	if (shl_dlist_linked(&p->list))
+	if (shl_dlist_linked(&p->list)) {
 		ctl_fn_peer_free(p);
 
+		ctl_index_remove(&p->l->peers_by_name, &p->friendly_name);
+		ctl_index_remove(&p->l->peers_by_mac, &p->p2p_mac);
+		ctl_index_remove(&p->l->w->peers_by_path, &p->path);
+		ctl_index_remove(&p->l->w->peers_by_label, &p->label);
+	}
+
 	free(p->wfd_subelements);
 	free(p->remote_address);
 	free(p->local_address);
@@ -48,6 +151,7 @@ static void ctl_peer_free(struct ctl_peer *p)
 	free(p->p2p_mac);
 
 	shl_dlist_unlink(&p->list);
+	free(p->path);
 	free(p->label);
 	free(p);
 }
@@ -81,6 +185,14 @@ static int ctl_peer_new(struct ctl_peer **out,
 		goto error;
 	}
 
+	r = sd_bus_path_encode("/org/freedesktop/miracle/wifi/peer",
+			       p->label,
+			       &p->path);
+	if (r < 0) {
+		cli_vERR(r);
+		goto error;
+	}
+
 	if (out)
 		*out = p;
 
@@ -97,6 +209,12 @@ static void ctl_peer_link(struct ctl_peer *p)
 		return;
 
 	shl_dlist_link_tail(&p->l->peers, &p->list);
+
+	ctl_index_add(&p->l->w->peers_by_label, &p->label);
+	ctl_index_add(&p->l->w->peers_by_path, &p->path);
+	ctl_index_add(&p->l->peers_by_mac, &p->p2p_mac);
+	ctl_index_add(&p->l->peers_by_name, &p->friendly_name);
+
 	ctl_fn_peer_new(p);
 }
 
@@ -106,13 +224,15 @@ static int ctl_peer_parse_properties(struct ctl_peer *p,
 	const char *t, *p2p_mac = NULL, *friendly_name = NULL;
 	const char *interface = NULL, *local_address = NULL;
 	const char *remote_address = NULL, *wfd_subelements = NULL;
-	bool connected_set = false;
+	bool connected_set = false, indexed;
 	char *tmp;
 	int connected, r;
 
 	if (!p || !m)
 		return cli_EINVAL();
 
+	indexed = shl_dlist_linked(&p->list);
+
 	r = sd_bus_message_enter_container(m, 'a', "{sv}");
 	if (r < 0)
 		return cli_log_parser(r);
@@ -178,8 +298,14 @@ static int ctl_peer_parse_properties(struct ctl_peer *p,
 	if (p2p_mac) {
 		tmp = strdup(p2p_mac);
 		if (tmp) {
+			if (indexed)
+				ctl_index_remove(&p->l->peers_by_mac,
+						 &p->p2p_mac);
 			free(p->p2p_mac);
 			p->p2p_mac = tmp;
+			if (indexed)
+				ctl_index_add(&p->l->peers_by_mac,
+					      &p->p2p_mac);
 		} else {
 			cli_vENOMEM();
 		}
@@ -188,8 +314,14 @@ static int ctl_peer_parse_properties(struct ctl_peer *p,
 	if (friendly_name) {
 		tmp = strdup(friendly_name);
 		if (tmp) {
+			if (indexed)
+				ctl_index_remove(&p->l->peers_by_name,
+						 &p->friendly_name);
 			free(p->friendly_name);
 			p->friendly_name = tmp;
+			if (indexed)
+				ctl_index_add(&p->l->peers_by_name,
+					      &p->friendly_name);
 		} else {
 			cli_vENOMEM();
 		}
@@ -250,21 +382,14 @@ static int ctl_peer_parse_properties(struct ctl_peer *p,
 int ctl_peer_connect(struct ctl_peer *p, const char *prov, const char *pin)
 {
 	_sd_bus_error_free_ sd_bus_error err = SD_BUS_ERROR_NULL;
-	_shl_free_ char *node = NULL;
 	int r;
 
 	if (!p)
 		return cli_EINVAL();
 
-	r = sd_bus_path_encode("/org/freedesktop/miracle/wifi/peer",
-			       p->label,
-			       &node);
-	if (r < 0)
-		return cli_ERR(r);
-
 	r = sd_bus_call_method(p->l->w->bus,
 			       "org.freedesktop.miracle.wifi",
-			       node,
+			       p->path,
 			       "org.freedesktop.miracle.wifi.Peer",
 			       "Connect",
 			       &err,
@@ -284,21 +409,14 @@ int ctl_peer_connect(struct ctl_peer *p, const char *prov, const char *pin)
 int ctl_peer_disconnect(struct ctl_peer *p)
 {
 	_sd_bus_error_free_ sd_bus_error err = SD_BUS_ERROR_NULL;
-	_shl_free_ char *node = NULL;
 	int r;
 
 	if (!p)
 		return cli_EINVAL();
 
-	r = sd_bus_path_encode("/org/freedesktop/miracle/wifi/peer",
-			       p->label,
-			       &node);
-	if (r < 0)
-		return cli_ERR(r);
-
 	r = sd_bus_call_method(p->l->w->bus,
 			       "org.freedesktop.miracle.wifi",
-			       node,
+			       p->path,
 			       "org.freedesktop.miracle.wifi.Peer",
 			       "Disconnect",
 			       &err,
@@ -319,19 +437,67 @@ int ctl_peer_disconnect(struct ctl_peer *p)
 
 static struct ctl_peer *ctl_link_find_peer(struct ctl_link *l,
 					   const char *label)
+{
+	struct ctl_peer *p;
+	char **elem;
+
+	elem = ctl_index_find(&l->w->peers_by_label, label);
+	if (!elem)
+		return NULL;
+
+	p = peer_from_htable(elem, label);
+	return p->l == l ? p : NULL;
+}
+
+static struct ctl_peer *ctl_link_find_peer_by_mac(struct ctl_link *l,
+						  const char *mac)
+{
+	char **elem;
+
+	elem = ctl_index_find(&l->peers_by_mac, mac);
+	if (!elem)
+		return NULL;
+
+	return peer_from_htable(elem, p2p_mac);
+}
+
+/*
+ * Label is "<mac>@<link>". P2PMac is only known once the peer's properties
+ * arrived, so fall back to matching the label itself.
+ */
+static struct ctl_peer *ctl_link_find_peer_by_label(struct ctl_link *l,
+						    const char *prefix)
 {
 	struct shl_dlist *i;
 	struct ctl_peer *p;
+	const char *next;
+
+	p = ctl_link_find_peer_by_mac(l, prefix);
+	if (p)
+		return p;
 
 	shl_dlist_for_each(i, &l->peers) {
-		p = peer_from_dlist(i);
-		if (!strcasecmp(p->label, label))
+		p = shl_dlist_entry(i, struct ctl_peer, list);
+		next = shl_startswith(p->label, prefix);
+		if (next && *next == '@')
 			return p;
 	}
 
 	return NULL;
 }
 
+static struct ctl_peer *ctl_link_find_peer_by_name(struct ctl_link *l,
+						   const char *name)
+{
+	char **elem;
+
+	elem = ctl_index_find(&l->peers_by_name, name);
+	if (!elem)
+		return NULL;
+
+	return peer_from_htable(elem, friendly_name);
+}
+
 static void ctl_link_free(struct ctl_link *l)
 {
 	struct ctl_peer *p;
@@ -344,14 +510,24 @@ static void ctl_link_free(struct ctl_link *l)
 		ctl_peer_free(p);
 	}
 
-	if (shl_dlist_linked(&l->list))
+	if (shl_dlist_linked(&l->list)) {
 		ctl_fn_link_free(l);
 
+		ctl_index_remove(&l->w->links_by_name, &l->friendly_name);
+		ctl_index_remove(&l->w->links_by_ifname, &l->ifname);
+		ctl_index_remove(&l->w->links_by_path, &l->path);
+		ctl_index_remove(&l->w->links_by_label, &l->label);
+	}
+
+	shl_htable_clear(&l->peers_by_name, NULL, NULL);
+	shl_htable_clear(&l->peers_by_mac, NULL, NULL);
+
 	free(l->wfd_subelements);
 	free(l->friendly_name);
 	free(l->ifname);
 
 	shl_dlist_unlink(&l->list);
+	free(l->path);
 	free(l->label);
 	free(l);
 }
@@ -379,6 +555,8 @@ static int ctl_link_new(struct ctl_link **out,
 
 	l->w = w;
 	shl_dlist_init(&l->peers);
+	ctl_index_init(&l->peers_by_mac);
+	ctl_index_init(&l->peers_by_name);
 
 	l->label = strdup(label);
 	if (!l->label) {
@@ -386,6 +564,14 @@ static int ctl_link_new(struct ctl_link **out,
 		goto error;
 	}
 
+	r = sd_bus_path_encode("/org/freedesktop/miracle/wifi/link",
+			       l->label,
+			       &l->path);
+	if (r < 0) {
+		cli_vERR(r);
+		goto error;
+	}
+
 	if (out)
 		*out = l;
 
@@ -402,6 +588,12 @@ static void ctl_link_link(struct ctl_link *l)
 		return;
 
 	shl_dlist_link_tail(&l->w->links, &l->list);
+
+	ctl_index_add(&l->w->links_by_label, &l->label);
+	ctl_index_add(&l->w->links_by_path, &l->path);
+	ctl_index_add(&l->w->links_by_ifname, &l->ifname);
+	ctl_index_add(&l->w->links_by_name, &l->friendly_name);
+
 	ctl_fn_link_new(l);
 }
 
@@ -414,12 +606,16 @@ static int ctl_link_parse_properties(struct ctl_link *l,
 	bool p2p_scanning_set = false;
 	char *tmp;
 	int p2p_scanning, r;
-	bool managed_set = false;
+	bool managed_set = false, indexed;
 	int managed;
+	bool streaming_set = false;
+	int streaming;
 
 	if (!l || !m)
 		return cli_EINVAL();
 
+	indexed = shl_dlist_linked(&l->list);
+
 	r = sd_bus_message_enter_container(m, 'a', "{sv}");
 	if (r < 0)
 		return cli_log_parser(r);
@@ -460,6 +656,13 @@ static int ctl_link_parse_properties(struct ctl_link *l,
 				return cli_log_parser(r);
 
 			p2p_scanning_set = true;
+		} else if (!strcmp(t, "Streaming")) {
+			r = bus_message_read_basic_variant(m, "b",
+						&streaming);
+			if (r < 0)
+				return cli_log_parser(r);
+
+			streaming_set = true;
 		} else if (!strcmp(t, "WfdSubelements")) {
 			r = bus_message_read_basic_variant(m, "s",
 						&wfd_subelements);
@@ -486,8 +689,14 @@ static int ctl_link_parse_properties(struct ctl_link *l,
 	if (interface_name) {
 		tmp = strdup(interface_name);
 		if (tmp) {
+			if (indexed)
+				ctl_index_remove(&l->w->links_by_ifname,
+						 &l->ifname);
 			free(l->ifname);
 			l->ifname = tmp;
+			if (indexed)
+				ctl_index_add(&l->w->links_by_ifname,
+					      &l->ifname);
 		} else {
 			cli_vENOMEM();
 		}
@@ -496,8 +705,14 @@ static int ctl_link_parse_properties(struct ctl_link *l,
 	if (friendly_name) {
 		tmp = strdup(friendly_name);
 		if (tmp) {
+			if (indexed)
+				ctl_index_remove(&l->w->links_by_name,
+						 &l->friendly_name);
 			free(l->friendly_name);
 			l->friendly_name = tmp;
+			if (indexed)
+				ctl_index_add(&l->w->links_by_name,
+					      &l->friendly_name);
 		} else {
 			cli_vENOMEM();
 		}
@@ -509,6 +724,9 @@ static int ctl_link_parse_properties(struct ctl_link *l,
 	if (p2p_scanning_set)
 		l->p2p_scanning = p2p_scanning;
 
+	if (streaming_set)
+		l->streaming = streaming;
+
 	if (wfd_subelements) {
 		tmp = strdup(wfd_subelements);
 		if (tmp) {
@@ -526,7 +744,6 @@ int ctl_link_set_friendly_name(struct ctl_link *l, const char *name)
 {
 	_sd_bus_message_unref_ sd_bus_message *m = NULL;
 	_sd_bus_error_free_ sd_bus_error err = SD_BUS_ERROR_NULL;
-	_shl_free_ char *node = NULL;
 	int r;
 
 	if (!l)
@@ -534,16 +751,10 @@ int ctl_link_set_friendly_name(struct ctl_link *l, const char *name)
 	if (!strcmp(l->friendly_name, name))
 		return 0;
 
-	r = sd_bus_path_encode("/org/freedesktop/miracle/wifi/link",
-			       l->label,
-			       &node);
-	if (r < 0)
-		return cli_ERR(r);
-
 	r = sd_bus_message_new_method_call(l->w->bus,
 					   &m,
 					   "org.freedesktop.miracle.wifi",
-					   node,
+					   l->path,
 					   "org.freedesktop.DBus.Properties",
 					   "Set");
 	if (r < 0)
@@ -581,7 +792,6 @@ int ctl_link_set_wfd_subelements(struct ctl_link *l, const char *val)
 {
 	_sd_bus_message_unref_ sd_bus_message *m = NULL;
 	_sd_bus_error_free_ sd_bus_error err = SD_BUS_ERROR_NULL;
-	_shl_free_ char *node = NULL;
 	int r;
 
 	if (!l)
@@ -589,16 +799,10 @@ int ctl_link_set_wfd_subelements(struct ctl_link *l, const char *val)
 	if (!strcmp(l->wfd_subelements, val))
 		return 0;
 
-	r = sd_bus_path_encode("/org/freedesktop/miracle/wifi/link",
-			       l->label,
-			       &node);
-	if (r < 0)
-		return cli_ERR(r);
-
 	r = sd_bus_message_new_method_call(l->w->bus,
 					   &m,
 					   "org.freedesktop.miracle.wifi",
-					   node,
+					   l->path,
 					   "org.freedesktop.DBus.Properties",
 					   "Set");
 	if (r < 0)
@@ -636,7 +840,6 @@ int ctl_link_set_managed(struct ctl_link *l, bool val)
 {
 	_sd_bus_message_unref_ sd_bus_message *m = NULL;
 	_sd_bus_error_free_ sd_bus_error err = SD_BUS_ERROR_NULL;
-	_shl_free_ char *node = NULL;
 	int r;
 
 	if (!l)
@@ -644,16 +847,10 @@ int ctl_link_set_managed(struct ctl_link *l, bool val)
 	if (l->managed == val)
 		return 0;
 
-	r = sd_bus_path_encode("/org/freedesktop/miracle/wifi/link",
-			       l->label,
-			       &node);
-	if (r < 0)
-		return cli_ERR(r);
-
 	r = sd_bus_message_new_method_call(l->w->bus,
 					   &m,
 					   "org.freedesktop.miracle.wifi",
-					   node,
+					   l->path,
 					   "org.freedesktop.DBus.Properties",
 					   "Set");
 	if (r < 0)
@@ -693,7 +890,6 @@ int ctl_link_set_p2p_scanning(struct ctl_link *l, bool val)
 {
 	_sd_bus_message_unref_ sd_bus_message *m = NULL;
 	_sd_bus_error_free_ sd_bus_error err = SD_BUS_ERROR_NULL;
-	_shl_free_ char *node = NULL;
 	int r;
 
 	if (!l)
@@ -701,16 +897,10 @@ int ctl_link_set_p2p_scanning(struct ctl_link *l, bool val)
 	if (l->p2p_scanning == val)
 		return 0;
 
-	r = sd_bus_path_encode("/org/freedesktop/miracle/wifi/link",
-			       l->label,
-			       &node);
-	if (r < 0)
-		return cli_ERR(r);
-
 	r = sd_bus_message_new_method_call(l->w->bus,
 					   &m,
 					   "org.freedesktop.miracle.wifi",
-					   node,
+					   l->path,
 					   "org.freedesktop.DBus.Properties",
 					   "Set");
 	if (r < 0)
@@ -754,22 +944,66 @@ int ctl_link_set_p2p_scanning(struct ctl_link *l, bool val)
 	return 0;
 }
 
+int ctl_link_set_streaming(struct ctl_link *l, bool val)
+{
+	_sd_bus_message_unref_ sd_bus_message *m = NULL;
+	_sd_bus_error_free_ sd_bus_error err = SD_BUS_ERROR_NULL;
+	int r;
+
+	if (!l)
+		return cli_EINVAL();
+	if (l->streaming == val)
+		return 0;
+
+	r = sd_bus_message_new_method_call(l->w->bus,
+					   &m,
+					   "org.freedesktop.miracle.wifi",
+					   l->path,
+					   "org.freedesktop.DBus.Properties",
+					   "Set");
+	if (r < 0)
+		return cli_log_create(r);
+
+	r = sd_bus_message_append(m, "ss",
+				  "org.freedesktop.miracle.wifi.Link",
+				  "Streaming");
+	if (r < 0)
+		return cli_log_create(r);
+
+	r = sd_bus_message_open_container(m, 'v', "b");
+	if (r < 0)
+		return cli_log_create(r);
+
+	r = sd_bus_message_append(m, "b", val);
+	if (r < 0)
+		return cli_log_create(r);
+
+	r = sd_bus_message_close_container(m);
+	if (r < 0)
+		return cli_log_create(r);
+
+	r = sd_bus_call(l->w->bus, m, 0, &err, NULL);
+	if (r < 0) {
+		cli_error("cannot change streaming state on link %s to %d: %s",
+			  l->label, val, bus_error_message(&err, r));
+		return r;
+	}
+
+	l->streaming = val;
+
+	return 0;
+}
+
 /*
  * Wifi Management
  */
 
-static int ctl_wifi_parse_link(struct ctl_wifi *w,
-			       const char *label,
-			       sd_bus_message *m)
+static int ctl_link_parse_interfaces(struct ctl_link *l,
+				     sd_bus_message *m)
 {
-	_ctl_link_free_ struct ctl_link *l = NULL;
 	const char *t;
 	int r;
 
-	r = ctl_link_new(&l, w, label);
-	if (r < 0)
-		return r;
-
 	r = sd_bus_message_enter_container(m, 'a', "{sa{sv}}");
 	if (r < 0)
 		return cli_log_parser(r);
@@ -806,29 +1040,15 @@ static int ctl_wifi_parse_link(struct ctl_wifi *w,
 	if (r < 0)
 		return cli_log_parser(r);
 
-	ctl_link_link(l);
-	l = NULL;
-
 	return 0;
 }
 
-static int ctl_wifi_parse_peer(struct ctl_wifi *w,
-			       const char *label,
-			       sd_bus_message *m)
+static int ctl_peer_parse_interfaces(struct ctl_peer *p,
+				     sd_bus_message *m)
 {
-	_ctl_peer_free_ struct ctl_peer *p = NULL;
 	const char *t;
-	struct ctl_link *l;
 	int r;
 
-	l = ctl_wifi_find_link_by_peer(w, label);
-	if (!l)
-		return cli_EINVAL();
-
-	r = ctl_peer_new(&p, l, label);
-	if (r < 0)
-		return r;
-
 	r = sd_bus_message_enter_container(m, 'a', "{sa{sv}}");
 	if (r < 0)
 		return cli_log_parser(r);
@@ -865,6 +1085,50 @@ static int ctl_wifi_parse_peer(struct ctl_wifi *w,
 	if (r < 0)
 		return cli_log_parser(r);
 
+	return 0;
+}
+
+static int ctl_wifi_parse_link(struct ctl_wifi *w,
+			       const char *label,
+			       sd_bus_message *m)
+{
+	_ctl_link_free_ struct ctl_link *l = NULL;
+	int r;
+
+	r = ctl_link_new(&l, w, label);
+	if (r < 0)
+		return r;
+
+	r = ctl_link_parse_interfaces(l, m);
+	if (r < 0)
+		return r;
+
+	ctl_link_link(l);
+	l = NULL;
+
+	return 0;
+}
+
+static int ctl_wifi_parse_peer(struct ctl_wifi *w,
+			       const char *label,
+			       sd_bus_message *m)
+{
+	_ctl_peer_free_ struct ctl_peer *p = NULL;
+	struct ctl_link *l;
+	int r;
+
+	l = ctl_wifi_find_link_by_peer(w, label);
+	if (!l)
+		return cli_EINVAL();
+
+	r = ctl_peer_new(&p, l, label);
+	if (r < 0)
+		return r;
+
+	r = ctl_peer_parse_interfaces(p, m);
+	if (r < 0)
+		return r;
+
 	ctl_peer_link(p);
 	p = NULL;
 
@@ -885,36 +1149,41 @@ static int ctl_wifi_parse_object(struct ctl_wifi *w,
 	if (r < 0)
 		return cli_log_parser(r);
 
-	r = sd_bus_path_decode(t,
-			       "/org/freedesktop/miracle/wifi/link",
-			       &label);
-	if (r < 0) {
-		return cli_ENOMEM();
-	} else if (r > 0) {
-		l = ctl_wifi_find_link(w, label);
-		if (!l && added) {
-			return ctl_wifi_parse_link(w, label, m);
-		} else if (l && !added) {
-			/* We don't do any dynamic interfaces, so if any of
-			 * them is removed, all of them are removed. */
+	/* Known objects are resolved via their cached path, only new objects
+	 * need their path decoded into a label. */
+	l = ctl_wifi_find_link_by_path(w, t);
+	p = l ? NULL : ctl_wifi_find_peer_by_path(w, t);
+
+	if (!added) {
+		/* We don't do any dynamic interfaces, so if any of
+		 * them is removed, all of them are removed. */
+		if (l)
 			ctl_link_free(l);
-		}
-	}
+		else if (p)
+			ctl_peer_free(p);
+	} else if (l) {
+		/* re-announced during a delta-sync, refresh in place */
+		l->stale = false;
+		return ctl_link_parse_interfaces(l, m);
+	} else if (p) {
+		p->stale = false;
+		return ctl_peer_parse_interfaces(p, m);
+	} else {
+		r = sd_bus_path_decode(t,
+				       "/org/freedesktop/miracle/wifi/link",
+				       &label);
+		if (r < 0)
+			return cli_ENOMEM();
+		else if (r > 0)
+			return ctl_wifi_parse_link(w, label, m);
 
-	r = sd_bus_path_decode(t,
-			       "/org/freedesktop/miracle/wifi/peer",
-			       &label);
-	if (r < 0) {
-		return cli_ENOMEM();
-	} else if (r > 0) {
-		p = ctl_wifi_find_peer(w, label);
-		if (!p && added) {
+		r = sd_bus_path_decode(t,
+				       "/org/freedesktop/miracle/wifi/peer",
+				       &label);
+		if (r < 0)
+			return cli_ENOMEM();
+		else if (r > 0)
 			return ctl_wifi_parse_peer(w, label, m);
-		} else if (p && !added) {
-			/* We don't do any dynamic interfaces, so if any of
-			 * them is removed, all of them are removed. */
-			ctl_peer_free(p);
-		}
 	}
 
 	/* skip unhandled payload */
@@ -944,7 +1213,6 @@ static int ctl_wifi_properties_fn(sd_bus_message *m,
 				  void *data,
 				  sd_bus_error *err)
 {
-	_shl_free_ char *label = NULL;
 	struct ctl_wifi *w = data;
 	struct ctl_link *l;
 	struct ctl_peer *p;
@@ -960,16 +1228,8 @@ static int ctl_wifi_properties_fn(sd_bus_message *m,
 	if (!t)
 		return cli_EINVAL();
 
-	r = sd_bus_path_decode(t,
-			       "/org/freedesktop/miracle/wifi/link",
-			       &label);
-	if (r < 0) {
-		return cli_ENOMEM();
-	} else if (r > 0) {
-		l = ctl_wifi_find_link(w, label);
-		if (!l)
-			return 0;
-
+	l = ctl_wifi_find_link_by_path(w, t);
+	if (l) {
 		r = sd_bus_message_read(m, "s", &t);
 		if (r < 0)
 			return cli_log_parser(r);
@@ -980,16 +1240,8 @@ static int ctl_wifi_properties_fn(sd_bus_message *m,
 		return ctl_link_parse_properties(l, m);
 	}
 
-	r = sd_bus_path_decode(t,
-			       "/org/freedesktop/miracle/wifi/peer",
-			       &label);
-	if (r < 0) {
-		return cli_ENOMEM();
-	} else if (r > 0) {
-		p = ctl_wifi_find_peer(w, label);
-		if (!p)
-			return 0;
-
+	p = ctl_wifi_find_peer_by_path(w, t);
+	if (p) {
 		r = sd_bus_message_read(m, "s", &t);
 		if (r < 0)
 			return cli_log_parser(r);
@@ -1007,7 +1259,6 @@ static int ctl_wifi_peer_fn(sd_bus_message *m,
 			    void *data,
 			    sd_bus_error *err)
 {
-	_shl_free_ char *label = NULL;
 	struct ctl_wifi *w = data;
 	struct ctl_peer *p;
 	const char *t;
@@ -1017,18 +1268,9 @@ static int ctl_wifi_peer_fn(sd_bus_message *m,
 	if (!t)
 		return cli_EINVAL();
 
-	r = sd_bus_path_decode(t,
-			       "/org/freedesktop/miracle/wifi/peer",
-			       &label);
-	if (r < 0) {
-		return cli_ERR(r);
-	} else if (r == 0) {
+	p = ctl_wifi_find_peer_by_path(w, t);
+	if (!p)
 		return 0;
-	} else if (r > 0) {
-		p = ctl_wifi_find_peer(w, label);
-		if (!p)
-			return 0;
-	}
 
 	if (sd_bus_message_is_signal(m,
 				     "org.freedesktop.miracle.wifi.Peer",
@@ -1121,6 +1363,12 @@ int ctl_wifi_new(struct ctl_wifi **out, sd_bus *bus)
 
 	w->bus = sd_bus_ref(bus);
 	shl_dlist_init(&w->links);
+	ctl_index_init(&w->links_by_label);
+	ctl_index_init(&w->links_by_ifname);
+	ctl_index_init(&w->links_by_name);
+	shl_htable_init_str(&w->links_by_path);
+	ctl_index_init(&w->peers_by_label);
+	shl_htable_init_str(&w->peers_by_path);
 
 	r = ctl_wifi_init(w);
 	if (r < 0) {
@@ -1146,19 +1394,90 @@ void ctl_wifi_free(struct ctl_wifi *w)
 	}
 
 	ctl_wifi_destroy(w);
+
+	shl_htable_clear(&w->peers_by_path, NULL, NULL);
+	shl_htable_clear(&w->peers_by_label, NULL, NULL);
+	shl_htable_clear(&w->links_by_path, NULL, NULL);
+	shl_htable_clear(&w->links_by_name, NULL, NULL);
+	shl_htable_clear(&w->links_by_ifname, NULL, NULL);
+	shl_htable_clear(&w->links_by_label, NULL, NULL);
+
 	sd_bus_unref(w->bus);
 	free(w);
 }
 
-int ctl_wifi_fetch(struct ctl_wifi *w)
+static void ctl_wifi_mark_stale(struct ctl_wifi *w)
+{
+	struct shl_dlist *i, *j;
+	struct ctl_link *l;
+	struct ctl_peer *p;
+
+	shl_dlist_for_each(i, &w->links) {
+		l = link_from_dlist(i);
+		l->stale = true;
+		shl_dlist_for_each(j, &l->peers) {
+			p = peer_from_dlist(j);
+			p->stale = true;
+		}
+	}
+}
+
+static void ctl_wifi_drop_stale(struct ctl_wifi *w)
+{
+	struct shl_dlist *i, *ti, *j, *tj;
+	struct ctl_link *l;
+	struct ctl_peer *p;
+
+	shl_dlist_for_each_safe(i, ti, &w->links) {
+		l = link_from_dlist(i);
+		if (l->stale) {
+			ctl_link_free(l);
+			continue;
+		}
+
+		shl_dlist_for_each_safe(j, tj, &l->peers) {
+			p = peer_from_dlist(j);
+			if (p->stale)
+				ctl_peer_free(p);
+		}
+	}
+}
+
+static int ctl_wifi_parse_objects(struct ctl_wifi *w, sd_bus_message *m)
+{
+	int r;
+
+	r = sd_bus_message_enter_container(m, 'a', "{oa{sa{sv}}}");
+	if (r < 0)
+		return cli_log_parser(r);
+
+	while ((r = sd_bus_message_enter_container(m,
+						   'e',
+						   "oa{sa{sv}}")) > 0) {
+		r = ctl_wifi_parse_object(w, m, true);
+		if (r < 0)
+			return r;
+
+		r = sd_bus_message_exit_container(m);
+		if (r < 0)
+			return cli_log_parser(r);
+	}
+	if (r < 0)
+		return cli_log_parser(r);
+
+	r = sd_bus_message_exit_container(m);
+	if (r < 0)
+		return cli_log_parser(r);
+
+	return 0;
+}
+
+static int ctl_wifi_fetch_all(struct ctl_wifi *w)
 {
 	_sd_bus_message_unref_ sd_bus_message *m = NULL;
 	_sd_bus_error_free_ sd_bus_error err = SD_BUS_ERROR_NULL;
 	int r;
 
-	if (!w)
-		return cli_EINVAL();
-
 	r = sd_bus_call_method(w->bus,
 			       "org.freedesktop.miracle.wifi",
 			       "/org/freedesktop/miracle/wifi",
@@ -1173,20 +1492,76 @@ int ctl_wifi_fetch(struct ctl_wifi *w)
 		return r;
 	}
 
-	r = sd_bus_message_enter_container(m, 'a', "{oa{sa{sv}}}");
+	ctl_wifi_mark_stale(w);
+
+	r = ctl_wifi_parse_objects(w, m);
+	if (r < 0)
+		return r;
+
+	ctl_wifi_drop_stale(w);
+	w->generation = 0;
+
+	return 0;
+}
+
+int ctl_wifi_fetch(struct ctl_wifi *w)
+{
+	_sd_bus_message_unref_ sd_bus_message *m = NULL;
+	_sd_bus_error_free_ sd_bus_error err = SD_BUS_ERROR_NULL;
+	struct ctl_link *l;
+	struct ctl_peer *p;
+	uint64_t generation;
+	const char *t;
+	int reset, r;
+
+	if (!w)
+		return cli_EINVAL();
+
+	/* Ask wifid for everything that changed since the generation we're
+	 * synced to. A generation of 0 (or one wifid no longer remembers)
+	 * makes wifid reply with all objects and the reset flag set. */
+	r = sd_bus_call_method(w->bus,
+			       "org.freedesktop.miracle.wifi",
+			       "/org/freedesktop/miracle/wifi",
+			       "org.freedesktop.miracle.wifi.Manager",
+			       "GetChangedObjects",
+			       &err,
+			       &m,
+			       "t",
+			       w->generation);
+	if (r < 0) {
+		/* older wifid without delta-sync support, or a bus policy
+		 * that does not let us call it */
+		if (sd_bus_error_has_name(&err, SD_BUS_ERROR_UNKNOWN_METHOD) ||
+		    sd_bus_error_has_name(&err, SD_BUS_ERROR_ACCESS_DENIED))
+			return ctl_wifi_fetch_all(w);
+
+		cli_error("cannot retrieve objects: %s",
+			  bus_error_message(&err, r));
+		return r;
+	}
+
+	r = sd_bus_message_read(m, "tb", &generation, &reset);
 	if (r < 0)
 		return cli_log_parser(r);
 
-	while ((r = sd_bus_message_enter_container(m,
-						   'e',
-						   "oa{sa{sv}}")) > 0) {
-		r = ctl_wifi_parse_object(w, m, true);
-		if (r < 0)
-			return r;
+	if (reset)
+		ctl_wifi_mark_stale(w);
 
-		r = sd_bus_message_exit_container(m);
-		if (r < 0)
-			return cli_log_parser(r);
+	r = sd_bus_message_enter_container(m, 'a', "o");
+	if (r < 0)
+		return cli_log_parser(r);
+
+	while ((r = sd_bus_message_read(m, "o", &t)) > 0) {
+		l = ctl_wifi_find_link_by_path(w, t);
+		if (l) {
+			ctl_link_free(l);
+			continue;
+		}
+
+		p = ctl_wifi_find_peer_by_path(w, t);
+		if (p)
+			ctl_peer_free(p);
 	}
 	if (r < 0)
 		return cli_log_parser(r);
@@ -1195,32 +1570,337 @@ int ctl_wifi_fetch(struct ctl_wifi *w)
 	if (r < 0)
 		return cli_log_parser(r);
 
+	r = ctl_wifi_parse_objects(w, m);
+	if (r < 0)
+		return r;
+
+	if (reset)
+		ctl_wifi_drop_stale(w);
+
+	w->generation = generation;
+
 	return 0;
 }
 
-struct ctl_link *ctl_wifi_find_link(struct ctl_wifi *w,
-				    const char *label)
+int ctl_wifi_print_metrics(struct ctl_wifi *w)
 {
-	struct shl_dlist *i;
-	struct ctl_link *l;
+	_sd_bus_message_unref_ sd_bus_message *m = NULL;
+	_sd_bus_error_free_ sd_bus_error err = SD_BUS_ERROR_NULL;
+	const char *dump;
+	int r;
 
-	if (!w || shl_isempty(label))
+	if (!w)
+		return cli_EINVAL();
+
+	r = sd_bus_call_method(w->bus,
+			       "org.freedesktop.miracle.wifi",
+			       "/org/freedesktop/miracle/wifi",
+			       "org.freedesktop.miracle.Metrics",
+			       "Dump",
+			       &err,
+			       &m,
+			       NULL);
+	if (r < 0) {
+		cli_error("cannot retrieve metrics: %s",
+			  bus_error_message(&err, r));
+		return r;
+	}
+
+	r = sd_bus_message_read(m, "s", &dump);
+	if (r < 0)
+		return cli_log_parser(r);
+
+	cli_printf("%s", dump);
+	return 0;
+}
+
+/*
+ * Snapshots
+ * The last synced state is kept in a key-file so a fresh ctl process can
+ * start from it and only fetch a delta. There is one group per object path
+ * and keys are named after the D-Bus properties.
+ */
+
+static char *ctl_snapshot_path(const char *path)
+{
+	gchar *t;
+	char *s;
+
+	if (path)
+		return strdup(path);
+
+	t = g_build_filename(g_get_user_cache_dir(),
+			     "miraclecast",
+			     "wifi-snapshot",
+			     NULL);
+	s = t ? strdup(t) : NULL;
+	g_free(t);
+
+	return s;
+}
+
+static char *ctl_snapshot_get_string(GKeyFile *gkf,
+				     const char *group,
+				     const char *key)
+{
+	gchar *t;
+	char *s;
+
+	t = g_key_file_get_string(gkf, group, key, NULL);
+	if (!t)
 		return NULL;
 
+	s = strdup(t);
+	g_free(t);
+
+	return s;
+}
+
+static void ctl_snapshot_set_string(GKeyFile *gkf,
+				    const char *group,
+				    const char *key,
+				    const char *val)
+{
+	if (val)
+		g_key_file_set_string(gkf, group, key, val);
+}
+
+static int ctl_snapshot_load_link(struct ctl_wifi *w,
+				  GKeyFile *gkf,
+				  const char *group,
+				  const char *label)
+{
+	struct ctl_link *l;
+	int r;
+
+	if (ctl_wifi_find_link(w, label))
+		return 0;
+
+	r = ctl_link_new(&l, w, label);
+	if (r < 0)
+		return r;
+
+	l->ifindex = g_key_file_get_integer(gkf, group, "InterfaceIndex", NULL);
+	l->ifname = ctl_snapshot_get_string(gkf, group, "InterfaceName");
+	l->friendly_name = ctl_snapshot_get_string(gkf, group, "FriendlyName");
+	l->managed = g_key_file_get_boolean(gkf, group, "Managed", NULL);
+	l->p2p_scanning = g_key_file_get_boolean(gkf, group, "P2PScanning",
+						 NULL);
+	l->streaming = g_key_file_get_boolean(gkf, group, "Streaming", NULL);
+	l->wfd_subelements = ctl_snapshot_get_string(gkf, group,
+						     "WfdSubelements");
+
+	ctl_link_link(l);
+
+	return 0;
+}
+
+static int ctl_snapshot_load_peer(struct ctl_wifi *w,
+				  GKeyFile *gkf,
+				  const char *group,
+				  const char *label)
+{
+	struct ctl_link *l;
+	struct ctl_peer *p;
+	int r;
+
+	if (ctl_wifi_find_peer(w, label))
+		return 0;
+
+	/* peers of links that didn't make it into the snapshot are dropped */
+	l = ctl_wifi_find_link_by_peer(w, label);
+	if (!l)
+		return 0;
+
+	r = ctl_peer_new(&p, l, label);
+	if (r < 0)
+		return r;
+
+	p->p2p_mac = ctl_snapshot_get_string(gkf, group, "P2PMac");
+	p->friendly_name = ctl_snapshot_get_string(gkf, group, "FriendlyName");
+	p->connected = g_key_file_get_boolean(gkf, group, "Connected", NULL);
+	p->interface = ctl_snapshot_get_string(gkf, group, "Interface");
+	p->local_address = ctl_snapshot_get_string(gkf, group,
+						   "LocalAddress");
+	p->remote_address = ctl_snapshot_get_string(gkf, group,
+						    "RemoteAddress");
+	p->wfd_subelements = ctl_snapshot_get_string(gkf, group,
+						     "WfdSubelements");
+
+	ctl_peer_link(p);
+
+	return 0;
+}
+
+int ctl_wifi_load_snapshot(struct ctl_wifi *w, const char *path)
+{
+	_shl_free_ char *file = NULL;
+	GKeyFile *gkf;
+	GError *error = NULL;
+	gchar **groups;
+	uint64_t generation;
+	char *label;
+	size_t i;
+	int r = 0;
+
+	if (!w)
+		return cli_EINVAL();
+
+	file = ctl_snapshot_path(path);
+	if (!file)
+		return cli_ENOMEM();
+
+	gkf = g_key_file_new();
+	if (!g_key_file_load_from_file(gkf, file, G_KEY_FILE_NONE, &error)) {
+		if (!g_error_matches(error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+			cli_debug("cannot load snapshot %s: %s",
+				  file, error->message);
+		g_error_free(error);
+		g_key_file_free(gkf);
+		return 0;
+	}
+
+	generation = g_key_file_get_uint64(gkf, "Wifi", "Generation", NULL);
+	if (!generation)
+		goto out;
+
+	groups = g_key_file_get_groups(gkf, NULL);
+
+	/* links first, peers need their link to be present */
+	for (i = 0; groups[i] && r >= 0; ++i) {
+		r = sd_bus_path_decode(groups[i],
+				       "/org/freedesktop/miracle/wifi/link",
+				       &label);
+		if (r <= 0)
+			continue;
+
+		r = ctl_snapshot_load_link(w, gkf, groups[i], label);
+		free(label);
+	}
+
+	for (i = 0; groups[i] && r >= 0; ++i) {
+		r = sd_bus_path_decode(groups[i],
+				       "/org/freedesktop/miracle/wifi/peer",
+				       &label);
+		if (r <= 0)
+			continue;
+
+		r = ctl_snapshot_load_peer(w, gkf, groups[i], label);
+		free(label);
+	}
+
+	g_strfreev(groups);
+
+	if (r >= 0)
+		w->generation = generation;
+
+out:
+	g_key_file_free(gkf);
+	return r < 0 ? r : 0;
+}
+
+int ctl_wifi_save_snapshot(struct ctl_wifi *w, const char *path)
+{
+	_shl_free_ char *file = NULL;
+	struct shl_dlist *i, *j;
+	struct ctl_link *l;
+	struct ctl_peer *p;
+	GKeyFile *gkf;
+	GError *error = NULL;
+	gchar *data, *dir;
+	gsize len;
+	int r = 0;
+
+	if (!w)
+		return cli_EINVAL();
+
+	/* nothing worth caching if we never got a generation */
+	if (!w->generation)
+		return 0;
+
+	file = ctl_snapshot_path(path);
+	if (!file)
+		return cli_ENOMEM();
+
+	gkf = g_key_file_new();
+	g_key_file_set_uint64(gkf, "Wifi", "Generation", w->generation);
+
 	shl_dlist_for_each(i, &w->links) {
 		l = link_from_dlist(i);
-		if (!strcasecmp(l->label, label))
-			return l;
+
+		g_key_file_set_integer(gkf, l->path, "InterfaceIndex",
+				       l->ifindex);
+		ctl_snapshot_set_string(gkf, l->path, "InterfaceName",
+					l->ifname);
+		ctl_snapshot_set_string(gkf, l->path, "FriendlyName",
+					l->friendly_name);
+		g_key_file_set_boolean(gkf, l->path, "Managed", l->managed);
+		g_key_file_set_boolean(gkf, l->path, "P2PScanning",
+				       l->p2p_scanning);
+		g_key_file_set_boolean(gkf, l->path, "Streaming",
+				       l->streaming);
+		ctl_snapshot_set_string(gkf, l->path, "WfdSubelements",
+					l->wfd_subelements);
+
+		shl_dlist_for_each(j, &l->peers) {
+			p = peer_from_dlist(j);
+
+			ctl_snapshot_set_string(gkf, p->path, "P2PMac",
+						p->p2p_mac);
+			ctl_snapshot_set_string(gkf, p->path, "FriendlyName",
+						p->friendly_name);
+			g_key_file_set_boolean(gkf, p->path, "Connected",
+					       p->connected);
+			ctl_snapshot_set_string(gkf, p->path, "Interface",
+						p->interface);
+			ctl_snapshot_set_string(gkf, p->path, "LocalAddress",
+						p->local_address);
+			ctl_snapshot_set_string(gkf, p->path, "RemoteAddress",
+						p->remote_address);
+			ctl_snapshot_set_string(gkf, p->path, "WfdSubelements",
+						p->wfd_subelements);
+		}
 	}
 
-	return NULL;
+	data = g_key_file_to_data(gkf, &len, NULL);
+	g_key_file_free(gkf);
+	if (!data)
+		return cli_ENOMEM();
+
+	dir = g_path_get_dirname(file);
+	g_mkdir_with_parents(dir, 0700);
+	g_free(dir);
+
+	if (!g_file_set_contents(file, data, len, &error)) {
+		cli_debug("cannot save snapshot %s: %s", file, error->message);
+		g_error_free(error);
+		r = -EIO;
+	}
+
+	g_free(data);
+	return r;
+}
+
+struct ctl_link *ctl_wifi_find_link(struct ctl_wifi *w,
+				    const char *label)
+{
+	char **elem;
+
+	if (!w)
+		return NULL;
+
+	elem = ctl_index_find(&w->links_by_label, label);
+	if (!elem)
+		return NULL;
+
+	return link_from_htable(elem, label);
 }
 
 struct ctl_link *ctl_wifi_search_link(struct ctl_wifi *w,
 				      const char *label)
 {
-	struct shl_dlist *i;
 	struct ctl_link *l;
+	char **elem;
 
 	if (!w || shl_isempty(label))
 		return NULL;
@@ -1230,18 +1910,14 @@ struct ctl_link *ctl_wifi_search_link(struct ctl_wifi *w,
 		return l;
 
 	/* try matching on interface */
-	shl_dlist_for_each(i, &w->links) {
-		l = link_from_dlist(i);
-		if (l->ifname && !strcasecmp(l->ifname, label))
-			return l;
-	}
+	elem = ctl_index_find(&w->links_by_ifname, label);
+	if (elem)
+		return link_from_htable(elem, ifname);
 
 	/* try matching on friendly-name */
-	shl_dlist_for_each(i, &w->links) {
-		l = link_from_dlist(i);
-		if (l->friendly_name && !strcasecmp(l->friendly_name, label))
-			return l;
-	}
+	elem = ctl_index_find(&w->links_by_name, label);
+	if (elem)
+		return link_from_htable(elem, friendly_name);
 
 	return NULL;
 }
@@ -1279,17 +1955,16 @@ struct ctl_link *ctl_wifi_search_link_by_peer(struct ctl_wifi *w,
 struct ctl_peer *ctl_wifi_find_peer(struct ctl_wifi *w,
 				    const char *label)
 {
-	struct ctl_link *l;
+	char **elem;
 
-	if (!w || shl_isempty(label))
+	if (!w)
 		return NULL;
 
-	/* first try exact match */
-	l = ctl_wifi_find_link_by_peer(w, label);
-	if (!l)
+	elem = ctl_index_find(&w->peers_by_label, label);
+	if (!elem)
 		return NULL;
 
-	return ctl_link_find_peer(l, label);
+	return peer_from_htable(elem, label);
 }
 
 struct ctl_peer *ctl_wifi_search_peer(struct ctl_wifi *w,
@@ -1322,19 +1997,13 @@ struct ctl_peer *ctl_wifi_search_peer(struct ctl_wifi *w,
 		if (sep)
 			*sep = 0;
 
-		shl_dlist_for_each(j, &l->peers) {
-			p = shl_dlist_entry(j, struct ctl_peer, list);
-			next = shl_startswith(p->label, label);
-			if (next && *next == '@')
-				return p;
-		}
+		p = ctl_link_find_peer_by_label(l, label);
+		if (p)
+			return p;
 
-		shl_dlist_for_each(j, &l->peers) {
-			p = shl_dlist_entry(j, struct ctl_peer, list);
-			if (p->friendly_name &&
-			    !strcasecmp(p->friendly_name, label))
-				return p;
-		}
+		p = ctl_link_find_peer_by_name(l, label);
+		if (p)
+			return p;
 
 		shl_dlist_for_each(j, &l->peers) {
 			p = shl_dlist_entry(j, struct ctl_peer, list);
@@ -1358,22 +2027,16 @@ struct ctl_peer *ctl_wifi_search_peer(struct ctl_wifi *w,
 
 	shl_dlist_for_each(i, &w->links) {
 		l = shl_dlist_entry(i, struct ctl_link, list);
-		shl_dlist_for_each(j, &l->peers) {
-			p = shl_dlist_entry(j, struct ctl_peer, list);
-			next = shl_startswith(p->label, label);
-			if (next && *next == '@')
-				return p;
-		}
+		p = ctl_link_find_peer_by_label(l, label);
+		if (p)
+			return p;
 	}
 
 	shl_dlist_for_each(i, &w->links) {
 		l = shl_dlist_entry(i, struct ctl_link, list);
-		shl_dlist_for_each(j, &l->peers) {
-			p = shl_dlist_entry(j, struct ctl_peer, list);
-			if (p->friendly_name &&
-			    !strcasecmp(p->friendly_name, label))
-				return p;
-		}
+		p = ctl_link_find_peer_by_name(l, label);
+		if (p)
+			return p;
 	}
 
 	shl_dlist_for_each(i, &w->links) {
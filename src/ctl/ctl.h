@@ -27,6 +27,7 @@
 #include <sys/types.h>
 #include <systemd/sd-bus.h>
 #include "shl_dlist.h"
+#include "shl_htable.h"
 #include "shl_log.h"
 
 #ifndef CTL_CTL_H
@@ -41,7 +42,9 @@ struct ctl_peer;
 struct ctl_peer {
 	struct shl_dlist list;
 	char *label;
+	char *path;
 	struct ctl_link *l;
+	bool stale;
 
 	/* properties */
 	char *p2p_mac;
@@ -54,6 +57,8 @@ struct ctl_peer {
 };
 
 #define peer_from_dlist(_p) shl_dlist_entry((_p), struct ctl_peer, list);
+#define peer_from_htable(_p, _member) \
+	shl_htable_entry((_p), struct ctl_peer, _member)
 
 int ctl_peer_connect(struct ctl_peer *p, const char *prov, const char *pin);
 int ctl_peer_disconnect(struct ctl_peer *p);
@@ -61,9 +66,13 @@ int ctl_peer_disconnect(struct ctl_peer *p);
 struct ctl_link {
 	struct shl_dlist list;
 	char *label;
+	char *path;
 	struct ctl_wifi *w;
+	bool stale;
 
 	struct shl_dlist peers;
+	struct shl_htable peers_by_mac;
+	struct shl_htable peers_by_name;
 
 	bool have_p2p_scan;
 
@@ -74,24 +83,43 @@ struct ctl_link {
 	bool managed;
 	char *wfd_subelements;
 	bool p2p_scanning;
+	bool streaming;
 };
 
 #define link_from_dlist(_l) shl_dlist_entry((_l), struct ctl_link, list);
+#define link_from_htable(_l, _member) \
+	shl_htable_entry((_l), struct ctl_link, _member)
 
 int ctl_link_set_friendly_name(struct ctl_link *l, const char *name);
 int ctl_link_set_managed(struct ctl_link *l, bool val);
 int ctl_link_set_wfd_subelements(struct ctl_link *l, const char *val);
 int ctl_link_set_p2p_scanning(struct ctl_link *l, bool val);
+int ctl_link_set_streaming(struct ctl_link *l, bool val);
 
 struct ctl_wifi {
 	sd_bus *bus;
 
 	struct shl_dlist links;
+
+	/* wifid generation we're synced to, 0 if unknown */
+	uint64_t generation;
+
+	/* Lookup indexes on top of the lists above. Labels, names and
+	 * MACs are matched case-insensitively, object paths exactly. */
+	struct shl_htable links_by_label;
+	struct shl_htable links_by_ifname;
+	struct shl_htable links_by_name;
+	struct shl_htable links_by_path;
+	struct shl_htable peers_by_label;
+	struct shl_htable peers_by_path;
 };
 
 int ctl_wifi_new(struct ctl_wifi **out, sd_bus *bus);
 void ctl_wifi_free(struct ctl_wifi *w);
 int ctl_wifi_fetch(struct ctl_wifi *w);
+int ctl_wifi_load_snapshot(struct ctl_wifi *w, const char *path);
+int ctl_wifi_save_snapshot(struct ctl_wifi *w, const char *path);
+int ctl_wifi_print_metrics(struct ctl_wifi *w);
 
 struct ctl_link *ctl_wifi_find_link(struct ctl_wifi *w,
 				    const char *label);
@@ -120,6 +148,24 @@ bool ctl_sink_is_connecting(struct ctl_sink *s);
 bool ctl_sink_is_connected(struct ctl_sink *s);
 bool ctl_sink_is_closed(struct ctl_sink *s);
 
+/* source handling */
+
+struct ctl_src;
+struct ctl_src_session;
+
+int ctl_src_new(struct ctl_src **out,
+		sd_event *event);
+void ctl_src_free(struct ctl_src *s);
+
+int ctl_src_listen(struct ctl_src *s, const char *local, unsigned int port);
+void ctl_src_close(struct ctl_src *s);
+bool ctl_src_is_listening(struct ctl_src *s);
+
+struct ctl_src_session *ctl_src_find_session(struct ctl_src *s,
+					     unsigned int id);
+int ctl_src_session_teardown(struct ctl_src_session *ss);
+const char *ctl_src_state_to_name(unsigned int state);
+
 /* CLI handling */
 
 extern unsigned int cli_max_sev;
@@ -223,6 +269,7 @@ void cli_exit(void);
 bool cli_running(void);
 
 int cli_help(const struct cli_cmd *cmds, int whitespace);
+int cli_print_metrics(void);
 int cli_do(const struct cli_cmd *cmds, char **args, unsigned int n);
 
 /* callback functions */
@@ -245,6 +292,12 @@ void ctl_fn_sink_connected(struct ctl_sink *s);
 void ctl_fn_sink_disconnected(struct ctl_sink *s);
 void ctl_fn_sink_resolution_set(struct ctl_sink *s);
 
+void ctl_fn_src_session_new(struct ctl_src_session *ss);
+int ctl_fn_src_session_playing(struct ctl_src_session *ss);
+void ctl_fn_src_session_paused(struct ctl_src_session *ss);
+void ctl_fn_src_session_free(struct ctl_src_session *ss);
+
 void cli_fn_help(void);
+void cli_fn_child_exited(pid_t pid);
 
 #endif /* CTL_CTL_H */
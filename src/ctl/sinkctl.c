@@ -35,9 +35,11 @@
 #include <unistd.h>
 #include "ctl.h"
 #include "ctl-sink.h"
+#include "loopstat.h"
 #include "wfd.h"
 #include "shl_macro.h"
 #include "shl_util.h"
+#include "trace.h"
 #include "util.h"
 #include "config.h"
 
@@ -62,6 +64,8 @@ int gst_audio_en = 1;
 static const int DEFAULT_RSTP_PORT = 1991;
 bool uibc_option;
 bool uibc_enabled;
+char *uibc_hidc;
+unsigned int uibc_hidc_types;
 bool external_player;
 int rstp_port;
 int uibc_port;
@@ -156,6 +160,7 @@ static int cmd_show(char **args, unsigned int n)
 		if (l->friendly_name && *l->friendly_name)
 			cli_printf("FriendlyName=%s\n", l->friendly_name);
 		cli_printf("P2PScanning=%d\n", l->p2p_scanning);
+		cli_printf("Streaming=%d\n", l->streaming);
 		if (l->wfd_subelements && *l->wfd_subelements)
 			cli_printf("WfdSubelements=%s\n", l->wfd_subelements);
 		cli_printf("Managed=%d\n", l->managed);
@@ -278,6 +283,23 @@ static int cmd_set_managed(char **args, unsigned int n)
 	return ctl_link_set_managed(l, managed);
 }
 
+/*
+ * cmd: metrics
+ */
+
+static int cmd_metrics(char **args, unsigned int n)
+{
+	int r;
+
+	cli_printf("sinkctl:\n");
+	r = cli_print_metrics();
+	if (r < 0)
+		return r;
+
+	cli_printf("wifid:\n");
+	return ctl_wifi_print_metrics(wifi);
+}
+
 /*
  * cmd: quit/exit
  */
@@ -329,6 +351,7 @@ static void stop_timeout(sd_event_source **out)
 
 static int scan_timeout_fn(sd_event_source *s, uint64_t usec, void *data)
 {
+	LOOPSTAT("sinkctl.scan_timeout");
 	stop_timeout(&scan_timeout);
 
 	if (pending_peer) {
@@ -347,6 +370,7 @@ static int scan_timeout_fn(sd_event_source *s, uint64_t usec, void *data)
 
 static int sink_timeout_fn(sd_event_source *s, uint64_t usec, void *data)
 {
+	LOOPSTAT("sinkctl.sink_timeout");
 	int r;
 
 	stop_timeout(&sink_timeout);
@@ -375,6 +399,7 @@ static const struct cli_cmd cli_cmds[] = {
 	{ "run",		"<link>",				CLI_M,	CLI_EQUAL,	1,	cmd_run,		"Run sink on given link" },
 	{ "bind",		"<link>",				CLI_M,	CLI_EQUAL,	1,	cmd_bind,		"Like 'run' but bind the link name to run when it is hotplugged" },
 	{ "set-managed",	"<link> <yes|no>",	CLI_M,	CLI_EQUAL,	2,	cmd_set_managed,	"Manage or unmnage a link" },
+	{ "metrics",		NULL,					CLI_M,	CLI_LESS,	0,	cmd_metrics,		"Dump RTSP and wifid metrics" },
 	{ "quit",		NULL,					CLI_Y,	CLI_MORE,	0,	cmd_quit,		"Quit program" },
 	{ "exit",		NULL,					CLI_Y,	CLI_MORE,	0,	cmd_quit,		NULL },
 	{ "help",		NULL,					CLI_M,	CLI_MORE,	0,	NULL,			"Print help" },
@@ -390,6 +415,7 @@ static void spawn_gst(struct ctl_sink *s)
 	if (sink_pid > 0)
 		return;
 
+	trace_flush();
 	pid = fork();
 	if (pid < 0) {
 		return cli_vERRNO();
@@ -416,6 +442,9 @@ static void spawn_gst(struct ctl_sink *s)
 		_exit(1);
 	} else {
 		sink_pid = pid;
+		trace_begin("player", "player", pid, NULL);
+		if (running_link)
+			ctl_link_set_streaming(running_link, true);
 	}
 }
 
@@ -424,6 +453,7 @@ void launch_player(struct ctl_sink *s) {
 	char resolution[64];
 	char port[64];
 	char uibc_portStr[64];
+	char hidc_types[16];
 	int i = 0;
    if (!external_player) {
 	   if (uibc_enabled) {
@@ -438,6 +468,15 @@ void launch_player(struct ctl_sink *s) {
 		argv[i++] = s->target;
 		sprintf(uibc_portStr, "%d", uibc_port);
 		argv[i++] = uibc_portStr;
+		/* only what the source accepted in M4, see ctl-sink.c */
+		if (uibc_hidc && uibc_hidc_types &&
+		    !(s->uibc_setting && !strcmp(s->uibc_setting, "disable"))) {
+			argv[i++] = "--hid";
+			argv[i++] = uibc_hidc;
+			sprintf(hidc_types, "%u", uibc_hidc_types);
+			argv[i++] = "--hid-types";
+			argv[i++] = hidc_types;
+		}
 	}
 	if (gst_debug) {
 		argv[i++] = "-d";
@@ -508,7 +547,25 @@ static void kill_gst(void)
 		return;
 
 	kill(sink_pid, SIGTERM);
+	trace_end("player", "player", sink_pid, "stopped");
+	sink_pid = 0;
+
+	if (running_link)
+		ctl_link_set_streaming(running_link, false);
+}
+
+/* the player quit on its own, it no longer holds Streaming */
+void cli_fn_child_exited(pid_t pid)
+{
+	if (pid != sink_pid)
+		return;
+
+	cli_debug("player %d exited", (int)pid);
+	trace_end("player", "player", sink_pid, "exited");
 	sink_pid = 0;
+
+	if (running_link)
+		ctl_link_set_streaming(running_link, false);
 }
 
 void ctl_fn_sink_connected(struct ctl_sink *s)
@@ -721,6 +778,7 @@ void cli_fn_help()
 	       "     --scale WxH                 Scale to resolution\n"
 	       "  -p --port <port>                  Port for rtsp (default %d)\n"
 	       "     --uibc                         Enables UIBC\n"
+	       "     --uibc-hidc <dev>[,<dev>...]   Forward hidraw devices via UIBC HIDC\n"
 	       "  -e --external-player           Configure player to use\n"
 	       "     --res <n,n,n>               Supported resolutions masks (CEA, VESA, HH)\n"
 	       "                                    default CEA  %08X\n"
@@ -749,6 +807,9 @@ static int ctl_interactive(char **argv, int argc)
 	if (r < 0)
 		goto error;
 
+	/* start from the cached state, the fetch only pulls a delta */
+	ctl_wifi_load_snapshot(wifi, NULL);
+
 	r = ctl_wifi_fetch(wifi);
 	if (r < 0)
 		goto error;
@@ -794,6 +855,7 @@ static int ctl_main(int argc, char *argv[])
 			ctl_link_set_p2p_scanning(l, false);
 	}
 
+	ctl_wifi_save_snapshot(wifi, NULL);
 	ctl_wifi_free(wifi);
 	return r;
 }
@@ -810,6 +872,7 @@ static int parse_argv(int argc, char *argv[])
 		ARG_RES,
 		ARG_HELP_RES,
 		ARG_UIBC,
+		ARG_UIBC_HIDC,
       ARG_HELP_COMMANDS,
 	};
 	static const struct option options[] = {
@@ -825,6 +888,7 @@ static int parse_argv(int argc, char *argv[])
 		{ "help-res",	no_argument,	NULL,	ARG_HELP_RES },
 		{ "port",		required_argument,	NULL,	'p' },
 		{ "uibc",		no_argument,		NULL,	ARG_UIBC },
+		{ "uibc-hidc",		required_argument,	NULL,	ARG_UIBC_HIDC },
 		{ "external-player",		required_argument,		NULL,	'e' },
 		{}
 	};
@@ -879,6 +943,10 @@ static int parse_argv(int argc, char *argv[])
 		case ARG_UIBC:
 			uibc_option = true;
 			break;
+		case ARG_UIBC_HIDC:
+			uibc_option = true;
+			uibc_hidc = optarg;
+			break;
 		case '?':
 			return -EINVAL;
 		}
@@ -949,6 +1017,8 @@ int main(int argc, char **argv)
 	if (!r)
 		return EXIT_SUCCESS;
 
+	trace_init("miracle-sinkctl");
+
 	r = sd_bus_default_system(&bus);
 	if (r < 0) {
 		cli_error("cannot connect to system bus: %s", strerror(-r));
@@ -0,0 +1,345 @@
+/*
+ * MiracleCast - Wifi-Display/Miracast Implementation
+ *
+ * MiracleCast is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * MiracleCast is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with MiracleCast; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Capture Backends
+ * "testsrc" generates scrolling colour bars with a bouncing box, which is
+ * enough to see dropped or torn frames on the sink. "shm:<path>" maps a file
+ * (usually in /dev/shm, or a memfd/linear dmabuf exported by the compositor
+ * under that path) that starts with a struct src_shm_header; the producer
+ * bumps seq around each write, so we never encode a half-written frame.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "ctl.h"
+#include "src-pipeline.h"
+#include "shl_macro.h"
+#include "shl_util.h"
+
+static void capture_frame_init(struct src_capture *c, struct src_frame *f)
+{
+	size_t luma = (size_t)c->width * c->height;
+
+	f->width = c->width;
+	f->height = c->height;
+	f->planes[0] = c->buf;
+	f->planes[1] = c->buf + luma;
+	f->planes[2] = c->buf + luma + luma / 4;
+	f->strides[0] = c->width;
+	f->strides[1] = c->width / 2;
+	f->strides[2] = c->width / 2;
+}
+
+/*
+ * testsrc
+ */
+
+static const uint8_t testsrc_bars[8][3] = {
+	/* Y, U, V of 75% SMPTE bars */
+	{ 180, 128, 128 },
+	{ 162,  44, 142 },
+	{ 131, 156,  44 },
+	{ 112,  72,  58 },
+	{  84, 184, 198 },
+	{  65, 100, 212 },
+	{  35, 212, 114 },
+	{  16, 128, 128 },
+};
+
+static int testsrc_open(struct src_capture *c, const char *arg)
+{
+	return 0;
+}
+
+static int testsrc_grab(struct src_capture *c, struct src_frame *f)
+{
+	int x, y, bar, w = c->width, h = c->height;
+	int box = shl_min(w, h) / 8 & ~1;
+	int bx, by, span_x, span_y;
+	uint8_t *row;
+
+	capture_frame_init(c, f);
+
+	/* first row of every plane, then replicate */
+	for (x = 0; x < w; ++x) {
+		bar = ((x + c->frame * 4) * 8 / w) % 8;
+		f->planes[0][x] = testsrc_bars[bar][0];
+		if (!(x & 1)) {
+			f->planes[1][x / 2] = testsrc_bars[bar][1];
+			f->planes[2][x / 2] = testsrc_bars[bar][2];
+		}
+	}
+	for (y = 1; y < h; ++y)
+		memcpy(f->planes[0] + y * w, f->planes[0], w);
+	for (y = 1; y < h / 2; ++y) {
+		memcpy(f->planes[1] + y * w / 2, f->planes[1], w / 2);
+		memcpy(f->planes[2] + y * w / 2, f->planes[2], w / 2);
+	}
+
+	/* white box bouncing between the edges */
+	span_x = shl_max(w - box, 1);
+	span_y = shl_max(h - box, 1);
+	bx = (c->frame * 8) % (2 * span_x);
+	by = (c->frame * 6) % (2 * span_y);
+	bx = (bx < span_x ? bx : 2 * span_x - bx) & ~1;
+	by = (by < span_y ? by : 2 * span_y - by) & ~1;
+
+	for (y = by; y < by + box && y < h; ++y) {
+		row = f->planes[0] + y * w + bx;
+		memset(row, 235, shl_min(box, w - bx));
+	}
+	for (y = by / 2; y < (by + box) / 2 && y < h / 2; ++y) {
+		memset(f->planes[1] + y * w / 2 + bx / 2, 128,
+		       shl_min(box, w - bx) / 2);
+		memset(f->planes[2] + y * w / 2 + bx / 2, 128,
+		       shl_min(box, w - bx) / 2);
+	}
+
+	return 0;
+}
+
+static const struct src_capture_ops testsrc_ops = {
+	.name = "testsrc",
+	.open = testsrc_open,
+	.grab = testsrc_grab,
+};
+
+/*
+ * shm
+ */
+
+static int shm_open_file(struct src_capture *c, const char *arg)
+{
+	struct stat st;
+	int r;
+
+	if (shl_isempty(arg))
+		return cli_EINVAL();
+
+	c->fd = open(arg, O_RDONLY | O_CLOEXEC);
+	if (c->fd < 0)
+		return cli_ERRNO();
+
+	r = fstat(c->fd, &st);
+	if (r < 0)
+		return cli_ERRNO();
+	if (st.st_size < (off_t)sizeof(struct src_shm_header))
+		return cli_EINVAL();
+
+	c->map_size = st.st_size;
+	c->map = mmap(NULL, c->map_size, PROT_READ, MAP_SHARED, c->fd, 0);
+	if (c->map == MAP_FAILED) {
+		c->map = NULL;
+		return cli_ERRNO();
+	}
+
+	return 0;
+}
+
+/* nearest-neighbour scale into our I420 buffer */
+static void shm_convert(struct src_capture *c, const struct src_shm_header *h,
+			const uint8_t *src, struct src_frame *f)
+{
+	int x, y, sx, sy, w = c->width, hgt = c->height;
+	const uint8_t *line, *p;
+	uint8_t *dy, *du, *dv;
+	int r, g, b;
+
+	for (y = 0; y < hgt; ++y) {
+		sy = y * (int)h->height / hgt;
+		dy = f->planes[0] + y * f->strides[0];
+		du = f->planes[1] + y / 2 * f->strides[1];
+		dv = f->planes[2] + y / 2 * f->strides[2];
+
+		if (h->format == SRC_SHM_I420) {
+			line = src + sy * h->stride;
+			for (x = 0; x < w; ++x)
+				dy[x] = line[x * (int)h->width / w];
+
+			if (y & 1)
+				continue;
+
+			/* chroma planes follow the luma plane at half stride */
+			line = src + h->stride * h->height + sy / 2 * (h->stride / 2);
+			for (x = 0; x < w / 2; ++x)
+				du[x] = line[x * (int)h->width / w];
+			line += h->stride / 2 * (h->height / 2);
+			for (x = 0; x < w / 2; ++x)
+				dv[x] = line[x * (int)h->width / w];
+			continue;
+		}
+
+		/* XRGB8888, BT.601 limited range */
+		line = src + sy * h->stride;
+		for (x = 0; x < w; ++x) {
+			sx = x * (int)h->width / w;
+			p = line + sx * 4;
+			b = p[0];
+			g = p[1];
+			r = p[2];
+			dy[x] = ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+			if (!(x & 1) && !(y & 1)) {
+				du[x / 2] = ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+				dv[x / 2] = ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+			}
+		}
+	}
+}
+
+static int shm_grab(struct src_capture *c, struct src_frame *f)
+{
+	const struct src_shm_header *map = c->map;
+	struct src_shm_header hdr, *h = &hdr;
+	uint64_t seq;
+	size_t need;
+
+	capture_frame_init(c, f);
+
+	seq = __atomic_load_n(&map->seq, __ATOMIC_ACQUIRE);
+	/* producer busy or nothing new: resend the previous frame */
+	if ((seq & 1) || seq == c->seq)
+		return 0;
+
+	/* validate a private copy so the producer cannot change it under us */
+	memcpy(&hdr, map, sizeof(hdr));
+
+	if (h->magic != SRC_SHM_MAGIC || !h->width || !h->height ||
+	    h->format > SRC_SHM_XRGB8888)
+		return -EINVAL;
+
+	if (h->format == SRC_SHM_XRGB8888 && h->stride / 4 < h->width)
+		return -EINVAL;
+	if (h->format == SRC_SHM_I420 && h->stride < h->width)
+		return -EINVAL;
+
+	need = (size_t)h->stride * h->height;
+	if (h->format == SRC_SHM_I420)
+		need += need / 2;
+	if (h->data_offset > c->map_size || need > c->map_size - h->data_offset)
+		return -EINVAL;
+
+	shm_convert(c, h, (const uint8_t*)c->map + h->data_offset, f);
+
+	/* torn read, keep what we have and retry on the next tick */
+	if (__atomic_load_n(&map->seq, __ATOMIC_ACQUIRE) == seq)
+		c->seq = seq;
+
+	return 0;
+}
+
+static void shm_close(struct src_capture *c)
+{
+	if (c->map)
+		munmap(c->map, c->map_size);
+	if (c->fd >= 0)
+		close(c->fd);
+}
+
+static const struct src_capture_ops shm_ops = {
+	.name = "shm",
+	.open = shm_open_file,
+	.grab = shm_grab,
+	.close = shm_close,
+};
+
+/*
+ * Capture Management
+ */
+
+static const struct src_capture_ops *capture_backends[] = {
+	&testsrc_ops,
+	&shm_ops,
+};
+
+int src_capture_new(struct src_capture **out, const char *spec,
+		    int width, int height)
+{
+	struct src_capture *c;
+	const char *arg = NULL;
+	size_t len, i;
+	int r;
+
+	if (!out || !spec || width <= 0 || height <= 0 || (width | height) & 1)
+		return cli_EINVAL();
+
+	len = strcspn(spec, ":");
+	if (spec[len] == ':')
+		arg = spec + len + 1;
+
+	c = calloc(1, sizeof(*c));
+	if (!c)
+		return cli_ENOMEM();
+
+	c->fd = -1;
+	c->width = width;
+	c->height = height;
+	for (i = 0; i < SHL_ARRAY_LENGTH(capture_backends); ++i) {
+		if (strlen(capture_backends[i]->name) == len &&
+		    !strncmp(capture_backends[i]->name, spec, len))
+			c->ops = capture_backends[i];
+	}
+	if (!c->ops) {
+		cli_error("unknown capture backend %s", spec);
+		r = -EINVAL;
+		goto error;
+	}
+
+	c->buf = calloc(1, (size_t)width * height * 3 / 2);
+	if (!c->buf) {
+		r = cli_ENOMEM();
+		goto error;
+	}
+
+	r = c->ops->open(c, arg);
+	if (r < 0)
+		goto error;
+
+	*out = c;
+	return 0;
+
+error:
+	src_capture_free(c);
+	return r;
+}
+
+void src_capture_free(struct src_capture *c)
+{
+	if (!c)
+		return;
+
+	if (c->ops && c->ops->close)
+		c->ops->close(c);
+	free(c->buf);
+	free(c);
+}
+
+int src_capture_grab(struct src_capture *c, struct src_frame *f)
+{
+	int r;
+
+	f->pts = shl_now(CLOCK_MONOTONIC);
+	r = c->ops->grab(c, f);
+	++c->frame;
+
+	return r;
+}
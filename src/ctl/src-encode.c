@@ -0,0 +1,455 @@
+/*
+ * MiracleCast - Wifi-Display/Miracast Implementation
+ *
+ * MiracleCast is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * MiracleCast is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with MiracleCast; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * H.264 Encoders
+ * "x264" is the one to use with real sinks; it is built if libx264 is found.
+ * "pcm" is always available: it writes every macroblock as I_PCM, which is a
+ * valid constrained-baseline stream that any decoder accepts, at the cost of
+ * an uncompressed bitrate. It has no dependencies and a fixed, predictable
+ * cost per frame, which is what loopback tests and benchmarks want. It
+ * ignores the bitrate, so it is only used if asked for by name.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ctl.h"
+#include "src-pipeline.h"
+#include "shl_macro.h"
+#include "shl_util.h"
+
+#ifdef HAVE_X264
+#include <x264.h>
+#endif
+
+/*
+ * Bitstream helpers
+ */
+
+struct bits {
+	uint8_t *data;
+	size_t pos;
+};
+
+static void bits_put(struct bits *b, unsigned int n, uint32_t v)
+{
+	while (n--) {
+		if (!(b->pos & 7))
+			b->data[b->pos >> 3] = 0;
+		if ((v >> n) & 1)
+			b->data[b->pos >> 3] |= 0x80 >> (b->pos & 7);
+		++b->pos;
+	}
+}
+
+static void bits_ue(struct bits *b, uint32_t v)
+{
+	unsigned int n = 32 - __builtin_clz(v + 1);
+
+	bits_put(b, n - 1, 0);
+	bits_put(b, n, v + 1);
+}
+
+static void bits_se(struct bits *b, int32_t v)
+{
+	bits_ue(b, v > 0 ? 2 * v - 1 : -2 * v);
+}
+
+static void bits_align_zero(struct bits *b)
+{
+	while (b->pos & 7)
+		bits_put(b, 1, 0);
+}
+
+static void bits_trailing(struct bits *b)
+{
+	bits_put(b, 1, 1);
+	bits_align_zero(b);
+}
+
+/* Annex B start code, NAL header and emulation prevention */
+static size_t nal_write(uint8_t *out, unsigned int ref_idc, unsigned int type,
+			const uint8_t *rbsp, size_t size)
+{
+	size_t i, o = 0;
+	unsigned int zeros = 0;
+
+	out[o++] = 0;
+	out[o++] = 0;
+	out[o++] = 0;
+	out[o++] = 1;
+	out[o++] = (ref_idc << 5) | type;
+
+	for (i = 0; i < size; ++i) {
+		if (zeros >= 2 && rbsp[i] <= 3) {
+			out[o++] = 3;
+			zeros = 0;
+		}
+		out[o++] = rbsp[i];
+		zeros = rbsp[i] ? 0 : zeros + 1;
+	}
+
+	return o;
+}
+
+/*
+ * pcm
+ */
+
+#define PCM_NAL_SPS	7
+#define PCM_NAL_PPS	8
+#define PCM_NAL_IDR	5
+#define PCM_NAL_AUD	9
+
+static int pcm_open(struct src_encoder *e)
+{
+	size_t mbs = (size_t)((e->width + 15) / 16) * ((e->height + 15) / 16);
+
+	/* mb_type, alignment and 384 samples per macroblock plus headers */
+	e->rbsp_size = mbs * (2 + 384) + 256;
+	e->rbsp = malloc(e->rbsp_size);
+	if (!e->rbsp)
+		return cli_ENOMEM();
+
+	/* worst case one emulation byte per two payload bytes */
+	e->buf_size = e->rbsp_size * 3 / 2 + 64;
+	e->buf = malloc(e->buf_size);
+	if (!e->buf)
+		return cli_ENOMEM();
+
+	return 0;
+}
+
+static size_t pcm_sps(struct src_encoder *e, uint8_t *rbsp)
+{
+	struct bits b = { rbsp, 0 };
+	unsigned int mbw = (e->width + 15) / 16, mbh = (e->height + 15) / 16;
+	unsigned int crop_r = (mbw * 16 - e->width) / 2;
+	unsigned int crop_b = (mbh * 16 - e->height) / 2;
+
+	bits_put(&b, 8, 66);		/* profile_idc: baseline */
+	bits_put(&b, 8, 0xc0);		/* constraint_set0/1: constrained */
+	bits_put(&b, 8, 42);		/* level_idc */
+	bits_ue(&b, 0);			/* seq_parameter_set_id */
+	bits_ue(&b, 0);			/* log2_max_frame_num_minus4 */
+	bits_ue(&b, 2);			/* pic_order_cnt_type */
+	bits_ue(&b, 0);			/* max_num_ref_frames */
+	bits_put(&b, 1, 0);		/* gaps_in_frame_num_value_allowed */
+	bits_ue(&b, mbw - 1);
+	bits_ue(&b, mbh - 1);
+	bits_put(&b, 1, 1);		/* frame_mbs_only_flag */
+	bits_put(&b, 1, 1);		/* direct_8x8_inference_flag */
+	bits_put(&b, 1, crop_r || crop_b);
+	if (crop_r || crop_b) {
+		bits_ue(&b, 0);
+		bits_ue(&b, crop_r);
+		bits_ue(&b, 0);
+		bits_ue(&b, crop_b);
+	}
+	bits_put(&b, 1, 0);		/* vui_parameters_present_flag */
+	bits_trailing(&b);
+
+	return b.pos / 8;
+}
+
+static size_t pcm_pps(uint8_t *rbsp)
+{
+	struct bits b = { rbsp, 0 };
+
+	bits_ue(&b, 0);			/* pic_parameter_set_id */
+	bits_ue(&b, 0);			/* seq_parameter_set_id */
+	bits_put(&b, 1, 0);		/* entropy_coding_mode_flag: CAVLC */
+	bits_put(&b, 1, 0);		/* bottom_field_pic_order_in_frame */
+	bits_ue(&b, 0);			/* num_slice_groups_minus1 */
+	bits_ue(&b, 0);			/* num_ref_idx_l0_default_active_minus1 */
+	bits_ue(&b, 0);			/* num_ref_idx_l1_default_active_minus1 */
+	bits_put(&b, 1, 0);		/* weighted_pred_flag */
+	bits_put(&b, 2, 0);		/* weighted_bipred_idc */
+	bits_se(&b, 0);			/* pic_init_qp_minus26 */
+	bits_se(&b, 0);			/* pic_init_qs_minus26 */
+	bits_se(&b, 0);			/* chroma_qp_index_offset */
+	bits_put(&b, 1, 1);		/* deblocking_filter_control_present */
+	bits_put(&b, 1, 0);		/* constrained_intra_pred_flag */
+	bits_put(&b, 1, 0);		/* redundant_pic_cnt_present_flag */
+	bits_trailing(&b);
+
+	return b.pos / 8;
+}
+
+/* copy one block row, clamping at the right/bottom picture edge */
+static uint8_t *pcm_block(uint8_t *o, const uint8_t *plane, int stride,
+			  int w, int h, int x0, int y0, int size)
+{
+	const uint8_t *line;
+	int x, y;
+
+	for (y = 0; y < size; ++y) {
+		line = plane + shl_min(y0 + y, h - 1) * stride;
+		if (x0 + size <= w) {
+			for (x = 0; x < size; ++x)
+				o[x] = line[x0 + x] ? : 1;
+		} else {
+			for (x = 0; x < size; ++x)
+				o[x] = line[shl_min(x0 + x, w - 1)] ? : 1;
+		}
+		o += size;
+	}
+
+	return o;
+}
+
+static int pcm_encode(struct src_encoder *e, const struct src_frame *f,
+		      const uint8_t **out, size_t *size, bool *key)
+{
+	unsigned int mbw = (e->width + 15) / 16, mbh = (e->height + 15) / 16;
+	unsigned int mx, my;
+	struct bits b;
+	uint8_t aud = 0x10;	/* primary_pic_type 0 (I), trailing bit */
+	uint8_t *o = e->buf;
+	uint8_t *p;
+	size_t n;
+
+	o += nal_write(o, 0, PCM_NAL_AUD, &aud, 1);
+	n = pcm_sps(e, e->rbsp);
+	o += nal_write(o, 3, PCM_NAL_SPS, e->rbsp, n);
+	n = pcm_pps(e->rbsp);
+	o += nal_write(o, 3, PCM_NAL_PPS, e->rbsp, n);
+
+	b.data = e->rbsp;
+	b.pos = 0;
+	bits_ue(&b, 0);			/* first_mb_in_slice */
+	bits_ue(&b, 7);			/* slice_type: I, all slices */
+	bits_ue(&b, 0);			/* pic_parameter_set_id */
+	bits_put(&b, 4, 0);		/* frame_num */
+	bits_ue(&b, e->frame & 1);	/* idr_pic_id, differs between IDRs */
+	bits_put(&b, 1, 0);		/* no_output_of_prior_pics_flag */
+	bits_put(&b, 1, 0);		/* long_term_reference_flag */
+	bits_se(&b, 0);			/* slice_qp_delta */
+	bits_ue(&b, 1);			/* disable_deblocking_filter_idc */
+
+	for (my = 0; my < mbh; ++my) {
+		for (mx = 0; mx < mbw; ++mx) {
+			bits_ue(&b, 25);	/* mb_type: I_PCM */
+			bits_align_zero(&b);
+
+			p = e->rbsp + b.pos / 8;
+			p = pcm_block(p, f->planes[0], f->strides[0],
+				      f->width, f->height, mx * 16, my * 16, 16);
+			p = pcm_block(p, f->planes[1], f->strides[1],
+				      f->width / 2, f->height / 2, mx * 8, my * 8, 8);
+			p = pcm_block(p, f->planes[2], f->strides[2],
+				      f->width / 2, f->height / 2, mx * 8, my * 8, 8);
+			b.pos = (p - e->rbsp) * 8;
+		}
+	}
+	bits_trailing(&b);
+
+	o += nal_write(o, 3, PCM_NAL_IDR, e->rbsp, b.pos / 8);
+
+	*out = e->buf;
+	*size = o - e->buf;
+	*key = true;
+	return 0;
+}
+
+static void pcm_close(struct src_encoder *e)
+{
+	free(e->rbsp);
+	free(e->buf);
+}
+
+static const struct src_encoder_ops pcm_ops = {
+	.name = "pcm",
+	.open = pcm_open,
+	.encode = pcm_encode,
+	.close = pcm_close,
+};
+
+/*
+ * x264
+ */
+
+#ifdef HAVE_X264
+
+static int x264_open(struct src_encoder *e)
+{
+	x264_param_t param;
+
+	if (x264_param_default_preset(&param, "ultrafast", "zerolatency") < 0)
+		return cli_EINVAL();
+
+	param.i_width = e->width;
+	param.i_height = e->height;
+	param.i_csp = X264_CSP_I420;
+	param.i_fps_num = e->fps;
+	param.i_fps_den = 1;
+	param.i_keyint_max = e->fps;
+	param.b_repeat_headers = 1;
+	param.b_annexb = 1;
+	param.b_aud = 1;
+	param.i_log_level = X264_LOG_WARNING;
+
+	param.rc.i_rc_method = X264_RC_ABR;
+	param.rc.i_bitrate = e->bitrate;
+	param.rc.i_vbv_max_bitrate = e->bitrate;
+	/* about two frames, keeps bursts short enough for sink buffers */
+	param.rc.i_vbv_buffer_size = shl_max(e->bitrate * 2 / e->fps, 1U);
+
+	if (x264_param_apply_profile(&param, "baseline") < 0)
+		return cli_EINVAL();
+
+	e->priv = x264_encoder_open(&param);
+	if (!e->priv)
+		return cli_EINVAL();
+
+	/* bound for the muxer's packet slots: raw size plus headers */
+	e->buf_size = (size_t)e->width * e->height * 3 / 2 + 64 * 1024;
+	return 0;
+}
+
+static int x264_encode(struct src_encoder *e, const struct src_frame *f,
+		       const uint8_t **out, size_t *size, bool *key)
+{
+	x264_picture_t in, pic;
+	x264_nal_t *nals;
+	int n_nals, r, i;
+
+	x264_picture_init(&in);
+	in.img.i_csp = X264_CSP_I420;
+	in.img.i_plane = 3;
+	for (i = 0; i < 3; ++i) {
+		in.img.plane[i] = f->planes[i];
+		in.img.i_stride[i] = f->strides[i];
+	}
+	in.i_pts = e->frame;
+
+	r = x264_encoder_encode(e->priv, &nals, &n_nals, &in, &pic);
+	if (r < 0)
+		return -EIO;
+
+	/* payloads of one frame are contiguous */
+	*out = r ? nals[0].p_payload : NULL;
+	*size = r;
+	*key = pic.b_keyframe;
+	return 0;
+}
+
+static void x264_close(struct src_encoder *e)
+{
+	if (e->priv)
+		x264_encoder_close(e->priv);
+}
+
+static const struct src_encoder_ops x264_ops = {
+	.name = "x264",
+	.open = x264_open,
+	.encode = x264_encode,
+	.close = x264_close,
+};
+
+#endif /* HAVE_X264 */
+
+/*
+ * Encoder Management
+ */
+
+static const struct src_encoder_ops *encoders[] = {
+#ifdef HAVE_X264
+	&x264_ops,
+#endif
+	&pcm_ops,
+};
+
+/* NULL if no encoder fit for real sinks is built in */
+const char *src_encoder_default(void)
+{
+#ifdef HAVE_X264
+	return x264_ops.name;
+#else
+	return NULL;
+#endif
+}
+
+int src_encoder_new(struct src_encoder **out, const char *name,
+		    int width, int height, int fps, unsigned int bitrate)
+{
+	struct src_encoder *e;
+	size_t i;
+	int r;
+
+	if (!out || width <= 0 || height <= 0 || fps <= 0)
+		return cli_EINVAL();
+
+	if (!name)
+		name = src_encoder_default();
+	if (!name) {
+		cli_error("no H.264 encoder built in, choose pcm explicitly to stream uncompressed video");
+		return -ENOTSUP;
+	}
+
+	e = calloc(1, sizeof(*e));
+	if (!e)
+		return cli_ENOMEM();
+
+	e->width = width;
+	e->height = height;
+	e->fps = fps;
+	e->bitrate = bitrate;
+	for (i = 0; i < SHL_ARRAY_LENGTH(encoders); ++i)
+		if (!strcmp(encoders[i]->name, name)) {
+			e->ops = encoders[i];
+			break;
+		}
+	if (!e->ops) {
+		cli_error("unknown encoder %s", name);
+		r = -EINVAL;
+		goto error;
+	}
+
+	r = e->ops->open(e);
+	if (r < 0)
+		goto error;
+
+	*out = e;
+	return 0;
+
+error:
+	src_encoder_free(e);
+	return r;
+}
+
+void src_encoder_free(struct src_encoder *e)
+{
+	if (!e)
+		return;
+
+	if (e->ops)
+		e->ops->close(e);
+	free(e);
+}
+
+int src_encoder_encode(struct src_encoder *e, const struct src_frame *f,
+		       const uint8_t **out, size_t *size, bool *key)
+{
+	int r;
+
+	r = e->ops->encode(e, f, out, size, key);
+	++e->frame;
+
+	return r;
+}
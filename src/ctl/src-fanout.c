@@ -0,0 +1,338 @@
+/*
+ * MiracleCast - Wifi-Display/Miracast Implementation
+ *
+ * MiracleCast is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * MiracleCast is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with MiracleCast; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * RTP Fan-out
+ * One encoded stream, many sinks. The muxer output of the last few frames is
+ * kept in a ring; every sink has its own socket and a position in that ring,
+ * so a sink whose socket is full just falls behind (and is resumed on
+ * EPOLLOUT) while the others keep going. A sink that falls out of the ring
+ * skips to the newest frame. Packets are sent with a per-sink RTP header
+ * (own SSRC and sequence numbers) in front of the shared TS payload.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "ctl.h"
+#include "loopstat.h"
+#include "src-pipeline.h"
+#include "shl_dlist.h"
+#include "shl_macro.h"
+#include "shl_util.h"
+
+static void sink_drop_frame(struct src_fanout_sink *s)
+{
+	++s->dropped;
+	++s->frame;
+	s->pkt = 0;
+}
+
+/* fills msgs for packets s->pkt.. of @fr, returns the number of messages */
+static size_t sink_build(struct src_fanout_sink *s,
+			 const struct src_fanout_frame *fr)
+{
+	size_t i, n = 0, segs, per_msg;
+	uint16_t seq = s->seq;
+	const uint8_t *pkt;
+	uint8_t *hdr;
+
+	per_msg = s->gso ? SRC_RTP_GSO_SEGMENTS : 1;
+	for (i = s->pkt; i < fr->n_pkts; ++i) {
+		pkt = fr->pkts + i * SRC_RTP_PACKET;
+		hdr = s->hdrs + (i - s->pkt) * SRC_RTP_HEADER;
+
+		/* keep version, PT and timestamp, rewrite seq and SSRC */
+		memcpy(hdr, pkt, 8);
+		hdr[2] = seq >> 8;
+		hdr[3] = seq;
+		hdr[8] = s->ssrc >> 24;
+		hdr[9] = s->ssrc >> 16;
+		hdr[10] = s->ssrc >> 8;
+		hdr[11] = s->ssrc;
+		++seq;
+
+		s->iov[2 * (i - s->pkt)].iov_base = hdr;
+		s->iov[2 * (i - s->pkt)].iov_len = SRC_RTP_HEADER;
+		s->iov[2 * (i - s->pkt) + 1].iov_base = (uint8_t*)pkt + SRC_RTP_HEADER;
+		s->iov[2 * (i - s->pkt) + 1].iov_len =
+			(i + 1 == fr->n_pkts ? fr->last_size : SRC_RTP_PACKET) -
+			SRC_RTP_HEADER;
+	}
+
+	for (i = 0; i < fr->n_pkts - s->pkt; i += segs) {
+		segs = shl_min(fr->n_pkts - s->pkt - i, per_msg);
+		s->msgs[n].msg_hdr.msg_iov = &s->iov[2 * i];
+		s->msgs[n].msg_hdr.msg_iovlen = 2 * segs;
+		++n;
+	}
+
+	return n;
+}
+
+/*
+ * Sends as much of the queue as the socket takes. Returns the number of
+ * packets sent.
+ */
+static int sink_flush(struct src_fanout_sink *s)
+{
+	struct src_fanout *f = s->fanout;
+	const struct src_fanout_frame *fr;
+	size_t n, pkts, per_msg, i, bytes;
+	int k, sent = 0;
+
+	while (s->frame < f->head) {
+		fr = &f->frames[s->frame % SRC_FANOUT_FRAMES];
+		n = sink_build(s, fr);
+
+		k = sendmmsg(s->fd, s->msgs, n, 0);
+		if (k < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN) {
+				/* resume when the socket drains */
+				++s->blocked;
+				sd_event_source_set_enabled(s->io, SD_EVENT_ON);
+				return sent;
+			}
+			if (errno == EIO && s->gso) {
+				cli_debug("UDP GSO not usable, falling back to sendmmsg");
+				src_rtp_disable_gso(s->fd);
+				s->gso = false;
+				continue;
+			}
+
+			/* e.g. ECONNREFUSED before the sink opened its port */
+			sink_drop_frame(s);
+			continue;
+		}
+
+		per_msg = s->gso ? SRC_RTP_GSO_SEGMENTS : 1;
+		pkts = shl_min(k * per_msg, fr->n_pkts - s->pkt);
+		for (bytes = 0, i = 0; i < pkts; ++i)
+			bytes += s->iov[2 * i].iov_len + s->iov[2 * i + 1].iov_len;
+		s->bytes += bytes;
+		f->bytes += bytes;
+		s->packets += pkts;
+		f->packets += pkts;
+		s->seq += pkts;
+		s->pkt += pkts;
+		sent += pkts;
+
+		if (s->pkt == fr->n_pkts) {
+			++s->frame;
+			s->pkt = 0;
+		}
+	}
+
+	sd_event_source_set_enabled(s->io, SD_EVENT_OFF);
+	return sent;
+}
+
+static int sink_io_fn(sd_event_source *source, int fd, uint32_t mask,
+		      void *data)
+{
+	LOOPSTAT("fanout.sink_io");
+	sink_flush(data);
+	return 0;
+}
+
+/*
+ * Takes the frame the muxer just wrote, points the muxer at the next ring
+ * slot and pushes the new frame to every sink. Returns the number of packets
+ * sent right away.
+ */
+int src_fanout_publish(struct src_fanout *f)
+{
+	struct src_fanout_frame *fr;
+	struct src_fanout_sink *s;
+	struct shl_dlist *i;
+	uint64_t oldest;
+	int sent = 0;
+
+	fr = &f->frames[f->head % SRC_FANOUT_FRAMES];
+	fr->n_pkts = f->rtp->n_pkts;
+	fr->last_size = f->rtp->last_size;
+	++f->head;
+	f->rtp->pkts = f->frames[f->head % SRC_FANOUT_FRAMES].pkts;
+
+	/* the next mux overwrites the slot before this one */
+	oldest = f->head - shl_min(f->head, (uint64_t)SRC_FANOUT_FRAMES - 1);
+
+	shl_dlist_for_each(i, &f->sinks) {
+		s = sink_from_dlist(i);
+
+		if (s->paused) {
+			s->frame = f->head;
+			s->pkt = 0;
+			continue;
+		}
+
+		if (s->frame < oldest) {
+			s->dropped += f->head - 1 - s->frame;
+			s->frame = f->head - 1;
+			s->pkt = 0;
+		}
+
+		/* still blocked, EPOLLOUT picks it up */
+		if (s->frame + 1 < f->head)
+			continue;
+
+		sent += sink_flush(s);
+	}
+
+	return sent;
+}
+
+int src_fanout_sink_new(struct src_fanout *f, struct src_fanout_sink **out,
+			const struct sockaddr_in *dest, unsigned int local_port)
+{
+	struct src_fanout_sink *s;
+	size_t max_pkts = f->rtp->max_pkts;
+	bool gso;
+	int r;
+
+	if (!out || !dest)
+		return cli_EINVAL();
+
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return cli_ENOMEM();
+
+	s->fanout = f;
+	s->dest = *dest;
+	s->frame = f->head;
+	s->ssrc = (uint32_t)((shl_now(CLOCK_MONOTONIC) + f->n_sinks) *
+			     2654435761ULL);
+	s->seq = s->ssrc >> 16;
+
+	s->fd = src_rtp_socket(dest, local_port, &gso);
+	if (s->fd < 0) {
+		r = s->fd;
+		goto error;
+	}
+	s->gso = gso;
+
+	s->hdrs = malloc(max_pkts * SRC_RTP_HEADER);
+	s->iov = calloc(max_pkts * 2, sizeof(*s->iov));
+	s->msgs = calloc(max_pkts, sizeof(*s->msgs));
+	if (!s->hdrs || !s->iov || !s->msgs) {
+		r = cli_ENOMEM();
+		goto error;
+	}
+
+	r = sd_event_add_io(f->event, &s->io, s->fd, EPOLLOUT, sink_io_fn, s);
+	if (r < 0) {
+		r = cli_ERR(r);
+		goto error;
+	}
+	sd_event_source_set_enabled(s->io, SD_EVENT_OFF);
+
+	shl_dlist_link_tail(&f->sinks, &s->list);
+	++f->n_sinks;
+
+	*out = s;
+	return 0;
+
+error:
+	src_fanout_sink_free(s);
+	return r;
+}
+
+void src_fanout_sink_free(struct src_fanout_sink *s)
+{
+	if (!s)
+		return;
+
+	if (s->list.next) {
+		shl_dlist_unlink(&s->list);
+		--s->fanout->n_sinks;
+	}
+
+	sd_event_source_unref(s->io);
+	if (s->fd >= 0)
+		close(s->fd);
+	free(s->msgs);
+	free(s->iov);
+	free(s->hdrs);
+	free(s);
+}
+
+void src_fanout_sink_pause(struct src_fanout_sink *s, bool paused)
+{
+	s->paused = paused;
+	if (paused)
+		sd_event_source_set_enabled(s->io, SD_EVENT_OFF);
+}
+
+int src_fanout_new(struct src_fanout **out, sd_event *event,
+		   struct src_rtp *rtp)
+{
+	struct src_fanout *f;
+	unsigned int i;
+	int r;
+
+	if (!out || !event || !rtp)
+		return cli_EINVAL();
+
+	f = calloc(1, sizeof(*f));
+	if (!f)
+		return cli_ENOMEM();
+
+	f->event = sd_event_ref(event);
+	f->rtp = rtp;
+	shl_dlist_init(&f->sinks);
+
+	/* the muxer's own slots become the first ring entry */
+	f->frames[0].pkts = rtp->pkts;
+	for (i = 1; i < SRC_FANOUT_FRAMES; ++i) {
+		f->frames[i].pkts = malloc(rtp->max_pkts * SRC_RTP_PACKET);
+		if (!f->frames[i].pkts) {
+			r = cli_ENOMEM();
+			goto error;
+		}
+	}
+
+	*out = f;
+	return 0;
+
+error:
+	src_fanout_free(f);
+	return r;
+}
+
+void src_fanout_free(struct src_fanout *f)
+{
+	unsigned int i;
+
+	if (!f)
+		return;
+
+	while (!shl_dlist_empty(&f->sinks))
+		src_fanout_sink_free(sink_from_dlist(f->sinks.next));
+
+	/* hand the muxer its own slots back, it frees them */
+	f->rtp->pkts = f->frames[0].pkts;
+	for (i = 1; i < SRC_FANOUT_FRAMES; ++i)
+		free(f->frames[i].pkts);
+
+	sd_event_unref(f->event);
+	free(f);
+}
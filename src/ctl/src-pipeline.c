@@ -0,0 +1,285 @@
+/*
+ * MiracleCast - Wifi-Display/Miracast Implementation
+ *
+ * MiracleCast is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * MiracleCast is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with MiracleCast; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <systemd/sd-event.h>
+#include <time.h>
+#include "ctl.h"
+#include "loopstat.h"
+#include "src-pipeline.h"
+#include "shl_macro.h"
+#include "shl_util.h"
+
+/*
+ * Pipeline
+ */
+
+static uint64_t thread_cpu_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+int src_pipeline_frame(struct src_pipeline *p)
+{
+	struct src_frame f;
+	const uint8_t *data;
+	uint64_t cpu, t;
+	size_t size;
+	bool key;
+	int r;
+
+	cpu = thread_cpu_usec();
+
+	r = src_capture_grab(p->capture, &f);
+	if (r < 0)
+		return r;
+
+	t = shl_now(CLOCK_MONOTONIC);
+	r = src_encoder_encode(p->encoder, &f, &data, &size, &key);
+	if (r < 0)
+		return r;
+	metrics_hist_add(&p->stats.encode, shl_now(CLOCK_MONOTONIC) - t);
+
+	/* encoder may be buffering (never with zerolatency) */
+	if (!size)
+		return 0;
+
+	r = src_rtp_mux(p->rtp, data, size, f.pts, key);
+	if (r < 0)
+		return r;
+
+	if (p->fanout) {
+		/* per-sink errors are accounted in the fan-out */
+		src_fanout_publish(p->fanout);
+		goto out;
+	}
+
+	r = src_rtp_send(p->rtp);
+	if (r < 0) {
+		/* a full send queue drops the frame, the sink conceals it */
+		++p->stats.send_errors;
+		if (r != -EAGAIN && r != -ENOBUFS && r != -ECONNREFUSED)
+			return r;
+	} else {
+		p->stats.packets += r;
+		p->stats.bytes += (r - 1) * SRC_RTP_PACKET + p->rtp->last_size;
+	}
+
+out:
+	++p->stats.frames;
+	metrics_hist_add(&p->stats.cpu, thread_cpu_usec() - cpu);
+
+	return 0;
+}
+
+static int pipeline_timer_fn(sd_event_source *source, uint64_t usec,
+			     void *data)
+{
+	LOOPSTAT("pipeline.timer");
+	struct src_pipeline *p = data;
+	uint64_t now;
+	int r;
+
+	r = src_pipeline_frame(p);
+	if (r < 0) {
+		cli_error("source pipeline failed: %d", r);
+		src_pipeline_stop(p);
+		return 0;
+	}
+
+	/* keep the cadence; if we fell behind, skip ticks instead of bursting */
+	now = shl_now(CLOCK_MONOTONIC);
+	p->next += p->interval;
+	if (p->next <= now) {
+		p->stats.late += (now - p->next) / p->interval + 1;
+		p->next += ((now - p->next) / p->interval + 1) * p->interval;
+	}
+
+	sd_event_source_set_time(source, p->next);
+	sd_event_source_set_enabled(source, SD_EVENT_ON);
+
+	return 0;
+}
+
+int src_pipeline_start(struct src_pipeline *p)
+{
+	int r;
+
+	if (p->running)
+		return 0;
+
+	p->next = shl_now(CLOCK_MONOTONIC);
+	if (!p->timer) {
+		r = sd_event_add_time(p->event, &p->timer, CLOCK_MONOTONIC,
+				      p->next, 0, pipeline_timer_fn, p);
+		if (r < 0)
+			return cli_ERR(r);
+	} else {
+		sd_event_source_set_time(p->timer, p->next);
+		sd_event_source_set_enabled(p->timer, SD_EVENT_ON);
+	}
+
+	if (!p->stats.start)
+		p->stats.start = p->next;
+	p->running = true;
+
+	return 0;
+}
+
+void src_pipeline_stop(struct src_pipeline *p)
+{
+	if (!p || !p->running)
+		return;
+
+	sd_event_source_set_enabled(p->timer, SD_EVENT_OFF);
+	p->running = false;
+}
+
+int src_pipeline_new(struct src_pipeline **out, sd_event *event,
+		     const struct src_pipeline_config *cfg)
+{
+	struct src_pipeline *p;
+	const char *enc;
+	size_t max_frame;
+	int r;
+
+	if (!out || !event || !cfg || cfg->fps <= 0)
+		return cli_EINVAL();
+
+	p = calloc(1, sizeof(*p));
+	if (!p)
+		return cli_ENOMEM();
+
+	p->event = sd_event_ref(event);
+	p->interval = 1000000ULL / cfg->fps;
+
+	r = src_capture_new(&p->capture, cfg->capture ? : "testsrc",
+			    cfg->width, cfg->height);
+	if (r < 0)
+		goto error;
+
+	enc = cfg->encoder ? : src_encoder_default();
+	r = src_encoder_new(&p->encoder, enc, cfg->width, cfg->height,
+			    cfg->fps, cfg->bitrate);
+	if (r < 0)
+		goto error;
+
+	/* the encoder's output buffer bounds any access unit it produces */
+	max_frame = p->encoder->buf_size;
+	r = src_rtp_new(&p->rtp, cfg->fanout ? NULL : &cfg->dest,
+			cfg->local_port, max_frame);
+	if (r < 0)
+		goto error;
+
+	if (cfg->fanout) {
+		r = src_fanout_new(&p->fanout, event, p->rtp);
+		if (r < 0)
+			goto error;
+	}
+
+	cli_debug("source pipeline %dx%d@%d, %s -> %s", cfg->width, cfg->height,
+		  cfg->fps, p->capture->ops->name, p->encoder->ops->name);
+
+	*out = p;
+	return 0;
+
+error:
+	src_pipeline_free(p);
+	return r;
+}
+
+void src_pipeline_free(struct src_pipeline *p)
+{
+	if (!p)
+		return;
+
+	src_pipeline_stop(p);
+	sd_event_source_unref(p->timer);
+	src_fanout_free(p->fanout);
+	src_rtp_free(p->rtp);
+	src_encoder_free(p->encoder);
+	src_capture_free(p->capture);
+	sd_event_unref(p->event);
+	free(p);
+}
+
+void src_pipeline_print_stats(struct src_pipeline *p, const char *prefix)
+{
+	struct src_pipeline_stats *s = &p->stats;
+	struct src_fanout_sink *sink;
+	struct shl_dlist *i;
+	uint64_t t, packets, bytes;
+
+	t = s->start ? shl_now(CLOCK_MONOTONIC) - s->start : 0;
+	if (!t || !s->frames) {
+		cli_printf("%sno frames sent\n", prefix);
+		return;
+	}
+
+	packets = p->fanout ? p->fanout->packets : s->packets;
+	bytes = p->fanout ? p->fanout->bytes : s->bytes;
+
+	cli_printf("%s%" PRIu64 " frames (%.1f fps), %" PRIu64 " late, %"
+		   PRIu64 " send errors\n", prefix, s->frames,
+		   s->frames * 1000000.0 / t, s->late, s->send_errors);
+	if (p->fanout)
+		cli_printf("%s%" PRIu64 " packets (%.0f pps), %.2f Mbit/s to %u sinks\n",
+			   prefix, packets, packets * 1000000.0 / t,
+			   bytes * 8.0 / t, p->fanout->n_sinks);
+	else
+		cli_printf("%s%" PRIu64 " packets (%.0f pps), %.2f Mbit/s, GSO %s\n",
+			   prefix, packets, packets * 1000000.0 / t,
+			   bytes * 8.0 / t, p->rtp->gso ? "on" : "off");
+	cli_printf("%sencode avg %" PRIu64 "us p99 %" PRIu64 "us, "
+		   "cpu/frame avg %" PRIu64 "us p99 %" PRIu64 "us\n", prefix,
+		   s->encode.sum / s->encode.count,
+		   metrics_hist_percentile(&s->encode, 99),
+		   s->cpu.sum / s->cpu.count,
+		   metrics_hist_percentile(&s->cpu, 99));
+
+	if (!p->fanout)
+		return;
+
+	shl_dlist_for_each(i, &p->fanout->sinks) {
+		sink = sink_from_dlist(i);
+		cli_printf("%s  %s:%u: %" PRIu64 " packets, %" PRIu64
+			   " frames dropped, blocked %" PRIu64 "x, GSO %s%s\n",
+			   prefix, inet_ntoa(sink->dest.sin_addr),
+			   ntohs(sink->dest.sin_port), sink->packets,
+			   sink->dropped, sink->blocked,
+			   sink->gso ? "on" : "off",
+			   sink->paused ? ", paused" : "");
+	}
+}
+
+int src_pipeline_add_sink(struct src_pipeline *p,
+			  const struct sockaddr_in *dest,
+			  unsigned int local_port,
+			  struct src_fanout_sink **out)
+{
+	if (!p->fanout)
+		return cli_EINVAL();
+
+	return src_fanout_sink_new(p->fanout, out, dest, local_port);
+}
@@ -0,0 +1,291 @@
+/*
+ * MiracleCast - Wifi-Display/Miracast Implementation
+ *
+ * MiracleCast is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * MiracleCast is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with MiracleCast; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Source Pipeline
+ * capture -> H.264 encode -> MPEG-TS mux -> RTP, all in-process and driven by
+ * a frame timer on the sd_event loop. Buffers are allocated when the pipeline
+ * is created; the per-frame path does not allocate. The muxer writes straight
+ * into the RTP packet slots, which are laid out back to back so one UDP GSO
+ * send can carry a run of them. In fan-out mode the same packets go to
+ * several sinks, see src-fanout.c.
+ */
+
+#ifndef SRC_PIPELINE_H
+#define SRC_PIPELINE_H
+
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <systemd/sd-event.h>
+#include "metrics.h"
+#include "shl_dlist.h"
+
+struct src_capture;
+struct src_encoder;
+struct src_rtp;
+struct src_pipeline;
+
+/* capture */
+
+/* planar 8bit YUV 4:2:0 */
+struct src_frame {
+	int width;
+	int height;
+	uint8_t *planes[3];
+	int strides[3];
+	uint64_t pts;		/* CLOCK_MONOTONIC usecs */
+};
+
+/* header of a "shm:" capture file, pixels follow at data_offset */
+#define SRC_SHM_MAGIC		0x48534d4d	/* "MMSH" */
+#define SRC_SHM_I420		0
+#define SRC_SHM_XRGB8888	1
+
+struct src_shm_header {
+	uint32_t magic;
+	uint32_t format;
+	uint32_t width;
+	uint32_t height;
+	uint32_t stride;
+	uint32_t data_offset;
+	/* odd while the producer writes a frame */
+	uint64_t seq;
+};
+
+struct src_capture_ops {
+	const char *name;
+	int (*open) (struct src_capture *c, const char *arg);
+	int (*grab) (struct src_capture *c, struct src_frame *f);
+	void (*close) (struct src_capture *c);
+};
+
+struct src_capture {
+	const struct src_capture_ops *ops;
+	int width;
+	int height;
+	uint8_t *buf;
+	uint64_t frame;
+
+	/* shm */
+	int fd;
+	void *map;
+	size_t map_size;
+	uint64_t seq;
+};
+
+int src_capture_new(struct src_capture **out, const char *spec,
+		    int width, int height);
+void src_capture_free(struct src_capture *c);
+int src_capture_grab(struct src_capture *c, struct src_frame *f);
+
+/* encoder */
+
+struct src_encoder_ops {
+	const char *name;
+	int (*open) (struct src_encoder *e);
+	int (*encode) (struct src_encoder *e, const struct src_frame *f,
+		       const uint8_t **out, size_t *size, bool *key);
+	void (*close) (struct src_encoder *e);
+};
+
+struct src_encoder {
+	const struct src_encoder_ops *ops;
+	int width;
+	int height;
+	int fps;
+	unsigned int bitrate;	/* kbit/s */
+	uint64_t frame;
+
+	uint8_t *buf;
+	size_t buf_size;
+	uint8_t *rbsp;
+	size_t rbsp_size;
+	void *priv;
+};
+
+int src_encoder_new(struct src_encoder **out, const char *name,
+		    int width, int height, int fps, unsigned int bitrate);
+void src_encoder_free(struct src_encoder *e);
+int src_encoder_encode(struct src_encoder *e, const struct src_frame *f,
+		       const uint8_t **out, size_t *size, bool *key);
+const char *src_encoder_default(void);
+
+/* TS/RTP */
+
+#define SRC_TS_SIZE		188
+#define SRC_RTP_HEADER		12
+#define SRC_RTP_TS_PER_PACKET	7
+#define SRC_RTP_PACKET		(SRC_RTP_HEADER + SRC_RTP_TS_PER_PACKET * SRC_TS_SIZE)
+/* GSO is limited to 64 segments and 64k per send */
+#define SRC_RTP_GSO_SEGMENTS	48
+
+struct src_rtp {
+	int fd;
+	struct sockaddr_in dest;
+	bool gso;
+
+	uint32_t ssrc;
+	uint16_t seq;
+	uint8_t cc_pat;
+	uint8_t cc_pmt;
+	uint8_t cc_video;
+
+	/* packet slots, SRC_RTP_PACKET apart, the last one may be short */
+	uint8_t *pkts;
+	size_t n_pkts;
+	size_t max_pkts;
+	size_t last_size;
+	unsigned int ts_in_pkt;
+
+	struct mmsghdr *msgs;
+	struct iovec *iov;
+};
+
+int src_rtp_new(struct src_rtp **out, const struct sockaddr_in *dest,
+		unsigned int local_port, size_t max_frame);
+void src_rtp_free(struct src_rtp *r);
+int src_rtp_mux(struct src_rtp *r, const uint8_t *data, size_t size,
+		uint64_t pts, bool key);
+int src_rtp_send(struct src_rtp *r);
+int src_rtp_socket(const struct sockaddr_in *dest, unsigned int local_port,
+		   bool *gso);
+void src_rtp_disable_gso(int fd);
+
+/* fan-out */
+
+/* frames kept for slow sinks; a sink further behind skips ahead */
+#define SRC_FANOUT_FRAMES	4
+
+struct src_fanout_frame {
+	uint8_t *pkts;
+	size_t n_pkts;
+	size_t last_size;
+};
+
+struct src_fanout {
+	sd_event *event;
+	struct src_rtp *rtp;
+
+	/* the muxer writes into frames[head % SRC_FANOUT_FRAMES] */
+	struct src_fanout_frame frames[SRC_FANOUT_FRAMES];
+	uint64_t head;
+
+	struct shl_dlist sinks;
+	unsigned int n_sinks;
+
+	uint64_t packets;
+	uint64_t bytes;
+};
+
+struct src_fanout_sink {
+	struct shl_dlist list;
+	struct src_fanout *fanout;
+
+	int fd;
+	struct sockaddr_in dest;
+	sd_event_source *io;
+	bool gso : 1;
+	bool paused : 1;
+
+	/* rewritten into every packet we send */
+	uint32_t ssrc;
+	uint16_t seq;
+
+	/* send queue position: next frame and packet within it */
+	uint64_t frame;
+	size_t pkt;
+
+	uint8_t *hdrs;
+	struct iovec *iov;
+	struct mmsghdr *msgs;
+
+	uint64_t packets;
+	uint64_t bytes;
+	uint64_t dropped;	/* frames skipped or lost to send errors */
+	uint64_t blocked;	/* times the socket was full */
+};
+
+#define sink_from_dlist(_s) \
+	shl_dlist_entry((_s), struct src_fanout_sink, list)
+
+int src_fanout_new(struct src_fanout **out, sd_event *event,
+		   struct src_rtp *rtp);
+void src_fanout_free(struct src_fanout *f);
+int src_fanout_publish(struct src_fanout *f);
+int src_fanout_sink_new(struct src_fanout *f, struct src_fanout_sink **out,
+			const struct sockaddr_in *dest, unsigned int local_port);
+void src_fanout_sink_free(struct src_fanout_sink *s);
+void src_fanout_sink_pause(struct src_fanout_sink *s, bool paused);
+
+/* pipeline */
+
+struct src_pipeline_config {
+	const char *capture;
+	const char *encoder;
+	int width;
+	int height;
+	int fps;
+	unsigned int bitrate;
+	struct sockaddr_in dest;
+	unsigned int local_port;
+	/* no dest, sinks are added with src_pipeline_add_sink() */
+	bool fanout;
+};
+
+struct src_pipeline_stats {
+	uint64_t frames;
+	uint64_t late;		/* frame ticks skipped because we fell behind */
+	uint64_t packets;
+	uint64_t bytes;
+	uint64_t send_errors;
+	uint64_t start;
+	struct metrics_hist encode;	/* usecs per frame in the encoder */
+	struct metrics_hist cpu;	/* thread CPU usecs per frame, all stages */
+};
+
+struct src_pipeline {
+	sd_event *event;
+	sd_event_source *timer;
+	uint64_t interval;
+	uint64_t next;
+	bool running;
+
+	struct src_capture *capture;
+	struct src_encoder *encoder;
+	struct src_rtp *rtp;
+	struct src_fanout *fanout;
+
+	struct src_pipeline_stats stats;
+};
+
+int src_pipeline_new(struct src_pipeline **out, sd_event *event,
+		     const struct src_pipeline_config *cfg);
+void src_pipeline_free(struct src_pipeline *p);
+int src_pipeline_start(struct src_pipeline *p);
+void src_pipeline_stop(struct src_pipeline *p);
+int src_pipeline_frame(struct src_pipeline *p);
+void src_pipeline_print_stats(struct src_pipeline *p, const char *prefix);
+int src_pipeline_add_sink(struct src_pipeline *p,
+			  const struct sockaddr_in *dest,
+			  unsigned int local_port,
+			  struct src_fanout_sink **out);
+
+#endif /* SRC_PIPELINE_H */
@@ -0,0 +1,436 @@
+/*
+ * MiracleCast - Wifi-Display/Miracast Implementation
+ *
+ * MiracleCast is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * MiracleCast is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with MiracleCast; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * MPEG-TS Muxer and RTP Sender
+ * WFD carries one MPEG-TS program over RTP (payload type 33), seven TS
+ * packets per datagram. The muxer fills the RTP packet slots in place. With
+ * UDP GSO the slots go out as a few large sends that the kernel (or NIC)
+ * splits at SRC_RTP_PACKET; without it we fall back to one datagram per slot,
+ * still batched through sendmmsg().
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/ip.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "ctl.h"
+#include "src-pipeline.h"
+#include "shl_macro.h"
+#include "shl_util.h"
+
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+
+/* PIDs as used by WFD sources in the wild */
+#define TS_PID_PAT		0x0000
+#define TS_PID_PMT		0x0100
+#define TS_PID_VIDEO		0x1011
+
+#define RTP_PT_MP2T		33
+/* PTS runs this far ahead of PCR, in 90kHz ticks */
+#define TS_PTS_DELAY		3000
+
+static uint32_t ts_crc32(const uint8_t *data, size_t size)
+{
+	uint32_t crc = 0xffffffff;
+	size_t i;
+	int b;
+
+	for (i = 0; i < size; ++i) {
+		crc ^= (uint32_t)data[i] << 24;
+		for (b = 0; b < 8; ++b)
+			crc = (crc << 1) ^ ((crc & 0x80000000) ? 0x04c11db7 : 0);
+	}
+
+	return crc;
+}
+
+/* next TS slot, opening a new RTP packet every seven TS packets */
+static uint8_t *ts_slot(struct src_rtp *r, uint32_t rtp_ts)
+{
+	uint8_t *p;
+
+	if (!r->n_pkts || r->ts_in_pkt == SRC_RTP_TS_PER_PACKET) {
+		if (r->n_pkts == r->max_pkts)
+			return NULL;
+
+		p = r->pkts + r->n_pkts * SRC_RTP_PACKET;
+		p[0] = 0x80;
+		p[1] = RTP_PT_MP2T;
+		p[2] = r->seq >> 8;
+		p[3] = r->seq;
+		p[4] = rtp_ts >> 24;
+		p[5] = rtp_ts >> 16;
+		p[6] = rtp_ts >> 8;
+		p[7] = rtp_ts;
+		p[8] = r->ssrc >> 24;
+		p[9] = r->ssrc >> 16;
+		p[10] = r->ssrc >> 8;
+		p[11] = r->ssrc;
+
+		++r->seq;
+		++r->n_pkts;
+		r->ts_in_pkt = 0;
+	}
+
+	p = r->pkts + (r->n_pkts - 1) * SRC_RTP_PACKET + SRC_RTP_HEADER +
+	    r->ts_in_pkt * SRC_TS_SIZE;
+	++r->ts_in_pkt;
+	r->last_size = SRC_RTP_HEADER + r->ts_in_pkt * SRC_TS_SIZE;
+
+	return p;
+}
+
+static int ts_section(struct src_rtp *r, uint32_t rtp_ts, uint16_t pid,
+		      uint8_t *cc, const uint8_t *section, size_t size)
+{
+	uint8_t *ts;
+	uint32_t crc;
+
+	ts = ts_slot(r, rtp_ts);
+	if (!ts)
+		return -ENOBUFS;
+
+	ts[0] = 0x47;
+	ts[1] = 0x40 | pid >> 8;
+	ts[2] = pid;
+	ts[3] = 0x10 | (*cc)++ % 16;
+	ts[4] = 0;		/* pointer_field */
+	memcpy(ts + 5, section, size);
+	crc = ts_crc32(section, size);
+	ts[5 + size] = crc >> 24;
+	ts[6 + size] = crc >> 16;
+	ts[7 + size] = crc >> 8;
+	ts[8 + size] = crc;
+	memset(ts + 9 + size, 0xff, SRC_TS_SIZE - 9 - size);
+
+	return 0;
+}
+
+static int ts_psi(struct src_rtp *r, uint32_t rtp_ts)
+{
+	static const uint8_t pat[] = {
+		0x00,			/* table_id */
+		0xb0, 13,		/* section_length */
+		0x00, 0x01,		/* transport_stream_id */
+		0xc1, 0x00, 0x00,
+		0x00, 0x01,		/* program_number */
+		0xe0 | TS_PID_PMT >> 8, TS_PID_PMT & 0xff,
+	};
+	static const uint8_t pmt[] = {
+		0x02,			/* table_id */
+		0xb0, 18,		/* section_length */
+		0x00, 0x01,		/* program_number */
+		0xc1, 0x00, 0x00,
+		0xe0 | TS_PID_VIDEO >> 8, TS_PID_VIDEO & 0xff,	/* PCR PID */
+		0xf0, 0x00,		/* program_info_length */
+		0x1b,			/* stream_type: H.264 */
+		0xe0 | TS_PID_VIDEO >> 8, TS_PID_VIDEO & 0xff,
+		0xf0, 0x00,		/* ES_info_length */
+	};
+	int r1;
+
+	r1 = ts_section(r, rtp_ts, TS_PID_PAT, &r->cc_pat, pat, sizeof(pat));
+	if (r1 < 0)
+		return r1;
+
+	return ts_section(r, rtp_ts, TS_PID_PMT, &r->cc_pmt, pmt, sizeof(pmt));
+}
+
+static void ts_timestamp(uint8_t *p, uint8_t prefix, uint64_t v)
+{
+	p[0] = prefix | ((v >> 29) & 0x0e) | 1;
+	p[1] = v >> 22;
+	p[2] = ((v >> 14) & 0xfe) | 1;
+	p[3] = v >> 7;
+	p[4] = ((v << 1) & 0xfe) | 1;
+}
+
+/*
+ * Packetizes one access unit. @pts is in CLOCK_MONOTONIC usecs, which also
+ * serves as our PCR time base.
+ */
+int src_rtp_mux(struct src_rtp *r, const uint8_t *data, size_t size,
+		uint64_t pts, bool key)
+{
+	uint64_t clk = pts * 9 / 100;
+	uint32_t rtp_ts = clk;
+	uint8_t pes[14], *ts, *o;
+	size_t total, done, n, af, from_pes;
+	bool first = true;
+	int ret;
+
+	r->n_pkts = 0;
+	r->ts_in_pkt = 0;
+	r->last_size = 0;
+
+	/* PSI with every access unit, sinks can join at any time */
+	ret = ts_psi(r, rtp_ts);
+	if (ret < 0)
+		return ret;
+
+	pes[0] = 0x00;
+	pes[1] = 0x00;
+	pes[2] = 0x01;
+	pes[3] = 0xe0;		/* stream_id: video */
+	pes[4] = 0x00;		/* PES_packet_length: unbounded */
+	pes[5] = 0x00;
+	pes[6] = 0x80;
+	pes[7] = 0x80;		/* PTS only */
+	pes[8] = 5;
+	ts_timestamp(pes + 9, 0x20, clk + TS_PTS_DELAY);
+
+	total = sizeof(pes) + size;
+	for (done = 0; done < total; done += n) {
+		ts = ts_slot(r, rtp_ts);
+		if (!ts)
+			return -ENOBUFS;
+
+		/* first packet carries PCR, the last one is stuffed */
+		af = first ? 8 : 0;
+		n = shl_min(total - done, (size_t)184 - af);
+		if (n < 184 - af)
+			af = 184 - n;
+
+		ts[0] = 0x47;
+		ts[1] = (first ? 0x40 : 0) | TS_PID_VIDEO >> 8;
+		ts[2] = TS_PID_VIDEO & 0xff;
+		ts[3] = (af ? 0x30 : 0x10) | r->cc_video++ % 16;
+		o = ts + 4;
+
+		if (af) {
+			o[0] = af - 1;
+			if (af > 1) {
+				o[1] = 0;
+				if (first) {
+					o[1] = 0x10 | (key ? 0x40 : 0);
+					o[2] = clk >> 25;
+					o[3] = clk >> 17;
+					o[4] = clk >> 9;
+					o[5] = clk >> 1;
+					o[6] = ((clk & 1) << 7) | 0x7e;
+					o[7] = 0;
+					memset(o + 8, 0xff, af - 8);
+				} else {
+					memset(o + 2, 0xff, af - 2);
+				}
+			}
+			o += af;
+		}
+
+		if (done < sizeof(pes)) {
+			from_pes = shl_min(sizeof(pes) - done, n);
+			memcpy(o, pes + done, from_pes);
+			memcpy(o + from_pes, data, n - from_pes);
+		} else {
+			memcpy(o, data + done - sizeof(pes), n);
+		}
+
+		first = false;
+	}
+
+	return 0;
+}
+
+static int rtp_sendmmsg(struct src_rtp *r, unsigned int n)
+{
+	unsigned int sent = 0;
+	int k;
+
+	while (sent < n) {
+		k = sendmmsg(r->fd, r->msgs + sent, n - sent, 0);
+		if (k < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		sent += k;
+	}
+
+	return sent;
+}
+
+/*
+ * Sends all slots filled by the last src_rtp_mux(). Returns the number of
+ * RTP packets handed to the kernel.
+ */
+int src_rtp_send(struct src_rtp *r)
+{
+	size_t i, n, segs;
+	int ret;
+
+	if (!r->n_pkts || r->fd < 0)
+		return 0;
+
+retry:
+	n = 0;
+	if (r->gso) {
+		for (i = 0; i < r->n_pkts; i += segs) {
+			segs = shl_min(r->n_pkts - i, (size_t)SRC_RTP_GSO_SEGMENTS);
+			r->iov[n].iov_base = r->pkts + i * SRC_RTP_PACKET;
+			r->iov[n].iov_len = (segs - 1) * SRC_RTP_PACKET;
+			r->iov[n].iov_len += i + segs == r->n_pkts ?
+					     r->last_size : SRC_RTP_PACKET;
+			++n;
+		}
+	} else {
+		for (i = 0; i < r->n_pkts; ++i) {
+			r->iov[n].iov_base = r->pkts + i * SRC_RTP_PACKET;
+			r->iov[n].iov_len = i + 1 == r->n_pkts ?
+					    r->last_size : SRC_RTP_PACKET;
+			++n;
+		}
+	}
+
+	ret = rtp_sendmmsg(r, n);
+	if (ret == -EIO && r->gso) {
+		/* no checksum offload on this route, segment in userspace */
+		cli_debug("UDP GSO not usable, falling back to sendmmsg");
+		src_rtp_disable_gso(r->fd);
+		r->gso = false;
+		goto retry;
+	}
+	if (ret < 0)
+		return ret;
+
+	return r->n_pkts;
+}
+
+/*
+ * Opens a nonblocking UDP socket connected to @dest, with UDP GSO at
+ * SRC_RTP_PACKET if the kernel supports it. Returns the fd or a negative
+ * error code.
+ */
+int src_rtp_socket(const struct sockaddr_in *dest, unsigned int local_port,
+		   bool *gso)
+{
+	struct sockaddr_in addr = { };
+	int fd, r, val;
+
+	fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	if (fd < 0)
+		return cli_ERRNO();
+
+	/* a frame goes out as one burst, give it room in the socket */
+	val = 4 * 1024 * 1024;
+	setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &val, sizeof(val));
+	/* CS5, lands in the WMM video access category */
+	val = IPTOS_CLASS_CS5;
+	setsockopt(fd, IPPROTO_IP, IP_TOS, &val, sizeof(val));
+
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(local_port);
+	r = bind(fd, (struct sockaddr*)&addr, sizeof(addr));
+	if (r >= 0)
+		r = connect(fd, (struct sockaddr*)dest, sizeof(*dest));
+	if (r < 0) {
+		r = cli_ERRNO();
+		close(fd);
+		return r;
+	}
+
+	/* socket-wide segment size, so every large send is split for us */
+	val = SRC_RTP_PACKET;
+	*gso = !setsockopt(fd, SOL_UDP, UDP_SEGMENT, &val, sizeof(val));
+	cli_debug("RTP to %s:%u, GSO %s", inet_ntoa(dest->sin_addr),
+		  ntohs(dest->sin_port), *gso ? "on" : "off");
+
+	return fd;
+}
+
+void src_rtp_disable_gso(int fd)
+{
+	int val = 0;
+
+	setsockopt(fd, SOL_UDP, UDP_SEGMENT, &val, sizeof(val));
+}
+
+/*
+ * Without @dest there is no socket; the packets are picked up from the slots
+ * by a fan-out (see src-fanout.c) instead of src_rtp_send().
+ */
+int src_rtp_new(struct src_rtp **out, const struct sockaddr_in *dest,
+		unsigned int local_port, size_t max_frame)
+{
+	struct src_rtp *r;
+	size_t i, ts;
+	int ret;
+
+	if (!out)
+		return cli_EINVAL();
+
+	r = calloc(1, sizeof(*r));
+	if (!r)
+		return cli_ENOMEM();
+
+	r->fd = -1;
+	r->ssrc = (uint32_t)(shl_now(CLOCK_MONOTONIC) * 2654435761ULL);
+	r->seq = r->ssrc >> 16;
+
+	/* PSI + PES header + payload, rounded up to whole RTP packets */
+	ts = 2 + (max_frame + 14 + 8 + 183) / 184;
+	r->max_pkts = (ts + SRC_RTP_TS_PER_PACKET - 1) / SRC_RTP_TS_PER_PACKET;
+	r->pkts = malloc(r->max_pkts * SRC_RTP_PACKET);
+	r->msgs = calloc(r->max_pkts, sizeof(*r->msgs));
+	r->iov = calloc(r->max_pkts, sizeof(*r->iov));
+	if (!r->pkts || !r->msgs || !r->iov) {
+		ret = cli_ENOMEM();
+		goto error;
+	}
+
+	for (i = 0; i < r->max_pkts; ++i) {
+		r->msgs[i].msg_hdr.msg_iov = &r->iov[i];
+		r->msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	if (dest) {
+		r->dest = *dest;
+		r->fd = src_rtp_socket(dest, local_port, &r->gso);
+		if (r->fd < 0) {
+			ret = r->fd;
+			goto error;
+		}
+	}
+
+	*out = r;
+	return 0;
+
+error:
+	src_rtp_free(r);
+	return ret;
+}
+
+void src_rtp_free(struct src_rtp *r)
+{
+	if (!r)
+		return;
+
+	if (r->fd >= 0)
+		close(r->fd);
+	free(r->iov);
+	free(r->msgs);
+	free(r->pkts);
+	free(r);
+}
@@ -0,0 +1,569 @@
+/*
+ * MiracleCast - Wifi-Display/Miracast Implementation
+ *
+ * MiracleCast is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * MiracleCast is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with MiracleCast; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <locale.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <systemd/sd-bus.h>
+#include <systemd/sd-event.h>
+#include <systemd/sd-journal.h>
+#include <unistd.h>
+#include "ctl.h"
+#include "ctl-src.h"
+#include "src-pipeline.h"
+#include "wfd.h"
+#include "shl_macro.h"
+#include "shl_util.h"
+#include "trace.h"
+#include "config.h"
+
+static sd_bus *bus;
+static struct ctl_src *src;
+
+struct src_stream {
+	struct src_pipeline *pipeline;
+	struct src_fanout_sink *sink;	/* set if on the shared pipeline */
+};
+
+static struct src_pipeline *shared;
+static int shared_fps;
+
+static unsigned int src_port = CTL_SRC_DEFAULT_PORT;
+static unsigned int src_max_sessions = CTL_SRC_DEFAULT_MAX_SESSIONS;
+static const char *src_capture = "testsrc";
+static const char *src_encoder;
+static unsigned int src_bitrate = 8000;
+static bool src_fanout;
+
+unsigned int wfd_supported_res_cea  = 0x000001ff;	/* up to 1080p60 */
+unsigned int wfd_supported_res_vesa = 0x00000000;
+unsigned int wfd_supported_res_hh   = 0x00000000;
+
+/*
+ * cmd list
+ */
+
+static int cmd_list(char **args, unsigned int n)
+{
+	struct shl_dlist *i;
+	struct ctl_src_session *ss;
+
+	cli_printf("%6s %-16s %-10s %-12s %s\n",
+		   "ID", "SINK", "STATE", "FORMAT", "RTP-PORT");
+
+	shl_dlist_for_each(i, &src->sessions) {
+		ss = session_from_dlist(i);
+		cli_printf("%6u %-16s %-10s %5dx%-4d@%-2d %u\n",
+			   ss->id, ss->remote,
+			   ctl_src_state_to_name(ss->state),
+			   ss->hres, ss->vres, ss->fps,
+			   ss->rtp_port);
+	}
+
+	cli_printf("\n %u session(s), %s on port %u\n", src->n_sessions,
+		   ctl_src_is_listening(src) ? "listening" : "not listening",
+		   src->port);
+
+	return 0;
+}
+
+/*
+ * cmd stats
+ */
+
+static int cmd_stats(char **args, unsigned int n)
+{
+	struct shl_dlist *i;
+	struct ctl_src_session *ss;
+	struct src_stream *st;
+
+	cli_printf("sessions set up: %llu, failed: %llu\n",
+		   (unsigned long long)src->setup_cnt,
+		   (unsigned long long)src->setup_failed);
+
+	if (src->setup_cnt)
+		cli_printf("setup time (accept to PLAY): min %lluus avg %lluus max %lluus\n",
+			   (unsigned long long)src->setup_min,
+			   (unsigned long long)(src->setup_sum / src->setup_cnt),
+			   (unsigned long long)src->setup_max);
+
+	shl_dlist_for_each(i, &src->sessions) {
+		ss = session_from_dlist(i);
+		st = ss->data;
+		if (!st || st->sink)
+			continue;
+
+		cli_printf("session %u:\n", ss->id);
+		src_pipeline_print_stats(st->pipeline, "  ");
+	}
+
+	if (shared) {
+		cli_printf("shared stream:\n");
+		src_pipeline_print_stats(shared, "  ");
+	}
+
+	return 0;
+}
+
+/*
+ * cmd listen
+ */
+
+static int cmd_listen(char **args, unsigned int n)
+{
+	unsigned int port = src_port;
+	int r;
+
+	if (n > 0)
+		port = atoi(args[0]);
+
+	if (ctl_src_is_listening(src)) {
+		cli_error("already listening on port %u", src->port);
+		return 0;
+	}
+
+	r = ctl_src_listen(src, NULL, port);
+	if (r < 0)
+		return r;
+
+	cli_printf("listening for sinks on port %u\n", src->port);
+	return 0;
+}
+
+/*
+ * cmd close
+ */
+
+static int cmd_close(char **args, unsigned int n)
+{
+	ctl_src_close(src);
+	return 0;
+}
+
+/*
+ * cmd teardown
+ */
+
+static int cmd_teardown(char **args, unsigned int n)
+{
+	struct ctl_src_session *ss;
+
+	ss = ctl_src_find_session(src, atoi(args[0]));
+	if (!ss) {
+		cli_error("unknown session %s", args[0]);
+		return 0;
+	}
+
+	return ctl_src_session_teardown(ss);
+}
+
+/*
+ * cmd: metrics
+ */
+
+static int cmd_metrics(char **args, unsigned int n)
+{
+	return cli_print_metrics();
+}
+
+/*
+ * cmd: quit/exit
+ */
+
+static int cmd_quit(char **args, unsigned int n)
+{
+	cli_exit();
+	return 0;
+}
+
+/*
+ * main
+ */
+
+static const struct cli_cmd cli_cmds[] = {
+	{ "listen",		"[port]",	CLI_M,	CLI_LESS,	1,	cmd_listen,	"Accept sink connections" },
+	{ "close",		NULL,		CLI_M,	CLI_LESS,	0,	cmd_close,	"Stop accepting sink connections" },
+	{ "list",		NULL,		CLI_M,	CLI_LESS,	0,	cmd_list,	"List all sink sessions" },
+	{ "teardown",		"<id>",		CLI_M,	CLI_EQUAL,	1,	cmd_teardown,	"Tear down a sink session" },
+	{ "stats",		NULL,		CLI_M,	CLI_LESS,	0,	cmd_stats,	"Show session setup and streaming statistics" },
+	{ "metrics",		NULL,		CLI_M,	CLI_LESS,	0,	cmd_metrics,	"Dump RTSP metrics" },
+	{ "quit",		NULL,		CLI_Y,	CLI_MORE,	0,	cmd_quit,	"Quit program" },
+	{ "exit",		NULL,		CLI_Y,	CLI_MORE,	0,	cmd_quit,	NULL },
+	{ "help",		NULL,		CLI_M,	CLI_MORE,	0,	NULL,		"Print help" },
+	{ },
+};
+
+void ctl_fn_src_session_new(struct ctl_src_session *ss)
+{
+	if (cli_running())
+		cli_printf("[" CLI_GREEN "ADD" CLI_DEFAULT "] Session: %u Sink: %s\n",
+			   ss->id, ss->remote);
+}
+
+/*
+ * streaming
+ * Every session gets its own pipeline, unless --fanout is given: then sinks
+ * that negotiated the same format share one pipeline and only the RTP send
+ * is per sink.
+ */
+
+static bool src_stream_can_share(struct ctl_src_session *ss)
+{
+	if (!src->fanout)
+		return false;
+	if (!shared)
+		return true;
+
+	return shared->capture->width == ss->hres &&
+	       shared->capture->height == ss->vres &&
+	       shared_fps == ss->fps;
+}
+
+static int src_stream_new(struct ctl_src_session *ss, struct src_stream **out)
+{
+	struct src_pipeline_config cfg = {
+		.capture = src_capture,
+		.encoder = src_encoder,
+		.width = ss->hres,
+		.height = ss->vres,
+		.fps = ss->fps,
+		.bitrate = src_bitrate,
+	};
+	struct sockaddr_in dest = { };
+	struct src_stream *st;
+	int r;
+
+	dest.sin_family = AF_INET;
+	dest.sin_port = htons(ss->rtp_port);
+	if (inet_pton(AF_INET, ss->remote, &dest.sin_addr) != 1) {
+		cli_error("session %u: sink %s is not IPv4", ss->id, ss->remote);
+		return -EAFNOSUPPORT;
+	}
+
+	st = calloc(1, sizeof(*st));
+	if (!st)
+		return cli_ENOMEM();
+
+	if (!src_stream_can_share(ss)) {
+		cfg.dest = dest;
+		r = src_pipeline_new(&st->pipeline, src->event, &cfg);
+		if (r < 0)
+			goto error;
+
+		*out = st;
+		return 0;
+	}
+
+	if (!shared) {
+		cfg.fanout = true;
+		r = src_pipeline_new(&shared, src->event, &cfg);
+		if (r < 0)
+			goto error;
+		shared_fps = ss->fps;
+	}
+
+	st->pipeline = shared;
+	r = src_pipeline_add_sink(shared, &dest, 0, &st->sink);
+	if (r < 0)
+		goto error;
+
+	*out = st;
+	return 0;
+
+error:
+	if (shared && !shared->fanout->n_sinks) {
+		src_pipeline_free(shared);
+		shared = NULL;
+	}
+	free(st);
+	return r;
+}
+
+static void src_stream_free(struct src_stream *st)
+{
+	if (!st)
+		return;
+
+	if (!st->sink) {
+		src_pipeline_free(st->pipeline);
+	} else {
+		src_fanout_sink_free(st->sink);
+		if (!shared->fanout->n_sinks) {
+			src_pipeline_free(shared);
+			shared = NULL;
+		}
+	}
+
+	free(st);
+}
+
+static int src_session_stream(struct ctl_src_session *ss)
+{
+	struct src_stream *st;
+	int r;
+
+	if (!ss->data) {
+		r = src_stream_new(ss, &st);
+		if (r < 0)
+			return r;
+		ss->data = st;
+	}
+
+	st = ss->data;
+	if (st->sink)
+		src_fanout_sink_pause(st->sink, false);
+
+	return src_pipeline_start(st->pipeline);
+}
+
+int ctl_fn_src_session_playing(struct ctl_src_session *ss)
+{
+	int r;
+
+	r = src_session_stream(ss);
+	if (r < 0) {
+		cli_error("session %u: cannot start streaming: %d", ss->id, r);
+		return r;
+	}
+
+	if (cli_running())
+		cli_printf("[" CLI_GREEN "PLAY" CLI_DEFAULT "] Session: %u %dx%d@%d to %s:%u (setup %llums)%s\n",
+			   ss->id, ss->hres, ss->vres, ss->fps,
+			   ss->remote, ss->rtp_port,
+			   (unsigned long long)(ss->t_playing - ss->t_accept) / 1000,
+			   ((struct src_stream*)ss->data)->sink ? " shared" : "");
+
+	return 0;
+}
+
+void ctl_fn_src_session_paused(struct ctl_src_session *ss)
+{
+	struct src_stream *st = ss->data;
+
+	if (st && st->sink)
+		src_fanout_sink_pause(st->sink, true);
+	else if (st)
+		src_pipeline_stop(st->pipeline);
+
+	if (cli_running())
+		cli_printf("[" CLI_YELLOW "PAUSE" CLI_DEFAULT "] Session: %u\n",
+			   ss->id);
+}
+
+void ctl_fn_src_session_free(struct ctl_src_session *ss)
+{
+	src_stream_free(ss->data);
+	ss->data = NULL;
+
+	if (cli_running())
+		cli_printf("[" CLI_RED "REMOVE" CLI_DEFAULT "] Session: %u Sink: %s\n",
+			   ss->id, ss->remote);
+}
+
+void cli_fn_child_exited(pid_t pid)
+{
+}
+
+void cli_fn_help()
+{
+	/*
+	 * 80-char barrier:
+	 *      01234567890123456789012345678901234567890123456789012345678901234567890123456789
+	 */
+	printf("%s [OPTIONS...] ...\n\n"
+	       "Run a Wifi-Display source via MiracleCast.\n"
+	       "  -h --help                      Show this help\n"
+	       "     --help-commands             Show avaliable commands\n"
+	       "     --version                   Show package version\n"
+	       "     --log-level <lvl>           Maximum level for log messages\n"
+	       "     --log-journal-level <lvl>   Maximum level for journal log messages\n"
+	       "  -p --port <port>               Port for rtsp (default %u)\n"
+	       "     --max-sessions <n>          Concurrent sink sessions (default %u)\n"
+	       "     --res <n,n,n>               Resolutions we can encode (CEA, VESA, HH)\n"
+	       "                                    default CEA  %08X\n"
+	       "                                    default VESA %08X\n"
+	       "                                    default HH   %08X\n"
+	       "     --help-res                  Shows avaliable values for res\n"
+	       "     --capture <spec>            Capture backend: testsrc, shm:<path>\n"
+	       "                                    (default testsrc)\n"
+	       "     --encoder <name>            H.264 encoder: x264, pcm (default %s)\n"
+	       "     --bitrate <kbit/s>          Target video bitrate (default %u)\n"
+	       "     --fanout                    Encode once for all sinks, offering\n"
+	       "                                    them a common video format\n"
+	       "\n"
+	       , program_invocation_short_name, CTL_SRC_DEFAULT_PORT,
+	       CTL_SRC_DEFAULT_MAX_SESSIONS,
+	       wfd_supported_res_cea, wfd_supported_res_vesa, wfd_supported_res_hh,
+	       src_encoder_default() ? : "none", src_bitrate
+	       );
+	/*
+	 * 80-char barrier:
+	 *      01234567890123456789012345678901234567890123456789012345678901234567890123456789
+	 */
+}
+
+static int ctl_interactive(char **argv, int argc)
+{
+	int r;
+
+	r = cli_init(bus, cli_cmds);
+	if (r < 0)
+		return r;
+
+	r = ctl_src_new(&src, cli_event);
+	if (r < 0)
+		goto error;
+
+	src->max_sessions = src_max_sessions;
+	src->fanout = src_fanout;
+
+	r = ctl_src_listen(src, NULL, src_port);
+	if (r < 0)
+		goto error;
+
+	if (argc > 0) {
+		r = cli_do(cli_cmds, argv, argc);
+		if (r == -EAGAIN)
+			cli_error("unknown operation %s", argv[0]);
+	}
+
+	r = cli_run();
+
+error:
+	ctl_src_free(src);
+	cli_destroy();
+	return r;
+}
+
+static int parse_argv(int argc, char *argv[])
+{
+	enum {
+		ARG_VERSION = 0x100,
+		ARG_LOG_LEVEL,
+		ARG_JOURNAL_LEVEL,
+		ARG_MAX_SESSIONS,
+		ARG_RES,
+		ARG_HELP_RES,
+		ARG_HELP_COMMANDS,
+		ARG_CAPTURE,
+		ARG_ENCODER,
+		ARG_BITRATE,
+		ARG_FANOUT,
+	};
+	static const struct option options[] = {
+		{ "help",	no_argument,		NULL,	'h' },
+		{ "help-commands",	no_argument,		NULL,	ARG_HELP_COMMANDS },
+		{ "version",	no_argument,		NULL,	ARG_VERSION },
+		{ "log-level",	required_argument,	NULL,	ARG_LOG_LEVEL },
+		{ "log-journal-level",	required_argument,	NULL,	ARG_JOURNAL_LEVEL },
+		{ "port",	required_argument,	NULL,	'p' },
+		{ "max-sessions",	required_argument,	NULL,	ARG_MAX_SESSIONS },
+		{ "res",	required_argument,	NULL,	ARG_RES },
+		{ "help-res",	no_argument,		NULL,	ARG_HELP_RES },
+		{ "capture",	required_argument,	NULL,	ARG_CAPTURE },
+		{ "encoder",	required_argument,	NULL,	ARG_ENCODER },
+		{ "bitrate",	required_argument,	NULL,	ARG_BITRATE },
+		{ "fanout",	no_argument,		NULL,	ARG_FANOUT },
+		{}
+	};
+	int c;
+
+	while ((c = getopt_long(argc, argv, "hp:", options, NULL)) >= 0) {
+		switch (c) {
+		case 'h':
+			cli_fn_help();
+			return 0;
+		case ARG_HELP_COMMANDS:
+			return cli_help(cli_cmds, 20);
+		case ARG_HELP_RES:
+			wfd_print_resolutions("");
+			return 0;
+		case ARG_VERSION:
+			puts(PACKAGE_STRING);
+			return 0;
+		case ARG_LOG_LEVEL:
+			cli_max_sev = log_parse_arg(optarg);
+			break;
+		case ARG_JOURNAL_LEVEL:
+			log_max_sev = log_parse_arg(optarg);
+			break;
+		case 'p':
+			src_port = atoi(optarg);
+			break;
+		case ARG_MAX_SESSIONS:
+			src_max_sessions = atoi(optarg);
+			break;
+		case ARG_RES:
+			sscanf(optarg, "%x,%x,%x",
+				&wfd_supported_res_cea,
+				&wfd_supported_res_vesa,
+				&wfd_supported_res_hh);
+			break;
+		case ARG_CAPTURE:
+			src_capture = optarg;
+			break;
+		case ARG_ENCODER:
+			src_encoder = optarg;
+			break;
+		case ARG_BITRATE:
+			src_bitrate = atoi(optarg);
+			break;
+		case ARG_FANOUT:
+			src_fanout = true;
+			break;
+		case '?':
+			return -EINVAL;
+		}
+	}
+
+	return 1;
+}
+
+int main(int argc, char **argv)
+{
+	int r, left;
+
+	setlocale(LC_ALL, "");
+
+	r = parse_argv(argc, argv);
+	if (r < 0)
+		return EXIT_FAILURE;
+	if (!r)
+		return EXIT_SUCCESS;
+
+	trace_init("miracle-srcctl");
+
+	if (!src_encoder && !src_encoder_default())
+		cli_warning("built without x264, sessions need --encoder pcm which ignores --bitrate");
+
+	r = sd_bus_default_system(&bus);
+	if (r < 0) {
+		cli_error("cannot connect to system bus: %s", strerror(-r));
+		return EXIT_FAILURE;
+	}
+
+	left = argc - optind;
+	left = left <= 0 ? 0 : left;
+	r = ctl_interactive(argv + optind, left);
+
+	sd_bus_unref(bus);
+
+	return r < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
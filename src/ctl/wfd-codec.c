@@ -0,0 +1,769 @@
+/*
+ * MiracleCast - Wifi-Display/Miracast Implementation
+ *
+ * MiracleCast is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * MiracleCast is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with MiracleCast; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include "shl_macro.h"
+#include "wfd-codec.h"
+
+/* hex digit values plus one, 0 for non-digits */
+#define WFD_HEX(_c, _v) [(unsigned char)(_c)] = (_v) + 1
+
+static const uint8_t wfd_hex[256] = {
+	WFD_HEX('0', 0), WFD_HEX('1', 1), WFD_HEX('2', 2), WFD_HEX('3', 3),
+	WFD_HEX('4', 4), WFD_HEX('5', 5), WFD_HEX('6', 6), WFD_HEX('7', 7),
+	WFD_HEX('8', 8), WFD_HEX('9', 9),
+	WFD_HEX('a', 10), WFD_HEX('b', 11), WFD_HEX('c', 12),
+	WFD_HEX('d', 13), WFD_HEX('e', 14), WFD_HEX('f', 15),
+	WFD_HEX('A', 10), WFD_HEX('B', 11), WFD_HEX('C', 12),
+	WFD_HEX('D', 13), WFD_HEX('E', 14), WFD_HEX('F', 15),
+};
+
+static const char wfd_hexdigits[16] = "0123456789abcdef";
+
+struct wfd_keyword {
+	const char *name;
+	size_t len;
+};
+
+#define WFD_KEYWORD(_s) { (_s), sizeof(_s) - 1 }
+
+static const struct wfd_keyword wfd_none = WFD_KEYWORD("none");
+
+static const struct wfd_keyword wfd_audio_formats[WFD_AUDIO_CNT] = {
+	[WFD_AUDIO_LPCM]		= WFD_KEYWORD("LPCM"),
+	[WFD_AUDIO_AAC]			= WFD_KEYWORD("AAC"),
+	[WFD_AUDIO_AC3]			= WFD_KEYWORD("AC3"),
+};
+
+static const struct wfd_keyword wfd_rtp_profiles[WFD_RTP_CNT] = {
+	[WFD_RTP_UDP]			= WFD_KEYWORD("RTP/AVP/UDP;unicast"),
+	[WFD_RTP_TCP]			= WFD_KEYWORD("RTP/AVP/TCP;unicast"),
+};
+
+static const struct wfd_keyword wfd_rtp_mode = WFD_KEYWORD("mode=play");
+
+static const struct wfd_keyword wfd_uibc_categories[] = {
+	WFD_KEYWORD("GENERIC"),
+	WFD_KEYWORD("HIDC"),
+};
+
+static const struct wfd_keyword wfd_uibc_inputs[WFD_UIBC_INPUT_CNT] = {
+	[WFD_UIBC_KEYBOARD]		= WFD_KEYWORD("Keyboard"),
+	[WFD_UIBC_MOUSE]		= WFD_KEYWORD("Mouse"),
+	[WFD_UIBC_SINGLETOUCH]		= WFD_KEYWORD("SingleTouch"),
+	[WFD_UIBC_MULTITOUCH]		= WFD_KEYWORD("MultiTouch"),
+	[WFD_UIBC_JOYSTICK]		= WFD_KEYWORD("Joystick"),
+	[WFD_UIBC_CAMERA]		= WFD_KEYWORD("Camera"),
+	[WFD_UIBC_GESTURE]		= WFD_KEYWORD("Gesture"),
+	[WFD_UIBC_REMOTECONTROL]	= WFD_KEYWORD("RemoteControl"),
+};
+
+static const struct wfd_keyword wfd_uibc_paths[WFD_UIBC_PATH_CNT] = {
+	[WFD_UIBC_INFRARED]		= WFD_KEYWORD("Infrared"),
+	[WFD_UIBC_USB]			= WFD_KEYWORD("USB"),
+	[WFD_UIBC_BT]			= WFD_KEYWORD("BT"),
+	[WFD_UIBC_ZIGBEE]		= WFD_KEYWORD("Zigbee"),
+	[WFD_UIBC_WIFI]			= WFD_KEYWORD("Wi-Fi"),
+	[WFD_UIBC_NOSP]			= WFD_KEYWORD("No-SP"),
+};
+
+enum {
+	WFD_UIBC_KEY_CATEGORIES,
+	WFD_UIBC_KEY_GENERIC,
+	WFD_UIBC_KEY_HIDC,
+	WFD_UIBC_KEY_PORT,
+	WFD_UIBC_KEY_CNT,
+};
+
+static const struct wfd_keyword wfd_uibc_keys[WFD_UIBC_KEY_CNT] = {
+	[WFD_UIBC_KEY_CATEGORIES]	= WFD_KEYWORD("input_category_list"),
+	[WFD_UIBC_KEY_GENERIC]		= WFD_KEYWORD("generic_cap_list"),
+	[WFD_UIBC_KEY_HIDC]		= WFD_KEYWORD("hidc_cap_list"),
+	[WFD_UIBC_KEY_PORT]		= WFD_KEYWORD("port"),
+};
+
+/*
+ * Parser helpers
+ * All of them advance *s only on success.
+ */
+
+static const char *wfd_skip_ws(const char *s)
+{
+	while (*s == ' ' || *s == '\t')
+		++s;
+
+	return s;
+}
+
+/* end of the value, a trailing CRLF is tolerated */
+static int wfd_read_end(const char *s)
+{
+	while (*s == ' ' || *s == '\t' || *s == '\r' || *s == '\n')
+		++s;
+
+	return *s ? -EINVAL : 0;
+}
+
+/* up to @max hex digits, more are an error */
+static int wfd_read_hex(const char **s, unsigned int max, uint32_t *out)
+{
+	const char *p = wfd_skip_ws(*s);
+	unsigned int n;
+	uint32_t v = 0;
+	uint8_t d;
+
+	for (n = 0; n < max && (d = wfd_hex[(unsigned char)*p]); ++n, ++p)
+		v = v << 4 | (d - 1);
+	if (!n || wfd_hex[(unsigned char)*p])
+		return -EINVAL;
+
+	*s = p;
+	*out = v;
+	return 0;
+}
+
+static int wfd_read_dec(const char **s, uint32_t max, uint32_t *out)
+{
+	const char *p = wfd_skip_ws(*s);
+	uint32_t v = 0;
+
+	if (*p < '0' || *p > '9')
+		return -EINVAL;
+
+	for ( ; *p >= '0' && *p <= '9'; ++p) {
+		v = v * 10 + (*p - '0');
+		if (v > max)
+			return -ERANGE;
+	}
+
+	*s = p;
+	*out = v;
+	return 0;
+}
+
+/* case-insensitive keyword, followed by one of @delims or the end */
+static bool wfd_read_word(const char **s, const struct wfd_keyword *k,
+			  const char *delims)
+{
+	const char *p = wfd_skip_ws(*s);
+
+	if (strncasecmp(p, k->name, k->len) || !strchr(delims, p[k->len]))
+		return false;
+
+	*s = p + k->len;
+	return true;
+}
+
+static int wfd_read_keyword(const char **s, const struct wfd_keyword *table,
+			    unsigned int n, const char *delims)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; ++i)
+		if (table[i].name && wfd_read_word(s, &table[i], delims))
+			return i;
+
+	return -EINVAL;
+}
+
+/* list separator: ',' with optional spaces around it */
+static bool wfd_read_comma(const char **s)
+{
+	const char *p = wfd_skip_ws(*s);
+
+	if (*p != ',')
+		return false;
+
+	*s = p + 1;
+	return true;
+}
+
+/*
+ * Output helpers
+ * Writes are dropped once the buffer is full but still counted, so callers
+ * learn the size they would have needed.
+ */
+
+struct wfd_out {
+	char *buf;
+	size_t size;
+	size_t len;
+};
+
+static void wfd_put(struct wfd_out *o, char c)
+{
+	if (o->len + 1 < o->size)
+		o->buf[o->len] = c;
+	++o->len;
+}
+
+static void wfd_put_mem(struct wfd_out *o, const char *s, size_t n)
+{
+	if (o->len + n < o->size)
+		memcpy(o->buf + o->len, s, n);
+	else if (o->len + 1 < o->size)
+		memcpy(o->buf + o->len, s, o->size - o->len - 1);
+	o->len += n;
+}
+
+static void wfd_put_word(struct wfd_out *o, const struct wfd_keyword *k)
+{
+	wfd_put_mem(o, k->name, k->len);
+}
+
+static void wfd_put_hex(struct wfd_out *o, uint32_t v, unsigned int digits)
+{
+	while (digits--)
+		wfd_put(o, wfd_hexdigits[(v >> (digits * 4)) & 0xf]);
+}
+
+static void wfd_put_dec(struct wfd_out *o, uint32_t v)
+{
+	char t[10];
+	unsigned int n = 0;
+
+	do {
+		t[n++] = '0' + v % 10;
+	} while (v /= 10);
+
+	while (n)
+		wfd_put(o, t[--n]);
+}
+
+static int wfd_out_finish(struct wfd_out *o)
+{
+	if (o->size)
+		o->buf[o->len < o->size ? o->len : o->size - 1] = 0;
+
+	return o->len < o->size ? (int)o->len : -ENOBUFS;
+}
+
+/*
+ * wfd_video_formats
+ *   none | <native> <preferred-display-mode> <h264-codec>[, <h264-codec>..]
+ *   h264-codec: <profile> <level> <CEA> <VESA> <HH> <latency>
+ *               <min-slice-size> <slice-enc-params> <frame-rate-control>
+ *               <max-hres|none> <max-vres|none>
+ */
+
+static int wfd_read_hex_or_none(const char **s, unsigned int max,
+				uint16_t *out)
+{
+	uint32_t v;
+	int r;
+
+	if (wfd_read_word(s, &wfd_none, " \t,\r\n")) {
+		*out = 0;
+		return 0;
+	}
+
+	r = wfd_read_hex(s, max, &v);
+	if (r < 0)
+		return r;
+
+	*out = v;
+	return 0;
+}
+
+static int wfd_read_h264(const char **s, struct wfd_h264_codec *c)
+{
+	uint32_t v[6];
+	int r;
+
+	if ((r = wfd_read_hex(s, 2, &v[0])) < 0 ||
+	    (r = wfd_read_hex(s, 2, &v[1])) < 0 ||
+	    (r = wfd_read_hex(s, 8, &c->cea)) < 0 ||
+	    (r = wfd_read_hex(s, 8, &c->vesa)) < 0 ||
+	    (r = wfd_read_hex(s, 8, &c->hh)) < 0 ||
+	    (r = wfd_read_hex(s, 2, &v[2])) < 0 ||
+	    (r = wfd_read_hex(s, 4, &v[3])) < 0 ||
+	    (r = wfd_read_hex(s, 4, &v[4])) < 0 ||
+	    (r = wfd_read_hex(s, 2, &v[5])) < 0 ||
+	    (r = wfd_read_hex_or_none(s, 4, &c->max_hres)) < 0 ||
+	    (r = wfd_read_hex_or_none(s, 4, &c->max_vres)) < 0)
+		return r;
+
+	c->profile = v[0];
+	c->level = v[1];
+	c->latency = v[2];
+	c->min_slice_size = v[3];
+	c->slice_enc_params = v[4];
+	c->frame_rate_control = v[5];
+	return 0;
+}
+
+int wfd_video_formats_parse(struct wfd_video_formats *v, const char *s)
+{
+	uint32_t native, pref;
+	int r;
+
+	v->none = false;
+	v->native = 0;
+	v->preferred_display_mode = 0;
+	v->n_codecs = 0;
+
+	if (wfd_read_word(&s, &wfd_none, " \t\r\n")) {
+		v->none = true;
+		return wfd_read_end(s);
+	}
+
+	if ((r = wfd_read_hex(&s, 2, &native)) < 0 ||
+	    (r = wfd_read_hex(&s, 2, &pref)) < 0)
+		return r;
+
+	v->native = native;
+	v->preferred_display_mode = pref;
+
+	do {
+		if (v->n_codecs >= WFD_H264_CODECS_MAX)
+			return -E2BIG;
+
+		r = wfd_read_h264(&s, &v->codecs[v->n_codecs]);
+		if (r < 0)
+			return r;
+
+		++v->n_codecs;
+	} while (wfd_read_comma(&s));
+
+	return wfd_read_end(s);
+}
+
+static void wfd_put_hex_or_none(struct wfd_out *o, uint16_t v)
+{
+	if (v)
+		wfd_put_hex(o, v, 4);
+	else
+		wfd_put_word(o, &wfd_none);
+}
+
+int wfd_video_formats_format(const struct wfd_video_formats *v,
+			     char *buf, size_t size)
+{
+	struct wfd_out o = { .buf = buf, .size = size };
+	const struct wfd_h264_codec *c;
+	unsigned int i;
+
+	if (v->none || !v->n_codecs) {
+		wfd_put_word(&o, &wfd_none);
+		return wfd_out_finish(&o);
+	}
+
+	wfd_put_hex(&o, v->native, 2);
+	wfd_put(&o, ' ');
+	wfd_put_hex(&o, v->preferred_display_mode, 2);
+
+	for (i = 0; i < v->n_codecs; ++i) {
+		c = &v->codecs[i];
+
+		wfd_put_mem(&o, i ? ", " : " ", i ? 2 : 1);
+		wfd_put_hex(&o, c->profile, 2);
+		wfd_put(&o, ' ');
+		wfd_put_hex(&o, c->level, 2);
+		wfd_put(&o, ' ');
+		wfd_put_hex(&o, c->cea, 8);
+		wfd_put(&o, ' ');
+		wfd_put_hex(&o, c->vesa, 8);
+		wfd_put(&o, ' ');
+		wfd_put_hex(&o, c->hh, 8);
+		wfd_put(&o, ' ');
+		wfd_put_hex(&o, c->latency, 2);
+		wfd_put(&o, ' ');
+		wfd_put_hex(&o, c->min_slice_size, 4);
+		wfd_put(&o, ' ');
+		wfd_put_hex(&o, c->slice_enc_params, 4);
+		wfd_put(&o, ' ');
+		wfd_put_hex(&o, c->frame_rate_control, 2);
+		wfd_put(&o, ' ');
+		wfd_put_hex_or_none(&o, c->max_hres);
+		wfd_put(&o, ' ');
+		wfd_put_hex_or_none(&o, c->max_vres);
+	}
+
+	return wfd_out_finish(&o);
+}
+
+/*
+ * wfd_audio_codecs
+ *   none | <format> <modes> <latency>[, <format> <modes> <latency>..]
+ */
+
+int wfd_audio_codecs_parse(struct wfd_audio_codecs *a, const char *s)
+{
+	struct wfd_audio_codec *c;
+	uint32_t latency;
+	int r;
+
+	a->n_codecs = 0;
+
+	if (wfd_read_word(&s, &wfd_none, " \t\r\n"))
+		return wfd_read_end(s);
+
+	do {
+		if (a->n_codecs >= WFD_AUDIO_CODECS_MAX)
+			return -E2BIG;
+
+		c = &a->codecs[a->n_codecs];
+
+		r = wfd_read_keyword(&s, wfd_audio_formats, WFD_AUDIO_CNT,
+				     " \t");
+		if (r < 0)
+			return r;
+		c->format = r;
+
+		if ((r = wfd_read_hex(&s, 8, &c->modes)) < 0 ||
+		    (r = wfd_read_hex(&s, 2, &latency)) < 0)
+			return r;
+		c->latency = latency;
+
+		++a->n_codecs;
+	} while (wfd_read_comma(&s));
+
+	return wfd_read_end(s);
+}
+
+int wfd_audio_codecs_format(const struct wfd_audio_codecs *a,
+			    char *buf, size_t size)
+{
+	struct wfd_out o = { .buf = buf, .size = size };
+	const struct wfd_audio_codec *c;
+	unsigned int i;
+
+	if (!a->n_codecs) {
+		wfd_put_word(&o, &wfd_none);
+		return wfd_out_finish(&o);
+	}
+
+	for (i = 0; i < a->n_codecs; ++i) {
+		c = &a->codecs[i];
+		if (c->format >= WFD_AUDIO_CNT)
+			return -EINVAL;
+
+		if (i)
+			wfd_put_mem(&o, ", ", 2);
+		wfd_put_word(&o, &wfd_audio_formats[c->format]);
+		wfd_put(&o, ' ');
+		wfd_put_hex(&o, c->modes, 8);
+		wfd_put(&o, ' ');
+		wfd_put_hex(&o, c->latency, 2);
+	}
+
+	return wfd_out_finish(&o);
+}
+
+const struct wfd_audio_codec *wfd_audio_codecs_find(const struct wfd_audio_codecs *a,
+						    unsigned int format)
+{
+	unsigned int i;
+
+	for (i = 0; i < a->n_codecs; ++i)
+		if (a->codecs[i].format == format)
+			return &a->codecs[i];
+
+	return NULL;
+}
+
+/*
+ * wfd_client_rtp_ports
+ *   <profile> <port0> <port1> mode=play
+ */
+
+int wfd_client_rtp_ports_parse(struct wfd_client_rtp_ports *p, const char *s)
+{
+	uint32_t port0, port1;
+	int r;
+
+	r = wfd_read_keyword(&s, wfd_rtp_profiles, WFD_RTP_CNT, " \t");
+	if (r < 0)
+		return r;
+	p->profile = r;
+
+	if ((r = wfd_read_dec(&s, UINT16_MAX, &port0)) < 0 ||
+	    (r = wfd_read_dec(&s, UINT16_MAX, &port1)) < 0)
+		return r;
+
+	if (!wfd_read_word(&s, &wfd_rtp_mode, " \t\r\n"))
+		return -EINVAL;
+
+	p->port0 = port0;
+	p->port1 = port1;
+	return wfd_read_end(s);
+}
+
+int wfd_client_rtp_ports_format(const struct wfd_client_rtp_ports *p,
+				char *buf, size_t size)
+{
+	struct wfd_out o = { .buf = buf, .size = size };
+
+	if (p->profile >= WFD_RTP_CNT)
+		return -EINVAL;
+
+	wfd_put_word(&o, &wfd_rtp_profiles[p->profile]);
+	wfd_put(&o, ' ');
+	wfd_put_dec(&o, p->port0);
+	wfd_put(&o, ' ');
+	wfd_put_dec(&o, p->port1);
+	wfd_put(&o, ' ');
+	wfd_put_word(&o, &wfd_rtp_mode);
+
+	return wfd_out_finish(&o);
+}
+
+/*
+ * wfd_uibc_capability
+ *   none | input_category_list=<GENERIC|HIDC|none>[, ..];
+ *          generic_cap_list=<input|none>[, ..];
+ *          hidc_cap_list=<input>/<path>[, ..]|none;
+ *          port=<port|none>
+ * Keys are accepted in any order.
+ */
+
+static int wfd_read_uibc_list(const char **s, unsigned int key,
+			      struct wfd_uibc_capability *u)
+{
+	const char *delims = " \t,;/\r\n";
+	struct wfd_uibc_hidc *h;
+	uint32_t port;
+	int r, p;
+
+	if (key == WFD_UIBC_KEY_PORT) {
+		if (wfd_read_word(s, &wfd_none, delims)) {
+			u->port = 0;
+			return 0;
+		}
+
+		r = wfd_read_dec(s, UINT16_MAX, &port);
+		if (r < 0)
+			return r;
+
+		u->port = port;
+		return 0;
+	}
+
+	if (wfd_read_word(s, &wfd_none, delims))
+		return 0;
+
+	do {
+		switch (key) {
+		case WFD_UIBC_KEY_CATEGORIES:
+			r = wfd_read_keyword(s, wfd_uibc_categories,
+					     SHL_ARRAY_LENGTH(wfd_uibc_categories),
+					     delims);
+			if (r < 0)
+				return r;
+			u->categories |= 1U << r;
+			break;
+		case WFD_UIBC_KEY_GENERIC:
+			r = wfd_read_keyword(s, wfd_uibc_inputs,
+					     WFD_UIBC_INPUT_CNT, delims);
+			if (r < 0)
+				return r;
+			u->generic |= 1U << r;
+			break;
+		case WFD_UIBC_KEY_HIDC:
+			if (u->n_hidc >= WFD_UIBC_HIDC_MAX)
+				return -E2BIG;
+
+			r = wfd_read_keyword(s, wfd_uibc_inputs,
+					     WFD_UIBC_INPUT_CNT, delims);
+			if (r < 0)
+				return r;
+			if (**s != '/')
+				return -EINVAL;
+			++*s;
+			p = wfd_read_keyword(s, wfd_uibc_paths,
+					     WFD_UIBC_PATH_CNT, delims);
+			if (p < 0)
+				return p;
+
+			h = &u->hidc[u->n_hidc++];
+			h->input = r;
+			h->path = p;
+			break;
+		}
+	} while (wfd_read_comma(s));
+
+	return 0;
+}
+
+int wfd_uibc_capability_parse(struct wfd_uibc_capability *u, const char *s)
+{
+	int key, r;
+
+	memset(u, 0, sizeof(*u));
+
+	if (wfd_read_word(&s, &wfd_none, " \t\r\n")) {
+		u->none = true;
+		return wfd_read_end(s);
+	}
+
+	do {
+		key = wfd_read_keyword(&s, wfd_uibc_keys, WFD_UIBC_KEY_CNT,
+				       " \t=");
+		if (key < 0)
+			return key;
+
+		s = wfd_skip_ws(s);
+		if (*s != '=')
+			return -EINVAL;
+		++s;
+
+		r = wfd_read_uibc_list(&s, key, u);
+		if (r < 0)
+			return r;
+
+		s = wfd_skip_ws(s);
+	} while (*s == ';' && *++s);
+
+	return wfd_read_end(s);
+}
+
+static void wfd_put_list_sep(struct wfd_out *o, bool *first)
+{
+	if (!*first)
+		wfd_put_mem(o, ", ", 2);
+	*first = false;
+}
+
+int wfd_uibc_capability_format(const struct wfd_uibc_capability *u,
+			       char *buf, size_t size)
+{
+	struct wfd_out o = { .buf = buf, .size = size };
+	unsigned int i;
+	bool first;
+
+	if (u->none) {
+		wfd_put_word(&o, &wfd_none);
+		return wfd_out_finish(&o);
+	}
+
+	wfd_put_word(&o, &wfd_uibc_keys[WFD_UIBC_KEY_CATEGORIES]);
+	wfd_put(&o, '=');
+	first = true;
+	for (i = 0; i < SHL_ARRAY_LENGTH(wfd_uibc_categories); ++i) {
+		if (u->categories & (1U << i)) {
+			wfd_put_list_sep(&o, &first);
+			wfd_put_word(&o, &wfd_uibc_categories[i]);
+		}
+	}
+	if (first)
+		wfd_put_word(&o, &wfd_none);
+
+	wfd_put(&o, ';');
+	wfd_put_word(&o, &wfd_uibc_keys[WFD_UIBC_KEY_GENERIC]);
+	wfd_put(&o, '=');
+	first = true;
+	for (i = 0; i < WFD_UIBC_INPUT_CNT; ++i) {
+		if (u->generic & (1U << i)) {
+			wfd_put_list_sep(&o, &first);
+			wfd_put_word(&o, &wfd_uibc_inputs[i]);
+		}
+	}
+	if (first)
+		wfd_put_word(&o, &wfd_none);
+
+	wfd_put(&o, ';');
+	wfd_put_word(&o, &wfd_uibc_keys[WFD_UIBC_KEY_HIDC]);
+	wfd_put(&o, '=');
+	first = true;
+	for (i = 0; i < u->n_hidc; ++i) {
+		if (u->hidc[i].input >= WFD_UIBC_INPUT_CNT ||
+		    u->hidc[i].path >= WFD_UIBC_PATH_CNT)
+			return -EINVAL;
+
+		wfd_put_list_sep(&o, &first);
+		wfd_put_word(&o, &wfd_uibc_inputs[u->hidc[i].input]);
+		wfd_put(&o, '/');
+		wfd_put_word(&o, &wfd_uibc_paths[u->hidc[i].path]);
+	}
+	if (first)
+		wfd_put_word(&o, &wfd_none);
+
+	wfd_put(&o, ';');
+	wfd_put_word(&o, &wfd_uibc_keys[WFD_UIBC_KEY_PORT]);
+	wfd_put(&o, '=');
+	if (u->port)
+		wfd_put_dec(&o, u->port);
+	else
+		wfd_put_word(&o, &wfd_none);
+
+	return wfd_out_finish(&o);
+}
+
+/*
+ * wfd_presentation_URL
+ *   <url0|none> <url1|none>
+ */
+
+static int wfd_read_url(const char **s, char *url)
+{
+	const char *p = wfd_skip_ws(*s);
+	size_t n;
+
+	if (wfd_read_word(&p, &wfd_none, " \t\r\n")) {
+		*url = 0;
+		*s = p;
+		return 0;
+	}
+
+	n = strcspn(p, " \t\r\n");
+	if (!n)
+		return -EINVAL;
+	if (n >= WFD_URL_MAX)
+		return -E2BIG;
+
+	memcpy(url, p, n);
+	url[n] = 0;
+	*s = p + n;
+	return 0;
+}
+
+int wfd_presentation_url_parse(struct wfd_presentation_url *u, const char *s)
+{
+	int r;
+
+	if ((r = wfd_read_url(&s, u->url0)) < 0 ||
+	    (r = wfd_read_url(&s, u->url1)) < 0)
+		return r;
+
+	return wfd_read_end(s);
+}
+
+static void wfd_put_url(struct wfd_out *o, const char *url)
+{
+	if (*url)
+		wfd_put_mem(o, url, strlen(url));
+	else
+		wfd_put_word(o, &wfd_none);
+}
+
+int wfd_presentation_url_format(const struct wfd_presentation_url *u,
+				char *buf, size_t size)
+{
+	struct wfd_out o = { .buf = buf, .size = size };
+
+	wfd_put_url(&o, u->url0);
+	wfd_put(&o, ' ');
+	wfd_put_url(&o, u->url1);
+
+	return wfd_out_finish(&o);
+}
@@ -0,0 +1,176 @@
+/*
+ * MiracleCast - Wifi-Display/Miracast Implementation
+ *
+ * MiracleCast is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * MiracleCast is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with MiracleCast; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * WFD Parameter Codec
+ * Typed parsing and formatting of the WFD RTSP parameters (WFD spec 6.1).
+ * Parsers take the value without its "name: " prefix and reject trailing
+ * garbage. Formatters produce the same and return the length like snprintf(),
+ * or -ENOBUFS if @size is too small. Nothing allocates; hex digits, keywords
+ * and output digits all go through static tables.
+ */
+
+#ifndef WFD_CODEC_H
+#define WFD_CODEC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define WFD_H264_CODECS_MAX 8
+#define WFD_AUDIO_CODECS_MAX 4
+#define WFD_UIBC_HIDC_MAX 16
+#define WFD_URL_MAX 256
+
+/* wfd_video_formats */
+
+enum wfd_h264_profile {
+	WFD_H264_CBP			= 0x01,
+	WFD_H264_CHP			= 0x02,
+};
+
+struct wfd_h264_codec {
+	uint8_t profile;
+	uint8_t level;
+	uint32_t cea;
+	uint32_t vesa;
+	uint32_t hh;
+	uint8_t latency;
+	uint16_t min_slice_size;
+	uint16_t slice_enc_params;
+	uint8_t frame_rate_control;
+	uint16_t max_hres;		/* 0 for "none" */
+	uint16_t max_vres;		/* 0 for "none" */
+};
+
+struct wfd_video_formats {
+	bool none;
+	uint8_t native;
+	uint8_t preferred_display_mode;
+	unsigned int n_codecs;
+	struct wfd_h264_codec codecs[WFD_H264_CODECS_MAX];
+};
+
+int wfd_video_formats_parse(struct wfd_video_formats *v, const char *s);
+int wfd_video_formats_format(const struct wfd_video_formats *v,
+			     char *buf, size_t size);
+
+/* wfd_audio_codecs */
+
+enum wfd_audio_format {
+	WFD_AUDIO_LPCM,
+	WFD_AUDIO_AAC,
+	WFD_AUDIO_AC3,
+	WFD_AUDIO_CNT,
+};
+
+struct wfd_audio_codec {
+	unsigned int format;
+	uint32_t modes;
+	uint8_t latency;
+};
+
+/* no codecs means "none" */
+struct wfd_audio_codecs {
+	unsigned int n_codecs;
+	struct wfd_audio_codec codecs[WFD_AUDIO_CODECS_MAX];
+};
+
+int wfd_audio_codecs_parse(struct wfd_audio_codecs *a, const char *s);
+int wfd_audio_codecs_format(const struct wfd_audio_codecs *a,
+			    char *buf, size_t size);
+const struct wfd_audio_codec *wfd_audio_codecs_find(const struct wfd_audio_codecs *a,
+						    unsigned int format);
+
+/* wfd_client_rtp_ports, mode is always "play" */
+
+enum wfd_rtp_profile {
+	WFD_RTP_UDP,
+	WFD_RTP_TCP,
+	WFD_RTP_CNT,
+};
+
+struct wfd_client_rtp_ports {
+	unsigned int profile;
+	uint16_t port0;
+	uint16_t port1;
+};
+
+int wfd_client_rtp_ports_parse(struct wfd_client_rtp_ports *p, const char *s);
+int wfd_client_rtp_ports_format(const struct wfd_client_rtp_ports *p,
+				char *buf, size_t size);
+
+/* wfd_uibc_capability */
+
+enum wfd_uibc_category {
+	WFD_UIBC_GENERIC		= 0x01,
+	WFD_UIBC_HIDC			= 0x02,
+};
+
+enum wfd_uibc_input {
+	WFD_UIBC_KEYBOARD,
+	WFD_UIBC_MOUSE,
+	WFD_UIBC_SINGLETOUCH,
+	WFD_UIBC_MULTITOUCH,
+	WFD_UIBC_JOYSTICK,
+	WFD_UIBC_CAMERA,
+	WFD_UIBC_GESTURE,
+	WFD_UIBC_REMOTECONTROL,
+	WFD_UIBC_INPUT_CNT,
+};
+
+enum wfd_uibc_path {
+	WFD_UIBC_INFRARED,
+	WFD_UIBC_USB,
+	WFD_UIBC_BT,
+	WFD_UIBC_ZIGBEE,
+	WFD_UIBC_WIFI,
+	WFD_UIBC_NOSP,
+	WFD_UIBC_PATH_CNT,
+};
+
+struct wfd_uibc_hidc {
+	uint8_t input;
+	uint8_t path;
+};
+
+struct wfd_uibc_capability {
+	bool none;
+	unsigned int categories;	/* WFD_UIBC_GENERIC/HIDC */
+	unsigned int generic;		/* 1 << WFD_UIBC_KEYBOARD.. */
+	unsigned int n_hidc;
+	struct wfd_uibc_hidc hidc[WFD_UIBC_HIDC_MAX];
+	uint16_t port;			/* 0 for "none" */
+};
+
+int wfd_uibc_capability_parse(struct wfd_uibc_capability *u, const char *s);
+int wfd_uibc_capability_format(const struct wfd_uibc_capability *u,
+			       char *buf, size_t size);
+
+/* wfd_presentation_URL, empty strings for "none" */
+
+struct wfd_presentation_url {
+	char url0[WFD_URL_MAX];
+	char url1[WFD_URL_MAX];
+};
+
+int wfd_presentation_url_parse(struct wfd_presentation_url *u, const char *s);
+int wfd_presentation_url_format(const struct wfd_presentation_url *u,
+				char *buf, size_t size);
+
+#endif /* WFD_CODEC_H */
@@ -21,6 +21,7 @@
 #include <stdio.h>
 #include <stdint.h>
 #include "ctl.h"
+#include "shl_macro.h"
 
 struct resolution_bitmap {
 	int index;
@@ -168,53 +169,100 @@ void vfd_dump_resolutions(uint32_t cea_mask, uint32_t vesa_mask, uint32_t hh_mas
 	}
 }
 
-int vfd_get_cea_resolution(uint32_t mask, int *hres, int *vres)
-{
-	int i;
+/*
+ * All tables are indexed by their bit number, so a mask maps straight to its
+ * entries; the sentinel is not part of the valid bits.
+ */
+#define VFD_VALID_MASK(_table) \
+	((uint32_t)((1ULL << (SHL_ARRAY_LENGTH(_table) - 1)) - 1))
 
+static int vfd_get_resolution(const struct resolution_bitmap *table,
+			      uint32_t valid, uint32_t mask,
+			      int *hres, int *vres)
+{
+	mask &= valid;
 	if (!mask)
 		return -EINVAL;
 
-	for (i = 0; resolutions_cea[i].hres != 0; i++) {
-		if ((1 << resolutions_cea[i].index) & mask) {
-			*vres = resolutions_cea[i].vres;
-			*hres = resolutions_cea[i].hres;
-			return 0;
-		}
-	}
-	return -EINVAL;
+	table += __builtin_ctz(mask);
+	*vres = table->vres;
+	*hres = table->hres;
+	return 0;
+}
+
+int vfd_get_cea_resolution(uint32_t mask, int *hres, int *vres)
+{
+	return vfd_get_resolution(resolutions_cea,
+				  VFD_VALID_MASK(resolutions_cea),
+				  mask, hres, vres);
 }
 
 int vfd_get_vesa_resolution(uint32_t mask, int *hres, int *vres)
 {
-	int i;
+	return vfd_get_resolution(resolutions_vesa,
+				  VFD_VALID_MASK(resolutions_vesa),
+				  mask, hres, vres);
+}
 
-	if (!mask)
-		return -EINVAL;
+int vfd_get_hh_resolution(uint32_t mask, int *hres, int *vres)
+{
+	return vfd_get_resolution(resolutions_hh,
+				  VFD_VALID_MASK(resolutions_hh),
+				  mask, hres, vres);
+}
 
-	for (i = 0; resolutions_vesa[i].hres != 0; i++) {
-		if ((1 << resolutions_vesa[i].index) & mask) {
-			*vres = resolutions_vesa[i].vres;
-			*hres = resolutions_vesa[i].hres;
-			return 0;
-		}
+static const struct resolution_bitmap *vfd_best_in(const struct resolution_bitmap *table,
+						   uint32_t valid, uint32_t mask,
+						   const struct resolution_bitmap *best)
+{
+	const struct resolution_bitmap *r;
+
+	for (mask &= valid; mask; mask &= mask - 1) {
+		r = &table[__builtin_ctz(mask)];
+		if (best && r->hres * r->vres < best->hres * best->vres)
+			continue;
+		if (best && r->hres * r->vres == best->hres * best->vres &&
+		    r->fps <= best->fps)
+			continue;
+		best = r;
 	}
-	return -EINVAL;
+
+	return best;
 }
 
-int vfd_get_hh_resolution(uint32_t mask, int *hres, int *vres)
+/*
+ * Narrow the three masks down to the single mode with the most pixels,
+ * higher refresh rates winning ties. On equal modes CEA is preferred over
+ * VESA over HH, as that is what TVs tend to handle best.
+ */
+int vfd_select_resolution(uint32_t *cea, uint32_t *vesa, uint32_t *hh,
+			  int *hres, int *vres, int *fps)
 {
-	int i;
+	const struct resolution_bitmap *best;
 
-	if (!mask)
+	best = vfd_best_in(resolutions_cea, VFD_VALID_MASK(resolutions_cea),
+			   *cea, NULL);
+	best = vfd_best_in(resolutions_vesa, VFD_VALID_MASK(resolutions_vesa),
+			   *vesa, best);
+	best = vfd_best_in(resolutions_hh, VFD_VALID_MASK(resolutions_hh),
+			   *hh, best);
+	if (!best)
 		return -EINVAL;
 
-	for (i = 0; resolutions_hh[i].hres != 0; i++) {
-		if ((1 << resolutions_hh[i].index) & mask) {
-			*vres = resolutions_hh[i].vres;
-			*hres = resolutions_hh[i].hres;
-			return 0;
-		}
-	}
-	return -EINVAL;
+	*cea = 0;
+	*vesa = 0;
+	*hh = 0;
+	if (best >= resolutions_cea &&
+	    best < resolutions_cea + SHL_ARRAY_LENGTH(resolutions_cea))
+		*cea = 1 << best->index;
+	else if (best >= resolutions_vesa &&
+		 best < resolutions_vesa + SHL_ARRAY_LENGTH(resolutions_vesa))
+		*vesa = 1 << best->index;
+	else
+		*hh = 1 << best->index;
+
+	*hres = best->hres;
+	*vres = best->vres;
+	*fps = best->fps;
+	return 0;
 }
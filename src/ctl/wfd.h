@@ -25,5 +25,7 @@ void wfd_print_resolutions(char * prefix);
 int vfd_get_cea_resolution(uint32_t mask, int *hres, int *vres);
 int vfd_get_vesa_resolution(uint32_t mask, int *hres, int *vres);
 int vfd_get_hh_resolution(uint32_t mask, int *hres, int *vres);
+int vfd_select_resolution(uint32_t *cea, uint32_t *vesa, uint32_t *hh,
+			  int *hres, int *vres, int *fps);
 
 #endif /* WFD_H */
@@ -156,6 +156,7 @@ static int cmd_show(char **args, unsigned int n)
 		if (l->friendly_name && *l->friendly_name)
 			cli_printf("FriendlyName=%s\n", l->friendly_name);
 		cli_printf("P2PScanning=%d\n", l->p2p_scanning);
+		cli_printf("Streaming=%d\n", l->streaming);
 		if (l->wfd_subelements && *l->wfd_subelements)
 			cli_printf("WfdSubelements=%s\n", l->wfd_subelements);
 		cli_printf("Managed=%d\n", l->managed);
@@ -376,6 +377,15 @@ static int cmd_disconnect(char **args, unsigned int n)
 	return ctl_peer_disconnect(p);
 }
 
+/*
+ * cmd: metrics
+ */
+
+static int cmd_metrics(char **args, unsigned int n)
+{
+	return ctl_wifi_print_metrics(wifi);
+}
+
 /*
  * cmd: quit/exit
  */
@@ -399,6 +409,7 @@ static const struct cli_cmd cli_cmds[] = {
 	{ "p2p-scan",		"[link] [stop]",			CLI_Y,	CLI_LESS,	2,	cmd_p2p_scan,		"Control neighborhood P2P scanning" },
 	{ "connect",		"<peer> [provision] [pin]",		CLI_M,	CLI_LESS,	3,	cmd_connect,		"Connect to peer" },
 	{ "disconnect",		"<peer>",				CLI_M,	CLI_EQUAL,	1,	cmd_disconnect,		"Disconnect from peer" },
+	{ "metrics",		NULL,					CLI_M,	CLI_LESS,	0,	cmd_metrics,		"Dump wifid metrics" },
 	{ "quit",		NULL,					CLI_Y,	CLI_MORE,	0,	cmd_quit,		"Quit program" },
 	{ "exit",		NULL,					CLI_Y,	CLI_MORE,	0,	cmd_quit,		NULL },
 	{ "help",		NULL,					CLI_M,	CLI_MORE,	0,	NULL,			"Print help" },
@@ -473,6 +484,10 @@ void ctl_fn_link_free(struct ctl_link *l)
 			   l->label);
 }
 
+void cli_fn_child_exited(pid_t pid)
+{
+}
+
 void cli_fn_help()
 {
 	/*
@@ -506,6 +521,9 @@ static int ctl_interactive(void)
 	if (r < 0)
 		return r;
 
+	/* start from the cached state, the fetch only pulls a delta */
+	ctl_wifi_load_snapshot(wifi, NULL);
+
 	r = ctl_wifi_fetch(wifi);
 	if (r < 0)
 		goto error;
@@ -528,6 +546,9 @@ static int ctl_single(char **argv, int argc)
 {
 	int r;
 
+	/* start from the cached state, the fetch only pulls a delta */
+	ctl_wifi_load_snapshot(wifi, NULL);
+
 	r = ctl_wifi_fetch(wifi);
 	if (r < 0)
 		return r;
@@ -553,6 +574,7 @@ static int ctl_main(int argc, char *argv[])
 	else
 		r = ctl_single(argv + optind, left);
 
+	ctl_wifi_save_snapshot(wifi, NULL);
 	ctl_wifi_free(wifi);
 	return r;
 }
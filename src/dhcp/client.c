@@ -45,6 +45,9 @@
 #include "gdhcp.h"
 #include "common.h"
 #include "ipv4ll.h"
+#include "loopstat.h"
+#include "probes.h"
+#include "trace.h"
 
 #define DISCOVER_TIMEOUT 5
 #define DISCOVER_RETRIES 6
@@ -2228,6 +2231,7 @@ static void get_request(GDHCPClient *dhcp_client, struct dhcp_packet *packet)
 static gboolean listener_event(GIOChannel *channel, GIOCondition condition,
 							gpointer user_data)
 {
+	LOOPSTAT("dhcp.client_listener");
 	GDHCPClient *dhcp_client = user_data;
 	struct dhcp_packet packet;
 	struct dhcpv6_packet *packet6 = NULL;
@@ -2328,6 +2332,18 @@ static gboolean listener_event(GIOChannel *channel, GIOCondition condition,
 
 	debug(dhcp_client, "received DHCP packet xid 0x%04x "
 			"(current state %d)", xid, dhcp_client->state);
+	MIRACLE_PROBE4(dhcp_client_packet,
+		       message_type ? *message_type : 0, re, xid,
+		       dhcp_client->state);
+
+	if (trace_enabled()) {
+		char detail[64];
+
+		snprintf(detail, sizeof(detail), "type %d xid 0x%08x state %d",
+			 message_type ? *message_type : 0, xid,
+			 dhcp_client->state);
+		trace_instant("dhcp", "client packet", detail);
+	}
 
 	switch (dhcp_client->state) {
 	case INIT_SELECTING:
@@ -0,0 +1,680 @@
+/*
+ * MiracleCast - Wifi-Display/Miracast Implementation
+ *
+ * Copyright (c) 2013-2014 David Herrmann <dh.herrmann@gmail.com>
+ *
+ * MiracleCast is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * MiracleCast is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with MiracleCast; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * DHCP Client/Server Core
+ * The gdhcp client or server for one network device, see dhcp.c for why this
+ * exists at all. Local addresses are configured by invoking the "ip" binary.
+ */
+
+#define LOG_SUBSYSTEM "dhcp"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <glib.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "dhcp.h"
+#include "gdhcp.h"
+#include "shl_log.h"
+#include "trace.h"
+#include "config.h"
+
+struct dhcp {
+	struct dhcp_config c;
+	const char *ip_binary;
+	int ifindex;
+
+	dhcp_msg_fn fn;
+	void *data;
+
+	GDHCPClient *client;
+	char *client_addr;
+
+	GDHCPServer *server;
+	char *server_addr;
+
+	bool lease_traced;
+};
+
+/*
+ * Following messages are passed to the callback:
+ *   sent on local lease:
+ *     L:<addr>   # local iface addr
+ *     S:<addr>   # subnet mask
+ *     D:<addr>   # primary DNS server
+ *     G:<addr>   # primary gateway
+ *   sent on remote lease:
+ *     R:<mac> <addr>   # addr given to remote device
+ */
+static void dhcp_msgf(struct dhcp *d, const char *format, ...)
+{
+	va_list args;
+	char *msg;
+	int r;
+
+	va_start(args, format);
+	r = vasprintf(&msg, format, args);
+	va_end(args);
+	if (r < 0)
+		return log_vENOMEM();
+
+	d->fn(d, msg, d->data);
+	free(msg);
+}
+
+static void dhcp_failed(struct dhcp *d)
+{
+	d->fn(d, NULL, d->data);
+}
+
+/* the client's first lease is traced as a "dhcp" span */
+static void dhcp_trace_lease_end(struct dhcp *d, const char *result)
+{
+	if (!d->lease_traced)
+		return;
+
+	trace_end("dhcp", "lease", (uintptr_t)d, result);
+	d->lease_traced = false;
+}
+
+static int flush_if_addr(struct dhcp *d)
+{
+	char *argv[64];
+	int i, r;
+	pid_t pid, rp;
+	sigset_t mask;
+
+	trace_flush();
+	pid = fork();
+	if (pid < 0) {
+		return log_ERRNO();
+	} else if (!pid) {
+		/* child */
+
+		sigemptyset(&mask);
+		sigprocmask(SIG_SETMASK, &mask, NULL);
+
+		/* redirect stdout to stderr */
+		dup2(2, 1);
+
+		i = 0;
+		argv[i++] = (char*)d->ip_binary;
+		argv[i++] = "addr";
+		argv[i++] = "flush";
+		argv[i++] = "dev";
+		argv[i++] = (char*)d->c.netdev;
+		argv[i] = NULL;
+
+		execve(argv[0], argv, environ);
+		_exit(1);
+	}
+
+	log_info("flushing local if-addr");
+	rp = waitpid(pid, &r, 0);
+	if (rp != pid) {
+		log_error("cannot flush local if-addr via '%s'",
+			  d->ip_binary);
+		return -EFAULT;
+	} else if (!WIFEXITED(r)) {
+		log_error("flushing local if-addr via '%s' failed",
+			  d->ip_binary);
+		return -EFAULT;
+	} else if (WEXITSTATUS(r)) {
+		log_error("flushing local if-addr via '%s' failed with: %d",
+			  d->ip_binary, WEXITSTATUS(r));
+		return -EFAULT;
+	}
+
+	log_debug("successfully flushed local if-addr via %s",
+		  d->ip_binary);
+
+	return 0;
+}
+
+static int add_if_addr(struct dhcp *d, const char *addr)
+{
+	char *argv[64];
+	int i, r;
+	pid_t pid, rp;
+	sigset_t mask;
+
+	trace_flush();
+	pid = fork();
+	if (pid < 0) {
+		return log_ERRNO();
+	} else if (!pid) {
+		/* child */
+
+		sigemptyset(&mask);
+		sigprocmask(SIG_SETMASK, &mask, NULL);
+
+		/* redirect stdout to stderr */
+		dup2(2, 1);
+
+		i = 0;
+		argv[i++] = (char*)d->ip_binary;
+		argv[i++] = "addr";
+		argv[i++] = "add";
+		argv[i++] = (char*)addr;
+		argv[i++] = "dev";
+		argv[i++] = (char*)d->c.netdev;
+		argv[i] = NULL;
+
+		execve(argv[0], argv, environ);
+		_exit(1);
+	}
+
+	log_info("adding local if-addr %s", addr);
+	rp = waitpid(pid, &r, 0);
+	if (rp != pid) {
+		log_error("cannot set local if-addr %s via '%s'",
+			  addr, d->ip_binary);
+		return -EFAULT;
+	} else if (!WIFEXITED(r)) {
+		log_error("setting local if-addr %s via '%s' failed",
+			  addr, d->ip_binary);
+		return -EFAULT;
+	} else if (WEXITSTATUS(r)) {
+		log_error("setting local if-addr %s via '%s' failed with: %d",
+			  addr, d->ip_binary, WEXITSTATUS(r));
+		return -EFAULT;
+	}
+
+	log_debug("successfully set local if-addr %s via %s",
+		  addr, d->ip_binary);
+
+	return 0;
+}
+
+int if_name_to_index(const char *name)
+{
+	struct ifreq ifr;
+	int fd, r;
+
+	if (strlen(name) > sizeof(ifr.ifr_name))
+		return -EINVAL;
+
+	fd = socket(PF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -errno;
+
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, name, sizeof(ifr.ifr_name));
+
+	r = ioctl(fd, SIOCGIFINDEX, &ifr);
+	if (r < 0)
+		r = -errno;
+	else
+		r = ifr.ifr_ifindex;
+
+	close(fd);
+	return r;
+}
+
+static void client_lease_fn(GDHCPClient *client, gpointer data)
+{
+	struct dhcp *d = data;
+	char *addr = NULL, *a, *subnet = NULL, *gateway = NULL, *dns = NULL;
+	GList *l;
+	int r;
+
+	log_info("lease available");
+
+	addr = g_dhcp_client_get_address(client);
+	log_info("lease: address: %s", addr);
+	dhcp_trace_lease_end(d, addr);
+
+	l = g_dhcp_client_get_option(client, G_DHCP_SUBNET);
+	for ( ; l; l = l->next) {
+		subnet = subnet ? : (char*)l->data;
+		log_info("lease: subnet: %s", (char*)l->data);
+	}
+
+	l = g_dhcp_client_get_option(client, G_DHCP_DNS_SERVER);
+	for ( ; l; l = l->next) {
+		dns = dns ? : (char*)l->data;
+		log_info("lease: dns-server: %s", (char*)l->data);
+	}
+
+	l = g_dhcp_client_get_option(client, G_DHCP_ROUTER);
+	for ( ; l; l = l->next) {
+		gateway = gateway ? : (char*)l->data;
+		log_info("lease: router: %s", (char*)l->data);
+	}
+
+	if (!addr) {
+		log_error("lease without IP address");
+		goto error;
+	}
+	if (!subnet) {
+		log_warning("lease without subnet mask, using 24");
+		subnet = "24";
+	}
+
+	r = asprintf(&a, "%s/%s", addr, subnet);
+	if (r < 0) {
+		log_vENOMEM();
+		goto error;
+	}
+
+	if (d->client_addr && !strcmp(d->client_addr, a)) {
+		log_info("given address already set");
+		free(a);
+	} else {
+		free(d->client_addr);
+		d->client_addr = a;
+
+		r = flush_if_addr(d);
+		if (r < 0) {
+			log_error("cannot flush addr on local interface %s",
+				  d->c.netdev);
+			goto error;
+		}
+
+		r = add_if_addr(d, d->client_addr);
+		if (r < 0) {
+			log_error("cannot set parameters on local interface %s",
+				  d->c.netdev);
+			goto error;
+		}
+
+		dhcp_msgf(d, "L:%s", addr);
+		dhcp_msgf(d, "S:%s", subnet);
+		if (dns)
+			dhcp_msgf(d, "D:%s", dns);
+		if (gateway)
+			dhcp_msgf(d, "G:%s", gateway);
+	}
+
+	g_free(addr);
+	return;
+
+error:
+	g_free(addr);
+	dhcp_failed(d);
+}
+
+static void client_no_lease_fn(GDHCPClient *client, gpointer data)
+{
+	struct dhcp *d = data;
+
+	log_error("no lease available");
+	dhcp_trace_lease_end(d, "no lease");
+	dhcp_failed(d);
+}
+
+static void server_log_fn(const char *str, void *data)
+{
+	log_format(NULL, 0, NULL, "gdhcp", LOG_DEBUG, "%s", str);
+}
+
+static void server_event_fn(const char *mac, const char *lease, void *data)
+{
+	struct dhcp *d = data;
+
+	log_debug("remote lease: %s %s", mac, lease);
+	trace_instant("dhcp", "remote lease", mac);
+	dhcp_msgf(d, "R:%s %s", mac, lease);
+}
+
+void dhcp_free(struct dhcp *d)
+{
+	if (!d)
+		return;
+
+	dhcp_trace_lease_end(d, "stopped");
+
+	if (!d->c.server) {
+		if (d->client) {
+			g_dhcp_client_stop(d->client);
+
+			if (d->client_addr) {
+				flush_if_addr(d);
+				free(d->client_addr);
+			}
+
+			g_dhcp_client_unref(d->client);
+		}
+	} else {
+		if (d->server) {
+			g_dhcp_server_stop(d->server);
+
+			g_dhcp_server_unref(d->server);
+		}
+
+		if (d->server_addr) {
+			flush_if_addr(d);
+			free(d->server_addr);
+		}
+	}
+
+	free(d);
+}
+
+int dhcp_new(struct dhcp **out,
+	     const struct dhcp_config *c,
+	     dhcp_msg_fn fn,
+	     void *data)
+{
+	GDHCPClientError cerr;
+	GDHCPServerError serr;
+	struct dhcp *d;
+	int r;
+
+	if (!out || !c || !c->netdev || !fn)
+		return log_EINVAL();
+
+	d = calloc(1, sizeof(*d));
+	if (!d)
+		return log_ENOMEM();
+
+	d->c = *c;
+	d->ip_binary = c->ip_binary ? : "/bin/ip";
+	d->fn = fn;
+	d->data = data;
+
+	if (geteuid())
+		log_warning("not running as uid=0, dhcp might not work");
+
+	d->ifindex = if_name_to_index(d->c.netdev);
+	if (d->ifindex < 0) {
+		r = -EINVAL;
+		log_error("cannot find interface %s (%d)",
+			  d->c.netdev, d->ifindex);
+		goto error;
+	}
+
+	if (!d->c.server) {
+		d->client = g_dhcp_client_new(G_DHCP_IPV4, d->ifindex,
+					      &cerr);
+		if (!d->client) {
+			r = -EINVAL;
+
+			switch (cerr) {
+			case G_DHCP_CLIENT_ERROR_INTERFACE_UNAVAILABLE:
+				log_error("cannot create GDHCP client: interface %s unavailable",
+					  d->c.netdev);
+				break;
+			case G_DHCP_CLIENT_ERROR_INTERFACE_IN_USE:
+				log_error("cannot create GDHCP client: interface %s in use",
+					  d->c.netdev);
+				break;
+			case G_DHCP_CLIENT_ERROR_INTERFACE_DOWN:
+				log_error("cannot create GDHCP client: interface %s down",
+					  d->c.netdev);
+				break;
+			case G_DHCP_CLIENT_ERROR_NOMEM:
+				r = log_ENOMEM();
+				break;
+			case G_DHCP_CLIENT_ERROR_INVALID_INDEX:
+				log_error("cannot create GDHCP client: invalid interface %s",
+					  d->c.netdev);
+				break;
+			case G_DHCP_CLIENT_ERROR_INVALID_OPTION:
+				log_error("cannot create GDHCP client: invalid options");
+				break;
+			default:
+				log_error("cannot create GDHCP client (%d)",
+					  cerr);
+				break;
+			}
+
+			goto error;
+		}
+
+		g_dhcp_client_set_send(d->client, G_DHCP_HOST_NAME,
+				       "<hostname>");
+
+		g_dhcp_client_set_request(d->client, G_DHCP_SUBNET);
+		g_dhcp_client_set_request(d->client, G_DHCP_DNS_SERVER);
+		g_dhcp_client_set_request(d->client, G_DHCP_ROUTER);
+
+		g_dhcp_client_register_event(d->client,
+					     G_DHCP_CLIENT_EVENT_LEASE_AVAILABLE,
+					     client_lease_fn, d);
+		g_dhcp_client_register_event(d->client,
+					     G_DHCP_CLIENT_EVENT_NO_LEASE,
+					     client_no_lease_fn, d);
+	} else {
+		r = asprintf(&d->server_addr, "%s/%s",
+			     d->c.local, d->c.subnet);
+		if (r < 0) {
+			r = log_ENOMEM();
+			goto error;
+		}
+
+		r = flush_if_addr(d);
+		if (r < 0) {
+			log_error("cannot flush addr on local interface %s",
+				  d->c.netdev);
+			goto error;
+		}
+
+		r = add_if_addr(d, d->server_addr);
+		if (r < 0) {
+			log_error("cannot set parameters on local interface %s",
+				  d->c.netdev);
+			goto error;
+		}
+
+		d->server = g_dhcp_server_new(G_DHCP_IPV4, d->ifindex,
+					      &serr, server_event_fn, d);
+		if (!d->server) {
+			r = -EINVAL;
+
+			switch(serr) {
+			case G_DHCP_SERVER_ERROR_INTERFACE_UNAVAILABLE:
+				log_error("cannot create GDHCP server: interface %s unavailable",
+					  d->c.netdev);
+				break;
+			case G_DHCP_SERVER_ERROR_INTERFACE_IN_USE:
+				log_error("cannot create GDHCP server: interface %s in use",
+					  d->c.netdev);
+				break;
+			case G_DHCP_SERVER_ERROR_INTERFACE_DOWN:
+				log_error("cannot create GDHCP server: interface %s down",
+					  d->c.netdev);
+				break;
+			case G_DHCP_SERVER_ERROR_NOMEM:
+				r = log_ENOMEM();
+				break;
+			case G_DHCP_SERVER_ERROR_INVALID_INDEX:
+				log_error("cannot create GDHCP server: invalid interface %s",
+					  d->c.netdev);
+				break;
+			case G_DHCP_SERVER_ERROR_INVALID_OPTION:
+				log_error("cannot create GDHCP server: invalid options");
+				break;
+			case G_DHCP_SERVER_ERROR_IP_ADDRESS_INVALID:
+				log_error("cannot create GDHCP server: invalid ip address");
+				break;
+			default:
+				log_error("cannot create GDHCP server (%d)",
+					  serr);
+				break;
+			}
+
+			goto error;
+		}
+
+		g_dhcp_server_set_debug(d->server, server_log_fn, NULL);
+		g_dhcp_server_set_lease_time(d->server, 60 * 60);
+
+		r = g_dhcp_server_set_option(d->server, G_DHCP_SUBNET,
+					     d->c.subnet);
+		if (r != 0) {
+			log_vERR(r);
+			goto error;
+		}
+
+		r = g_dhcp_server_set_option(d->server, G_DHCP_ROUTER,
+					     d->c.gateway);
+		if (r != 0) {
+			log_vERR(r);
+			goto error;
+		}
+
+		r = g_dhcp_server_set_option(d->server, G_DHCP_DNS_SERVER,
+					     d->c.dns);
+		if (r != 0) {
+			log_vERR(r);
+			goto error;
+		}
+
+		r = g_dhcp_server_set_ip_range(d->server, d->c.from, d->c.to);
+		if (r != 0) {
+			log_vERR(r);
+			goto error;
+		}
+	}
+
+	*out = d;
+	return 0;
+
+error:
+	dhcp_free(d);
+	return r;
+}
+
+int dhcp_start(struct dhcp *d)
+{
+	int r;
+
+	if (!d->c.server) {
+		log_info("running dhcp client on %s via '%s'",
+			 d->c.netdev, d->ip_binary);
+
+		r = g_dhcp_client_start(d->client, NULL);
+		if (r != 0) {
+			log_error("cannot start DHCP client: %d", r);
+			return -EFAULT;
+		}
+
+		if (trace_enabled()) {
+			trace_begin("dhcp", "lease", (uintptr_t)d, d->c.netdev);
+			d->lease_traced = true;
+		}
+	} else {
+		log_info("running dhcp server on %s via '%s'",
+			 d->c.netdev, d->ip_binary);
+
+		r = g_dhcp_server_start(d->server);
+		if (r != 0) {
+			log_error("cannot start DHCP server: %d", r);
+			return -EFAULT;
+		}
+
+		dhcp_msgf(d, "L:%s", d->c.local);
+	}
+
+	return 0;
+}
+
+static int make_address(char *buf, const char *prefix, const char *suffix,
+			const char *name)
+{
+	int r;
+	struct in_addr addr;
+
+	if (!prefix)
+		prefix = "192.168.77";
+
+	r = snprintf(buf, INET_ADDRSTRLEN, "%s.%s", prefix, suffix);
+	if (r >= INET_ADDRSTRLEN)
+		goto error;
+
+	r = inet_pton(AF_INET, buf, &addr);
+	if (r != 1)
+		goto error;
+
+	inet_ntop(AF_INET, &addr, buf, INET_ADDRSTRLEN);
+	buf[INET_ADDRSTRLEN - 1] = 0;
+	return 0;
+
+error:
+	log_error("Invalid address --%s=%s.%s (prefix: %s suffix: %s)",
+		  name, prefix, suffix, prefix, suffix);
+	return -EINVAL;
+}
+
+static int make_subnet(char *buf, const char *subnet)
+{
+	int r;
+	struct in_addr addr;
+
+	r = inet_pton(AF_INET, subnet, &addr);
+	if (r != 1)
+		goto error;
+
+	inet_ntop(AF_INET, &addr, buf, INET_ADDRSTRLEN);
+	buf[INET_ADDRSTRLEN - 1] = 0;
+	return 0;
+
+error:
+	log_error("Invalid address --subnet=%s", subnet);
+	return -EINVAL;
+}
+
+/* NULL picks the default for any of the arguments */
+int dhcp_config_server(struct dhcp_config *c,
+		       const char *prefix,
+		       const char *local,
+		       const char *gateway,
+		       const char *dns,
+		       const char *subnet,
+		       const char *from,
+		       const char *to)
+{
+	int r;
+
+	c->server = true;
+
+	r = make_address(c->local, prefix, local ? : "1", "local");
+	if (r < 0)
+		return r;
+	r = make_address(c->gateway, prefix, gateway ? : "1", "gateway");
+	if (r < 0)
+		return r;
+	r = make_address(c->dns, prefix, dns ? : "1", "dns");
+	if (r < 0)
+		return r;
+	r = make_subnet(c->subnet, subnet ? : "255.255.255.0");
+	if (r < 0)
+		return r;
+	r = make_address(c->from, prefix, from ? : "100", "from");
+	if (r < 0)
+		return r;
+	r = make_address(c->to, prefix, to ? : "199", "to");
+	if (r < 0)
+		return r;
+
+	return 0;
+}
@@ -44,65 +44,39 @@
 
 #define LOG_SUBSYSTEM "dhcp"
 
-#include <arpa/inet.h>
 #include <errno.h>
-#include <fcntl.h>
 #include <getopt.h>
 #include <glib.h>
-#include <net/if.h>
-#include <netinet/in.h>
-#include <netinet/udp.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/epoll.h>
-#include <sys/ioctl.h>
 #include <sys/signalfd.h>
 #include <sys/socket.h>
-#include <sys/wait.h>
 #include <unistd.h>
-#include "gdhcp.h"
+#include "dhcp.h"
+#include "loopstat.h"
 #include "shl_log.h"
+#include "trace.h"
 #include "config.h"
 
-static const char *arg_netdev;
-static const char *arg_ip_binary = "/bin/ip";
-static bool arg_server;
-static char arg_local[INET_ADDRSTRLEN];
-static char arg_gateway[INET_ADDRSTRLEN];
-static char arg_dns[INET_ADDRSTRLEN];
-static char arg_subnet[INET_ADDRSTRLEN];
-static char arg_from[INET_ADDRSTRLEN];
-static char arg_to[INET_ADDRSTRLEN];
+static struct dhcp_config arg_config;
 static int arg_comm = -1;
 
 struct manager {
-	int ifindex;
 	GMainLoop *loop;
 
 	int sfd;
 	GIOChannel *sfd_chan;
 	guint sfd_id;
 
-	GDHCPClient *client;
-	char *client_addr;
-
-	GDHCPServer *server;
-	char *server_addr;
+	struct dhcp *dhcp;
 };
 
 /*
- * We send prefixed messages via @comm. You should use a packet-based
- * socket-type so boundaries are preserved. Following packets are sent:
- *   sent on local lease:
- *     L:<addr>   # local iface addr
- *     S:<addr>   # subnet mask
- *     D:<addr>   # primary DNS server
- *     G:<addr>   # primary gateway
- *   sent on remote lease:
- *     R:<mac> <addr>   # addr given to remote device
+ * We forward the DHCP messages (see dhcp-core.c) via @comm. You should use a
+ * packet-based socket-type so boundaries are preserved.
  */
 static void write_comm(const void *msg, size_t size)
 {
@@ -120,262 +94,26 @@ static void write_comm(const void *msg, size_t size)
 	}
 }
 
-static void writef_comm(const void *format, ...)
-{
-	va_list args;
-	char *msg;
-	int r;
-
-	va_start(args, format);
-	r = vasprintf(&msg, format, args);
-	va_end(args);
-	if (r < 0)
-		return log_vENOMEM();
-
-	write_comm(msg, r);
-	free(msg);
-}
-
-static int flush_if_addr(void)
-{
-	char *argv[64];
-	int i, r;
-	pid_t pid, rp;
-	sigset_t mask;
-
-	pid = fork();
-	if (pid < 0) {
-		return log_ERRNO();
-	} else if (!pid) {
-		/* child */
-
-		sigemptyset(&mask);
-		sigprocmask(SIG_SETMASK, &mask, NULL);
-
-		/* redirect stdout to stderr */
-		dup2(2, 1);
-
-		i = 0;
-		argv[i++] = (char*)arg_ip_binary;
-		argv[i++] = "addr";
-		argv[i++] = "flush";
-		argv[i++] = "dev";
-		argv[i++] = (char*)arg_netdev;
-		argv[i] = NULL;
-
-		execve(argv[0], argv, environ);
-		_exit(1);
-	}
-
-	log_info("flushing local if-addr");
-	rp = waitpid(pid, &r, 0);
-	if (rp != pid) {
-		log_error("cannot flush local if-addr via '%s'",
-			  arg_ip_binary);
-		return -EFAULT;
-	} else if (!WIFEXITED(r)) {
-		log_error("flushing local if-addr via '%s' failed",
-			  arg_ip_binary);
-		return -EFAULT;
-	} else if (WEXITSTATUS(r)) {
-		log_error("flushing local if-addr via '%s' failed with: %d",
-			  arg_ip_binary, WEXITSTATUS(r));
-		return -EFAULT;
-	}
-
-	log_debug("successfully flushed local if-addr via %s",
-		  arg_ip_binary);
-
-	return 0;
-}
-
-static int add_if_addr(const char *addr)
-{
-	char *argv[64];
-	int i, r;
-	pid_t pid, rp;
-	sigset_t mask;
-
-	pid = fork();
-	if (pid < 0) {
-		return log_ERRNO();
-	} else if (!pid) {
-		/* child */
-
-		sigemptyset(&mask);
-		sigprocmask(SIG_SETMASK, &mask, NULL);
-
-		/* redirect stdout to stderr */
-		dup2(2, 1);
-
-		i = 0;
-		argv[i++] = (char*)arg_ip_binary;
-		argv[i++] = "addr";
-		argv[i++] = "add";
-		argv[i++] = (char*)addr;
-		argv[i++] = "dev";
-		argv[i++] = (char*)arg_netdev;
-		argv[i] = NULL;
-
-		execve(argv[0], argv, environ);
-		_exit(1);
-	}
-
-	log_info("adding local if-addr %s", addr);
-	rp = waitpid(pid, &r, 0);
-	if (rp != pid) {
-		log_error("cannot set local if-addr %s via '%s'",
-			  addr, arg_ip_binary);
-		return -EFAULT;
-	} else if (!WIFEXITED(r)) {
-		log_error("setting local if-addr %s via '%s' failed",
-			  addr, arg_ip_binary);
-		return -EFAULT;
-	} else if (WEXITSTATUS(r)) {
-		log_error("setting local if-addr %s via '%s' failed with: %d",
-			  addr, arg_ip_binary, WEXITSTATUS(r));
-		return -EFAULT;
-	}
-
-	log_debug("successfully set local if-addr %s via %s",
-		  addr, arg_ip_binary);
-
-	return 0;
-}
-
-int if_name_to_index(const char *name)
-{
-	struct ifreq ifr;
-	int fd, r;
-
-	if (strlen(name) > sizeof(ifr.ifr_name))
-		return -EINVAL;
-
-	fd = socket(PF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
-	if (fd < 0)
-		return -errno;
-
-	memset(&ifr, 0, sizeof(ifr));
-	strncpy(ifr.ifr_name, name, sizeof(ifr.ifr_name));
-
-	r = ioctl(fd, SIOCGIFINDEX, &ifr);
-	if (r < 0)
-		r = -errno;
-	else
-		r = ifr.ifr_ifindex;
-
-	close(fd);
-	return r;
-}
-
-static void sig_dummy(int sig)
-{
-}
-
-static void client_lease_fn(GDHCPClient *client, gpointer data)
+static void manager_dhcp_fn(struct dhcp *d, const char *msg, void *data)
 {
 	struct manager *m = data;
-	char *addr = NULL, *a, *subnet = NULL, *gateway = NULL, *dns = NULL;
-	GList *l;
-	int r;
-
-	log_info("lease available");
-
-	addr = g_dhcp_client_get_address(client);
-	log_info("lease: address: %s", addr);
-
-	l = g_dhcp_client_get_option(client, G_DHCP_SUBNET);
-	for ( ; l; l = l->next) {
-		subnet = subnet ? : (char*)l->data;
-		log_info("lease: subnet: %s", (char*)l->data);
-	}
-
-	l = g_dhcp_client_get_option(client, G_DHCP_DNS_SERVER);
-	for ( ; l; l = l->next) {
-		dns = dns ? : (char*)l->data;
-		log_info("lease: dns-server: %s", (char*)l->data);
-	}
-
-	l = g_dhcp_client_get_option(client, G_DHCP_ROUTER);
-	for ( ; l; l = l->next) {
-		gateway = gateway ? : (char*)l->data;
-		log_info("lease: router: %s", (char*)l->data);
-	}
-
-	if (!addr) {
-		log_error("lease without IP address");
-		goto error;
-	}
-	if (!subnet) {
-		log_warning("lease without subnet mask, using 24");
-		subnet = "24";
-	}
-
-	r = asprintf(&a, "%s/%s", addr, subnet);
-	if (r < 0) {
-		log_vENOMEM();
-		goto error;
-	}
-
-	if (m->client_addr && !strcmp(m->client_addr, a)) {
-		log_info("given address already set");
-		free(a);
-	} else {
-		free(m->client_addr);
-		m->client_addr = a;
-
-		r = flush_if_addr();
-		if (r < 0) {
-			log_error("cannot flush addr on local interface %s",
-				  arg_netdev);
-			goto error;
-		}
-
-		r = add_if_addr(m->client_addr);
-		if (r < 0) {
-			log_error("cannot set parameters on local interface %s",
-				  arg_netdev);
-			goto error;
-		}
 
-		writef_comm("L:%s", addr);
-		writef_comm("S:%s", subnet);
-		if (dns)
-			writef_comm("D:%s", dns);
-		if (gateway)
-			writef_comm("G:%s", gateway);
+	if (!msg) {
+		g_main_loop_quit(m->loop);
+		return;
 	}
 
-	g_free(addr);
-	return;
-
-error:
-	g_free(addr);
-	g_main_loop_quit(m->loop);
+	write_comm(msg, strlen(msg));
 }
 
-static void client_no_lease_fn(GDHCPClient *client, gpointer data)
-{
-	struct manager *m = data;
-
-	log_error("no lease available");
-	g_main_loop_quit(m->loop);
-}
-
-static void server_log_fn(const char *str, void *data)
-{
-	log_format(NULL, 0, NULL, "gdhcp", LOG_DEBUG, "%s", str);
-}
-
-static void server_event_fn(const char *mac, const char *lease, void *data)
+static void sig_dummy(int sig)
 {
-	log_debug("remote lease: %s %s", mac, lease);
-	writef_comm("R:%s %s", mac, lease);
 }
 
 static gboolean manager_signal_fn(GIOChannel *chan, GIOCondition mask,
 				  gpointer data)
 {
+	LOOPSTAT("dhcp.signal");
 	struct manager *m = data;
 	ssize_t l;
 	struct signalfd_siginfo info;
@@ -408,29 +146,7 @@ static void manager_free(struct manager *m)
 	if (!m)
 		return;
 
-	if (!arg_server) {
-		if (m->client) {
-			g_dhcp_client_stop(m->client);
-
-			if (m->client_addr) {
-				flush_if_addr();
-				free(m->client_addr);
-			}
-
-			g_dhcp_client_unref(m->client);
-		}
-	} else {
-		if (m->server) {
-			g_dhcp_server_stop(m->server);
-
-			g_dhcp_server_unref(m->server);
-		}
-
-		if (m->server_addr) {
-			flush_if_addr();
-			free(m->server_addr);
-		}
-	}
+	dhcp_free(m->dhcp);
 
 	if (m->sfd >= 0) {
 		g_source_remove(m->sfd_id);
@@ -457,8 +173,6 @@ static int manager_new(struct manager **out)
 	int r, i;
 	sigset_t mask;
 	struct sigaction sig;
-	GDHCPClientError cerr;
-	GDHCPServerError serr;
 	struct manager *m;
 
 	m = calloc(1, sizeof(*m));
@@ -467,17 +181,6 @@ static int manager_new(struct manager **out)
 
 	m->sfd = -1;
 
-	if (geteuid())
-		log_warning("not running as uid=0, dhcp might not work");
-
-	m->ifindex = if_name_to_index(arg_netdev);
-	if (m->ifindex < 0) {
-		r = -EINVAL;
-		log_error("cannot find interface %s (%d)",
-			  arg_netdev, m->ifindex);
-		goto error;
-	}
-
 	m->loop = g_main_loop_new(NULL, FALSE);
 
 	sigemptyset(&mask);
@@ -512,148 +215,9 @@ static int manager_new(struct manager **out)
 				   manager_signal_fn,
 				   m);
 
-	if (!arg_server) {
-		m->client = g_dhcp_client_new(G_DHCP_IPV4, m->ifindex,
-					      &cerr);
-		if (!m->client) {
-			r = -EINVAL;
-
-			switch (cerr) {
-			case G_DHCP_CLIENT_ERROR_INTERFACE_UNAVAILABLE:
-				log_error("cannot create GDHCP client: interface %s unavailable",
-					  arg_netdev);
-				break;
-			case G_DHCP_CLIENT_ERROR_INTERFACE_IN_USE:
-				log_error("cannot create GDHCP client: interface %s in use",
-					  arg_netdev);
-				break;
-			case G_DHCP_CLIENT_ERROR_INTERFACE_DOWN:
-				log_error("cannot create GDHCP client: interface %s down",
-					  arg_netdev);
-				break;
-			case G_DHCP_CLIENT_ERROR_NOMEM:
-				r = log_ENOMEM();
-				break;
-			case G_DHCP_CLIENT_ERROR_INVALID_INDEX:
-				log_error("cannot create GDHCP client: invalid interface %s",
-					  arg_netdev);
-				break;
-			case G_DHCP_CLIENT_ERROR_INVALID_OPTION:
-				log_error("cannot create GDHCP client: invalid options");
-				break;
-			default:
-				log_error("cannot create GDHCP client (%d)",
-					  cerr);
-				break;
-			}
-
-			goto error;
-		}
-
-		g_dhcp_client_set_send(m->client, G_DHCP_HOST_NAME,
-				       "<hostname>");
-
-		g_dhcp_client_set_request(m->client, G_DHCP_SUBNET);
-		g_dhcp_client_set_request(m->client, G_DHCP_DNS_SERVER);
-		g_dhcp_client_set_request(m->client, G_DHCP_ROUTER);
-
-		g_dhcp_client_register_event(m->client,
-					     G_DHCP_CLIENT_EVENT_LEASE_AVAILABLE,
-					     client_lease_fn, m);
-		g_dhcp_client_register_event(m->client,
-					     G_DHCP_CLIENT_EVENT_NO_LEASE,
-					     client_no_lease_fn, m);
-	} else {
-		r = asprintf(&m->server_addr, "%s/%s", arg_local, arg_subnet);
-		if (r < 0) {
-			r = log_ENOMEM();
-			goto error;
-		}
-
-		r = flush_if_addr();
-		if (r < 0) {
-			log_error("cannot flush addr on local interface %s",
-				  arg_netdev);
-			goto error;
-		}
-
-		r = add_if_addr(m->server_addr);
-		if (r < 0) {
-			log_error("cannot set parameters on local interface %s",
-				  arg_netdev);
-			goto error;
-		}
-
-		m->server = g_dhcp_server_new(G_DHCP_IPV4, m->ifindex,
-					      &serr, server_event_fn, m);
-		if (!m->server) {
-			r = -EINVAL;
-
-			switch(serr) {
-			case G_DHCP_SERVER_ERROR_INTERFACE_UNAVAILABLE:
-				log_error("cannot create GDHCP server: interface %s unavailable",
-					  arg_netdev);
-				break;
-			case G_DHCP_SERVER_ERROR_INTERFACE_IN_USE:
-				log_error("cannot create GDHCP server: interface %s in use",
-					  arg_netdev);
-				break;
-			case G_DHCP_SERVER_ERROR_INTERFACE_DOWN:
-				log_error("cannot create GDHCP server: interface %s down",
-					  arg_netdev);
-				break;
-			case G_DHCP_SERVER_ERROR_NOMEM:
-				r = log_ENOMEM();
-				break;
-			case G_DHCP_SERVER_ERROR_INVALID_INDEX:
-				log_error("cannot create GDHCP server: invalid interface %s",
-					  arg_netdev);
-				break;
-			case G_DHCP_SERVER_ERROR_INVALID_OPTION:
-				log_error("cannot create GDHCP server: invalid options");
-				break;
-			case G_DHCP_SERVER_ERROR_IP_ADDRESS_INVALID:
-				log_error("cannot create GDHCP server: invalid ip address");
-				break;
-			default:
-				log_error("cannot create GDHCP server (%d)",
-					  serr);
-				break;
-			}
-
-			goto error;
-		}
-
-		g_dhcp_server_set_debug(m->server, server_log_fn, NULL);
-		g_dhcp_server_set_lease_time(m->server, 60 * 60);
-
-		r = g_dhcp_server_set_option(m->server, G_DHCP_SUBNET,
-					     arg_subnet);
-		if (r != 0) {
-			log_vERR(r);
-			goto error;
-		}
-
-		r = g_dhcp_server_set_option(m->server, G_DHCP_ROUTER,
-					     arg_gateway);
-		if (r != 0) {
-			log_vERR(r);
-			goto error;
-		}
-
-		r = g_dhcp_server_set_option(m->server, G_DHCP_DNS_SERVER,
-					     arg_dns);
-		if (r != 0) {
-			log_vERR(r);
-			goto error;
-		}
-
-		r = g_dhcp_server_set_ip_range(m->server, arg_from, arg_to);
-		if (r != 0) {
-			log_vERR(r);
-			goto error;
-		}
-	}
+	r = dhcp_new(&m->dhcp, &arg_config, manager_dhcp_fn, m);
+	if (r < 0)
+		goto error;
 
 	*out = m;
 	return 0;
@@ -667,78 +231,15 @@ static int manager_run(struct manager *m)
 {
 	int r;
 
-	if (!arg_server) {
-		log_info("running dhcp client on %s via '%s'",
-			 arg_netdev, arg_ip_binary);
-
-		r = g_dhcp_client_start(m->client, NULL);
-		if (r != 0) {
-			log_error("cannot start DHCP client: %d", r);
-			return -EFAULT;
-		}
-	} else {
-		log_info("running dhcp server on %s via '%s'",
-			 arg_netdev, arg_ip_binary);
-
-		r = g_dhcp_server_start(m->server);
-		if (r != 0) {
-			log_error("cannot start DHCP server: %d", r);
-			return -EFAULT;
-		}
-
-		writef_comm("L:%s", arg_local);
-	}
+	r = dhcp_start(m->dhcp);
+	if (r < 0)
+		return r;
 
 	g_main_loop_run(m->loop);
 
 	return 0;
 }
 
-static int make_address(char *buf, const char *prefix, const char *suffix,
-			const char *name)
-{
-	int r;
-	struct in_addr addr;
-
-	if (!prefix)
-		prefix = "192.168.77";
-
-	r = snprintf(buf, INET_ADDRSTRLEN, "%s.%s", prefix, suffix);
-	if (r >= INET_ADDRSTRLEN)
-		goto error;
-
-	r = inet_pton(AF_INET, buf, &addr);
-	if (r != 1)
-		goto error;
-
-	inet_ntop(AF_INET, &addr, buf, INET_ADDRSTRLEN);
-	buf[INET_ADDRSTRLEN - 1] = 0;
-	return 0;
-
-error:
-	log_error("Invalid address --%s=%s.%s (prefix: %s suffix: %s)",
-		  name, prefix, suffix, prefix, suffix);
-	return -EINVAL;
-}
-
-static int make_subnet(char *buf, const char *subnet)
-{
-	int r;
-	struct in_addr addr;
-
-	r = inet_pton(AF_INET, subnet, &addr);
-	if (r != 1)
-		goto error;
-
-	inet_ntop(AF_INET, &addr, buf, INET_ADDRSTRLEN);
-	buf[INET_ADDRSTRLEN - 1] = 0;
-	return 0;
-
-error:
-	log_error("Invalid address --subnet=%s", subnet);
-	return -EINVAL;
-}
-
 static int help(void)
 {
 	printf("%s [OPTIONS...] ...\n\n"
@@ -824,17 +325,17 @@ static int parse_argv(int argc, char *argv[])
 			log_init_time();
 			break;
 		case ARG_NETDEV:
-			arg_netdev = optarg;
+			arg_config.netdev = optarg;
 			break;
 		case ARG_IP_BINARY:
-			arg_ip_binary = optarg;
+			arg_config.ip_binary = optarg;
 			break;
 		case ARG_COMM_FD:
 			arg_comm = atoi(optarg);
 			break;
 
 		case ARG_SERVER:
-			arg_server = true;
+			arg_config.server = true;
 			break;
 		case ARG_PREFIX:
 			prefix = optarg;
@@ -868,41 +369,29 @@ static int parse_argv(int argc, char *argv[])
 		return -EINVAL;
 	}
 
-	if (!arg_netdev) {
+	if (!arg_config.netdev) {
 		log_error("no network-device given (see --help for --netdev)");
 		return -EINVAL;
 	}
 
-	if (access(arg_ip_binary, X_OK) < 0) {
+	if (!arg_config.ip_binary)
+		arg_config.ip_binary = "/bin/ip";
+
+	if (access(arg_config.ip_binary, X_OK) < 0) {
 		log_error("execution of ip-binary (%s) not allowed: %m",
-			  arg_ip_binary);
+			  arg_config.ip_binary);
 		return -EINVAL;
 	}
 
-	if (!arg_server) {
+	if (!arg_config.server) {
 		if (prefix || local || gateway ||
 		    dns || subnet || from || to) {
 			log_error("server option given, but running as client");
 			return -EINVAL;
 		}
 	} else {
-		r = make_address(arg_local, prefix, local ? : "1", "local");
-		if (r < 0)
-			return -EINVAL;
-		r = make_address(arg_gateway, prefix, gateway ? : "1",
-				 "gateway");
-		if (r < 0)
-			return -EINVAL;
-		r = make_address(arg_dns, prefix, dns ? : "1", "dns");
-		if (r < 0)
-			return -EINVAL;
-		r = make_subnet(arg_subnet, subnet ? : "255.255.255.0");
-		if (r < 0)
-			return -EINVAL;
-		r = make_address(arg_from, prefix, from ? : "100", "from");
-		if (r < 0)
-			return -EINVAL;
-		r = make_address(arg_to, prefix, to ? : "199", "to");
+		r = dhcp_config_server(&arg_config, prefix, local, gateway,
+				       dns, subnet, from, to);
 		if (r < 0)
 			return -EINVAL;
 	}
@@ -925,6 +414,8 @@ int main(int argc, char **argv)
 	if (!r)
 		return EXIT_SUCCESS;
 
+	trace_init("miracle-dhcp");
+
 	r = manager_new(&m);
 	if (r < 0)
 		goto finish;
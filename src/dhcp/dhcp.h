@@ -0,0 +1,74 @@
+/*
+ * MiracleCast - Wifi-Display/Miracast Implementation
+ *
+ * Copyright (c) 2013-2014 David Herrmann <dh.herrmann@gmail.com>
+ *
+ * MiracleCast is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * MiracleCast is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with MiracleCast; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * DHCP Client/Server
+ * One client or server on one network device, run from the default GLib main
+ * context. miracle-dhcp wraps a single one in its own process and forwards
+ * the messages over --comm-fd; miracled runs them in-process.
+ */
+
+#ifndef DHCP_H
+#define DHCP_H
+
+#include <netinet/in.h>
+#include <stdbool.h>
+
+struct dhcp;
+
+struct dhcp_config {
+	const char *netdev;
+	const char *ip_binary;		/* NULL for /bin/ip */
+	bool server;
+
+	/* server only, see dhcp_config_server() */
+	char local[INET_ADDRSTRLEN];
+	char gateway[INET_ADDRSTRLEN];
+	char dns[INET_ADDRSTRLEN];
+	char subnet[INET_ADDRSTRLEN];
+	char from[INET_ADDRSTRLEN];
+	char to[INET_ADDRSTRLEN];
+};
+
+/*
+ * Called with the "X:<value>" messages documented in dhcp-core.c, and once
+ * with @msg == NULL if the client or server gave up. Do not free @d from
+ * within the callback.
+ */
+typedef void (*dhcp_msg_fn) (struct dhcp *d, const char *msg, void *data);
+
+int dhcp_config_server(struct dhcp_config *c,
+		       const char *prefix,
+		       const char *local,
+		       const char *gateway,
+		       const char *dns,
+		       const char *subnet,
+		       const char *from,
+		       const char *to);
+
+int dhcp_new(struct dhcp **out,
+	     const struct dhcp_config *c,
+	     dhcp_msg_fn fn,
+	     void *data);
+void dhcp_free(struct dhcp *d);
+int dhcp_start(struct dhcp *d);
+
+int if_name_to_index(const char *name);
+
+#endif /* DHCP_H */
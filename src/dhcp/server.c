@@ -42,6 +42,9 @@
 #include <glib.h>
 
 #include "common.h"
+#include "loopstat.h"
+#include "probes.h"
+#include "trace.h"
 
 /* 8 hours */
 #define DEFAULT_DHCP_LEASE_SEC (8*60*60)
@@ -653,6 +656,7 @@ static void send_inform(GDHCPServer *dhcp_server,
 static gboolean listener_event(GIOChannel *channel, GIOCondition condition,
 							gpointer user_data)
 {
+	LOOPSTAT("dhcp.server_listener");
 	GDHCPServer *dhcp_server = user_data;
 	struct dhcp_packet packet;
 	struct dhcp_lease *lease;
@@ -673,6 +677,16 @@ static gboolean listener_event(GIOChannel *channel, GIOCondition condition,
 	if (type == 0)
 		return TRUE;
 
+	MIRACLE_PROBE3(dhcp_server_packet, type, re, packet.xid);
+
+	if (trace_enabled()) {
+		char detail[48];
+
+		snprintf(detail, sizeof(detail), "type %d xid 0x%08x",
+			 type, packet.xid);
+		trace_instant("dhcp", "server packet", detail);
+	}
+
 	server_id_option = dhcp_get_option(&packet, DHCP_SERVER_ID);
 	if (server_id_option) {
 		uint32_t server_nid = get_be32(server_id_option);
@@ -0,0 +1,239 @@
+/*
+ * MiracleCast - Wifi-Display/Miracast Implementation
+ *
+ * MiracleCast is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * MiracleCast is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with MiracleCast; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * GLib Bridge
+ * gdhcp runs on the default GLib main context. Instead of a second loop we
+ * iterate that context from sd-event: a prepare hook does check/dispatch for
+ * the previous round and prepare/query for the next one, mirrors the polled
+ * fds as io sources and the GLib timeout as a timer. GPollFD events use the
+ * poll() bits, which match the epoll ones.
+ */
+
+#include <errno.h>
+#include <glib.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <systemd/sd-event.h>
+#include "loopstat.h"
+#include "miracled.h"
+#include "shl_log.h"
+
+struct miracled_glib {
+	sd_event *event;
+	GMainContext *ctx;
+	sd_event_source *timer;
+
+	/* fds we poll, with revents for the next check */
+	GPollFD *fds;
+	sd_event_source **srcs;
+	int n_fds;
+	GPollFD *query;
+	int max_fds;
+	int max_prio;
+	bool queried;
+};
+
+static void glib_drop_fds(struct miracled_glib *g)
+{
+	int i;
+
+	for (i = 0; i < g->n_fds; ++i)
+		sd_event_source_unref(g->srcs[i]);
+	g->n_fds = 0;
+}
+
+static int glib_io_fn(sd_event_source *source, int fd, uint32_t mask,
+		      void *data)
+{
+	struct miracled_glib *g = data;
+	int i;
+
+	/* picked up by the next prepare round */
+	for (i = 0; i < g->n_fds; ++i)
+		if (g->fds[i].fd == fd)
+			g->fds[i].revents = mask;
+
+	return 0;
+}
+
+static int glib_timer_fn(sd_event_source *source, uint64_t usec, void *data)
+{
+	/* the next prepare round dispatches and re-arms */
+	sd_event_source_set_time(source, (uint64_t)-1);
+	return 0;
+}
+
+static int glib_grow(struct miracled_glib *g, int n)
+{
+	GPollFD *fds, *query;
+	sd_event_source **srcs;
+
+	fds = realloc(g->fds, n * sizeof(*fds));
+	if (fds)
+		g->fds = fds;
+	query = realloc(g->query, n * sizeof(*query));
+	if (query)
+		g->query = query;
+	srcs = realloc(g->srcs, n * sizeof(*srcs));
+	if (srcs)
+		g->srcs = srcs;
+	if (!fds || !query || !srcs)
+		return log_ENOMEM();
+
+	g->max_fds = n;
+	return 0;
+}
+
+static int glib_sync_fds(struct miracled_glib *g, GPollFD *fds, int n)
+{
+	int i, r;
+
+	for (i = 0; i < n && n == g->n_fds; ++i)
+		if (fds[i].fd != g->fds[i].fd || fds[i].events != g->fds[i].events)
+			break;
+
+	if (n == g->n_fds && i == n) {
+		/* same set as last round */
+		for (i = 0; i < n; ++i)
+			g->fds[i].revents = 0;
+		return 0;
+	}
+
+	glib_drop_fds(g);
+	memcpy(g->fds, fds, n * sizeof(*fds));
+
+	for (i = 0; i < n; ++i) {
+		g->fds[i].revents = 0;
+		r = sd_event_add_io(g->event, &g->srcs[i], fds[i].fd,
+				    fds[i].events, glib_io_fn, g);
+		if (r < 0) {
+			g->n_fds = i;
+			return log_ERR(r);
+		}
+		++g->n_fds;
+	}
+
+	return 0;
+}
+
+static int glib_prepare_fn(sd_event_source *source, void *data)
+{
+	LOOPSTAT("glib");
+	struct miracled_glib *g = data;
+	uint64_t now;
+	gint timeout;
+	int n, r;
+
+	if (g->queried) {
+		g->queried = false;
+		if (g_main_context_check(g->ctx, g->max_prio, g->fds, g->n_fds))
+			g_main_context_dispatch(g->ctx);
+	}
+
+	g_main_context_prepare(g->ctx, &g->max_prio);
+
+	while ((n = g_main_context_query(g->ctx, g->max_prio, &timeout,
+					 g->query, g->max_fds)) > g->max_fds) {
+		r = glib_grow(g, n);
+		if (r < 0)
+			return r;
+	}
+
+	r = glib_sync_fds(g, g->query, n);
+	if (r < 0)
+		return r;
+
+	if (timeout < 0) {
+		sd_event_source_set_time(g->timer, (uint64_t)-1);
+	} else {
+		sd_event_now(g->event, CLOCK_MONOTONIC, &now);
+		sd_event_source_set_time(g->timer, now + timeout * 1000ULL);
+	}
+
+	g->queried = true;
+	return 0;
+}
+
+int miracled_glib_new(struct miracled_glib **out, sd_event *event)
+{
+	struct miracled_glib *g;
+	int r;
+
+	g = calloc(1, sizeof(*g));
+	if (!g)
+		return log_ENOMEM();
+
+	g->event = sd_event_ref(event);
+	g->ctx = g_main_context_ref(g_main_context_default());
+	if (!g_main_context_acquire(g->ctx)) {
+		log_error("GLib main context owned by another thread");
+		r = -EBUSY;
+		goto error;
+	}
+
+	r = glib_grow(g, 8);
+	if (r < 0)
+		goto error;
+
+	r = sd_event_add_time(event, &g->timer, CLOCK_MONOTONIC, (uint64_t)-1,
+			      0, glib_timer_fn, g);
+	if (r < 0) {
+		log_vERR(r);
+		goto error;
+	}
+
+	/* never disabled, so its prepare hook runs on every iteration */
+	sd_event_source_set_enabled(g->timer, SD_EVENT_ON);
+
+	/* run before sd-bus's prepare hook, so messages queued while
+	 * dispatching GLib are flushed in the same round */
+	sd_event_source_set_priority(g->timer, SD_EVENT_PRIORITY_IMPORTANT);
+
+	r = sd_event_source_set_prepare(g->timer, glib_prepare_fn);
+	if (r < 0) {
+		log_vERR(r);
+		goto error;
+	}
+
+	*out = g;
+	return 0;
+
+error:
+	miracled_glib_free(g);
+	return r;
+}
+
+void miracled_glib_free(struct miracled_glib *g)
+{
+	if (!g)
+		return;
+
+	glib_drop_fds(g);
+	sd_event_source_unref(g->timer);
+	if (g->ctx) {
+		if (g_main_context_is_owner(g->ctx))
+			g_main_context_release(g->ctx);
+		g_main_context_unref(g->ctx);
+	}
+	sd_event_unref(g->event);
+	free(g->srcs);
+	free(g->query);
+	free(g->fds);
+	free(g);
+}
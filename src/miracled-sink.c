@@ -0,0 +1,306 @@
+/*
+ * MiracleCast - Wifi-Display/Miracast Implementation
+ *
+ * MiracleCast is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * MiracleCast is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with MiracleCast; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Sink Sessions
+ * The RTSP sink of miracle-sinkctl, run inside miracled. miracled tells us
+ * which source to connect to once the P2P group is up; we retry the RTSP
+ * connection like sinkctl does and spawn the player once the resolution is
+ * negotiated. ctl-sink.c logs through cli_printf(), which goes to our log.
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <systemd/sd-event.h>
+#include <systemd/sd-journal.h>
+#include <unistd.h>
+#include "ctl.h"
+#include "ctl-sink.h"
+#include "loopstat.h"
+#include "miracled.h"
+#include "shl_log.h"
+#include "shl_util.h"
+#include "trace.h"
+
+struct miracled_sink {
+	sd_event *event;
+	struct ctl_sink *sink;
+
+	char *target;
+	sd_event_source *retry;
+	unsigned int retries;
+
+	pid_t player;
+	bool connected : 1;
+};
+
+/* ctl-sink.c only hands us the ctl_sink, and there is only one */
+static struct miracled_sink *sink_instance;
+
+/* globals ctl-cli.c and sinkctl.c provide for the split-process sink */
+unsigned int cli_max_sev = LOG_NOTICE;
+int rstp_port;
+bool uibc_option;
+bool uibc_enabled;
+char *uibc_hidc;
+int uibc_port;
+unsigned int wfd_supported_res_cea  = 0x0001ffff;
+unsigned int wfd_supported_res_vesa = 0x1fffffff;
+unsigned int wfd_supported_res_hh   = 0x00001fff;
+
+void cli_printv(const char *fmt, va_list args)
+{
+	char *msg;
+	size_t l;
+
+	if (vasprintf(&msg, fmt, args) < 0)
+		return log_vENOMEM();
+
+	l = strlen(msg);
+	if (l && msg[l - 1] == '\n')
+		msg[l - 1] = 0;
+
+	log_format(NULL, 0, NULL, "sink", LOG_INFO, "%s", msg);
+	free(msg);
+}
+
+void cli_printf(const char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	cli_printv(fmt, args);
+	va_end(args);
+}
+
+static void sink_spawn_player(struct miracled_sink *s)
+{
+	char *argv[16], port[16], resolution[64];
+	int i = 0, fd_journal;
+	sigset_t mask;
+	pid_t pid;
+
+	if (s->player > 0)
+		return;
+
+	trace_flush();
+	pid = fork();
+	if (pid < 0) {
+		return log_vERRNO();
+	} else if (pid) {
+		s->player = pid;
+		trace_begin("player", "player", pid, NULL);
+		miracled_sink_streaming(true);
+		return;
+	}
+
+	/* child */
+
+	sigemptyset(&mask);
+	sigprocmask(SIG_SETMASK, &mask, NULL);
+
+	fd_journal = sd_journal_stream_fd("miracled-gst", LOG_DEBUG, false);
+	if (fd_journal >= 0) {
+		dup2(fd_journal, 1);
+		dup2(fd_journal, 2);
+	} else {
+		dup2(2, 1);
+	}
+
+	argv[i++] = "miracle-gst";
+	if (log_max_sev >= LOG_DEBUG) {
+		argv[i++] = "-d";
+		argv[i++] = "3";
+	}
+	argv[i++] = "-a";
+	argv[i++] = "-p";
+	sprintf(port, "%d", rstp_port);
+	argv[i++] = port;
+	if (s->sink->hres && s->sink->vres) {
+		sprintf(resolution, "%dx%d", s->sink->hres, s->sink->vres);
+		argv[i++] = "-r";
+		argv[i++] = resolution;
+	}
+	argv[i] = NULL;
+
+	execvpe(argv[0], argv, environ);
+	log_error("stream player failed (%d): %m", errno);
+	_exit(1);
+}
+
+static void sink_kill_player(struct miracled_sink *s)
+{
+	/* reaped by the manager's SIGCHLD handler */
+	if (s->player > 0) {
+		kill(s->player, SIGTERM);
+		trace_end("player", "player", s->player, "stopped");
+		miracled_sink_streaming(false);
+	}
+	s->player = 0;
+}
+
+static int sink_retry_fn(sd_event_source *source, uint64_t usec, void *data)
+{
+	LOOPSTAT("miracled.sink_retry");
+	struct miracled_sink *s = data;
+	int r;
+
+	if (!s->target || !ctl_sink_is_closed(s->sink))
+		return 0;
+
+	r = ctl_sink_connect(s->sink, s->target);
+	if (r >= 0)
+		return 0;
+
+	if (s->retries++ >= 3) {
+		log_error("cannot connect to source %s: %d", s->target, r);
+		return 0;
+	}
+
+	sd_event_source_set_time(source, shl_now(CLOCK_MONOTONIC) +
+					 s->retries * 1000ULL * 1000ULL);
+	sd_event_source_set_enabled(source, SD_EVENT_ONESHOT);
+	return 0;
+}
+
+void ctl_fn_sink_connected(struct ctl_sink *sink)
+{
+	log_notice("sink connected to %s", sink_instance->target);
+	sink_instance->connected = true;
+}
+
+void ctl_fn_sink_disconnected(struct ctl_sink *sink)
+{
+	struct miracled_sink *s = sink_instance;
+
+	if (!s->connected) {
+		/* treat HUP as timeout */
+		sink_retry_fn(s->retry, 0, s);
+	} else {
+		log_notice("sink disconnected from %s", s->target);
+		s->connected = false;
+	}
+}
+
+void ctl_fn_sink_resolution_set(struct ctl_sink *sink)
+{
+	log_info("sink resolution %dx%d", sink->hres, sink->vres);
+	if (sink_instance->connected)
+		sink_spawn_player(sink_instance);
+}
+
+int miracled_sink_start(struct miracled_sink *s, const char *target)
+{
+	char *t;
+
+	t = strdup(target);
+	if (!t)
+		return log_ENOMEM();
+
+	miracled_sink_stop(s);
+	s->target = t;
+	s->retries = 1;
+
+	/* the source needs a moment to open its RTSP port */
+	sd_event_source_set_time(s->retry, shl_now(CLOCK_MONOTONIC) +
+					   1000ULL * 1000ULL);
+	sd_event_source_set_enabled(s->retry, SD_EVENT_ONESHOT);
+
+	return 0;
+}
+
+void miracled_sink_stop(struct miracled_sink *s)
+{
+	if (!s->target)
+		return;
+
+	sd_event_source_set_enabled(s->retry, SD_EVENT_OFF);
+	sink_kill_player(s);
+	ctl_sink_close(s->sink);
+	s->connected = false;
+	free(s->target);
+	s->target = NULL;
+}
+
+/* the player quit on its own, see miracled_child_exited() */
+void miracled_sink_child_exited(struct miracled_sink *s, pid_t pid)
+{
+	if (!s || pid != s->player)
+		return;
+
+	log_debug("player %d exited", (int)pid);
+	trace_end("player", "player", pid, "exited");
+	s->player = 0;
+	miracled_sink_streaming(false);
+}
+
+int miracled_sink_new(struct miracled_sink **out,
+		      sd_event *event,
+		      unsigned int rtsp_port)
+{
+	struct miracled_sink *s;
+	int r;
+
+	if (sink_instance)
+		return log_EINVAL();
+
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return log_ENOMEM();
+
+	s->event = sd_event_ref(event);
+	rstp_port = rtsp_port;
+	cli_max_sev = log_max_sev;
+
+	r = ctl_sink_new(&s->sink, event);
+	if (r < 0)
+		goto error;
+
+	r = sd_event_add_time(event, &s->retry, CLOCK_MONOTONIC, 0, 0,
+			      sink_retry_fn, s);
+	if (r < 0) {
+		log_vERR(r);
+		goto error;
+	}
+	sd_event_source_set_enabled(s->retry, SD_EVENT_OFF);
+
+	sink_instance = s;
+	*out = s;
+	return 0;
+
+error:
+	miracled_sink_free(s);
+	return r;
+}
+
+void miracled_sink_free(struct miracled_sink *s)
+{
+	if (!s)
+		return;
+
+	miracled_sink_stop(s);
+	sd_event_source_unref(s->retry);
+	ctl_sink_free(s->sink);
+	sd_event_unref(s->event);
+	if (sink_instance == s)
+		sink_instance = NULL;
+	free(s);
+}
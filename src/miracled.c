@@ -24,34 +24,399 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/signalfd.h>
 #include <systemd/sd-bus.h>
 #include <systemd/sd-daemon.h>
 #include <systemd/sd-event.h>
 #include <time.h>
 #include <unistd.h>
+#include "dhcp.h"
+#include "loopstat.h"
 #include "miracled.h"
 #include "shl_macro.h"
 #include "shl_log.h"
 #include "shl_util.h"
+#include "trace.h"
+#include "wifid.h"
 #include "config.h"
 
-static void manager_free(struct manager *m)
+/*
+ * Miracle Daemon
+ * Single-process host for the wifi manager, DHCP and a Wifi-Display sink.
+ * The manager runs exactly as in miracle-wifid (including its D-Bus API), but
+ * DHCP runs in-process on our sd-event loop instead of one miracle-dhcp per
+ * group, and the sink follows links and peers through the wifid hooks instead
+ * of D-Bus signals. miracle-wifid, miracle-dhcp and miracle-sinkctl keep
+ * working on their own; run either this or them.
+ */
+
+static const char *arg_ip_binary = "/bin/ip";
+static bool arg_sink;
+static unsigned int arg_rtsp_port = 1991;
+
+/* the hooks have no user-data, there is only one daemon */
+static struct miracled *daemon_instance;
+
+/*
+ * DHCP
+ */
+
+struct miracled_dhcp {
+	struct dhcp *dhcp;
+	sd_event_source *failed;
+	wifid_dhcp_fn fn;
+	void *data;
+};
+
+static int miracled_dhcp_failed_fn(sd_event_source *source, void *data)
+{
+	LOOPSTAT("miracled.dhcp_failed");
+	struct miracled_dhcp *md = data;
+
+	/* the group drops us from here */
+	md->fn(md->data, NULL);
+	return 0;
+}
+
+static void miracled_dhcp_fn(struct dhcp *dhcp, const char *msg, void *data)
 {
-	if (!m)
+	struct miracled_dhcp *md = data;
+	int r;
+
+	if (msg) {
+		md->fn(md->data, msg);
 		return;
+	}
 
-	free(m);
+	/* gdhcp is still on the stack, report the failure from a clean frame */
+	if (md->failed)
+		return;
+
+	r = sd_event_add_defer(daemon_instance->event, &md->failed,
+			       miracled_dhcp_failed_fn, md);
+	if (r < 0)
+		log_vERR(r);
 }
 
-static int manager_new(struct manager **out)
+static void miracled_dhcp_stop(void *handle)
 {
-	return -EINVAL;
+	struct miracled_dhcp *md = handle;
+
+	if (!md)
+		return;
+
+	sd_event_source_unref(md->failed);
+	dhcp_free(md->dhcp);
+	free(md);
 }
 
-static int manager_run(struct manager *m)
+static int miracled_dhcp_start(void **out,
+			       const char *ifname,
+			       unsigned int subnet,
+			       wifid_dhcp_fn fn,
+			       void *data)
 {
+	struct dhcp_config c = {
+		.netdev = ifname,
+		.ip_binary = arg_ip_binary,
+	};
+	struct miracled_dhcp *md;
+	char prefix[64];
+	int r;
+
+	if (subnet) {
+		sprintf(prefix, "192.168.%u", subnet);
+		r = dhcp_config_server(&c, prefix, NULL, NULL, NULL,
+				       NULL, NULL, NULL);
+		if (r < 0)
+			return r;
+	}
+
+	md = calloc(1, sizeof(*md));
+	if (!md)
+		return log_ENOMEM();
+
+	md->fn = fn;
+	md->data = data;
+
+	r = dhcp_new(&md->dhcp, &c, miracled_dhcp_fn, md);
+	if (r < 0)
+		goto error;
+
+	r = dhcp_start(md->dhcp);
+	if (r < 0)
+		goto error;
+
+	*out = md;
 	return 0;
+
+error:
+	miracled_dhcp_stop(md);
+	return r;
+}
+
+/*
+ * Sink
+ * Same policy as miracle-sinkctl's "run": advertise as WFD sink on the link,
+ * keep scanning, accept the first GO negotiation and connect the RTSP sink to
+ * the peer once DHCP gave it an address.
+ */
+
+static void miracled_stop_timeout(struct miracled *d)
+{
+	sd_event_source_unref(d->scan_timeout);
+	d->scan_timeout = NULL;
+}
+
+static void miracled_rescan(struct miracled *d)
+{
+	miracled_stop_timeout(d);
+	if (d->sink_link)
+		link_set_p2p_scanning(d->sink_link, true);
+}
+
+static int miracled_scan_timeout_fn(sd_event_source *source, uint64_t usec,
+				    void *data)
+{
+	LOOPSTAT("miracled.scan_timeout");
+	struct miracled *d = data;
+
+	if (d->pending_peer)
+		log_notice("timeout waiting for %s",
+			   peer_get_friendly_name(d->pending_peer));
+	d->pending_peer = NULL;
+	miracled_rescan(d);
+
+	return 0;
+}
+
+/* the player runs, pause P2P discovery on the sink link */
+void miracled_sink_streaming(bool streaming)
+{
+	struct miracled *d = daemon_instance;
+
+	if (d && d->sink_link)
+		link_set_streaming(d->sink_link, streaming);
+}
+
+static bool miracled_is_sink_peer(struct miracled *d, struct peer *p)
+{
+	return d->sink && p->l == d->sink_link &&
+	       !shl_isempty(peer_get_wfd_subelements(p));
+}
+
+static void miracled_drop_peer(struct miracled *d, struct peer *p)
+{
+	if (p == d->pending_peer) {
+		d->pending_peer = NULL;
+		miracled_rescan(d);
+	}
+
+	if (p == d->running_peer) {
+		log_info("no longer running on peer %s", p->p2p_mac);
+		miracled_sink_stop(d->sink);
+		d->running_peer = NULL;
+		miracled_rescan(d);
+	}
+}
+
+static void miracled_link_started(struct link *l)
+{
+	struct miracled *d = daemon_instance;
+	int r;
+
+	if (!d->sink || d->sink_link || !l->managed)
+		return;
+	if (interface_name && strcmp(interface_name, l->ifname))
+		return;
+
+	d->sink_link = l;
+	r = link_set_wfd_subelements(l, "000600111c4400c8");
+	if (r >= 0)
+		r = link_set_p2p_scanning(l, true);
+	if (r < 0)
+		log_warning("cannot start sink on link %s: %d", l->ifname, r);
+	else
+		log_info("sink running on link %s", l->ifname);
+}
+
+static void miracled_link_stopped(struct link *l)
+{
+	struct miracled *d = daemon_instance;
+
+	if (l != d->sink_link)
+		return;
+
+	log_info("sink no longer running on link %s", l->ifname);
+	if (d->running_peer)
+		miracled_drop_peer(d, d->running_peer);
+	d->pending_peer = NULL;
+	d->sink_link = NULL;
+	miracled_stop_timeout(d);
+}
+
+static void miracled_peer_removed(struct peer *p)
+{
+	miracled_drop_peer(daemon_instance, p);
+}
+
+static void miracled_peer_go_neg_request(struct peer *p,
+					 const char *prov,
+					 const char *pin)
+{
+	struct miracled *d = daemon_instance;
+	uint64_t now;
+	int r;
+
+	if (!miracled_is_sink_peer(d, p) || d->running_peer)
+		return;
+
+	/* auto accept any incoming connection attempt */
+	r = peer_connect(p, "auto", "");
+	if (r < 0)
+		return;
+	d->pending_peer = p;
+
+	/* wpas does not tell us if the connection attempt (or DHCP with some
+	 * devices, up to 30s) never finishes */
+	now = shl_now(CLOCK_MONOTONIC);
+	miracled_stop_timeout(d);
+	r = sd_event_add_time(d->event, &d->scan_timeout, CLOCK_MONOTONIC,
+			      now + 60 * 1000ULL * 1000ULL, 0,
+			      miracled_scan_timeout_fn, d);
+	if (r < 0)
+		log_vERR(r);
+}
+
+static void miracled_peer_formation_failure(struct peer *p,
+					    const char *reason)
+{
+	struct miracled *d = daemon_instance;
+
+	if (!miracled_is_sink_peer(d, p) || d->running_peer)
+		return;
+
+	log_notice("group formation with %s failed: %s", p->p2p_mac, reason);
+	d->pending_peer = NULL;
+	miracled_rescan(d);
+}
+
+static void miracled_peer_connected_changed(struct peer *p)
+{
+	struct miracled *d = daemon_instance;
+	int r;
+
+	if (!miracled_is_sink_peer(d, p))
+		return;
+
+	if (!p->connected) {
+		miracled_drop_peer(d, p);
+		return;
+	}
+
+	if (d->running_peer || !peer_get_remote_address(p))
+		return;
+
+	d->pending_peer = NULL;
+	miracled_stop_timeout(d);
+
+	r = miracled_sink_start(d->sink, peer_get_remote_address(p));
+	if (r < 0)
+		return;
+
+	d->running_peer = p;
+	log_info("now running on peer %s (%s)", p->p2p_mac,
+		 peer_get_remote_address(p));
+}
+
+static void miracled_child_exited(pid_t pid)
+{
+	struct miracled *d = daemon_instance;
+
+	miracled_sink_child_exited(d->sink, pid);
+}
+
+static const struct wifid_hooks miracled_hooks = {
+	.link_started = miracled_link_started,
+	.link_stopped = miracled_link_stopped,
+	.peer_removed = miracled_peer_removed,
+	.peer_go_neg_request = miracled_peer_go_neg_request,
+	.peer_formation_failure = miracled_peer_formation_failure,
+	.peer_connected_changed = miracled_peer_connected_changed,
+	.dhcp_start = miracled_dhcp_start,
+	.dhcp_stop = miracled_dhcp_stop,
+	.child_exited = miracled_child_exited,
+};
+
+/*
+ * Daemon
+ */
+
+static void miracled_free(struct miracled *d)
+{
+	if (!d)
+		return;
+
+	/* links go first, they stop their DHCP and tell the sink */
+	manager_free(d->wifi);
+	miracled_stop_timeout(d);
+	miracled_sink_free(d->sink);
+	miracled_glib_free(d->glib);
+
+	wifid_hooks = NULL;
+	daemon_instance = NULL;
+
+	sd_event_unref(d->event);
+	free(d);
+}
+
+static int miracled_new(struct miracled **out)
+{
+	struct miracled *d;
+	int r;
+
+	d = calloc(1, sizeof(*d));
+	if (!d)
+		return log_ENOMEM();
+
+	daemon_instance = d;
+	wifid_hooks = &miracled_hooks;
+
+	r = sd_event_default(&d->event);
+	if (r < 0) {
+		log_vERR(r);
+		goto error;
+	}
+
+	r = miracled_glib_new(&d->glib, d->event);
+	if (r < 0)
+		goto error;
+
+	if (arg_sink) {
+		r = miracled_sink_new(&d->sink, d->event, arg_rtsp_port);
+		if (r < 0)
+			goto error;
+	}
+
+	/* shares the default event loop and bus with us */
+	r = manager_new(&d->wifi);
+	if (r < 0)
+		goto error;
+
+	r = manager_startup(d->wifi);
+	if (r < 0)
+		goto error;
+
+	*out = d;
+	return 0;
+
+error:
+	miracled_free(d);
+	return r;
+}
+
+static int miracled_run(struct miracled *d)
+{
+	return sd_event_loop(d->event);
 }
 
 static int help(void)
@@ -62,10 +427,26 @@ static int help(void)
 	 */
 	printf("%s [OPTIONS...] ...\n\n"
 	       "Remote-display Management-daemon.\n\n"
-	       "  -h --help             Show this help\n"
-	       "     --version          Show package version\n"
-	       "     --log-level <lvl>  Maximum level for log messages\n"
-	       "     --log-time         Prefix log-messages with timestamp\n"
+	       "  -h --help                Show this help\n"
+	       "     --version             Show package version\n"
+	       "     --log-level <lvl>     Maximum level for log messages\n"
+	       "     --log-time            Prefix log-messages with timestamp\n"
+	       "     --stall-threshold <ms>\n"
+	       "                           Log event-loop stalls above this [default: 50]\n"
+	       "\n"
+	       "  -i --interface           Choose the interface to use\n"
+	       "     --config-methods      Define config methods for pairing, default 'pbc'\n"
+	       "     --wpa-loglevel <lvl   wpa_supplicant log-level\n"
+	       "     --use-dev             enable workaround for 'no ifname' issue\n"
+	       "     --lazy-managed        manage interface only when user decide to do\n"
+	       "     --p2p-scan <mode>=<find>,<listen>,<off>[,social]\n"
+	       "                           P2P discovery duty cycle, see miracle-wifid\n"
+	       "     --go-band <band>      Band of local P2P groups, see miracle-wifid\n"
+	       "     --go-width <mhz>      Width of local P2P groups, see miracle-wifid\n"
+	       "     --ip-binary <path>    Path to 'ip' binary [default: /bin/ip]\n"
+	       "\n"
+	       "     --sink                Run a Wifi-Display sink on the interface\n"
+	       "     --rtsp-port <port>    Port for the sink's stream player [default: 1991]\n"
 	       , program_invocation_short_name);
 	/*
 	 * 80-char barrier:
@@ -81,20 +462,48 @@ static int parse_argv(int argc, char *argv[])
 		ARG_VERSION = 0x100,
 		ARG_LOG_LEVEL,
 		ARG_LOG_TIME,
+		ARG_STALL_THRESHOLD,
+		ARG_WPA_LOGLEVEL,
+		ARG_USE_DEV,
+		ARG_CONFIG_METHODS,
+		ARG_LAZY_MANAGED,
+		ARG_P2P_SCAN,
+		ARG_GO_BAND,
+		ARG_GO_WIDTH,
+		ARG_IP_BINARY,
+		ARG_SINK,
+		ARG_RTSP_PORT,
 	};
 	static const struct option options[] = {
 		{ "help",	no_argument,		NULL,	'h' },
 		{ "version",	no_argument,		NULL,	ARG_VERSION },
 		{ "log-level",	required_argument,	NULL,	ARG_LOG_LEVEL },
 		{ "log-time",	no_argument,		NULL,	ARG_LOG_TIME },
+		{ "stall-threshold",	required_argument,	NULL,	ARG_STALL_THRESHOLD },
+
+		{ "interface",	required_argument,	NULL,	'i' },
+		{ "wpa-loglevel",	required_argument,	NULL,	ARG_WPA_LOGLEVEL },
+		{ "use-dev",	no_argument,		NULL,	ARG_USE_DEV },
+		{ "config-methods",	required_argument,	NULL,	ARG_CONFIG_METHODS },
+		{ "lazy-managed",	no_argument,		NULL,	ARG_LAZY_MANAGED },
+		{ "p2p-scan",	required_argument,	NULL,	ARG_P2P_SCAN },
+		{ "go-band",	required_argument,	NULL,	ARG_GO_BAND },
+		{ "go-width",	required_argument,	NULL,	ARG_GO_WIDTH },
+		{ "ip-binary",	required_argument,	NULL,	ARG_IP_BINARY },
+
+		{ "sink",	no_argument,		NULL,	ARG_SINK },
+		{ "rtsp-port",	required_argument,	NULL,	ARG_RTSP_PORT },
 		{}
 	};
 	int c;
 
-	while ((c = getopt_long(argc, argv, "h", options, NULL)) >= 0) {
+	while ((c = getopt_long(argc, argv, "hi:", options, NULL)) >= 0) {
 		switch (c) {
 		case 'h':
 			return help();
+		case 'i':
+			interface_name = optarg;
+			break;
 		case ARG_VERSION:
 			puts(PACKAGE_STRING);
 			return 0;
@@ -104,6 +513,48 @@ static int parse_argv(int argc, char *argv[])
 		case ARG_LOG_TIME:
 			log_init_time();
 			break;
+		case ARG_STALL_THRESHOLD:
+			loopstat_set_threshold(atoi(optarg));
+			break;
+		case ARG_WPA_LOGLEVEL:
+			arg_wpa_loglevel = log_parse_arg(optarg);
+			break;
+		case ARG_USE_DEV:
+			use_dev = true;
+			break;
+		case ARG_CONFIG_METHODS:
+			config_methods = optarg;
+			break;
+		case ARG_LAZY_MANAGED:
+			lazy_managed = true;
+			break;
+		case ARG_P2P_SCAN:
+			if (p2p_scan_parse(optarg) < 0) {
+				log_error("invalid --p2p-scan: %s", optarg);
+				return -EINVAL;
+			}
+			break;
+		case ARG_GO_BAND:
+			if (p2p_go_band_parse(optarg) < 0) {
+				log_error("invalid --go-band: %s", optarg);
+				return -EINVAL;
+			}
+			break;
+		case ARG_GO_WIDTH:
+			if (p2p_go_width_parse(optarg) < 0) {
+				log_error("invalid --go-width: %s", optarg);
+				return -EINVAL;
+			}
+			break;
+		case ARG_IP_BINARY:
+			arg_ip_binary = optarg;
+			break;
+		case ARG_SINK:
+			arg_sink = true;
+			break;
+		case ARG_RTSP_PORT:
+			arg_rtsp_port = atoi(optarg);
+			break;
 		case '?':
 			return -EINVAL;
 		}
@@ -124,7 +575,7 @@ static int parse_argv(int argc, char *argv[])
 
 int main(int argc, char **argv)
 {
-	struct manager *m = NULL;
+	struct miracled *d = NULL;
 	int r;
 
 	srand(time(NULL));
@@ -135,7 +586,15 @@ int main(int argc, char **argv)
 	if (!r)
 		return EXIT_SUCCESS;
 
-	r = manager_new(&m);
+	trace_init("miracled");
+
+	if (getuid() != 0) {
+		r = EACCES;
+		log_notice("Must run as root");
+		goto finish;
+	}
+
+	r = miracled_new(&d);
 	if (r < 0)
 		goto finish;
 
@@ -146,11 +605,11 @@ int main(int argc, char **argv)
 		goto finish;
 	}
 
-	r = manager_run(m);
+	r = miracled_run(d);
 
 finish:
 	sd_notify(false, "STATUS=Exiting..");
-	manager_free(m);
+	miracled_free(d);
 
 	log_debug("exiting..");
 	return abs(r);
@@ -21,16 +21,51 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <sys/types.h>
 #include <systemd/sd-bus.h>
 #include <systemd/sd-event.h>
 
 #ifndef MIRACLED_H
 #define MIRACLED_H
 
-/* manager */
+struct link;
+struct manager;
+struct peer;
+struct miracled_glib;
+struct miracled_sink;
 
-struct manager {
+/* glib bridge */
+
+int miracled_glib_new(struct miracled_glib **out, sd_event *event);
+void miracled_glib_free(struct miracled_glib *g);
+
+/* sink sessions */
+
+int miracled_sink_new(struct miracled_sink **out,
+		      sd_event *event,
+		      unsigned int rtsp_port);
+void miracled_sink_free(struct miracled_sink *s);
+int miracled_sink_start(struct miracled_sink *s, const char *target);
+void miracled_sink_stop(struct miracled_sink *s);
+void miracled_sink_child_exited(struct miracled_sink *s, pid_t pid);
+
+/* daemon hooks */
+
+void miracled_sink_streaming(bool streaming);
+
+/* daemon */
+
+struct miracled {
 	sd_event *event;
+	struct miracled_glib *glib;
+	struct manager *wifi;
+
+	/* sink: the link we run on, the peer we talk to */
+	struct miracled_sink *sink;
+	struct link *sink_link;
+	struct peer *running_peer;
+	struct peer *pending_peer;
+	sd_event_source *scan_timeout;
 };
 
 #endif /* MIRACLED_H */
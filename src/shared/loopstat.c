@@ -0,0 +1,155 @@
+/*
+ * MiracleCast - Wifi-Display/Miracast Implementation
+ *
+ * MiracleCast is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * MiracleCast is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with MiracleCast; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#define LOG_SUBSYSTEM "loop"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "loopstat.h"
+#include "metrics.h"
+#include "shl_log.h"
+#include "shl_macro.h"
+
+static void loopstat_format(FILE *f, struct metric *m);
+static void loopstat_reset(struct metric *m);
+
+static METRICS_HIST(loop_dispatch_time, "loop.dispatch_time", "us",
+		    "time per event-loop dispatch");
+static METRICS_COUNTER(loop_stalls, "loop.stalls",
+		       "dispatches above the stall threshold");
+static METRICS_TEXT(loop_top, "loop.top",
+		    "sources with most dispatch time: count, total, max, stalls",
+		    loopstat_format, loopstat_reset);
+
+static struct loopstat_site *loopstat_sites;
+static unsigned int loopstat_cnt;
+static uint64_t loopstat_stall_ns = LOOPSTAT_STALL_MSEC_DEFAULT * 1000000ULL;
+
+/* slowest nested dispatch of the current outermost one */
+static unsigned int loopstat_depth;
+static struct loopstat_site *loopstat_inner;
+static uint64_t loopstat_inner_ns;
+
+/* 0 disables stall reports */
+void loopstat_set_threshold(unsigned int msec)
+{
+	loopstat_stall_ns = msec * 1000000ULL;
+}
+
+struct loopstat_timer loopstat_begin(struct loopstat_site *site)
+{
+	if (_shl_unlikely_(!site->registered)) {
+		site->registered = true;
+		site->next = loopstat_sites;
+		loopstat_sites = site;
+		++loopstat_cnt;
+		metrics_register(&loop_top.m);
+	}
+
+	++loopstat_depth;
+	return (struct loopstat_timer){ .site = site,
+					.start = metrics_now_ns() };
+}
+
+void loopstat_end(struct loopstat_timer *t)
+{
+	struct loopstat_site *s = t->site;
+	uint64_t d = metrics_now_ns() - t->start;
+	bool stall;
+
+	++s->count;
+	s->total += d;
+	if (d > s->max)
+		s->max = d;
+
+	stall = loopstat_stall_ns && d >= loopstat_stall_ns;
+	if (stall)
+		++s->stalls;
+
+	if (--loopstat_depth) {
+		if (d > loopstat_inner_ns) {
+			loopstat_inner = s;
+			loopstat_inner_ns = d;
+		}
+		return;
+	}
+
+	metrics_hist_record(&loop_dispatch_time, d / 1000);
+
+	if (stall) {
+		metrics_counter_inc(&loop_stalls);
+		if (loopstat_inner)
+			log_warning("event-loop stalled for %" PRIu64 "ms in %s (%s took %" PRIu64 "ms)",
+				    d / 1000000, s->name, loopstat_inner->name,
+				    loopstat_inner_ns / 1000000);
+		else
+			log_warning("event-loop stalled for %" PRIu64 "ms in %s",
+				    d / 1000000, s->name);
+	}
+
+	loopstat_inner = NULL;
+	loopstat_inner_ns = 0;
+}
+
+static int loopstat_cmp(const void *a, const void *b)
+{
+	const struct loopstat_site *sa = *(const struct loopstat_site**)a;
+	const struct loopstat_site *sb = *(const struct loopstat_site**)b;
+
+	if (sa->total != sb->total)
+		return sa->total < sb->total ? 1 : -1;
+
+	return 0;
+}
+
+/* one line per source: loop.top{<name>} count=.. total=..us max=..us stalls=.. */
+static void loopstat_format(FILE *f, struct metric *m)
+{
+	struct loopstat_site **v, *s;
+	unsigned int i, n = 0;
+
+	v = malloc(sizeof(*v) * (loopstat_cnt + 1));
+	if (!v)
+		return;
+
+	for (s = loopstat_sites; s; s = s->next)
+		if (s->count)
+			v[n++] = s;
+	qsort(v, n, sizeof(*v), loopstat_cmp);
+
+	for (i = 0; i < n && i < LOOPSTAT_TOP; ++i)
+		fprintf(f, "%s{%s} count=%" PRIu64 " total=%" PRIu64 "us"
+			" max=%" PRIu64 "us stalls=%" PRIu64 "\n",
+			m->name, v[i]->name, v[i]->count, v[i]->total / 1000,
+			v[i]->max / 1000, v[i]->stalls);
+
+	free(v);
+}
+
+static void loopstat_reset(struct metric *m)
+{
+	struct loopstat_site *s;
+
+	for (s = loopstat_sites; s; s = s->next) {
+		s->count = 0;
+		s->total = 0;
+		s->max = 0;
+		s->stalls = 0;
+	}
+}
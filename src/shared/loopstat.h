@@ -0,0 +1,64 @@
+/*
+ * MiracleCast - Wifi-Display/Miracast Implementation
+ *
+ * MiracleCast is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * MiracleCast is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with MiracleCast; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Event-loop Statistics
+ * Our daemons are single-threaded event-loops, any slow callback delays all
+ * other sources. LOOPSTAT(name) at the top of a callback times it until it
+ * returns and accounts the time to @name. A dispatch slower than the stall
+ * threshold is logged, the sources with the most dispatch time are published
+ * as the "loop.top" metric.
+ * Callbacks may nest, like GLib sources dispatched from sd-event. Both levels
+ * are accounted, but a stall is reported once by the outermost callback,
+ * together with its slowest nested one.
+ */
+
+#ifndef MIRACLE_LOOPSTAT_H
+#define MIRACLE_LOOPSTAT_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include "shl_macro.h"
+
+#define LOOPSTAT_STALL_MSEC_DEFAULT 50
+#define LOOPSTAT_TOP 10
+
+struct loopstat_site {
+	struct loopstat_site *next;
+	const char *name;
+	bool registered;
+	uint64_t count;
+	uint64_t total;
+	uint64_t max;
+	uint64_t stalls;
+};
+
+struct loopstat_timer {
+	struct loopstat_site *site;
+	uint64_t start;
+};
+
+void loopstat_set_threshold(unsigned int msec);
+struct loopstat_timer loopstat_begin(struct loopstat_site *site);
+void loopstat_end(struct loopstat_timer *t);
+
+#define LOOPSTAT(_name) \
+	static struct loopstat_site loopstat__site = { .name = (_name) }; \
+	_shl_cleanup_(loopstat_end) _shl_unused_ struct loopstat_timer \
+		loopstat__timer = loopstat_begin(&loopstat__site)
+
+#endif /* MIRACLE_LOOPSTAT_H */
@@ -0,0 +1,209 @@
+/*
+ * MiracleCast - Wifi-Display/Miracast Implementation
+ *
+ * MiracleCast is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * MiracleCast is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with MiracleCast; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "metrics.h"
+#include "shl_macro.h"
+
+static struct metric *metrics_list;
+static unsigned int metrics_cnt;
+
+void metrics_register(struct metric *m)
+{
+	if (m->registered)
+		return;
+
+	m->registered = true;
+	m->next = metrics_list;
+	metrics_list = m;
+	++metrics_cnt;
+}
+
+struct metric *metrics_find(const char *name)
+{
+	struct metric *m;
+
+	for (m = metrics_list; m; m = m->next)
+		if (!strcmp(m->name, name))
+			return m;
+
+	return NULL;
+}
+
+/* gauges describe current state and are left alone */
+void metrics_reset(void)
+{
+	struct metrics_counter *c;
+	struct metrics_hist *h;
+	struct metrics_text *t;
+	struct metric *m;
+
+	for (m = metrics_list; m; m = m->next) {
+		switch (m->type) {
+		case METRICS_COUNTER:
+			c = shl_container_of(m, struct metrics_counter, m);
+			c->value = 0;
+			break;
+		case METRICS_HIST:
+			h = shl_container_of(m, struct metrics_hist, m);
+			h->count = 0;
+			h->sum = 0;
+			h->min = 0;
+			h->max = 0;
+			memset(h->buckets, 0, sizeof(h->buckets));
+			break;
+		case METRICS_TEXT:
+			t = shl_container_of(m, struct metrics_text, m);
+			if (t->reset)
+				t->reset(m);
+			break;
+		}
+	}
+}
+
+uint64_t metrics_hist_bucket_low(unsigned int bucket)
+{
+	unsigned int e;
+
+	if (bucket < METRICS_HIST_SUB)
+		return bucket;
+
+	e = (bucket >> METRICS_HIST_SUB_BITS) + METRICS_HIST_SUB_BITS - 1;
+	return (uint64_t)(METRICS_HIST_SUB | (bucket & (METRICS_HIST_SUB - 1))) <<
+	       (e - METRICS_HIST_SUB_BITS);
+}
+
+/* upper bound of the bucket holding the @pct percentile, within [min, max] */
+uint64_t metrics_hist_percentile(struct metrics_hist *h, unsigned int pct)
+{
+	uint64_t target, sum = 0, v;
+	unsigned int i;
+
+	if (!h->count)
+		return 0;
+
+	target = (h->count * pct + 99) / 100;
+	if (!target)
+		target = 1;
+
+	for (i = 0; i < METRICS_HIST_BUCKETS - 1; ++i) {
+		sum += h->buckets[i];
+		if (sum >= target)
+			break;
+	}
+
+	if (i >= METRICS_HIST_BUCKETS - 1)
+		return h->max;
+
+	v = metrics_hist_bucket_low(i + 1) - 1;
+	return shl_clamp(v, h->min, h->max);
+}
+
+static int metrics_cmp(const void *a, const void *b)
+{
+	const struct metric *ma = *(const struct metric**)a;
+	const struct metric *mb = *(const struct metric**)b;
+
+	return strcmp(ma->name, mb->name);
+}
+
+static void metrics_format_one(FILE *f, struct metric *m)
+{
+	struct metrics_counter *c;
+	struct metrics_gauge *g;
+	struct metrics_hist *h;
+	struct metrics_text *t;
+	const char *u;
+
+	fprintf(f, "# %s: %s\n", m->name, m->help);
+
+	switch (m->type) {
+	case METRICS_COUNTER:
+		c = shl_container_of(m, struct metrics_counter, m);
+		fprintf(f, "%s %" PRIu64 "\n", m->name, c->value);
+		break;
+	case METRICS_GAUGE:
+		g = shl_container_of(m, struct metrics_gauge, m);
+		fprintf(f, "%s %" PRId64 "\n", m->name, g->value);
+		break;
+	case METRICS_HIST:
+		h = shl_container_of(m, struct metrics_hist, m);
+		u = m->unit ? : "";
+		fprintf(f, "%s count=%" PRIu64 " sum=%" PRIu64 "%s",
+			m->name, h->count, h->sum, u);
+		if (h->count)
+			fprintf(f, " min=%" PRIu64 "%s p50=%" PRIu64 "%s"
+				" p90=%" PRIu64 "%s p99=%" PRIu64 "%s"
+				" max=%" PRIu64 "%s",
+				h->min, u,
+				metrics_hist_percentile(h, 50), u,
+				metrics_hist_percentile(h, 90), u,
+				metrics_hist_percentile(h, 99), u,
+				h->max, u);
+		fprintf(f, "\n");
+		break;
+	case METRICS_TEXT:
+		t = shl_container_of(m, struct metrics_text, m);
+		t->format(f, m);
+		break;
+	}
+}
+
+/*
+ * Text dump of all registered metrics, sorted by name:
+ *   # <name>: <help>
+ *   <name> <value>
+ *   <name> count=<n> sum=<s> min=.. p50=.. p90=.. p99=.. max=..
+ * Text metrics print their own lines after the help line.
+ */
+int metrics_format(char **out)
+{
+	struct metric **v, *m;
+	unsigned int i, n = 0;
+	size_t size;
+	char *buf;
+	FILE *f;
+
+	v = malloc(sizeof(*v) * (metrics_cnt + 1));
+	if (!v)
+		return -ENOMEM;
+
+	for (m = metrics_list; m; m = m->next)
+		v[n++] = m;
+	qsort(v, n, sizeof(*v), metrics_cmp);
+
+	f = open_memstream(&buf, &size);
+	if (!f) {
+		free(v);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < n; ++i)
+		metrics_format_one(f, v[i]);
+
+	free(v);
+	if (fclose(f))
+		return -ENOMEM;
+
+	*out = buf;
+	return 0;
+}
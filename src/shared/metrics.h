@@ -0,0 +1,194 @@
+/*
+ * MiracleCast - Wifi-Display/Miracast Implementation
+ *
+ * MiracleCast is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * MiracleCast is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with MiracleCast; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Metrics
+ * Counters, gauges and log-linear histograms. Each metric is a static object
+ * next to the code updating it and registers itself on first use, so an
+ * update is one predictable branch plus an add. Metrics are owned by the
+ * thread running the event-loop; all our daemons update them from there only,
+ * hence no atomics or locks.
+ */
+
+#ifndef MIRACLE_METRICS_H
+#define MIRACLE_METRICS_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "shl_macro.h"
+
+enum {
+	METRICS_COUNTER,
+	METRICS_GAUGE,
+	METRICS_HIST,
+	METRICS_TEXT,
+};
+
+struct metric {
+	struct metric *next;
+	const char *name;
+	const char *unit;
+	const char *help;
+	unsigned int type;
+	bool registered;
+};
+
+struct metrics_counter {
+	struct metric m;
+	uint64_t value;
+};
+
+struct metrics_gauge {
+	struct metric m;
+	int64_t value;
+};
+
+/*
+ * Histogram buckets: values below METRICS_HIST_SUB are exact, above that each
+ * power of two is split into METRICS_HIST_SUB linear buckets (<12.5% error).
+ * Values >= 2^METRICS_HIST_MAX_BITS end up in the last bucket.
+ */
+#define METRICS_HIST_SUB_BITS 3
+#define METRICS_HIST_SUB (1U << METRICS_HIST_SUB_BITS)
+#define METRICS_HIST_MAX_BITS 40
+#define METRICS_HIST_BUCKETS \
+	((METRICS_HIST_MAX_BITS - METRICS_HIST_SUB_BITS + 1) << METRICS_HIST_SUB_BITS)
+
+struct metrics_hist {
+	struct metric m;
+	uint64_t count;
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+	uint32_t buckets[METRICS_HIST_BUCKETS];
+};
+
+/* free-form metric, @format prints its lines and @reset is optional */
+struct metrics_text {
+	struct metric m;
+	void (*format) (FILE *f, struct metric *m);
+	void (*reset) (struct metric *m);
+};
+
+#define METRICS_COUNTER(_var, _name, _help) \
+	struct metrics_counter _var = { \
+		.m = { .name = (_name), .help = (_help), \
+		       .type = METRICS_COUNTER }, \
+	}
+
+#define METRICS_GAUGE(_var, _name, _help) \
+	struct metrics_gauge _var = { \
+		.m = { .name = (_name), .help = (_help), \
+		       .type = METRICS_GAUGE }, \
+	}
+
+#define METRICS_HIST(_var, _name, _unit, _help) \
+	struct metrics_hist _var = { \
+		.m = { .name = (_name), .unit = (_unit), .help = (_help), \
+		       .type = METRICS_HIST }, \
+	}
+
+#define METRICS_TEXT(_var, _name, _help, _format, _reset) \
+	struct metrics_text _var = { \
+		.m = { .name = (_name), .help = (_help), \
+		       .type = METRICS_TEXT }, \
+		.format = (_format), \
+		.reset = (_reset), \
+	}
+
+void metrics_register(struct metric *m);
+struct metric *metrics_find(const char *name);
+void metrics_reset(void);
+int metrics_format(char **out);
+
+static inline void metrics_counter_add(struct metrics_counter *c, uint64_t n)
+{
+	if (_shl_unlikely_(!c->m.registered))
+		metrics_register(&c->m);
+	c->value += n;
+}
+
+static inline void metrics_counter_inc(struct metrics_counter *c)
+{
+	metrics_counter_add(c, 1);
+}
+
+static inline void metrics_gauge_add(struct metrics_gauge *g, int64_t n)
+{
+	if (_shl_unlikely_(!g->m.registered))
+		metrics_register(&g->m);
+	g->value += n;
+}
+
+static inline void metrics_gauge_set(struct metrics_gauge *g, int64_t v)
+{
+	if (_shl_unlikely_(!g->m.registered))
+		metrics_register(&g->m);
+	g->value = v;
+}
+
+static inline unsigned int metrics_hist_bucket(uint64_t v)
+{
+	unsigned int e;
+
+	if (v < METRICS_HIST_SUB)
+		return v;
+
+	e = 63 - __builtin_clzll(v);
+	if (e >= METRICS_HIST_MAX_BITS)
+		return METRICS_HIST_BUCKETS - 1;
+
+	return (e - METRICS_HIST_SUB_BITS + 1) << METRICS_HIST_SUB_BITS |
+	       ((v >> (e - METRICS_HIST_SUB_BITS)) & (METRICS_HIST_SUB - 1));
+}
+
+uint64_t metrics_hist_bucket_low(unsigned int bucket);
+uint64_t metrics_hist_percentile(struct metrics_hist *h, unsigned int pct);
+
+/* record into a histogram owned by some object, it is never registered */
+static inline void metrics_hist_add(struct metrics_hist *h, uint64_t v)
+{
+	if (!h->count || v < h->min)
+		h->min = v;
+	if (v > h->max)
+		h->max = v;
+	++h->count;
+	h->sum += v;
+	++h->buckets[metrics_hist_bucket(v)];
+}
+
+static inline void metrics_hist_record(struct metrics_hist *h, uint64_t v)
+{
+	if (_shl_unlikely_(!h->m.registered))
+		metrics_register(&h->m);
+
+	metrics_hist_add(h, v);
+}
+
+/* monotonic nanoseconds, for timing hot paths finer than shl_now() */
+static inline uint64_t metrics_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#endif /* MIRACLE_METRICS_H */
@@ -0,0 +1,58 @@
+/*
+ * MiracleCast - Wifi-Display/Miracast Implementation
+ *
+ * MiracleCast is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * MiracleCast is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with MiracleCast; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Static Tracepoints
+ * USDT probes for bpftrace/perf, provider "miraclecast". With HAVE_SDT each
+ * probe is a single nop plus a note in the ELF; without it they compile to
+ * nothing and their arguments are not evaluated. List them with:
+ *   bpftrace -l 'usdt:/usr/bin/miracle-wifid:miraclecast:*'
+ * Examples are in res/bpftrace/.
+ *
+ * Message probes pass (type, size, cookie) where they have them. String
+ * arguments are plain pointers, use str() in bpftrace.
+ */
+
+#ifndef MIRACLE_PROBES_H
+#define MIRACLE_PROBES_H
+
+#ifdef HAVE_SDT
+
+#include <sys/sdt.h>
+
+#define MIRACLE_PROBE(_name) \
+	DTRACE_PROBE(miraclecast, _name)
+#define MIRACLE_PROBE1(_name, _a1) \
+	DTRACE_PROBE1(miraclecast, _name, _a1)
+#define MIRACLE_PROBE2(_name, _a1, _a2) \
+	DTRACE_PROBE2(miraclecast, _name, _a1, _a2)
+#define MIRACLE_PROBE3(_name, _a1, _a2, _a3) \
+	DTRACE_PROBE3(miraclecast, _name, _a1, _a2, _a3)
+#define MIRACLE_PROBE4(_name, _a1, _a2, _a3, _a4) \
+	DTRACE_PROBE4(miraclecast, _name, _a1, _a2, _a3, _a4)
+
+#else /* HAVE_SDT */
+
+#define MIRACLE_PROBE(_name) do { } while (0)
+#define MIRACLE_PROBE1(_name, _a1) do { } while (0)
+#define MIRACLE_PROBE2(_name, _a1, _a2) do { } while (0)
+#define MIRACLE_PROBE3(_name, _a1, _a2, _a3) do { } while (0)
+#define MIRACLE_PROBE4(_name, _a1, _a2, _a3, _a4) do { } while (0)
+
+#endif /* HAVE_SDT */
+
+#endif /* MIRACLE_PROBES_H */
@@ -31,12 +31,17 @@
 #include <systemd/sd-event.h>
 #include <time.h>
 #include <unistd.h>
+#include "loopstat.h"
+#include "metrics.h"
+#include "probes.h"
 #include "rtsp.h"
 #include "shl_dlist.h"
 #include "shl_htable.h"
 #include "shl_macro.h"
 #include "shl_ring.h"
 #include "shl_util.h"
+#include "trace.h"
+#include "uring.h"
 
 /* 5s default timeout for messages */
 #define RTSP_DEFAULT_TIMEOUT (5ULL * 1000ULL * 1000ULL)
@@ -51,6 +56,7 @@ struct rtsp {
 	uint64_t cookies;
 	int fd;
 	sd_event_source *fd_source;
+	struct uring_sock *uring;
 
 	sd_event *event;
 	int64_t priority;
@@ -59,6 +65,11 @@ struct rtsp {
 	/* outgoing messages */
 	struct shl_dlist outgoing;
 	size_t outgoing_cnt;
+	size_t outgoing_size;
+
+	struct rtsp_limits limits;
+	rtsp_watermark_fn watermark_fn;
+	void *watermark_data;
 
 	/* waiting messages */
 	struct shl_htable waiting;
@@ -69,6 +80,7 @@ struct rtsp {
 		struct rtsp_message *m;
 		struct shl_ring buf;
 		size_t buflen;
+		size_t headers;
 
 		enum {
 			STATE_NEW,
@@ -92,6 +104,7 @@ struct rtsp {
 
 	bool is_dead : 1;
 	bool is_calling : 1;
+	bool is_congested : 1;
 };
 
 struct rtsp_match {
@@ -187,6 +200,28 @@ static void rtsp_free_match(struct rtsp_match *match);
 static void rtsp_drop_message(struct rtsp_message *m);
 static int rtsp_incoming_message(struct rtsp_message *m);
 
+static METRICS_COUNTER(rtsp_rx_bytes, "rtsp.rx_bytes",
+		       "bytes received on RTSP buses");
+static METRICS_COUNTER(rtsp_tx_bytes, "rtsp.tx_bytes",
+		       "bytes sent on RTSP buses");
+static METRICS_COUNTER(rtsp_rx_messages, "rtsp.rx_messages",
+		       "RTSP messages received");
+static METRICS_COUNTER(rtsp_tx_messages, "rtsp.tx_messages",
+		       "RTSP messages sent");
+static METRICS_COUNTER(rtsp_io_calls, "rtsp.io_calls",
+		       "recv() and send() calls of the epoll backend");
+static METRICS_COUNTER(rtsp_timeouts, "rtsp.timeouts",
+		       "RTSP requests that got no reply in time");
+static METRICS_COUNTER(rtsp_rejected, "rtsp.rejected",
+		       "incoming messages over the parser limits");
+static METRICS_COUNTER(rtsp_outgoing_full, "rtsp.outgoing_full",
+		       "messages refused because the outgoing queue was full");
+static METRICS_HIST(rtsp_parse_time, "rtsp.parse_time", "ns",
+		    "parser time per received chunk");
+
+/* handler time within the current rtsp_read(), not counted as parse time */
+static uint64_t rtsp_handler_ns;
+
 /*
  * Helpers
  * Some helpers that don't really belong into a specific group.
@@ -222,6 +257,7 @@ static const char *code_descriptions[] = {
 	[RTSP_CODE_REQUEST_ENTITY_TOO_LARGE]			= "Request Entity Too Large",
 	[RTSP_CODE_REQUEST_URI_TOO_LARGE]			= "Request-URI too Large",
 	[RTSP_CODE_UNSUPPORTED_MEDIA_TYPE]			= "Unsupported Media Type",
+	[RTSP_CODE_REQUEST_HEADER_FIELDS_TOO_LARGE]		= "Request Header Fields Too Large",
 
 	[RTSP_CODE_PARAMETER_NOT_UNDERSTOOD]			= "Parameter not Understood",
 	[RTSP_CODE_CONFERENCE_NOT_FOUND]			= "Conference not Found",
@@ -1034,22 +1070,105 @@ int rtsp_message_append_basic(struct rtsp_message *m,
 	return r;
 }
 
-int rtsp_message_appendv_basic(struct rtsp_message *m,
-			       char type,
-			       va_list *args)
+/*
+ * Compiled Types
+ * Type characters map to dense opcodes via rtsp_type_ops[], stored off by one
+ * so 0 marks invalid characters.
+ */
+
+static const uint8_t rtsp_type_ops[256] = {
+	[RTSP_TYPE_STRING]		= RTSP_OP_STRING + 1,
+	[RTSP_TYPE_INT32]		= RTSP_OP_INT32 + 1,
+	[RTSP_TYPE_UINT32]		= RTSP_OP_UINT32 + 1,
+	[RTSP_TYPE_HEX32]		= RTSP_OP_HEX32 + 1,
+	[RTSP_TYPE_SKIP]		= RTSP_OP_SKIP + 1,
+	[RTSP_TYPE_RAW]			= RTSP_OP_RAW + 1,
+	[RTSP_TYPE_HEADER_START]	= RTSP_OP_HEADER_START + 1,
+	[RTSP_TYPE_HEADER_END]		= RTSP_OP_HEADER_END + 1,
+	[RTSP_TYPE_BODY_START]		= RTSP_OP_BODY_START + 1,
+	[RTSP_TYPE_BODY_END]		= RTSP_OP_BODY_END + 1,
+};
+
+static int rtsp_type_to_op(char type)
+{
+	uint8_t op = rtsp_type_ops[(unsigned char)type];
+
+	return op ? op - 1 : -EINVAL;
+}
+
+/*
+ * Checks what the builders can check without a message: known types, at most
+ * RTSP_TYPES_MAX of them, no nested headers, headers only at the top or
+ * inside the body, values other than raw only inside headers, and everything
+ * closed again at the end.
+ */
+int rtsp_types_compile(struct rtsp_types *t, const char *types)
+{
+	bool header = false, body = false;
+	unsigned int n = 0;
+	int op;
+
+	if (!t || !types)
+		return -EINVAL;
+
+	for ( ; *types; ++types) {
+		if (n >= RTSP_TYPES_MAX)
+			return -E2BIG;
+
+		op = rtsp_type_to_op(*types);
+		if (op < 0)
+			return op;
+
+		switch (op) {
+		case RTSP_OP_HEADER_START:
+			if (header)
+				return -EINVAL;
+			header = true;
+			break;
+		case RTSP_OP_HEADER_END:
+			if (!header)
+				return -EINVAL;
+			header = false;
+			break;
+		case RTSP_OP_BODY_START:
+			if (header || body)
+				return -EINVAL;
+			body = true;
+			break;
+		case RTSP_OP_BODY_END:
+			if (header || !body)
+				return -EINVAL;
+			body = false;
+			break;
+		case RTSP_OP_RAW:
+			break;
+		default:
+			if (!header)
+				return -EINVAL;
+			break;
+		}
+
+		t->ops[n++] = op;
+	}
+
+	if (header || body)
+		return -EINVAL;
+
+	t->n = n;
+	return 0;
+}
+
+static int rtsp_message_appendv_op(struct rtsp_message *m,
+				   unsigned int op,
+				   va_list *args)
 {
 	char buf[128] = { };
 	const char *orig;
 	uint32_t u32;
 	int32_t i32;
 
-	if (!m || m->type == RTSP_MESSAGE_DATA)
-		return -EINVAL;
-	if (m->is_sealed)
-		return -EBUSY;
-
-	switch (type) {
-	case RTSP_TYPE_RAW:
+	switch (op) {
+	case RTSP_OP_RAW:
 		orig = va_arg(*args, const char*);
 		if (!orig)
 			orig = "";
@@ -1061,34 +1180,34 @@ int rtsp_message_appendv_basic(struct rtsp_message *m,
 						     false);
 		else
 			return rtsp_message_append_line(m, orig);
-	case RTSP_TYPE_HEADER_START:
+	case RTSP_OP_HEADER_START:
 		orig = va_arg(*args, const char*);
 
 		return rtsp_message_open_header(m, orig);
-	case RTSP_TYPE_HEADER_END:
+	case RTSP_OP_HEADER_END:
 		return rtsp_message_close_header(m);
-	case RTSP_TYPE_BODY_START:
+	case RTSP_OP_BODY_START:
 		return rtsp_message_open_body(m);
-	case RTSP_TYPE_BODY_END:
+	case RTSP_OP_BODY_END:
 		return rtsp_message_close_body(m);
 	}
 
 	if (!m->iter_header)
 		return -EINVAL;
 
-	switch (type) {
-	case RTSP_TYPE_STRING:
+	switch (op) {
+	case RTSP_OP_STRING:
 		orig = va_arg(*args, const char*);
 		if (!orig)
 			orig = "";
 
 		break;
-	case RTSP_TYPE_INT32:
+	case RTSP_OP_INT32:
 		i32 = va_arg(*args, int32_t);
 		sprintf(buf, "%" PRId32, i32);
 		orig = buf;
 		break;
-	case RTSP_TYPE_UINT32:
+	case RTSP_OP_UINT32:
 		u32 = va_arg(*args, uint32_t);
 		sprintf(buf, "%" PRIu32, u32);
 		orig = buf;
@@ -1100,6 +1219,24 @@ int rtsp_message_appendv_basic(struct rtsp_message *m,
 	return rtsp_header_append_token(m->iter_header, orig);
 }
 
+int rtsp_message_appendv_basic(struct rtsp_message *m,
+			       char type,
+			       va_list *args)
+{
+	int op;
+
+	if (!m || m->type == RTSP_MESSAGE_DATA)
+		return -EINVAL;
+	if (m->is_sealed)
+		return -EBUSY;
+
+	op = rtsp_type_to_op(type);
+	if (op < 0)
+		return op;
+
+	return rtsp_message_appendv_op(m, op, args);
+}
+
 int rtsp_message_append(struct rtsp_message *m,
 			const char *types,
 			...)
@@ -1128,7 +1265,9 @@ int rtsp_message_appendv(struct rtsp_message *m,
 		return 0;
 
 	for ( ; *types; ++types) {
-		r = rtsp_message_appendv_basic(m, *types, args);
+		r = rtsp_type_to_op(*types);
+		if (r >= 0)
+			r = rtsp_message_appendv_op(m, r, args);
 		if (r < 0)
 			return r;
 	}
@@ -1136,6 +1275,30 @@ int rtsp_message_appendv(struct rtsp_message *m,
 	return 0;
 }
 
+int rtsp_message_append_types(struct rtsp_message *m,
+			      const struct rtsp_types *t,
+			      ...)
+{
+	va_list args;
+	unsigned int i;
+	int r = 0;
+
+	if (!m || m->type == RTSP_MESSAGE_DATA || !t)
+		return -EINVAL;
+	if (m->is_sealed)
+		return -EBUSY;
+
+	va_start(args, t);
+	for (i = 0; i < t->n; ++i) {
+		r = rtsp_message_appendv_op(m, t->ops[i], &args);
+		if (r < 0)
+			break;
+	}
+	va_end(args);
+
+	return r;
+}
+
 static int rtsp_message_serialize_common(struct rtsp_message *m)
 {
 	_shl_free_ char *head = NULL, *headers = NULL, *body = NULL;
@@ -1480,22 +1643,17 @@ int rtsp_message_read_basic(struct rtsp_message *m,
 	return r;
 }
 
-int rtsp_message_readv_basic(struct rtsp_message *m,
-			     char type,
-			     va_list *args)
+static int rtsp_message_readv_op(struct rtsp_message *m,
+				 unsigned int op,
+				 va_list *args)
 {
 	const char *key;
 	const char **out_str, *entry;
 	int32_t i32, *out_i32;
 	uint32_t u32, *out_u32;
 
-	if (!m || m->type == RTSP_MESSAGE_DATA)
-		return -EINVAL;
-	if (!m->is_sealed)
-		return -EBUSY;
-
-	switch (type) {
-	case RTSP_TYPE_RAW:
+	switch (op) {
+	case RTSP_OP_RAW:
 		if (!m->iter_header)
 			return -EINVAL;
 
@@ -1504,16 +1662,16 @@ int rtsp_message_readv_basic(struct rtsp_message *m,
 			*out_str = m->iter_header->value ? : "";
 
 		return 0;
-	case RTSP_TYPE_HEADER_START:
+	case RTSP_OP_HEADER_START:
 		key = va_arg(*args, const char*);
 
 		return rtsp_message_enter_header(m, key);
-	case RTSP_TYPE_HEADER_END:
+	case RTSP_OP_HEADER_END:
 		rtsp_message_exit_header(m);
 		return 0;
-	case RTSP_TYPE_BODY_START:
+	case RTSP_OP_BODY_START:
 		return rtsp_message_enter_body(m);
-	case RTSP_TYPE_BODY_END:
+	case RTSP_OP_BODY_END:
 		rtsp_message_exit_body(m);
 		return 0;
 	}
@@ -1525,14 +1683,14 @@ int rtsp_message_readv_basic(struct rtsp_message *m,
 
 	entry = m->iter_header->tokens[m->iter_token];
 
-	switch (type) {
-	case RTSP_TYPE_STRING:
+	switch (op) {
+	case RTSP_OP_STRING:
 		out_str = va_arg(*args, const char**);
 		if (out_str)
 			*out_str = entry;
 
 		break;
-	case RTSP_TYPE_INT32:
+	case RTSP_OP_INT32:
 		if (sscanf(entry, "%" SCNd32, &i32) != 1)
 			return -EINVAL;
 
@@ -1541,7 +1699,7 @@ int rtsp_message_readv_basic(struct rtsp_message *m,
 			*out_i32 = i32;
 
 		break;
-	case RTSP_TYPE_UINT32:
+	case RTSP_OP_UINT32:
 		if (sscanf(entry, "%" SCNu32, &u32) != 1)
 			return -EINVAL;
 
@@ -1550,7 +1708,7 @@ int rtsp_message_readv_basic(struct rtsp_message *m,
 			*out_u32 = u32;
 
 		break;
-	case RTSP_TYPE_HEX32:
+	case RTSP_OP_HEX32:
 		if (sscanf(entry, "%" SCNx32, &u32) != 1)
 			return -EINVAL;
 
@@ -1559,7 +1717,7 @@ int rtsp_message_readv_basic(struct rtsp_message *m,
 			*out_u32 = u32;
 
 		break;
-	case RTSP_TYPE_SKIP:
+	case RTSP_OP_SKIP:
 		/* just increment token */
 		break;
 	default:
@@ -1571,6 +1729,33 @@ int rtsp_message_readv_basic(struct rtsp_message *m,
 	return 0;
 }
 
+int rtsp_message_readv_basic(struct rtsp_message *m,
+			     char type,
+			     va_list *args)
+{
+	int op;
+
+	if (!m || m->type == RTSP_MESSAGE_DATA)
+		return -EINVAL;
+	if (!m->is_sealed)
+		return -EBUSY;
+
+	op = rtsp_type_to_op(type);
+	if (op < 0)
+		return op;
+
+	return rtsp_message_readv_op(m, op, args);
+}
+
+/* on errors, leave the header and body again so the next read starts fresh */
+static void rtsp_message_read_abort(struct rtsp_message *m)
+{
+	if (m->iter_body)
+		rtsp_message_exit_body(m);
+	if (m->iter_header)
+		rtsp_message_exit_header(m);
+}
+
 int rtsp_message_read(struct rtsp_message *m,
 		      const char *types,
 		      ...)
@@ -1599,12 +1784,11 @@ int rtsp_message_readv(struct rtsp_message *m,
 		return 0;
 
 	for ( ; *types; ++types) {
-		r = rtsp_message_readv_basic(m, *types, args);
+		r = rtsp_type_to_op(*types);
+		if (r >= 0)
+			r = rtsp_message_readv_op(m, r, args);
 		if (r < 0) {
-			if (m->iter_body)
-				rtsp_message_exit_body(m);
-			if (m->iter_header)
-				rtsp_message_exit_header(m);
+			rtsp_message_read_abort(m);
 			return r;
 		}
 	}
@@ -1612,6 +1796,32 @@ int rtsp_message_readv(struct rtsp_message *m,
 	return 0;
 }
 
+int rtsp_message_read_types(struct rtsp_message *m,
+			    const struct rtsp_types *t,
+			    ...)
+{
+	va_list args;
+	unsigned int i;
+	int r = 0;
+
+	if (!m || m->type == RTSP_MESSAGE_DATA || !t)
+		return -EINVAL;
+	if (!m->is_sealed)
+		return -EBUSY;
+
+	va_start(args, t);
+	for (i = 0; i < t->n; ++i) {
+		r = rtsp_message_readv_op(m, t->ops[i], &args);
+		if (r < 0) {
+			rtsp_message_read_abort(m);
+			break;
+		}
+	}
+	va_end(args);
+
+	return r;
+}
+
 int rtsp_message_skip_basic(struct rtsp_message *m, char type)
 {
 	return rtsp_message_read_basic(m, type, NULL, NULL, NULL, NULL);
@@ -2072,6 +2282,32 @@ int rtsp_message_new_from_raw(struct rtsp *bus,
  * the message and continue parsing the next one.
  */
 
+/*
+ * Once a message exceeds our limits, the stream cannot be trusted to be in
+ * sync anymore. Answer the request if we know its CSeq, then discard all
+ * further input; rtsp_io_fn() hangs up once the reply is sent.
+ */
+static void parser_reject(struct rtsp *bus, unsigned int code)
+{
+	_rtsp_message_unref_ struct rtsp_message *rep = NULL;
+	struct rtsp_parser *dec = &bus->parser;
+	int r;
+
+	metrics_counter_inc(&rtsp_rejected);
+
+	if (code && dec->m && dec->m->type == RTSP_MESSAGE_REQUEST &&
+	    dec->m->cookie & RTSP_FLAG_REMOTE_COOKIE) {
+		r = rtsp_message_new_reply(bus, &rep, dec->m->cookie, code,
+					   NULL);
+		if (r >= 0)
+			rtsp_send(bus, rep);
+	}
+
+	rtsp_message_unref(dec->m);
+	dec->m = NULL;
+	dec->dead = true;
+}
+
 static int parser_append_header(struct rtsp *bus,
 				char *line)
 {
@@ -2097,6 +2333,12 @@ static int parser_append_header(struct rtsp *bus,
 		if (r < 0 || *next)
 			return -EINVAL;
 
+		if (bus->limits.max_body && clen > bus->limits.max_body) {
+			parser_reject(bus,
+				      RTSP_CODE_REQUEST_ENTITY_TOO_LARGE);
+			return 0;
+		}
+
 		/* overwrite previous lengths */
 		dec->remaining_body = clen;
 	} else if (h == dec->m->header_cseq) {
@@ -2128,10 +2370,16 @@ static int parser_finish_header_line(struct rtsp *bus)
 	line[dec->buflen] = 0;
 	sanitize_line(line, dec->buflen);
 
-	if (!dec->m)
-		r = rtsp_message_from_head(bus, &dec->m, line);
-	else
-		r = parser_append_header(bus, line);
+	if (!dec->m) {
+		dec->headers = 0;
+		return rtsp_message_from_head(bus, &dec->m, line);
+	}
+
+	/* parse the line anyway, so we can reply with its CSeq */
+	r = parser_append_header(bus, line);
+	if (r >= 0 && !dec->dead && bus->limits.max_headers &&
+	    ++dec->headers > bus->limits.max_headers)
+		parser_reject(bus, RTSP_CODE_REQUEST_HEADER_FIELDS_TOO_LARGE);
 
 	return r;
 }
@@ -2454,6 +2702,11 @@ static int parser_feed_char_data_head(struct rtsp *bus, char ch)
 		dec->data_channel = buf[0];
 		dec->data_size = (((uint16_t)buf[1]) << 8) | (uint16_t)buf[2];
 		dec->state = STATE_DATA_BODY;
+
+		/* data frames have no CSeq to reply to */
+		if (bus->limits.max_data &&
+		    dec->data_size > bus->limits.max_data)
+			parser_reject(bus, 0);
 	}
 
 	return 0;
@@ -2521,6 +2774,14 @@ static int parser_feed_char(struct rtsp *bus, char ch)
 		break;
 	}
 
+	if (r < 0 || dec->dead)
+		return r;
+
+	/* the body is bounded by max_body, anything else by max_line */
+	if (bus->limits.max_line && dec->buflen > bus->limits.max_line &&
+	    dec->state != STATE_BODY && dec->state != STATE_DATA_BODY)
+		parser_reject(bus, RTSP_CODE_REQUEST_HEADER_FIELDS_TOO_LARGE);
+
 	return r;
 }
 
@@ -2534,6 +2795,8 @@ static int rtsp_parse_data(struct rtsp *bus,
 
 	if (!len)
 		return -EAGAIN;
+	if (dec->dead)
+		return 0;
 
 	/*
 	 * We keep dec->buflen as cache for the current parsed-buffer size. We
@@ -2552,6 +2815,12 @@ static int rtsp_parse_data(struct rtsp *bus,
 		if (r < 0)
 			return r;
 
+		if (dec->dead) {
+			shl_ring_flush(&dec->buf);
+			dec->buflen = 0;
+			return 0;
+		}
+
 		dec->last_chr = buf[i];
 	}
 
@@ -2661,8 +2930,35 @@ static int rtsp_hup(struct rtsp *bus)
 	return rtsp_call(bus, NULL);
 }
 
+/*
+ * Request/reply pairs are traced as "request" spans keyed by CSeq, in
+ * "rtsp.out" for our requests and "rtsp.in" for the remote's.
+ */
+static void rtsp_trace_message(struct rtsp_message *m, bool incoming)
+{
+	uint64_t cseq = m->cookie & ~RTSP_FLAG_REMOTE_COOKIE;
+	char buf[64];
+
+	if (!trace_enabled())
+		return;
+
+	switch (m->type) {
+	case RTSP_MESSAGE_REQUEST:
+		trace_begin(incoming ? "rtsp.in" : "rtsp.out", "request", cseq,
+			    m->request_method);
+		break;
+	case RTSP_MESSAGE_REPLY:
+		snprintf(buf, sizeof(buf), "%u %s", m->reply_code,
+			 m->reply_phrase ? : "");
+		trace_end(incoming ? "rtsp.out" : "rtsp.in", "request", cseq,
+			  buf);
+		break;
+	}
+}
+
 static int rtsp_timer_fn(sd_event_source *src, uint64_t usec, void *data)
 {
+	LOOPSTAT("rtsp.timer");
 	struct rtsp_message *m = data;
 	int r;
 
@@ -2671,6 +2967,8 @@ static int rtsp_timer_fn(sd_event_source *src, uint64_t usec, void *data)
 
 	sd_event_source_set_enabled(m->timer_source, SD_EVENT_OFF);
 	rtsp_drop_message(m);
+	metrics_counter_inc(&rtsp_timeouts);
+	trace_end("rtsp.out", "request", m->cookie, "timeout");
 	r = rtsp_call_message(m, NULL);
 
 	rtsp_message_unref(m);
@@ -2734,6 +3032,7 @@ static void rtsp_link_outgoing(struct rtsp_message *m)
 	shl_dlist_link_tail(&m->bus->outgoing, &m->list);
 	m->is_outgoing = true;
 	++m->bus->outgoing_cnt;
+	m->bus->outgoing_size += m->raw_size;
 	rtsp_message_ref(m);
 }
 
@@ -2744,13 +3043,40 @@ static void rtsp_unlink_outgoing(struct rtsp_message *m)
 		m->is_outgoing = false;
 		m->is_sending = false;
 		--m->bus->outgoing_cnt;
+		m->bus->outgoing_size -= m->raw_size;
 		rtsp_message_unref(m);
 	}
 }
 
+/* called whenever the queue grows or shrinks, but never while tearing down */
+static void rtsp_check_watermarks(struct rtsp *bus)
+{
+	const struct rtsp_limits *l = &bus->limits;
+
+	if (!bus->is_congested) {
+		if (!l->outgoing_high || bus->outgoing_size < l->outgoing_high)
+			return;
+		bus->is_congested = true;
+	} else {
+		if (bus->outgoing_size > l->outgoing_low)
+			return;
+		bus->is_congested = false;
+	}
+
+	if (bus->watermark_fn)
+		bus->watermark_fn(bus, bus->is_congested, bus->watermark_data);
+}
+
 static int rtsp_incoming_message(struct rtsp_message *m)
 {
-	int r;
+	uint64_t start;
+	int r = 0;
+
+	metrics_counter_inc(&rtsp_rx_messages);
+	MIRACLE_PROBE3(rtsp_message_in, m->type, m->raw_size,
+		       m->cookie & ~RTSP_FLAG_REMOTE_COOKIE);
+	rtsp_trace_message(m, true);
+	start = metrics_now_ns();
 
 	switch (m->type) {
 	case RTSP_MESSAGE_UNKNOWN:
@@ -2758,20 +3084,35 @@ static int rtsp_incoming_message(struct rtsp_message *m)
 	case RTSP_MESSAGE_DATA:
 		/* simply forward all these to the match-handlers */
 		r = rtsp_call(m->bus, m);
-		if (r < 0)
-			return r;
-
 		break;
 	case RTSP_MESSAGE_REPLY:
 		/* find the waiting request and invoke the handler */
 		r = rtsp_call_reply(m->bus, m);
-		if (r < 0)
-			return r;
-
 		break;
 	}
 
-	return 0;
+	rtsp_handler_ns += metrics_now_ns() - start;
+	MIRACLE_PROBE3(rtsp_message_done, m->type, m->raw_size,
+		       m->cookie & ~RTSP_FLAG_REMOTE_COOKIE);
+
+	return r < 0 ? r : 0;
+}
+
+static int rtsp_feed(struct rtsp *bus, const char *buf, size_t len)
+{
+	uint64_t start;
+	int r;
+
+	metrics_counter_add(&rtsp_rx_bytes, len);
+
+	/* parses all messages and calls rtsp_incoming_message() for each */
+	rtsp_handler_ns = 0;
+	start = metrics_now_ns();
+	r = rtsp_parse_data(bus, buf, len);
+	metrics_hist_record(&rtsp_parse_time,
+			    metrics_now_ns() - start - rtsp_handler_ns);
+
+	return r;
 }
 
 static int rtsp_read(struct rtsp *bus)
@@ -2779,6 +3120,7 @@ static int rtsp_read(struct rtsp *bus)
 	char buf[4096];
 	ssize_t res;
 
+	metrics_counter_inc(&rtsp_io_calls);
 	res = recv(bus->fd,
 		   buf,
 		   sizeof(buf),
@@ -2795,8 +3137,22 @@ static int rtsp_read(struct rtsp *bus)
 		res = sizeof(buf);
 	}
 
-	/* parses all messages and calls rtsp_incoming_message() for each */
-	return rtsp_parse_data(bus, buf, res);
+	return rtsp_feed(bus, buf, res);
+}
+
+static void rtsp_finish_message(struct rtsp_message *m)
+{
+	metrics_counter_inc(&rtsp_tx_messages);
+	MIRACLE_PROBE3(rtsp_message_out, m->type, m->raw_size,
+		       m->cookie & ~RTSP_FLAG_REMOTE_COOKIE);
+	rtsp_trace_message(m, false);
+
+	/* no need to wait for answer if no-body listens */
+	if (!m->cb_fn)
+		rtsp_unlink_waiting(m);
+
+	/* might destroy the message */
+	rtsp_unlink_outgoing(m);
 }
 
 static int rtsp_write_message(struct rtsp_message *m)
@@ -2806,6 +3162,7 @@ static int rtsp_write_message(struct rtsp_message *m)
 
 	m->is_sending = true;
 	remaining = m->raw_size - m->sent;
+	metrics_counter_inc(&rtsp_io_calls);
 	res = send(m->bus->fd,
 		   &m->raw[m->sent],
 		   remaining,
@@ -2820,14 +3177,9 @@ static int rtsp_write_message(struct rtsp_message *m)
 	}
 
 	m->sent += res;
-	if (m->sent >= m->raw_size) {
-		/* no need to wait for answer if no-body listens */
-		if (!m->cb_fn)
-			rtsp_unlink_waiting(m);
-
-		/* might destroy the message */
-		rtsp_unlink_outgoing(m);
-	}
+	metrics_counter_add(&rtsp_tx_bytes, res);
+	if (m->sent >= m->raw_size)
+		rtsp_finish_message(m);
 
 	return 0;
 }
@@ -2835,19 +3187,27 @@ static int rtsp_write_message(struct rtsp_message *m)
 static int rtsp_write(struct rtsp *bus)
 {
 	struct rtsp_message *m;
+	int r;
 
 	if (shl_dlist_empty(&bus->outgoing))
 		return 0;
 
 	m = shl_dlist_first_entry(&bus->outgoing, struct rtsp_message, list);
-	return rtsp_write_message(m);
+	r = rtsp_write_message(m);
+	if (r >= 0)
+		rtsp_check_watermarks(bus);
+
+	return r;
 }
 
 static int rtsp_io_fn(sd_event_source *src, int fd, uint32_t mask, void *data)
 {
+	LOOPSTAT("rtsp.io");
 	struct rtsp *bus = data;
 	int r, write_r;
 
+	MIRACLE_PROBE2(rtsp_io, fd, mask);
+
 	/* make sure bus stays around during any possible callbacks */
 	rtsp_ref(bus);
 
@@ -2891,10 +3251,90 @@ static int rtsp_io_fn(sd_event_source *src, int fd, uint32_t mask, void *data)
 error:
 	r = rtsp_hup(bus);
 out:
+	/* a rejected stream is closed once our error reply is out */
+	if (!bus->is_dead && bus->parser.dead &&
+	    shl_dlist_empty(&bus->outgoing))
+		r = rtsp_hup(bus);
+
 	rtsp_unref(bus);
 	return r;
 }
 
+/*
+ * With io_uring, messages are handed to the ring as soon as they are queued
+ * and stay on the outgoing list until their send completes. Sends complete in
+ * order, so each completion belongs to the first message on the list.
+ */
+
+static int rtsp_uring_send(struct rtsp_message *m)
+{
+	int r;
+
+	r = uring_sock_send(m->bus->uring, &m->raw[m->sent],
+			    m->raw_size - m->sent);
+	if (r < 0)
+		return r;
+
+	m->is_sending = true;
+	return 0;
+}
+
+static void rtsp_uring_recv_fn(struct uring_sock *s,
+			       const void *buf,
+			       size_t len,
+			       int error,
+			       void *data)
+{
+	LOOPSTAT("rtsp.io");
+	struct rtsp *bus = data;
+	int r;
+
+	MIRACLE_PROBE2(rtsp_io, bus->fd, EPOLLIN);
+	rtsp_ref(bus);
+
+	if (error < 0)
+		r = error;
+	else if (!len)
+		r = -EPIPE;
+	else
+		r = rtsp_feed(bus, buf, len);
+
+	if (r < 0 || (bus->parser.dead && shl_dlist_empty(&bus->outgoing)))
+		rtsp_hup(bus);
+
+	rtsp_unref(bus);
+}
+
+static void rtsp_uring_sent_fn(struct uring_sock *s, int error, void *data)
+{
+	LOOPSTAT("rtsp.io");
+	struct rtsp *bus = data;
+	struct rtsp_message *m;
+
+	MIRACLE_PROBE2(rtsp_io, bus->fd, EPOLLOUT);
+	if (shl_dlist_empty(&bus->outgoing))
+		return;
+
+	rtsp_ref(bus);
+
+	if (error < 0) {
+		rtsp_hup(bus);
+		goto out;
+	}
+
+	m = shl_dlist_first_entry(&bus->outgoing, struct rtsp_message, list);
+	metrics_counter_add(&rtsp_tx_bytes, m->raw_size - m->sent);
+	m->sent = m->raw_size;
+	rtsp_finish_message(m);
+	rtsp_check_watermarks(bus);
+
+	if (bus->parser.dead && shl_dlist_empty(&bus->outgoing))
+		rtsp_hup(bus);
+
+out:
+	rtsp_unref(bus);
+}
+
 static int rtsp_io_prepare_fn(sd_event_source *src, void *data)
 {
 	struct rtsp *bus = data;
@@ -2925,6 +3365,7 @@ int rtsp_open(struct rtsp **out, int fd)
 
 	bus->ref = 1;
 	bus->fd = fd;
+	bus->limits = (struct rtsp_limits)RTSP_LIMITS_DEFAULT;
 	shl_dlist_init(&bus->matches);
 	shl_dlist_init(&bus->outgoing);
 	shl_htable_init_u64(&bus->waiting);
@@ -3019,9 +3460,47 @@ bool rtsp_is_dead(struct rtsp *bus)
 	return !bus || bus->is_dead;
 }
 
+void rtsp_get_limits(struct rtsp *bus, struct rtsp_limits *limits)
+{
+	if (!bus || !limits)
+		return;
+
+	*limits = bus->limits;
+}
+
+int rtsp_set_limits(struct rtsp *bus, const struct rtsp_limits *limits)
+{
+	if (!bus || !limits)
+		return -EINVAL;
+	if (limits->outgoing_high &&
+	    limits->outgoing_low >= limits->outgoing_high)
+		return -EINVAL;
+	if (limits->max_outgoing && limits->outgoing_high > limits->max_outgoing)
+		return -EINVAL;
+
+	bus->limits = *limits;
+	return 0;
+}
+
+/* @fn is called with @high set once congested and without once drained */
+void rtsp_set_watermark_fn(struct rtsp *bus, rtsp_watermark_fn fn, void *data)
+{
+	if (!bus)
+		return;
+
+	bus->watermark_fn = fn;
+	bus->watermark_data = data;
+}
+
+size_t rtsp_get_outgoing_size(struct rtsp *bus)
+{
+	return bus ? bus->outgoing_size : 0;
+}
+
 int rtsp_attach_event(struct rtsp *bus, sd_event *event, int priority)
 {
 	struct rtsp_message *m;
+	struct shl_dlist *i;
 	int r;
 
 	if (!bus)
@@ -3042,22 +3521,42 @@ int rtsp_attach_event(struct rtsp *bus, sd_event *event, int priority)
 
 	bus->priority = priority;
 
-	r = sd_event_add_io(bus->event,
-			    &bus->fd_source,
-			    bus->fd,
-			    EPOLLHUP | EPOLLERR | EPOLLIN,
-			    rtsp_io_fn,
-			    bus);
-	if (r < 0)
-		goto error;
+	/* io_uring if we have it, readiness through epoll otherwise */
+	r = uring_sock_new(&bus->uring,
+			   bus->event,
+			   priority,
+			   bus->fd,
+			   4096,
+			   16,
+			   rtsp_uring_recv_fn,
+			   rtsp_uring_sent_fn,
+			   bus);
+	if (r >= 0) {
+		shl_dlist_for_each(i, &bus->outgoing) {
+			m = shl_dlist_entry(i, struct rtsp_message, list);
+			r = rtsp_uring_send(m);
+			if (r < 0)
+				goto error;
+		}
+	} else {
+		r = sd_event_add_io(bus->event,
+				    &bus->fd_source,
+				    bus->fd,
+				    EPOLLHUP | EPOLLERR | EPOLLIN,
+				    rtsp_io_fn,
+				    bus);
+		if (r < 0)
+			goto error;
 
-	r = sd_event_source_set_priority(bus->fd_source, priority);
-	if (r < 0)
-		goto error;
+		r = sd_event_source_set_priority(bus->fd_source, priority);
+		if (r < 0)
+			goto error;
 
-	r = sd_event_source_set_prepare(bus->fd_source, rtsp_io_prepare_fn);
-	if (r < 0)
-		goto error;
+		r = sd_event_source_set_prepare(bus->fd_source,
+						rtsp_io_prepare_fn);
+		if (r < 0)
+			goto error;
+	}
 
 	RTSP_FOREACH_WAITING(m, bus) {
 		/* no need to wait for timeout if no-body listens */
@@ -3098,6 +3597,8 @@ void rtsp_detach_event(struct rtsp *bus)
 		m->timer_source = NULL;
 	}
 
+	uring_sock_free(bus->uring);
+	bus->uring = NULL;
 	sd_event_source_unref(bus->fd_source);
 	bus->fd_source = NULL;
 	sd_event_unref(bus->event);
@@ -3210,6 +3711,12 @@ int rtsp_call_async(struct rtsp *bus,
 	if (!m->raw)
 		return -EINVAL;
 
+	if (bus->limits.max_outgoing &&
+	    bus->outgoing_size + m->raw_size > bus->limits.max_outgoing) {
+		metrics_counter_inc(&rtsp_outgoing_full);
+		return -ENOBUFS;
+	}
+
 	m->is_used = true;
 	m->cb_fn = cb_fn;
 	m->fn_data = data;
@@ -3233,6 +3740,16 @@ int rtsp_call_async(struct rtsp *bus,
 
 	rtsp_link_outgoing(m);
 
+	if (bus->uring) {
+		r = rtsp_uring_send(m);
+		if (r < 0) {
+			rtsp_drop_message(m);
+			return r;
+		}
+	}
+
+	rtsp_check_watermarks(bus);
+
 	if (cookie)
 		*cookie = m->cookie;
 
@@ -3241,15 +3758,25 @@ int rtsp_call_async(struct rtsp *bus,
 
 static void rtsp_drop_message(struct rtsp_message *m)
 {
+	struct rtsp *bus;
+	bool queued;
+
 	if (!m)
 		return;
 
+	bus = m->bus;
+
 	/* never interrupt messages while being partly sent */
-	if (!m->is_sending)
+	queued = m->is_outgoing && !m->is_sending;
+	if (queued)
 		rtsp_unlink_outgoing(m);
 
 	/* remove from waiting list so neither timeouts nor completions fire */
 	rtsp_unlink_waiting(m);
+
+	/* a cancelled or timed out request may have been what held us high */
+	if (queued)
+		rtsp_check_watermarks(bus);
 }
 
 void rtsp_call_async_cancel(struct rtsp *bus, uint64_t cookie)
@@ -53,6 +53,134 @@ enum {
 #define RTSP_TYPE_BODY_START			'{'
 #define RTSP_TYPE_BODY_END			'}'
 
+/*
+ * Compiled Types
+ * rtsp_message_read() and rtsp_message_append() interpret their type string
+ * on every call. A struct rtsp_types holds the same string validated and
+ * decoded into opcodes once, to be run against any number of messages with
+ * rtsp_message_read_types() and rtsp_message_append_types().
+ *
+ * rtsp_types_compile() does this at runtime. RTSP_TYPES() does it at build
+ * time for a list of type characters, rejecting unknown types, misordered or
+ * unbalanced header/body markers, values outside a header and overlong lists
+ * with a compiler error:
+ *   static const struct rtsp_types t = RTSP_TYPES('{', '<', 's', '>', '}');
+ */
+
+enum {
+	RTSP_OP_STRING,
+	RTSP_OP_INT32,
+	RTSP_OP_UINT32,
+	RTSP_OP_HEX32,
+	RTSP_OP_SKIP,
+	RTSP_OP_RAW,
+	RTSP_OP_HEADER_START,
+	RTSP_OP_HEADER_END,
+	RTSP_OP_BODY_START,
+	RTSP_OP_BODY_END,
+	RTSP_OP_CNT,
+};
+
+#define RTSP_TYPES_MAX 12
+
+struct rtsp_types {
+	uint8_t n;
+	uint8_t ops[RTSP_TYPES_MAX];
+};
+
+#define RTSP__OP(_c) \
+	((_c) == RTSP_TYPE_STRING ? RTSP_OP_STRING : \
+	 (_c) == RTSP_TYPE_INT32 ? RTSP_OP_INT32 : \
+	 (_c) == RTSP_TYPE_UINT32 ? RTSP_OP_UINT32 : \
+	 (_c) == RTSP_TYPE_HEX32 ? RTSP_OP_HEX32 : \
+	 (_c) == RTSP_TYPE_SKIP ? RTSP_OP_SKIP : \
+	 (_c) == RTSP_TYPE_RAW ? RTSP_OP_RAW : \
+	 (_c) == RTSP_TYPE_HEADER_START ? RTSP_OP_HEADER_START : \
+	 (_c) == RTSP_TYPE_HEADER_END ? RTSP_OP_HEADER_END : \
+	 (_c) == RTSP_TYPE_BODY_START ? RTSP_OP_BODY_START : \
+	 (_c) == RTSP_TYPE_BODY_END ? RTSP_OP_BODY_END : RTSP_OP_CNT)
+
+/* compiler error on unknown types */
+#define RTSP__OP_CHECKED(_c) \
+	(RTSP__OP(_c) + 0 * sizeof(char[RTSP__OP(_c) < RTSP_OP_CNT ? 1 : -1]))
+
+#define RTSP__COMMA() ,
+
+#define RTSP__MAP1(_f, _s, _a) _f(_a)
+#define RTSP__MAP2(_f, _s, _a, ...) _f(_a) _s() RTSP__MAP1(_f, _s, __VA_ARGS__)
+#define RTSP__MAP3(_f, _s, _a, ...) _f(_a) _s() RTSP__MAP2(_f, _s, __VA_ARGS__)
+#define RTSP__MAP4(_f, _s, _a, ...) _f(_a) _s() RTSP__MAP3(_f, _s, __VA_ARGS__)
+#define RTSP__MAP5(_f, _s, _a, ...) _f(_a) _s() RTSP__MAP4(_f, _s, __VA_ARGS__)
+#define RTSP__MAP6(_f, _s, _a, ...) _f(_a) _s() RTSP__MAP5(_f, _s, __VA_ARGS__)
+#define RTSP__MAP7(_f, _s, _a, ...) _f(_a) _s() RTSP__MAP6(_f, _s, __VA_ARGS__)
+#define RTSP__MAP8(_f, _s, _a, ...) _f(_a) _s() RTSP__MAP7(_f, _s, __VA_ARGS__)
+#define RTSP__MAP9(_f, _s, _a, ...) _f(_a) _s() RTSP__MAP8(_f, _s, __VA_ARGS__)
+#define RTSP__MAP10(_f, _s, _a, ...) _f(_a) _s() RTSP__MAP9(_f, _s, __VA_ARGS__)
+#define RTSP__MAP11(_f, _s, _a, ...) _f(_a) _s() RTSP__MAP10(_f, _s, __VA_ARGS__)
+#define RTSP__MAP12(_f, _s, _a, ...) _f(_a) _s() RTSP__MAP11(_f, _s, __VA_ARGS__)
+#define RTSP__MAPN(_1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, \
+		   _n, ...) _n
+#define RTSP__MAP(_f, _s, ...) \
+	RTSP__MAPN(__VA_ARGS__, RTSP__MAP12, RTSP__MAP11, RTSP__MAP10, \
+		   RTSP__MAP9, RTSP__MAP8, RTSP__MAP7, RTSP__MAP6, \
+		   RTSP__MAP5, RTSP__MAP4, RTSP__MAP3, RTSP__MAP2, \
+		   RTSP__MAP1)(_f, _s, __VA_ARGS__)
+
+/*
+ * Walk the list with the rules of rtsp_types_compile(): @_h and @_b are the
+ * header and body depth before @_c, RTSP__BAD() tells whether @_c may not
+ * follow them. Values other than raw lines must be inside a header.
+ */
+#define RTSP__H(_h, _c) \
+	((_h) + ((_c) == RTSP_TYPE_HEADER_START) - ((_c) == RTSP_TYPE_HEADER_END))
+#define RTSP__B(_b, _c) \
+	((_b) + ((_c) == RTSP_TYPE_BODY_START) - ((_c) == RTSP_TYPE_BODY_END))
+#define RTSP__BAD(_h, _b, _c) \
+	((_c) == RTSP_TYPE_HEADER_START ? (_h) != 0 : \
+	 (_c) == RTSP_TYPE_HEADER_END ? (_h) != 1 : \
+	 (_c) == RTSP_TYPE_BODY_START ? (_h) || (_b) : \
+	 (_c) == RTSP_TYPE_BODY_END ? (_h) || (_b) != 1 : \
+	 (_c) == RTSP_TYPE_RAW ? 0 : !(_h))
+
+#define RTSP__ORDER1(_h, _b, _a) \
+	(RTSP__BAD(_h, _b, _a) || RTSP__H(_h, _a) || RTSP__B(_b, _a))
+#define RTSP__ORDER2(_h, _b, _a, ...) (RTSP__BAD(_h, _b, _a) || \
+	RTSP__ORDER1(RTSP__H(_h, _a), RTSP__B(_b, _a), __VA_ARGS__))
+#define RTSP__ORDER3(_h, _b, _a, ...) (RTSP__BAD(_h, _b, _a) || \
+	RTSP__ORDER2(RTSP__H(_h, _a), RTSP__B(_b, _a), __VA_ARGS__))
+#define RTSP__ORDER4(_h, _b, _a, ...) (RTSP__BAD(_h, _b, _a) || \
+	RTSP__ORDER3(RTSP__H(_h, _a), RTSP__B(_b, _a), __VA_ARGS__))
+#define RTSP__ORDER5(_h, _b, _a, ...) (RTSP__BAD(_h, _b, _a) || \
+	RTSP__ORDER4(RTSP__H(_h, _a), RTSP__B(_b, _a), __VA_ARGS__))
+#define RTSP__ORDER6(_h, _b, _a, ...) (RTSP__BAD(_h, _b, _a) || \
+	RTSP__ORDER5(RTSP__H(_h, _a), RTSP__B(_b, _a), __VA_ARGS__))
+#define RTSP__ORDER7(_h, _b, _a, ...) (RTSP__BAD(_h, _b, _a) || \
+	RTSP__ORDER6(RTSP__H(_h, _a), RTSP__B(_b, _a), __VA_ARGS__))
+#define RTSP__ORDER8(_h, _b, _a, ...) (RTSP__BAD(_h, _b, _a) || \
+	RTSP__ORDER7(RTSP__H(_h, _a), RTSP__B(_b, _a), __VA_ARGS__))
+#define RTSP__ORDER9(_h, _b, _a, ...) (RTSP__BAD(_h, _b, _a) || \
+	RTSP__ORDER8(RTSP__H(_h, _a), RTSP__B(_b, _a), __VA_ARGS__))
+#define RTSP__ORDER10(_h, _b, _a, ...) (RTSP__BAD(_h, _b, _a) || \
+	RTSP__ORDER9(RTSP__H(_h, _a), RTSP__B(_b, _a), __VA_ARGS__))
+#define RTSP__ORDER11(_h, _b, _a, ...) (RTSP__BAD(_h, _b, _a) || \
+	RTSP__ORDER10(RTSP__H(_h, _a), RTSP__B(_b, _a), __VA_ARGS__))
+#define RTSP__ORDER12(_h, _b, _a, ...) (RTSP__BAD(_h, _b, _a) || \
+	RTSP__ORDER11(RTSP__H(_h, _a), RTSP__B(_b, _a), __VA_ARGS__))
+#define RTSP__ORDER(...) \
+	RTSP__MAPN(__VA_ARGS__, RTSP__ORDER12, RTSP__ORDER11, RTSP__ORDER10, \
+		   RTSP__ORDER9, RTSP__ORDER8, RTSP__ORDER7, RTSP__ORDER6, \
+		   RTSP__ORDER5, RTSP__ORDER4, RTSP__ORDER3, RTSP__ORDER2, \
+		   RTSP__ORDER1)(0, 0, __VA_ARGS__)
+
+#define RTSP_TYPES(...) { \
+		.n = sizeof((const char[]){ __VA_ARGS__ }) + \
+		     0 * sizeof(char[RTSP__ORDER(__VA_ARGS__) ? -1 : 1]), \
+		.ops = { RTSP__MAP(RTSP__OP_CHECKED, RTSP__COMMA, \
+				   __VA_ARGS__) }, \
+	}
+
+int rtsp_types_compile(struct rtsp_types *t, const char *types);
+
 enum {
 	RTSP_CODE_CONTINUE = 100,
 
@@ -85,6 +213,8 @@ enum {
 	RTSP_CODE_REQUEST_URI_TOO_LARGE,
 	RTSP_CODE_UNSUPPORTED_MEDIA_TYPE,
 
+	RTSP_CODE_REQUEST_HEADER_FIELDS_TOO_LARGE = 431,
+
 	RTSP_CODE_PARAMETER_NOT_UNDERSTOOD = 451,
 	RTSP_CODE_CONFERENCE_NOT_FOUND,
 	RTSP_CODE_NOT_ENOUGH_BANDWIDTH,
@@ -114,6 +244,41 @@ typedef int (*rtsp_callback_fn) (struct rtsp *bus,
 				 struct rtsp_message *m,
 				 void *data);
 
+/*
+ * Limits
+ * Bound what a peer can make us buffer. Zero disables a limit. A request over
+ * an incoming limit is answered with 431 (header lines) or 413 (body), if its
+ * CSeq is known, and the bus hangs up once that reply is out. Data frames
+ * over @max_data hang up right away; their length field cannot exceed 64KiB,
+ * so there is no default. Messages that would push the outgoing queue over
+ * @max_outgoing make rtsp_call_async() fail with -ENOBUFS.
+ *
+ * The watermark callback is called with @high set once the outgoing queue
+ * reaches @outgoing_high bytes, and without once it drained to
+ * @outgoing_low, so producers can pause in between.
+ */
+
+struct rtsp_limits {
+	size_t max_headers;		/* header lines per message */
+	size_t max_line;		/* bytes per header line */
+	size_t max_body;		/* bytes per message body */
+	size_t max_data;		/* bytes per interleaved data frame */
+	size_t max_outgoing;		/* bytes queued for sending */
+	size_t outgoing_high;
+	size_t outgoing_low;
+};
+
+#define RTSP_LIMITS_DEFAULT { \
+		.max_headers = 128, \
+		.max_line = 8192, \
+		.max_body = 64 * 1024, \
+		.max_outgoing = 1024 * 1024, \
+		.outgoing_high = 256 * 1024, \
+		.outgoing_low = 64 * 1024, \
+	}
+
+typedef void (*rtsp_watermark_fn) (struct rtsp *bus, bool high, void *data);
+
 /*
  * Bus
  */
@@ -131,6 +296,11 @@ static inline void rtsp_unref_p(struct rtsp **bus)
 
 bool rtsp_is_dead(struct rtsp *bus);
 
+void rtsp_get_limits(struct rtsp *bus, struct rtsp_limits *limits);
+int rtsp_set_limits(struct rtsp *bus, const struct rtsp_limits *limits);
+void rtsp_set_watermark_fn(struct rtsp *bus, rtsp_watermark_fn fn, void *data);
+size_t rtsp_get_outgoing_size(struct rtsp *bus);
+
 int rtsp_attach_event(struct rtsp *bus, sd_event *event, int priority);
 void rtsp_detach_event(struct rtsp *bus);
 
@@ -226,6 +396,9 @@ int rtsp_message_append(struct rtsp_message *m,
 int rtsp_message_appendv(struct rtsp_message *m,
 			 const char *types,
 			 va_list *args);
+int rtsp_message_append_types(struct rtsp_message *m,
+			      const struct rtsp_types *t,
+			      ...);
 
 int rtsp_message_set_cookie(struct rtsp_message *m, uint64_t cookie);
 int rtsp_message_seal(struct rtsp_message *m);
@@ -249,6 +422,9 @@ int rtsp_message_read(struct rtsp_message *m,
 int rtsp_message_readv(struct rtsp_message *m,
 		       const char *types,
 		       va_list *args);
+int rtsp_message_read_types(struct rtsp_message *m,
+			    const struct rtsp_types *t,
+			    ...);
 
 int rtsp_message_skip_basic(struct rtsp_message *m, char type);
 int rtsp_message_skip(struct rtsp_message *m, const char *types);
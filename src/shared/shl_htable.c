@@ -419,6 +419,25 @@ bool shl_htable_remove(struct shl_htable *htable, const void *obj, size_t hash,
 	return false;
 }
 
+bool shl_htable_remove_exact(struct shl_htable *htable, const void *obj,
+			     size_t hash)
+{
+	struct htable *ht = (void*)&htable->htable;
+	struct htable_iter i;
+	void *c;
+
+	for (c = htable_firstval(ht, &i, hash);
+	     c;
+	     c = htable_nextval(ht, &i, hash)) {
+		if (c == obj) {
+			htable_delval(ht, &i);
+			return true;
+		}
+	}
+
+	return false;
+}
+
 /*
  * Helpers
  */
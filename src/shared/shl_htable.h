@@ -82,6 +82,8 @@ bool shl_htable_lookup(struct shl_htable *htable, const void *obj, size_t hash,
 int shl_htable_insert(struct shl_htable *htable, const void *obj, size_t hash);
 bool shl_htable_remove(struct shl_htable *htable, const void *obj, size_t hash,
 		       void **out);
+bool shl_htable_remove_exact(struct shl_htable *htable, const void *obj,
+			     size_t hash);
 
 size_t shl_htable_this_or_next(struct shl_htable *htable, size_t i);
 void *shl_htable_get_entry(struct shl_htable *htable, size_t i);
@@ -0,0 +1,133 @@
+/*
+ * MiracleCast - Wifi-Display/Miracast Implementation
+ *
+ * MiracleCast is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * MiracleCast is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with MiracleCast; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#define LOG_SUBSYSTEM "trace"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include "metrics.h"
+#include "shl_log.h"
+#include "shl_macro.h"
+#include "trace.h"
+
+FILE *trace_file;
+static bool trace_first;
+static pid_t trace_pid;
+
+static void trace_string(const char *s)
+{
+	fputc('"', trace_file);
+	for ( ; *s; ++s) {
+		if (*s == '"' || *s == '\\')
+			fprintf(trace_file, "\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			fprintf(trace_file, "\\u%04x", *s);
+		else
+			fputc(*s, trace_file);
+	}
+	fputc('"', trace_file);
+}
+
+static void trace_open_event(char ph, const char *cat, const char *name)
+{
+	/* separator first, so a crashed process leaves no dangling ',' */
+	fputs(trace_first ? "" : "\n,", trace_file);
+	trace_first = false;
+
+	fprintf(trace_file, "{\"ph\":\"%c\",\"pid\":%d,\"tid\":%d,"
+		"\"ts\":%" PRIu64 ",\"cat\":",
+		ph, (int)trace_pid, (int)trace_pid, metrics_now_ns() / 1000);
+	trace_string(cat);
+	fputs(",\"name\":", trace_file);
+	trace_string(name);
+}
+
+void trace__event(char ph, const char *cat, const char *name,
+		  uint64_t id, const char *detail)
+{
+	trace_open_event(ph, cat, name);
+
+	if (ph == 'i')
+		fputs(",\"s\":\"p\"", trace_file);
+	else
+		fprintf(trace_file, ",\"id2\":{\"local\":\"0x%" PRIx64 "\"}",
+			id);
+
+	if (detail) {
+		fputs(",\"args\":{\"detail\":", trace_file);
+		trace_string(detail);
+		fputc('}', trace_file);
+	}
+
+	fputc('}', trace_file);
+}
+
+/* file is valid JSON after trace_close(), a missing ']' is accepted, too */
+int trace_init(const char *name)
+{
+	_shl_free_ char *path = NULL;
+	const char *dir;
+	int r;
+
+	if (trace_file)
+		return 0;
+
+	dir = getenv("MIRACLE_TRACE");
+	if (!dir || !*dir)
+		return 0;
+
+	r = asprintf(&path, "%s/%s-%d.json", dir, name, (int)getpid());
+	if (r < 0)
+		return log_ENOMEM();
+
+	trace_file = fopen(path, "we");
+	if (!trace_file) {
+		r = -errno;
+		log_warning("cannot open trace file %s: %m", path);
+		return r;
+	}
+
+	log_info("writing trace to %s", path);
+	fputs("[\n", trace_file);
+	trace_first = true;
+	trace_pid = getpid();
+
+	trace_open_event('M', "__metadata", "process_name");
+	fputs(",\"args\":{\"name\":", trace_file);
+	trace_string(name);
+	fputs("}}", trace_file);
+
+	atexit(trace_close);
+	return 0;
+}
+
+/* forked children must not close the parent's trace, see trace_flush() */
+void trace_close(void)
+{
+	if (!trace_file || trace_pid != getpid())
+		return;
+
+	fputs("\n]\n", trace_file);
+	fclose(trace_file);
+	trace_file = NULL;
+}
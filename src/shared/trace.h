@@ -0,0 +1,89 @@
+/*
+ * MiracleCast - Wifi-Display/Miracast Implementation
+ *
+ * MiracleCast is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * MiracleCast is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with MiracleCast; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Trace Export
+ * Timeline events in Chrome trace-event JSON, loadable in chrome://tracing
+ * and ui.perfetto.dev. Tracing is enabled by MIRACLE_TRACE=<dir> in the
+ * environment; it is inherited by spawned helpers, and each process writes
+ * <dir>/<name>-<pid>.json. Timestamps are CLOCK_MONOTONIC so files of all
+ * processes share one timeline, res/miracle-trace-merge joins them.
+ *
+ * Spans are async events identified by (@cat, @id) within a process, they
+ * may begin and end in different callbacks. @detail is optional.
+ */
+
+#ifndef MIRACLE_TRACE_H
+#define MIRACLE_TRACE_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include "shl_macro.h"
+
+extern FILE *trace_file;
+
+int trace_init(const char *name);
+void trace_close(void);
+void trace__event(char ph, const char *cat, const char *name,
+		  uint64_t id, const char *detail);
+
+static inline bool trace_enabled(void)
+{
+	return _shl_unlikely_(trace_file != NULL);
+}
+
+/* call right before fork(), so the child cannot write out our buffer */
+static inline void trace_flush(void)
+{
+	if (trace_enabled())
+		fflush(trace_file);
+}
+
+/* start a span */
+static inline void trace_begin(const char *cat, const char *name,
+			       uint64_t id, const char *detail)
+{
+	if (trace_enabled())
+		trace__event('b', cat, name, id, detail);
+}
+
+/* mark a stage inside a running span */
+static inline void trace_step(const char *cat, const char *name,
+			      uint64_t id, const char *detail)
+{
+	if (trace_enabled())
+		trace__event('n', cat, name, id, detail);
+}
+
+/* end a span, @name must match its begin */
+static inline void trace_end(const char *cat, const char *name,
+			     uint64_t id, const char *detail)
+{
+	if (trace_enabled())
+		trace__event('e', cat, name, id, detail);
+}
+
+/* event outside of any span */
+static inline void trace_instant(const char *cat, const char *name,
+				 const char *detail)
+{
+	if (trace_enabled())
+		trace__event('i', cat, name, 0, detail);
+}
+
+#endif /* MIRACLE_TRACE_H */
@@ -0,0 +1,609 @@
+/*
+ * MiracleCast - Wifi-Display/Miracast Implementation
+ *
+ * MiracleCast is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * MiracleCast is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with MiracleCast; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define LOG_SUBSYSTEM "uring"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <systemd/sd-event.h>
+#include "uring.h"
+
+#ifdef HAVE_URING
+
+#include <liburing.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "loopstat.h"
+#include "metrics.h"
+#include "shl_dlist.h"
+#include "shl_log.h"
+#include "shl_macro.h"
+
+#define URING_ENTRIES 256
+/* buffer groups per ring; sockets beyond that fall back to epoll */
+#define URING_BGID_MAX 1024
+#define URING_BGID_BITS (sizeof(unsigned long) * 8)
+
+static METRICS_COUNTER(uring_submits, "uring.submits",
+		       "io_uring_enter() calls submitting SQEs");
+static METRICS_COUNTER(uring_completions, "uring.completions",
+		       "io_uring completions dispatched");
+
+enum {
+	URING_OP_RECV,
+	URING_OP_SEND,
+};
+
+struct uring {
+	struct shl_dlist list;
+	unsigned long ref;
+	sd_event *event;
+	sd_event_source *efd_source;
+	int efd;
+	struct io_uring ring;
+	unsigned long bgids[URING_BGID_MAX / URING_BGID_BITS];
+
+	/* unsubmitted tail of the SQ, if it is a send of @last_owner */
+	struct io_uring_sqe *last_sqe;
+	struct uring_sock *last_owner;
+};
+
+struct uring_op {
+	struct shl_dlist list;
+	struct uring_sock *s;
+	unsigned int type;
+	size_t len;
+	char buf[];
+};
+
+struct uring_sock {
+	/* the owner plus one per operation in flight */
+	unsigned long ref;
+	struct uring *u;
+	int fd;
+	uring_recv_fn recv_fn;
+	uring_sent_fn sent_fn;
+	void *data;
+
+	struct io_uring_buf_ring *br;
+	char *bufs;
+	size_t buf_size;
+	unsigned int buf_cnt;
+	uint16_t bgid;
+	struct uring_op recv_op;
+
+	/* sends waiting for the chain in flight to complete */
+	struct shl_dlist pending;
+	unsigned int sending;
+
+	bool recv_armed : 1;
+	bool dead : 1;
+};
+
+static struct shl_dlist uring_list = SHL_DLIST_INIT(uring_list);
+
+static void uring_submit(struct uring *u)
+{
+	u->last_sqe = NULL;
+	u->last_owner = NULL;
+
+	if (!io_uring_sq_ready(&u->ring))
+		return;
+
+	metrics_counter_inc(&uring_submits);
+	io_uring_submit(&u->ring);
+}
+
+static struct io_uring_sqe *uring_get_sqe(struct uring *u)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = io_uring_get_sqe(&u->ring);
+	if (!sqe) {
+		/* SQ is full, flush it early */
+		uring_submit(u);
+		sqe = io_uring_get_sqe(&u->ring);
+	}
+
+	u->last_sqe = NULL;
+	u->last_owner = NULL;
+	return sqe;
+}
+
+static int uring_bgid_get(struct uring *u)
+{
+	unsigned int i;
+
+	for (i = 0; i < URING_BGID_MAX; ++i) {
+		if (u->bgids[i / URING_BGID_BITS] & (1UL << (i % URING_BGID_BITS)))
+			continue;
+
+		u->bgids[i / URING_BGID_BITS] |= 1UL << (i % URING_BGID_BITS);
+		return i;
+	}
+
+	return -ENOSPC;
+}
+
+static void uring_bgid_put(struct uring *u, uint16_t bgid)
+{
+	u->bgids[bgid / URING_BGID_BITS] &= ~(1UL << (bgid % URING_BGID_BITS));
+}
+
+static void uring_unref(struct uring *u)
+{
+	if (!u || !u->ref || --u->ref)
+		return;
+
+	shl_dlist_unlink(&u->list);
+	sd_event_source_unref(u->efd_source);
+	io_uring_queue_exit(&u->ring);
+	close(u->efd);
+	sd_event_unref(u->event);
+	free(u);
+}
+
+static void uring_sock_put(struct uring_sock *s)
+{
+	struct uring *u = s->u;
+
+	if (--s->ref)
+		return;
+
+	io_uring_free_buf_ring(&u->ring, s->br, s->buf_cnt, s->bgid);
+	uring_bgid_put(u, s->bgid);
+	free(s->bufs);
+	free(s);
+	uring_unref(u);
+}
+
+static void uring_sock_recycle(struct uring_sock *s, unsigned int bid)
+{
+	io_uring_buf_ring_add(s->br, s->bufs + bid * s->buf_size, s->buf_size,
+			      bid, io_uring_buf_ring_mask(s->buf_cnt), 0);
+	io_uring_buf_ring_advance(s->br, 1);
+}
+
+static int uring_sock_arm(struct uring_sock *s)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_get_sqe(s->u);
+	if (!sqe)
+		return -EBUSY;
+
+	io_uring_prep_recv_multishot(sqe, s->fd, NULL, 0, 0);
+	sqe->flags |= IOSQE_BUFFER_SELECT;
+	sqe->buf_group = s->bgid;
+	io_uring_sqe_set_data(sqe, &s->recv_op);
+
+	s->recv_armed = true;
+	++s->ref;
+	return 0;
+}
+
+/* -EAGAIN if @op has to wait for the chain in flight */
+static int uring_sock_prep_send(struct uring_sock *s, struct uring_op *op)
+{
+	struct uring *u = s->u;
+	struct io_uring_sqe *sqe, *prev;
+
+	prev = u->last_owner == s ? u->last_sqe : NULL;
+	if (s->sending && !prev)
+		return -EAGAIN;
+
+	sqe = io_uring_get_sqe(&u->ring);
+	if (!sqe) {
+		uring_submit(u);
+		if (s->sending)
+			return -EAGAIN;
+
+		sqe = io_uring_get_sqe(&u->ring);
+		if (!sqe)
+			return -EBUSY;
+	} else if (prev) {
+		prev->flags |= IOSQE_IO_LINK;
+	}
+
+	io_uring_prep_send(sqe, s->fd, op->buf, op->len,
+			   MSG_NOSIGNAL | MSG_WAITALL);
+	io_uring_sqe_set_data(sqe, op);
+
+	u->last_sqe = sqe;
+	u->last_owner = s;
+	++s->sending;
+	++s->ref;
+	return 0;
+}
+
+static void uring_sock_drain(struct uring_sock *s)
+{
+	struct uring_op *op;
+
+	while (!shl_dlist_empty(&s->pending)) {
+		op = shl_dlist_first_entry(&s->pending, struct uring_op, list);
+		if (uring_sock_prep_send(s, op) < 0)
+			break;
+
+		shl_dlist_unlink(&op->list);
+	}
+}
+
+static void uring_sock_recv_done(struct uring_sock *s, int res,
+				 unsigned int flags)
+{
+	bool more = flags & IORING_CQE_F_MORE;
+	unsigned int bid;
+
+	/* the recv reference keeps @s alive across the callback */
+	if (!more)
+		s->recv_armed = false;
+
+	if (flags & IORING_CQE_F_BUFFER) {
+		bid = flags >> IORING_CQE_BUFFER_SHIFT;
+		if (!s->dead && res > 0)
+			s->recv_fn(s, s->bufs + bid * s->buf_size, res, 0,
+				   s->data);
+		uring_sock_recycle(s, bid);
+	} else if (!s->dead && res != -ENOBUFS) {
+		s->recv_fn(s, NULL, 0, res < 0 ? res : 0, s->data);
+	}
+
+	if (!more) {
+		/* rearm if we ran out of buffers or the kernel stopped early */
+		if (!s->dead && (res > 0 || res == -ENOBUFS) &&
+		    uring_sock_arm(s) < 0)
+			s->recv_fn(s, NULL, 0, -EBUSY, s->data);
+		uring_sock_put(s);
+	}
+}
+
+static void uring_sock_send_done(struct uring_op *op, int res)
+{
+	struct uring_sock *s = op->s;
+	int error;
+
+	if (res < 0)
+		error = res;
+	else if ((size_t)res < op->len)
+		error = -EIO;
+	else
+		error = 0;
+
+	free(op);
+	--s->sending;
+
+	if (!s->dead) {
+		/* queued sends go before anything the callback sends */
+		if (!s->sending)
+			uring_sock_drain(s);
+		if (s->sent_fn)
+			s->sent_fn(s, error, s->data);
+	}
+
+	uring_sock_put(s);
+}
+
+static int uring_io_fn(sd_event_source *source, int fd, uint32_t mask,
+		       void *data)
+{
+	LOOPSTAT("uring.io");
+	struct uring *u = data;
+	struct io_uring_cqe *cqe;
+	struct uring_op *op;
+	unsigned int flags;
+	eventfd_t cnt;
+	int res;
+
+	eventfd_read(u->efd, &cnt);
+
+	/* sockets might drop the last reference during callbacks */
+	++u->ref;
+
+	while (!io_uring_peek_cqe(&u->ring, &cqe)) {
+		op = io_uring_cqe_get_data(cqe);
+		res = cqe->res;
+		flags = cqe->flags;
+		io_uring_cqe_seen(&u->ring, cqe);
+		metrics_counter_inc(&uring_completions);
+
+		/* cancellations carry no op */
+		if (!op)
+			continue;
+
+		if (op->type == URING_OP_RECV)
+			uring_sock_recv_done(op->s, res, flags);
+		else
+			uring_sock_send_done(op, res);
+	}
+
+	uring_unref(u);
+	return 0;
+}
+
+/* batch everything queued during this iteration into one syscall */
+static int uring_prepare_fn(sd_event_source *source, void *data)
+{
+	uring_submit(data);
+	return 0;
+}
+
+static int uring_new(struct uring **out, sd_event *event, int priority)
+{
+	struct io_uring_probe *probe;
+	struct uring *u;
+	bool ok;
+	int r;
+
+	u = calloc(1, sizeof(*u));
+	if (!u)
+		return -ENOMEM;
+
+	u->ref = 1;
+	u->efd = -1;
+
+	r = io_uring_queue_init(URING_ENTRIES, &u->ring, 0);
+	if (r < 0) {
+		log_debug("cannot set up io_uring (%d), using epoll", r);
+		free(u);
+		return -EOPNOTSUPP;
+	}
+
+	/* multishot recv and buffer rings arrived with SEND_ZC in 6.0 */
+	probe = io_uring_get_probe_ring(&u->ring);
+	ok = probe && io_uring_opcode_supported(probe, IORING_OP_SEND_ZC);
+	io_uring_free_probe(probe);
+	if (!ok) {
+		log_debug("io_uring lacks multishot recv, using epoll");
+		r = -EOPNOTSUPP;
+		goto error;
+	}
+
+	u->efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (u->efd < 0) {
+		r = -errno;
+		goto error;
+	}
+
+	r = io_uring_register_eventfd(&u->ring, u->efd);
+	if (r < 0)
+		goto error;
+
+	r = sd_event_add_io(event, &u->efd_source, u->efd, EPOLLIN,
+			    uring_io_fn, u);
+	if (r < 0)
+		goto error;
+
+	r = sd_event_source_set_priority(u->efd_source, priority);
+	if (r < 0)
+		goto error;
+
+	r = sd_event_source_set_prepare(u->efd_source, uring_prepare_fn);
+	if (r < 0)
+		goto error;
+
+	u->event = sd_event_ref(event);
+	shl_dlist_link(&uring_list, &u->list);
+
+	*out = u;
+	return 0;
+
+error:
+	sd_event_source_unref(u->efd_source);
+	io_uring_queue_exit(&u->ring);
+	if (u->efd >= 0)
+		close(u->efd);
+	free(u);
+	return r;
+}
+
+/* one ring per event loop, shared by all its sockets */
+static int uring_get(struct uring **out, sd_event *event, int priority)
+{
+	struct shl_dlist *i;
+	struct uring *u;
+
+	shl_dlist_for_each(i, &uring_list) {
+		u = shl_dlist_entry(i, struct uring, list);
+		if (u->event == event) {
+			++u->ref;
+			*out = u;
+			return 0;
+		}
+	}
+
+	return uring_new(out, event, priority);
+}
+
+int uring_sock_new(struct uring_sock **out,
+		   sd_event *event,
+		   int priority,
+		   int fd,
+		   size_t buf_size,
+		   unsigned int buf_cnt,
+		   uring_recv_fn recv_fn,
+		   uring_sent_fn sent_fn,
+		   void *data)
+{
+	struct uring_sock *s;
+	const char *env;
+	unsigned int i;
+	int r;
+
+	if (!out || !event || fd < 0 || !recv_fn)
+		return -EINVAL;
+	if (!buf_size || !buf_cnt || buf_cnt > 32768 ||
+	    (buf_cnt & (buf_cnt - 1)))
+		return -EINVAL;
+
+	env = getenv("MIRACLE_URING");
+	if (env && !strcmp(env, "0"))
+		return -EOPNOTSUPP;
+
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return -ENOMEM;
+
+	s->ref = 1;
+	s->fd = fd;
+	s->recv_fn = recv_fn;
+	s->sent_fn = sent_fn;
+	s->data = data;
+	s->buf_size = buf_size;
+	s->buf_cnt = buf_cnt;
+	s->recv_op.s = s;
+	s->recv_op.type = URING_OP_RECV;
+	shl_dlist_init(&s->pending);
+
+	s->bufs = malloc(buf_size * buf_cnt);
+	if (!s->bufs) {
+		r = -ENOMEM;
+		goto err_sock;
+	}
+
+	r = uring_get(&s->u, event, priority);
+	if (r < 0)
+		goto err_sock;
+
+	r = uring_bgid_get(s->u);
+	if (r < 0)
+		goto err_ring;
+
+	s->bgid = r;
+	s->br = io_uring_setup_buf_ring(&s->u->ring, buf_cnt, s->bgid, 0, &r);
+	if (!s->br)
+		goto err_bgid;
+
+	for (i = 0; i < buf_cnt; ++i)
+		io_uring_buf_ring_add(s->br, s->bufs + i * buf_size, buf_size,
+				      i, io_uring_buf_ring_mask(buf_cnt), i);
+	io_uring_buf_ring_advance(s->br, buf_cnt);
+
+	r = uring_sock_arm(s);
+	if (r < 0) {
+		io_uring_free_buf_ring(&s->u->ring, s->br, buf_cnt, s->bgid);
+		goto err_bgid;
+	}
+
+	*out = s;
+	return 0;
+
+err_bgid:
+	uring_bgid_put(s->u, s->bgid);
+err_ring:
+	uring_unref(s->u);
+err_sock:
+	free(s->bufs);
+	free(s);
+	return r;
+}
+
+/*
+ * No callbacks are called after this. The caller may close the fd right away,
+ * the cancellation is submitted before we return.
+ */
+void uring_sock_free(struct uring_sock *s)
+{
+	struct io_uring_sqe *sqe;
+	struct uring_op *op;
+
+	if (!s || s->dead)
+		return;
+
+	s->dead = true;
+
+	while (!shl_dlist_empty(&s->pending)) {
+		op = shl_dlist_first_entry(&s->pending, struct uring_op, list);
+		shl_dlist_unlink(&op->list);
+		free(op);
+	}
+
+	if (s->recv_armed || s->sending) {
+		sqe = uring_get_sqe(s->u);
+		if (sqe) {
+			io_uring_prep_cancel_fd(sqe, s->fd,
+						IORING_ASYNC_CANCEL_ALL);
+			io_uring_sqe_set_data(sqe, NULL);
+		}
+		uring_submit(s->u);
+	}
+
+	uring_sock_put(s);
+}
+
+int uring_sock_send(struct uring_sock *s, const void *buf, size_t len)
+{
+	struct uring_op *op;
+	int r;
+
+	if (!s || s->dead)
+		return -EINVAL;
+
+	op = malloc(sizeof(*op) + len);
+	if (!op)
+		return -ENOMEM;
+
+	op->s = s;
+	op->type = URING_OP_SEND;
+	op->len = len;
+	memcpy(op->buf, buf, len);
+
+	if (!shl_dlist_empty(&s->pending))
+		r = -EAGAIN;
+	else
+		r = uring_sock_prep_send(s, op);
+
+	if (r == -EAGAIN) {
+		shl_dlist_link_tail(&s->pending, &op->list);
+		r = 0;
+	} else if (r < 0) {
+		free(op);
+	}
+
+	return r;
+}
+
+#else /* HAVE_URING */
+
+int uring_sock_new(struct uring_sock **out,
+		   sd_event *event,
+		   int priority,
+		   int fd,
+		   size_t buf_size,
+		   unsigned int buf_cnt,
+		   uring_recv_fn recv_fn,
+		   uring_sent_fn sent_fn,
+		   void *data)
+{
+	return -EOPNOTSUPP;
+}
+
+void uring_sock_free(struct uring_sock *s)
+{
+}
+
+int uring_sock_send(struct uring_sock *s, const void *buf, size_t len)
+{
+	return -EOPNOTSUPP;
+}
+
+#endif /* HAVE_URING */
@@ -0,0 +1,67 @@
+/*
+ * MiracleCast - Wifi-Display/Miracast Implementation
+ *
+ * MiracleCast is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * MiracleCast is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with MiracleCast; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * io_uring Sockets
+ * Completion based I/O for the RTSP and wpas buses. There is one ring per
+ * sd_event, its eventfd is just another event source. SQEs queued while
+ * dispatching are submitted together right before the loop polls again, so a
+ * loop iteration costs one io_uring_enter() no matter how many sockets sent.
+ *
+ * Each socket keeps a multishot recv armed on its own provided buffer ring, so
+ * receiving needs no syscall at all. Sends copy their payload and complete in
+ * order; sends queued back to back are submitted as one linked chain.
+ *
+ * Only built with HAVE_URING, which is off by default (ENABLE_URING,
+ * --enable-uring, -During=true). uring_sock_new() fails with -EOPNOTSUPP if
+ * io_uring is not built or too old in the running kernel, or if the
+ * MIRACLE_URING environment variable is "0", and with -ENOSPC once a loop
+ * has 1024 sockets on it. Callers then stay on epoll.
+ */
+
+#ifndef MIRACLE_URING_H
+#define MIRACLE_URING_H
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <systemd/sd-event.h>
+
+struct uring_sock;
+
+/* @len is 0 on EOF, @error is a negative errno if receiving failed */
+typedef void (*uring_recv_fn) (struct uring_sock *s,
+			       const void *buf,
+			       size_t len,
+			       int error,
+			       void *data);
+
+/* once per uring_sock_send(), in order; short sends fail with -EIO */
+typedef void (*uring_sent_fn) (struct uring_sock *s, int error, void *data);
+
+int uring_sock_new(struct uring_sock **out,
+		   sd_event *event,
+		   int priority,
+		   int fd,
+		   size_t buf_size,
+		   unsigned int buf_cnt,
+		   uring_recv_fn recv_fn,
+		   uring_sent_fn sent_fn,
+		   void *data);
+void uring_sock_free(struct uring_sock *s);
+int uring_sock_send(struct uring_sock *s, const void *buf, size_t len);
+
+#endif /* MIRACLE_URING_H */
@@ -32,8 +32,12 @@
 #include <sys/un.h>
 #include <systemd/sd-event.h>
 #include <unistd.h>
+#include "loopstat.h"
+#include "metrics.h"
+#include "probes.h"
 #include "shl_dlist.h"
 #include "shl_util.h"
+#include "uring.h"
 #include "wpas.h"
 #include "shl_log.h"
 
@@ -49,6 +53,17 @@
 /* max message size */
 #define WPAS_MAX_LEN 16384
 
+static METRICS_COUNTER(wpas_requests, "wpas.requests",
+		       "requests sent to wpa_supplicant");
+static METRICS_COUNTER(wpas_events, "wpas.events",
+		       "events received from wpa_supplicant");
+static METRICS_COUNTER(wpas_io_calls, "wpas.io_calls",
+		       "sendto() and recvfrom() calls of the epoll backend");
+static METRICS_COUNTER(wpas_timeouts, "wpas.timeouts",
+		       "wpa_supplicant requests that timed out");
+static METRICS_HIST(wpas_rtt, "wpas.rtt", "us",
+		    "wpa_supplicant request round-trip time");
+
 struct wpas_message {
 	unsigned long ref;
 	struct wpas *w;
@@ -58,6 +73,7 @@ struct wpas_message {
 	void *data;
 	uint64_t cookie;
 	uint64_t timeout;
+	uint64_t sent_time;
 	struct sockaddr_un peer;
 
 	char *raw;
@@ -72,6 +88,10 @@ struct wpas_message {
 	char **argv;
 	size_t iter;
 
+	/* open-addressing index over the dict keys in argv, 0 is empty */
+	size_t dict_size;
+	uint32_t *dict;
+
 	bool queued : 1;
 	bool sent : 1;
 	bool sealed : 1;
@@ -98,6 +118,7 @@ struct wpas {
 	sd_event *event;
 	sd_event_source *fd_source;
 	sd_event_source *timer_source;
+	struct uring_sock *uring;
 
 	struct shl_dlist match_list;
 
@@ -246,6 +267,7 @@ void wpas_message_unref(struct wpas_message *m)
 		return;
 
 	shl_strv_free(m->argv);
+	free(m->dict);
 	wpas_unref(m->w);
 	free(m->ifname);
 	free(m->raw);
@@ -320,6 +342,25 @@ const char *wpas_message_get_ifname(struct wpas_message *msg)
 	return msg ? msg->ifname : NULL;
 }
 
+/* address a request on the global interface to one of its ifaces */
+int wpas_message_set_ifname(struct wpas_message *msg, const char *ifname)
+{
+	char *t;
+
+	if (!msg || !ifname || !*ifname)
+		return -EINVAL;
+	if (msg->sealed)
+		return -EBUSY;
+
+	t = strdup(ifname);
+	if (!t)
+		return -ENOMEM;
+
+	free(msg->ifname);
+	msg->ifname = t;
+	return 0;
+}
+
 bool wpas_message_is_sealed(struct wpas_message *msg)
 {
 	return !msg || msg->sealed;
@@ -445,6 +486,11 @@ int wpas_message_appendv_basic(struct wpas_message *m,
 	m->argv[m->argc++] = str;
 	m->argv[m->argc] = NULL;
 	str = NULL;
+
+	/* rebuilt on the next dict read */
+	free(m->dict);
+	m->dict = NULL;
+	m->dict_size = 0;
 	return 0;
 }
 
@@ -510,6 +556,16 @@ int wpas_message_seal(struct wpas_message *m)
 		str = t;
 	}
 
+	if (m->type == WPAS_MESSAGE_REQUEST && m->ifname) {
+		t = shl_strjoin("IFNAME=", m->ifname, " ", str, NULL);
+		if (!t)
+			return -ENOMEM;
+
+		r += strlen(t) - strlen(str);
+		free(str);
+		str = t;
+	}
+
 	m->rawlen = r;
 	m->raw = str;
 	str = NULL;
@@ -672,48 +728,166 @@ int wpas_message_argv_read(struct wpas_message *m,
 	return 0;
 }
 
+/* FNV-1a over the first @len bytes of @key */
+static uint32_t wpas__dict_hash(const char *key, size_t len)
+{
+	uint32_t h = 2166136261U;
+
+	while (len--)
+		h = (h ^ (unsigned char)*key++) * 16777619U;
+
+	return h;
+}
+
+static bool wpas__dict_match(const char *entry, const char *key, size_t len)
+{
+	return !strncmp(entry, key, len) && entry[len] == '=';
+}
+
+/*
+ * Index all key=value entries of @m. Duplicate keys keep their first entry,
+ * like the linear scan this replaces. The table is at most half full, so
+ * probe chains stay short.
+ */
+static int wpas__dict_build(struct wpas_message *m)
+{
+	size_t i, j, l, size;
+	const char *eq;
+	uint32_t *dict;
+
+	for (size = 8; size < m->argc * 2; size *= 2)
+		/* empty */ ;
+
+	dict = calloc(size, sizeof(*dict));
+	if (!dict)
+		return -ENOMEM;
+
+	for (i = m->name ? 1 : 0; i < m->argc; ++i) {
+		eq = strchr(m->argv[i], '=');
+		if (!eq)
+			continue;
+
+		l = eq - m->argv[i];
+		j = wpas__dict_hash(m->argv[i], l) & (size - 1);
+		for ( ; dict[j]; j = (j + 1) & (size - 1))
+			if (wpas__dict_match(m->argv[dict[j] - 1], m->argv[i], l))
+				break;
+
+		if (!dict[j])
+			dict[j] = i + 1;
+	}
+
+	m->dict = dict;
+	m->dict_size = size;
+	return 0;
+}
+
+static int wpas__dict_lookup(struct wpas_message *m,
+			     const char *name,
+			     const char **out)
+{
+	size_t j, l;
+	int r;
+
+	if (!m->dict) {
+		r = wpas__dict_build(m);
+		if (r < 0)
+			return r;
+	}
+
+	l = strlen(name);
+	j = wpas__dict_hash(name, l) & (m->dict_size - 1);
+	for ( ; m->dict[j]; j = (j + 1) & (m->dict_size - 1)) {
+		if (wpas__dict_match(m->argv[m->dict[j] - 1], name, l)) {
+			*out = m->argv[m->dict[j] - 1] + l + 1;
+			return 0;
+		}
+	}
+
+	return -ENOENT;
+}
+
+static int wpas__dict_convert(const char *entry, char type, void *out)
+{
+	switch (type) {
+	case WPAS_TYPE_STRING:
+		*(const char**)out = entry;
+		break;
+	case WPAS_TYPE_INT32:
+		if (sscanf(entry, "%" SCNd32, (int32_t*)out) != 1)
+			return -EINVAL;
+		break;
+	case WPAS_TYPE_UINT32:
+		if (sscanf(entry, "%" SCNu32, (uint32_t*)out) != 1)
+			return -EINVAL;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
 int wpas_message_dict_read(struct wpas_message *m,
 			   const char *name,
 			   char type,
 			   void *out)
 {
 	const char *entry;
-	size_t i, l;
+	int r;
 
 	if (!m || !name || !out)
 		return -EINVAL;
 
-	for (i = m->name ? 1 : 0; i < m->argc; ++i) {
-		entry = strchr(m->argv[i], '=');
-		if (!entry)
-			continue;
+	r = wpas__dict_lookup(m, name, &entry);
+	if (r < 0)
+		return r;
 
-		l = entry - m->argv[i];
-		if (strncmp(m->argv[i], name, l) || name[l])
-			continue;
+	return wpas__dict_convert(entry, type, out);
+}
 
-		++entry;
+/*
+ * Read several dict entries at once. Takes (name, type, out) triples followed
+ * by NULL. Missing keys leave their @out untouched. Returns the number of keys
+ * found, or a negative error code if a value could not be converted.
+ */
+int wpas_message_dict_read_many(struct wpas_message *m, ...)
+{
+	const char *name, *entry;
+	va_list args;
+	int r, n = 0;
+	char type;
+	void *out;
 
-		switch (type) {
-		case WPAS_TYPE_STRING:
-			*(const char**)out = entry;
-			break;
-		case WPAS_TYPE_INT32:
-			if (sscanf(entry, "%" SCNd32, (int32_t*)out) != 1)
-				return -EINVAL;
-			break;
-		case WPAS_TYPE_UINT32:
-			if (sscanf(entry, "%" SCNu32, (uint32_t*)out) != 1)
-				return -EINVAL;
-			break;
-		default:
-			return -EINVAL;
+	if (!m)
+		return -EINVAL;
+
+	va_start(args, m);
+	while ((name = va_arg(args, const char*))) {
+		type = va_arg(args, int);
+		out = va_arg(args, void*);
+		if (!out) {
+			r = -EINVAL;
+			goto out;
 		}
 
-		return 0;
+		r = wpas__dict_lookup(m, name, &entry);
+		if (r == -ENOENT)
+			continue;
+		else if (r < 0)
+			goto out;
+
+		r = wpas__dict_convert(entry, type, out);
+		if (r < 0)
+			goto out;
+
+		++n;
 	}
 
-	return -ENOENT;
+	r = n;
+out:
+	va_end(args);
+	return r;
 }
 
 static int wpas__parse_args(struct wpas_message *m,
@@ -1212,6 +1386,8 @@ void wpas_unref(struct wpas *w)
 	free(w);
 }
 
+static void wpas__uring_flush(struct wpas *w);
+
 int wpas_call_async(struct wpas *w,
 		    struct wpas_message *m,
 		    wpas_callback_fn cb_fn,
@@ -1242,6 +1418,7 @@ int wpas_call_async(struct wpas *w,
 	m->cookie = ++w->cookies ? : ++w->cookies;
 
 	wpas__link_message(w, m);
+	wpas__uring_flush(w);
 
 	if (cookie)
 		*cookie = m->cookie;
@@ -1300,6 +1477,7 @@ int wpas_send(struct wpas *w,
 	m->cookie = 0;
 
 	wpas__link_message(w, m);
+	wpas__uring_flush(w);
 
 	return 0;
 }
@@ -1310,7 +1488,10 @@ static int wpas__send(struct wpas *w, struct wpas_message *m)
 
 	if (!m->rawlen)
 		return 0;
+	if (w->uring)
+		return uring_sock_send(w->uring, m->raw, m->rawlen);
 
+	metrics_counter_inc(&wpas_io_calls);
 	l = sendto(w->fd,
 		   m->raw,
 		   m->rawlen,
@@ -1343,6 +1524,10 @@ static int wpas__write(struct wpas *w)
 		return r;
 
 	m->sent = true;
+	m->sent_time = shl_now(CLOCK_MONOTONIC);
+	MIRACLE_PROBE3(wpas_message_out, m->type, m->rawlen, m->cookie);
+	if (m->type == WPAS_MESSAGE_REQUEST)
+		metrics_counter_inc(&wpas_requests);
 	if (!m->cookie)
 		wpas__unlink_message(w, m);
 
@@ -1355,6 +1540,7 @@ static int wpas__read_message(struct wpas *w, struct wpas_message **out)
 	socklen_t src_len = sizeof(src);
 	ssize_t l;
 
+	metrics_counter_inc(&wpas_io_calls);
 	l = recvfrom(w->fd,
 		     w->recvbuf,
 		     sizeof(w->recvbuf) - 1,
@@ -1378,20 +1564,17 @@ static int wpas__read_message(struct wpas *w, struct wpas_message **out)
 	return wpas__parse_message(w, w->recvbuf, l, &src, out);
 }
 
-static int wpas__read(struct wpas *w)
+static void wpas__handle(struct wpas *w, struct wpas_message *a)
 {
-	_wpas_message_unref_ struct wpas_message *a = NULL;
 	_wpas_message_unref_ struct wpas_message *m = NULL;
-	int r;
-
-	r = wpas__read_message(w, &a);
-	if (r < 0)
-		return r;
 
 	switch (a->type) {
 	case WPAS_MESSAGE_UNKNOWN:
 	case WPAS_MESSAGE_REQUEST:
 	case WPAS_MESSAGE_EVENT:
+		if (a->type == WPAS_MESSAGE_EVENT)
+			metrics_counter_inc(&wpas_events);
+		MIRACLE_PROBE3(wpas_message_in, a->type, a->rawlen, 0);
 		wpas__call(w, a);
 		break;
 	case WPAS_MESSAGE_REPLY:
@@ -1400,6 +1583,9 @@ static int wpas__read(struct wpas *w)
 		if (!m || !m->sent)
 			break;
 
+		metrics_hist_record(&wpas_rtt,
+				    shl_now(CLOCK_MONOTONIC) - m->sent_time);
+		MIRACLE_PROBE3(wpas_message_in, a->type, a->rawlen, m->cookie);
 		wpas__unlink_message(w, m);
 		if (m->removed)
 			break;
@@ -1407,15 +1593,29 @@ static int wpas__read(struct wpas *w)
 		wpas__message_call(m, a);
 		break;
 	}
+}
 
+static int wpas__read(struct wpas *w)
+{
+	_wpas_message_unref_ struct wpas_message *a = NULL;
+	int r;
+
+	r = wpas__read_message(w, &a);
+	if (r < 0)
+		return r;
+
+	wpas__handle(w, a);
 	return 0;
 }
 
 static int wpas_io_fn(sd_event_source *source, int fd, uint32_t mask, void *d)
 {
+	LOOPSTAT("wpas.io");
 	struct wpas *w = d;
 	int r, write_r;
 
+	MIRACLE_PROBE2(wpas_io, fd, mask);
+
 	/* make sure WPAS stays around during any user-callbacks */
 	wpas_ref(w);
 
@@ -1500,8 +1700,85 @@ static int wpas_io_prepare_fn(sd_event_source *source, void *d)
 	return 0;
 }
 
+/*
+ * With io_uring there is no EPOLLOUT or ->prepare() to drive the queue, so
+ * requests are sent as soon as they reach the front and the timer is armed
+ * right here. Only client sockets use it, they have a fixed peer.
+ */
+static void wpas__uring_flush(struct wpas *w)
+{
+	struct wpas_message *m;
+
+	if (!w->uring)
+		return;
+
+	/* on failure the timer eventually hangs up */
+	while ((m = wpas__get_current(w)) && !m->sent)
+		if (wpas__write(w) < 0)
+			break;
+
+	if (m) {
+		sd_event_source_set_time(w->timer_source, m->timeout);
+		sd_event_source_set_enabled(w->timer_source, SD_EVENT_ON);
+	} else {
+		sd_event_source_set_enabled(w->timer_source, SD_EVENT_OFF);
+	}
+}
+
+static void wpas_uring_recv_fn(struct uring_sock *s,
+			       const void *buf,
+			       size_t len,
+			       int error,
+			       void *data)
+{
+	LOOPSTAT("wpas.io");
+	_wpas_message_unref_ struct wpas_message *a = NULL;
+	struct wpas *w = data;
+	int r;
+
+	MIRACLE_PROBE2(wpas_io, w->fd, EPOLLIN);
+	wpas_ref(w);
+
+	/* datagrams, so an empty read is just an empty message */
+	if (error < 0) {
+		wpas__hup(w);
+		goto out;
+	} else if (!len) {
+		goto out;
+	}
+
+	if (len > sizeof(w->recvbuf) - 1)
+		len = sizeof(w->recvbuf) - 1;
+	memcpy(w->recvbuf, buf, len);
+	w->recvbuf[len] = 0;
+
+	r = wpas__parse_message(w, w->recvbuf, len, &w->peer, &a);
+	if (r < 0) {
+		wpas__hup(w);
+		goto out;
+	}
+
+	wpas__handle(w, a);
+	wpas__uring_flush(w);
+
+out:
+	wpas_unref(w);
+}
+
+static void wpas_uring_sent_fn(struct uring_sock *s, int error, void *data)
+{
+	struct wpas *w = data;
+
+	if (error < 0) {
+		wpas_ref(w);
+		wpas__hup(w);
+		wpas_unref(w);
+	}
+}
+
 static int wpas_timer_fn(sd_event_source *source, uint64_t timeout, void *d)
 {
+	LOOPSTAT("wpas.timer");
 	struct wpas *w = d;
 	struct wpas_message *m;
 
@@ -1516,6 +1793,8 @@ static int wpas_timer_fn(sd_event_source *source, uint64_t timeout, void *d)
 	if (!m)
 		goto out;
 
+	metrics_counter_inc(&wpas_timeouts);
+
 	/* A message timed out. We cannot drop it because there might be a
 	 * delayed response coming in and WPAS doesn't provide serials/cookies.
 	 * We also cannot reopen the connection as this might cause missing
@@ -1550,24 +1829,6 @@ int wpas_attach_event(struct wpas *w, sd_event *event, int priority)
 			return r;
 	}
 
-	mask = EPOLLHUP | EPOLLERR | EPOLLIN;
-	r = sd_event_add_io(w->event,
-			    &w->fd_source,
-			    w->fd,
-			    mask,
-			    wpas_io_fn,
-			    w);
-	if (r < 0)
-		goto error;
-
-	r = sd_event_source_set_priority(w->fd_source, priority);
-	if (r < 0)
-		goto error;
-
-	r = sd_event_source_set_prepare(w->fd_source, wpas_io_prepare_fn);
-	if (r < 0)
-		goto error;
-
 	r = sd_event_add_time(w->event,
 			      &w->timer_source,
 			      CLOCK_MONOTONIC,
@@ -1586,6 +1847,40 @@ int wpas_attach_event(struct wpas *w, sd_event *event, int priority)
 	if (r < 0)
 		goto error;
 
+	/* io_uring for clients if we have it, epoll otherwise */
+	if (!w->server)
+		r = uring_sock_new(&w->uring,
+				   w->event,
+				   priority,
+				   w->fd,
+				   WPAS_MAX_LEN,
+				   4,
+				   wpas_uring_recv_fn,
+				   wpas_uring_sent_fn,
+				   w);
+	if (w->uring) {
+		wpas__uring_flush(w);
+		return 0;
+	}
+
+	mask = EPOLLHUP | EPOLLERR | EPOLLIN;
+	r = sd_event_add_io(w->event,
+			    &w->fd_source,
+			    w->fd,
+			    mask,
+			    wpas_io_fn,
+			    w);
+	if (r < 0)
+		goto error;
+
+	r = sd_event_source_set_priority(w->fd_source, priority);
+	if (r < 0)
+		goto error;
+
+	r = sd_event_source_set_prepare(w->fd_source, wpas_io_prepare_fn);
+	if (r < 0)
+		goto error;
+
 	return 0;
 
 error:
@@ -1598,6 +1893,8 @@ void wpas_detach_event(struct wpas *w)
 	if (!w || !w->event)
 		return;
 
+	uring_sock_free(w->uring);
+	w->uring = NULL;
 	w->event = sd_event_unref(w->event);
 	w->fd_source = sd_event_source_unref(w->fd_source);
 	w->timer_source = sd_event_source_unref(w->timer_source);
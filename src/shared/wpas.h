@@ -122,6 +122,7 @@ unsigned int wpas_message_get_level(struct wpas_message *msg);
 const char *wpas_message_get_name(struct wpas_message *msg);
 const char *wpas_message_get_raw(struct wpas_message *msg);
 const char *wpas_message_get_ifname(struct wpas_message *msg);
+int wpas_message_set_ifname(struct wpas_message *msg, const char *ifname);
 bool wpas_message_is_sealed(struct wpas_message *msg);
 
 const char *wpas_message_get_peer(struct wpas_message *msg);
@@ -152,6 +153,7 @@ int wpas_message_dict_read(struct wpas_message *m,
 			   const char *name,
 			   char type,
 			   void *out);
+int wpas_message_dict_read_many(struct wpas_message *m, ...);
 
 static inline void wpas_message_unref_p(struct wpas_message **m)
 {
@@ -1,26 +1,166 @@
 
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/hidraw.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
 #include "miracle-uibcctl.h"
+#include "shl_util.h"
+
+static volatile sig_atomic_t uibc_quit;
+
+static void uibcSignal(int signo) {
+  uibc_quit = 1;
+}
+
+static int uibcInputListen(const char *path) {
+  struct sockaddr_un addr;
+  int fd;
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    log_error("input socket path too long: %s", path);
+    return -EINVAL;
+  }
+
+  fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return log_ERRNO();
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  unlink(path);
+
+  if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+      listen(fd, 1) < 0) {
+    log_vERRNO();
+    close(fd);
+    return -errno;
+  }
+
+  return fd;
+}
+
+/* drain all pending events from a viewer into the scheduler */
+static int uibcInputRead(int fd, UibcClient *c) {
+  UibcInputEvent ev;
+  ssize_t n;
+  int r;
+
+  for (;;) {
+    n = recv(fd, &ev, sizeof(ev), 0);
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EINTR)
+        return 0;
+      return log_ERRNO();
+    } else if (n == 0) {
+      return -EPIPE;
+    } else if (n != sizeof(ev)) {
+      log_warning("dropping short input event (%zd bytes)", n);
+      continue;
+    }
+
+    r = uibcClientPush(c, &ev);
+    if (r < 0)
+      return r;
+  }
+}
+
+/* legacy text input: one "<type>,<count>,<id>,<x>,<y>" event per line */
+static int uibcTextRead(int fd, char *line, size_t *len, size_t size,
+    UibcClient *c) {
+  UibcInputEvent ev;
+  char *pos, *end;
+  uint64_t now;
+  ssize_t n;
+  int r;
+
+  n = read(fd, line + *len, size - *len - 1);
+  if (n < 0)
+    return (errno == EAGAIN || errno == EINTR) ? 0 : log_ERRNO();
+  else if (n == 0)
+    return -EPIPE;
+
+  *len += n;
+  line[*len] = 0;
+  now = shl_now(CLOCK_MONOTONIC);
+
+  pos = line;
+  while ((end = strchr(pos, '\n'))) {
+    *end = 0;
+    /* anything the viewer prints that isn't an event is ignored */
+    if (uibcParseEvent(pos, &ev) >= 0) {
+      ev.timestamp = now;
+      r = uibcClientPush(c, &ev);
+      if (r < 0)
+        return r;
+    }
+    pos = end + 1;
+  }
+
+  *len -= pos - line;
+  memmove(line, pos, *len);
+
+  /* drop overlong garbage instead of stalling */
+  if (*len >= size - 1)
+    *len = 0;
+
+  return 0;
+}
 
 int main(int argc, char *argv[]) {
     //TODO: Add miracle TUI interface
-    //TODO: Add parsearg
-    //--daemon (read stdin)
 
   int portno;
   struct hostent *server;
   int sockfd;
   struct sockaddr_in serv_addr;
-  char buffer[256];
-  int r;
+  struct sigaction sig;
+  struct pollfd fds[3 + UIBC_MAX_HID];
+  UibcHidDevice hid[UIBC_MAX_HID];
+  unsigned int nhid = 0, j;
+  char *hidlist = NULL, *tok, *save;
+  unsigned int hidtypes = 0;
+  struct timespec timeout;
+  const char *input = NULL;
+  static UibcClient client;
+  unsigned int rate = UIBC_DEFAULT_RATE;
+  char line[1024];
+  size_t line_len = 0;
+  uint64_t now;
+  int listenfd = -1, clientfd = -1, textfd = STDIN_FILENO;
+  int i, one = 1, r = 0;
 
   log_max_sev = LOG_INFO;
 
   if (argc < 3) {
     fprintf(stderr, "Usage:\n");
-    fprintf(stderr, "   %s <hostname> <port>\n", argv[0]);
+    fprintf(stderr, "   %s <hostname> <port> [--daemon] [--input <socket>] [--rate <hz>]\n"
+        "          [--hid <hidraw>[,<hidraw>...] --hid-types <mask>]\n", argv[0]);
+    fprintf(stderr, "   --rate  touch-move flush rate, 0 sends every move (default %d)\n", UIBC_DEFAULT_RATE);
+    fprintf(stderr, "   --hid-types  HIDC types the source accepted, 1 << type each\n");
     return EXIT_FAILURE;
   }
 
+  for (i = 3; i < argc; ++i) {
+    if (!strcmp(argv[i], "--input") && i + 1 < argc)
+      input = argv[++i];
+    else if (!strcmp(argv[i], "--rate") && i + 1 < argc)
+      rate = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--hid") && i + 1 < argc)
+      hidlist = argv[++i];
+    else if (!strcmp(argv[i], "--hid-types") && i + 1 < argc)
+      hidtypes = strtoul(argv[++i], NULL, 0);
+    else if (!strcmp(argv[i], "--log-level") && i + 1 < argc)
+      log_max_sev = log_parse_arg(argv[++i]);
+  }
+
   server = gethostbyname(argv[1]);
   portno = atoi(argv[2]);
 
@@ -31,7 +171,7 @@ int main(int argc, char *argv[]) {
     exit(0);
   }
 
-  sockfd = socket(AF_INET, SOCK_STREAM, 0);
+  sockfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
 
   if (sockfd < 0) {
     perror("ERROR opening socket");
@@ -48,65 +188,506 @@ int main(int argc, char *argv[]) {
     return EXIT_FAILURE;
   }
 
-  bool daemon = true;
-  while(1) {
-    if (!daemon) {
-      printf("enter event <type>,<count>,<id>,<x>,<y>: ");
+  /* input packets are tiny, never let Nagle hold them back */
+  if (setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) < 0)
+    log_vERRNO();
+
+  if (input) {
+    listenfd = uibcInputListen(input);
+    if (listenfd < 0)
+      return EXIT_FAILURE;
+  }
+
+  memset(&sig, 0, sizeof(sig));
+  sig.sa_handler = uibcSignal;
+  sigaction(SIGINT, &sig, NULL);
+  sigaction(SIGTERM, &sig, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  /* descriptors go out once here, reports are passed through later */
+  for (tok = hidlist ? strtok_r(hidlist, ",", &save) : NULL;
+       tok && nhid < UIBC_MAX_HID;
+       tok = strtok_r(NULL, ",", &save)) {
+    if (uibcHidAttach(&hid[nhid], tok, sockfd, hidtypes) >= 0)
+      ++nhid;
+  }
+
+  client.sockfd = sockfd;
+  uibcSchedulerInit(&client.sched, rate);
+
+  while (!uibc_quit) {
+    fds[0].fd = textfd;
+    fds[0].events = POLLIN;
+    fds[1].fd = listenfd;
+    fds[1].events = POLLIN;
+    fds[2].fd = clientfd;
+    fds[2].events = POLLIN;
+    for (j = 0; j < nhid; ++j) {
+      fds[3 + j].fd = hid[j].fd;
+      fds[3 + j].events = POLLIN;
     }
-    bzero(buffer, 256);
-    fgets(buffer, 255, stdin);
-    if (buffer == NULL) {
+
+    /* sleep until the next scheduler tick if moves are pending */
+    if (client.sched.deadline) {
+      now = shl_now(CLOCK_MONOTONIC);
+      now = client.sched.deadline > now ? client.sched.deadline - now : 0;
+      timeout.tv_sec = now / 1000000ULL;
+      timeout.tv_nsec = (now % 1000000ULL) * 1000ULL;
+    }
+
+    if (ppoll(fds, 3 + nhid, client.sched.deadline ? &timeout : NULL, NULL) < 0) {
+      if (errno == EINTR)
+        continue;
+      r = log_ERRNO();
       break;
     }
-    if (!daemon) {
-      printf("input: %s", buffer);
+
+    if (fds[1].revents & POLLIN) {
+      /* a new viewer replaces the previous one */
+      i = accept4(listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (i >= 0) {
+        if (clientfd >= 0)
+          close(clientfd);
+        clientfd = i;
+      }
     }
-    char type = buffer[0];
-    UibcMessage uibcmessage;
-    if (type == '0' || type == '1') {
-      uibcmessage = buildUibcMessage(GENERIC_TOUCH_DOWN, buffer, 1, 1);
-    } else if (type == '3' || type == '4') {
-      uibcmessage = buildUibcMessage(GENERIC_KEY_DOWN, buffer, 1, 1);
-    } else {
-      if (!daemon) {
-        printf("unknow event type: %s", buffer);
+
+    if (fds[2].revents & (POLLIN | POLLHUP | POLLERR)) {
+      r = uibcInputRead(clientfd, &client);
+      if (r == -EPIPE) {
+        close(clientfd);
+        clientfd = -1;
+        r = 0;
       }
-      continue;
     }
 
-    r = sendUibcMessage(&uibcmessage, sockfd);
-    if (r) {
-      return r;
+    if (r >= 0 && fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+      r = uibcTextRead(textfd, line, &line_len, sizeof(line), &client);
+      if (r == -EPIPE) {
+        /* stdin is done, keep serving binary viewers if we have any */
+        textfd = -1;
+        r = 0;
+        if (listenfd < 0)
+          uibc_quit = 1;
+      }
+    }
+
+    for (j = 0; r >= 0 && j < nhid; ++j) {
+      if (fds[3 + j].revents & POLLIN) {
+        r = uibcHidRead(&hid[j], &client);
+        if (r == -ENODEV) {
+          /* unplugged before we saw POLLHUP, e.g. EIO */
+          uibcHidDetach(&hid[j]);
+          r = 0;
+        }
+      } else if (fds[3 + j].revents & (POLLHUP | POLLERR)) {
+        /* unplugged, keep the others going */
+        log_warning("HID device %s went away", hid[j].path);
+        uibcHidDetach(&hid[j]);
+      }
     }
+
+    if (r >= 0 && client.sched.deadline &&
+        shl_now(CLOCK_MONOTONIC) >= client.sched.deadline)
+      r = uibcClientFlush(&client);
+    if (r < 0)
+      break;
   }
 
+  if (r >= 0)
+    r = uibcClientFlush(&client);
+
+  log_info("scheduler: %" PRIu64 " events, %" PRIu64 " moves merged, %"
+      PRIu64 " packets sent", client.sched.received, client.sched.merged,
+      client.sched.sent);
+  uibcLatencyReport(&client.encode, "input-to-encoded");
+  uibcLatencyReport(&client.latency, "input-to-wire");
+
+  for (j = 0; j < nhid; ++j)
+    uibcHidDetach(&hid[j]);
+  if (clientfd >= 0)
+    close(clientfd);
+  if (listenfd >= 0) {
+    close(listenfd);
+    unlink(input);
+  }
   close(sockfd);
-  return EXIT_SUCCESS;
+  return r < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
 }
 
-const char *int2binary(int x, int padding)
-{
-  char *b;
-  int min_padding = x > 0 ? floor(log2(x)) : 0;
-  if (padding < min_padding) {
-    padding = min_padding;
+void uibcSchedulerInit(UibcScheduler *s, unsigned int rate) {
+  memset(s, 0, sizeof(*s));
+  s->interval = rate ? 1000000ULL / rate : 0;
+}
+
+static bool uibcSamePointers(const UibcInputEvent *a, const UibcInputEvent *b) {
+  int i;
+
+  if (a->count != b->count)
+    return false;
+
+  for (i = 0; i < a->count; ++i) {
+    if (a->pointers[i].id != b->pointers[i].id)
+      return false;
   }
 
-  b = (char *)malloc (sizeof (char *) * padding + 1);
-  strcpy(b, "");
+  return true;
+}
+
+/* queue an event, merging it into a pending move of the same pointers */
+int uibcClientPush(UibcClient *c, const UibcInputEvent *ev) {
+  UibcScheduler *s = &c->sched;
+  UibcInputEvent *q;
+  uint64_t now;
+  size_t i;
+  int r;
+
+  ++s->received;
 
-  int z;
-  for (z = pow(2,padding); z > 0; z >>= 1) {
-    strcat(b, ((x & z) == z) ? "1" : "0");
+  if (ev->type == GENERIC_TOUCH_MOVE && s->interval) {
+    /* only look back until the last non-move, downs/ups are barriers */
+    for (i = s->queued; i-- > 0; ) {
+      q = &s->queue[i];
+      if (q->type != GENERIC_TOUCH_MOVE)
+        break;
+
+      if (uibcSamePointers(q, ev)) {
+        /* keep the older timestamp, that's when the user moved first */
+        memcpy(q->pointers, ev->pointers, sizeof(q->pointers));
+        ++s->merged;
+        return 0;
+      }
+    }
   }
 
-  return b;
+  if (s->queued == UIBC_QUEUE_MAX) {
+    r = uibcClientFlush(c);
+    if (r < 0)
+      return r;
+  }
+
+  s->queue[s->queued++] = *ev;
+
+  if (ev->type != GENERIC_TOUCH_MOVE || !s->interval) {
+    /* send with the current poll iteration */
+    s->deadline = 1;
+  } else if (!s->deadline) {
+    /* align move flushes to the frame grid */
+    now = shl_now(CLOCK_MONOTONIC);
+    s->deadline = now - now % s->interval + s->interval;
+  }
+
+  return 0;
 }
 
-int sendUibcMessage(UibcMessage* uibcmessage, int sockfd) {
+/* account a freshly encoded batch before it goes out */
+static void uibcClientEncoded(UibcClient *c) {
+  uint64_t now;
+  size_t i;
+
+  c->sched.sent += c->batch.n;
+
+  now = shl_now(CLOCK_MONOTONIC);
+  for (i = 0; i < c->batch.n; ++i)
+    uibcLatencyAdd(&c->encode, c->batch.stamp[i], now);
+}
+
+/* encode and send everything queued, in order */
+int uibcClientFlush(UibcClient *c) {
+  UibcScheduler *s = &c->sched;
+  UibcBatch *batch = &c->batch;
+  const UibcInputEvent *ev;
+  ssize_t len;
+  size_t i;
+  int r;
+
+  for (i = 0; i < s->queued; ++i) {
+    ev = &s->queue[i];
+
+    len = uibcEncodeEvent(ev, batch->buf[batch->n], UIBC_PACKET_MAX, 1, 1);
+    if (len < 0)
+      continue;
+
+    batch->iov[batch->n].iov_base = batch->buf[batch->n];
+    batch->iov[batch->n].iov_len = len;
+    batch->stamp[batch->n] = ev->timestamp;
+    ++batch->n;
+
+    if (batch->n == UIBC_BATCH_MAX) {
+      uibcClientEncoded(c);
+      r = uibcBatchFlush(batch, c->sockfd, &c->latency);
+      if (r < 0)
+        goto out;
+    }
+  }
+
+  uibcClientEncoded(c);
+  r = uibcBatchFlush(batch, c->sockfd, &c->latency);
+
+out:
+  s->queued = 0;
+  s->deadline = 0;
+  return r;
+}
+
+/* fill a HIDC header for a value of @len bytes, returns the header length */
+size_t uibcEncodeHidcHeader(uint8_t *buf, uint8_t type, uint8_t usage,
+    size_t len) {
+  size_t uibcBodyLen = UIBC_HIDC_HEADER_LEN + len;
+
+  //Version (3 bits),T (1 bit),Reserved(8 bits),Input Category (4 bits)
+  buf[0] = 0x00;
+  buf[1] = UIBC_CATEGORY_HIDC;
+  //Length(16 bits)
+  buf[2] = (uibcBodyLen >> 8) & 0xFF;
+  buf[3] = uibcBodyLen & 0xFF;
+
+  //HIDC Input Body Format
+  buf[4] = UIBC_HIDC_PATH_USB; // Input Path, we only advertise USB
+  buf[5] = type; // HID Type
+  buf[6] = usage; // Usage
+  buf[7] = (len >> 8) & 0xFF; // Length, 2 octets
+  buf[8] = len & 0xFF;
+
+  return UIBC_HIDC_HEADER_LEN;
+}
+
+/* guess the HIDC type from the first top-level usage of a descriptor */
+static int uibcHidType(const uint8_t *desc, size_t len) {
+  unsigned int page = 0, usage = 0, size;
+  size_t i;
+
+  for (i = 0; i < len; i += 1 + size) {
+    size = desc[i] & 0x03;
+    size = size == 3 ? 4 : size;
+
+    if (desc[i] == 0xFE) {
+      /* long item, never carries usages we care about */
+      if (i + 1 >= len)
+        break;
+      size = 2 + desc[i + 1];
+      continue;
+    } else if (i + size >= len) {
+      break;
+    }
+
+    if ((desc[i] & 0xFC) == 0x04)
+      page = desc[i + 1];
+    else if ((desc[i] & 0xFC) == 0x08)
+      usage = desc[i + 1];
+    else if ((desc[i] & 0xFC) == 0xA0)
+      break;
+  }
+
+  if (page == 0x01 && (usage == 0x06 || usage == 0x07))
+    return UIBC_HIDC_TYPE_KEYBOARD;
+  if (page == 0x01 && (usage == 0x01 || usage == 0x02))
+    return UIBC_HIDC_TYPE_MOUSE;
+  if (page == 0x01 && (usage == 0x04 || usage == 0x05))
+    return UIBC_HIDC_TYPE_JOYSTICK;
+  if (page == 0x0D && usage == 0x04)
+    return UIBC_HIDC_TYPE_MULTI_TOUCH;
+  if (page == 0x0D)
+    return UIBC_HIDC_TYPE_SINGLE_TOUCH;
+  if (page == 0x0C)
+    return UIBC_HIDC_TYPE_REMOTE_CONTROL;
+
+  return -EINVAL;
+}
+
+/*
+ * open a hidraw device and send its report descriptor, @types are the HIDC
+ * types negotiated with the source as 1 << type
+ */
+int uibcHidAttach(UibcHidDevice *d, const char *path, int sockfd,
+    unsigned int types) {
+  struct hidraw_report_descriptor desc;
+  uint8_t header[UIBC_HIDC_HEADER_LEN];
+  struct iovec iov[2];
+  int size, r;
+
+  memset(d, 0, sizeof(*d));
+
+  d->fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+  if (d->fd < 0) {
+    log_error("cannot open HID device %s: %m", path);
+    return -errno;
+  }
+
+  if (ioctl(d->fd, HIDIOCGRDESCSIZE, &size) < 0) {
+    r = log_ERRNO();
+    goto error;
+  }
+
+  desc.size = size;
+  if (ioctl(d->fd, HIDIOCGRDESC, &desc) < 0) {
+    r = log_ERRNO();
+    goto error;
+  }
+
+  r = uibcHidType(desc.value, desc.size);
+  if (r < 0) {
+    log_error("HID device %s is neither keyboard, mouse, touch nor remote", path);
+    goto error;
+  }
+  d->type = r;
+
+  if (!(types & (1U << d->type))) {
+    log_error("HID device %s has HIDC type %u, which the source did not accept",
+        path, d->type);
+    r = -EOPNOTSUPP;
+    goto error;
+  }
+
+  d->path = strdup(path);
+  if (!d->path) {
+    r = log_ENOMEM();
+    goto error;
+  }
+
+  iov[0].iov_base = header;
+  iov[0].iov_len = uibcEncodeHidcHeader(header, d->type,
+      UIBC_HIDC_USAGE_REPORT_DESCRIPTOR, desc.size);
+  iov[1].iov_base = desc.value;
+  iov[1].iov_len = desc.size;
+
+  if (writev(sockfd, iov, 2) < 0) {
+    r = log_ERRNO();
+    goto error;
+  }
+
+  log_info("HID device %s attached as HIDC type %u", path, d->type);
+  return 0;
+
+error:
+  uibcHidDetach(d);
+  return r;
+}
+
+void uibcHidDetach(UibcHidDevice *d) {
+  if (d->fd >= 0)
+    close(d->fd);
+  d->fd = -1;
+  free(d->path);
+  d->path = NULL;
+}
+
+/*
+ * pass all pending reports of @d through without looking at them, returns
+ * -ENODEV if @d cannot be read anymore
+ */
+int uibcHidRead(UibcHidDevice *d, UibcClient *c) {
+  static uint8_t report[UIBC_HID_REPORT_MAX];
+  UibcBatch *batch = &c->batch;
+  uint8_t *buf;
+  uint64_t now;
+  ssize_t n;
+  int r;
+
+  /* keep ordering with generic events that are already queued */
+  if (c->sched.queued) {
+    r = uibcClientFlush(c);
+    if (r < 0)
+      return r;
+  }
+
+  now = shl_now(CLOCK_MONOTONIC);
+
+  for (;;) {
+    /* hidraw cuts reports to the buffer, so read into one that fits all */
+    n = read(d->fd, report, sizeof(report));
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EINTR)
+        break;
+      log_warning("cannot read HID device %s: %m", d->path);
+      return -ENODEV;
+    } else if (n == 0) {
+      break;
+    } else if (n > UIBC_PACKET_MAX - UIBC_HIDC_HEADER_LEN) {
+      if (!d->dropping)
+        log_warning("HID device %s sent a %zd byte report, dropping reports above %d bytes",
+            d->path, n, UIBC_PACKET_MAX - UIBC_HIDC_HEADER_LEN);
+      d->dropping = true;
+      continue;
+    }
+
+    buf = batch->buf[batch->n];
+    memcpy(buf + UIBC_HIDC_HEADER_LEN, report, n);
+    uibcEncodeHidcHeader(buf, d->type, UIBC_HIDC_USAGE_REPORT, n);
+    batch->iov[batch->n].iov_base = buf;
+    batch->iov[batch->n].iov_len = UIBC_HIDC_HEADER_LEN + n;
+    batch->stamp[batch->n] = now;
+    ++batch->n;
+
+    if (batch->n == UIBC_BATCH_MAX) {
+      uibcClientEncoded(c);
+      r = uibcBatchFlush(batch, c->sockfd, &c->latency);
+      if (r < 0)
+        return r;
+    }
+  }
+
+  uibcClientEncoded(c);
+  return uibcBatchFlush(batch, c->sockfd, &c->latency);
+}
+
+/* send all queued packets with a single writev(), retrying partial writes */
+int uibcBatchFlush(UibcBatch *batch, int sockfd, struct metrics_hist *latency) {
+  struct iovec *iov = batch->iov;
+  size_t i, cnt = batch->n;
+  uint64_t now;
   ssize_t n;
 
-  printf("sending %zu bytes\n", uibcmessage->m_PacketDataLen);
+  while (cnt > 0) {
+    n = writev(sockfd, iov, cnt);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      batch->n = 0;
+      return log_ERRNO();
+    }
+
+    while (cnt > 0 && (size_t)n >= iov->iov_len) {
+      n -= iov->iov_len;
+      ++iov;
+      --cnt;
+    }
+    if (cnt > 0) {
+      iov->iov_base = (uint8_t*)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+
+  now = shl_now(CLOCK_MONOTONIC);
+  for (i = 0; i < batch->n; ++i)
+    uibcLatencyAdd(latency, batch->stamp[i], now);
+
+  batch->n = 0;
+  return 0;
+}
+
+void uibcLatencyAdd(struct metrics_hist *latency, uint64_t stamp, uint64_t now) {
+  if (!stamp || stamp > now)
+    return;
+
+  metrics_hist_add(latency, now - stamp);
+}
+
+void uibcLatencyReport(struct metrics_hist *latency, const char *name) {
+  if (!latency->count)
+    return;
+
+  log_info("%s latency: %" PRIu64 " events, min %" PRIu64
+      "us, avg %" PRIu64 "us, p50 %" PRIu64 "us, p99 %" PRIu64
+      "us, max %" PRIu64 "us",
+      name, latency->count, latency->min,
+      latency->sum / latency->count,
+      metrics_hist_percentile(latency, 50),
+      metrics_hist_percentile(latency, 99), latency->max);
+}
+
+int sendUibcMessage(UibcMessage* uibcmessage, int sockfd) {
+  ssize_t n;
 
   n = write(sockfd, uibcmessage->m_PacketData , uibcmessage->m_PacketDataLen);
 
@@ -118,6 +699,146 @@ int sendUibcMessage(UibcMessage* uibcmessage, int sockfd) {
   return EXIT_SUCCESS;
 }
 
+/* parse a text event into @ev without allocating */
+int uibcParseEvent(const char *inEventDesc, UibcInputEvent *ev) {
+  const char *pos = inEventDesc;
+  char *end;
+  unsigned long fields[2 + 3 * UIBC_MAX_POINTERS];
+  size_t n = 0;
+  int i;
+
+  memset(ev, 0, sizeof(*ev));
+
+  while (n < sizeof(fields) / sizeof(*fields)) {
+    /* key codes are hex, everything else decimal */
+    fields[n] = strtoul(pos, &end,
+        (n > 0 && n < 3 && fields[0] >= GENERIC_KEY_DOWN) ? 16 : 10);
+    if (end == pos)
+      return -EINVAL;
+    ++n;
+
+    while (*end == ' ' || *end == '\t' || *end == '\r')
+      ++end;
+    if (!*end)
+      break;
+    if (*end != ',')
+      return -EINVAL;
+    pos = end + 1;
+  }
+
+  ev->type = fields[0];
+  switch (ev->type) {
+    case GENERIC_TOUCH_DOWN:
+    case GENERIC_TOUCH_UP:
+    case GENERIC_TOUCH_MOVE:
+      if (n < 5 || (n - 2) % 3 || fields[1] != (n - 2) / 3)
+        return -EINVAL;
+
+      ev->count = fields[1];
+      for (i = 0; i < ev->count; ++i) {
+        ev->pointers[i].id = fields[2 + i * 3];
+        ev->pointers[i].x = fields[3 + i * 3];
+        ev->pointers[i].y = fields[4 + i * 3];
+      }
+      return 0;
+
+    case GENERIC_KEY_DOWN:
+    case GENERIC_KEY_UP:
+      if (n != 3)
+        return -EINVAL;
+
+      ev->keys[0] = fields[1];
+      ev->keys[1] = fields[2];
+      return 0;
+
+    default:
+      return -EINVAL;
+  }
+}
+
+/* encode @ev into @buf, returns the packet length */
+ssize_t uibcEncodeEvent(const UibcInputEvent *ev, uint8_t *buf, size_t size,
+    double widthRatio, double heightRatio) {
+  size_t uibcBodyLen, genericPacketLen, offset;
+  int32_t temp;
+  bool scale;
+  int i;
+
+  switch (ev->type) {
+    case GENERIC_TOUCH_DOWN:
+    case GENERIC_TOUCH_UP:
+    case GENERIC_TOUCH_MOVE:
+      if (ev->count > UIBC_MAX_POINTERS)
+        return -EINVAL;
+      genericPacketLen = ev->count * 5 + 1;
+      break;
+    case GENERIC_KEY_DOWN:
+    case GENERIC_KEY_UP:
+      genericPacketLen = 5;
+      break;
+    default:
+      return -EINVAL;
+  }
+
+  uibcBodyLen = genericPacketLen + 7; // Generic header length = 7
+  //Padding to even number
+  uibcBodyLen = (uibcBodyLen % 2 == 0) ? uibcBodyLen : (uibcBodyLen + 1);
+  if (uibcBodyLen > size)
+    return -ENOBUFS;
+
+  // UIBC header Octets
+  //Version (3 bits),T (1 bit),Reserved(8 bits),Input Category (4 bits)
+  buf[0] = 0x00; // 000 0 0000
+  buf[1] = 0x00; // 0000 0000
+  //Length(16 bits)
+  buf[2] = (uibcBodyLen >> 8) & 0xFF;
+  buf[3] = uibcBodyLen & 0xFF;
+
+  //Generic Input Body Format
+  buf[4] = ev->type; // Type ID, 1 octet
+  // Length, 2 octets
+  buf[5] = (genericPacketLen >> 8) & 0xFF;
+  buf[6] = genericPacketLen & 0xFF;
+
+  if (ev->type >= GENERIC_KEY_DOWN) {
+    buf[7] = 0x00; // reserved
+    buf[8] = (ev->keys[0] >> 8) & 0xFF;
+    buf[9] = ev->keys[0] & 0xFF;
+    buf[10] = (ev->keys[1] >> 8) & 0xFF;
+    buf[11] = ev->keys[1] & 0xFF;
+    return uibcBodyLen;
+  }
+
+  // Number of pointers, 1 octet
+  buf[7] = ev->count;
+
+  // coordinates are already in source resolution in the common case
+  scale = widthRatio != 1 || heightRatio != 1;
+
+  offset = 8;
+  for (i = 0; i < ev->count; i++) {
+    buf[offset++] = ev->pointers[i].id;
+
+    temp = ev->pointers[i].x;
+    if (scale)
+      temp = (int32_t)((double)temp / widthRatio);
+    buf[offset++] = (temp >> 8) & 0xFF;
+    buf[offset++] = temp & 0xFF;
+
+    temp = ev->pointers[i].y;
+    if (scale)
+      temp = (int32_t)((double)temp / heightRatio);
+    buf[offset++] = (temp >> 8) & 0xFF;
+    buf[offset++] = temp & 0xFF;
+  }
+
+  while (offset < uibcBodyLen) {
+    buf[offset++] = 0x00;
+  }
+
+  return uibcBodyLen;
+}
+
 UibcMessage buildUibcMessage(MessageType type,
     const char* inEventDesc,
     double widthRatio,
@@ -164,86 +885,30 @@ void getUIBCGenericTouchPacket(const char *inEventDesc,
     UibcMessage* uibcmessage,
     double widthRatio,
     double heightRatio) {
-  log_info("getUIBCGenericTouchPacket (%s)", inEventDesc);
-  char* outData;
-  int32_t typeId = 0;
-  int32_t numberOfPointers = 0;
-  size_t uibcBodyLen = 0;
-  int32_t genericPacketLen = 0;
-  int32_t temp;
-  size_t size;
+  UibcInputEvent ev;
+  ssize_t len;
 
-  char** splitedStr = str_split((char*)inEventDesc, ",", &size);
-
-  if ((int)size - 5 < 0 || ((int)size - 5) % 3 != 0) {
+  if (uibcParseEvent(inEventDesc, &ev) < 0 || ev.type > GENERIC_TOUCH_MOVE) {
     log_error("getUIBCGenericTouchPacket (%s)", "bad input event");
     return;
   }
-  int offset_split = 0;
-  typeId = atoi(*(splitedStr + offset_split++));
-  numberOfPointers = atoi(*(splitedStr + offset_split++));
-
-  genericPacketLen = numberOfPointers * 5 + 1;
-  uibcBodyLen = genericPacketLen + 7; // Generic header length = 7
-  //Padding to even number
-  uibcBodyLen = (uibcBodyLen % 2 == 0) ? uibcBodyLen : (uibcBodyLen + 1);
-
-  outData = (char*)malloc(uibcBodyLen);
-  // UIBC header Octets
-  int offset_header = 0;
-  //Version (3 bits),T (1 bit),Reserved(8 bits),Input Category (4 bits)
-  outData[offset_header++] = 0x00; // 000 0 0000
-  outData[offset_header++] = 0x00; // 0000 0000
-
-  //Length(16 bits)
-  outData[offset_header++] = (uibcBodyLen >> 8) & 0xFF; // first 8 bytes
-  outData[offset_header++] = uibcBodyLen & 0xFF; // last 8 bytes
-
-  //Generic Input Body Format
-  outData[offset_header++] = typeId & 0xFF; // Tyoe ID, 1 octet
-
-  // Length, 2 octets
-  outData[offset_header++] = (genericPacketLen >> 8) & 0xFF; // first 8 bytes
-  outData[offset_header++] = genericPacketLen & 0xFF; //last 8 bytes
-
-  // Number of pointers, 1 octet
-  outData[offset_header++] = numberOfPointers & 0xFF; 
-
-  int offset = 0;
-  log_info("getUIBCGenericTouchPacket numberOfPointers=[%d]\n", numberOfPointers);
-  for (int i = 0; i < numberOfPointers; i++) {
-    int splitoffset = offset_split + (i * 3);
-    temp = atoi(*(splitedStr + splitoffset++));
-    offset = offset_header + ( i * 5);
-    outData[offset++] = temp & 0xFF;
-    log_info("getUIBCGenericTouchPacket PointerId=[%d]\n", temp);
-
-    temp = atoi(*(splitedStr + splitoffset++));
-    temp = (int32_t)((double)temp / widthRatio);
-    log_info("getUIBCGenericTouchPacket X-coordinate=[%d]\n", temp);
-    outData[offset++] = (temp >> 8) & 0xFF;
-    outData[offset++] = temp & 0xFF;
-
-    temp = atoi(*(splitedStr + splitoffset++));
-    temp = (int32_t)((double)temp / heightRatio);
-    log_info("getUIBCGenericTouchPacket Y-coordinate=[%d]\n", temp);
-    outData[offset++] = (temp >> 8) & 0xFF;
-    outData[offset++] = temp & 0xFF;
-  }
 
-  while (offset <= uibcBodyLen) {
-    outData[offset++] = 0x00;
-  }
+  uibcmessage->m_PacketData = malloc(UIBC_PACKET_MAX);
+  if (!uibcmessage->m_PacketData)
+    return;
 
-  for (int i = 0; i < size; i++) {
-    free(*(splitedStr + i));
+  len = uibcEncodeEvent(&ev, (uint8_t*)uibcmessage->m_PacketData,
+      UIBC_PACKET_MAX, widthRatio, heightRatio);
+  if (len < 0) {
+    free(uibcmessage->m_PacketData);
+    uibcmessage->m_PacketData = NULL;
+    return;
   }
-  free(splitedStr);
 
-  binarydump(outData, uibcBodyLen);
+  if (log_max_sev >= LOG_DEBUG)
+    binarydump(uibcmessage->m_PacketData, len);
   uibcmessage->m_DataValid = true;
-  uibcmessage->m_PacketData = outData;
-  uibcmessage->m_PacketDataLen = uibcBodyLen;
+  uibcmessage->m_PacketDataLen = len;
 }
 
 void hexdump(void *_data, size_t len)
@@ -271,13 +936,19 @@ void binarydump(void *_data, size_t len)
 {
   unsigned char *data = _data;
   size_t count;
+  char bits[9];
+  int i;
 
   int line = 7;
   for (count = 0; count < len; count++) {
     if ((count & line) == 0) {
       fprintf(stderr,"%04zu: ", count);
     }
-    fprintf(stderr,"%s ", int2binary(*data, 8));
+    for (i = 0; i < 8; i++) {
+      bits[i] = (*data & (0x80 >> i)) ? '1' : '0';
+    }
+    bits[8] = 0;
+    fprintf(stderr,"%s ", bits);
     data++;
     if ((count & line) == line) {
       fprintf(stderr,"\n");
@@ -290,81 +961,30 @@ void binarydump(void *_data, size_t len)
 // format: "typeId, Key code 1(0x00), Key code 2(0x00)"
 void getUIBCGenericKeyPacket(const char *inEventDesc,
     UibcMessage* uibcmessage) {
-  log_info("getUIBCGenericKeyPacket (%s)", inEventDesc);
-  char* outData = uibcmessage->m_PacketData;
-  int32_t typeId = 0;
-  int32_t uibcBodyLen = 0;
-  int32_t genericPacketLen = 0;
-  int32_t temp = 0;
-  size_t size;
-  char** splitedStr = str_split((char*)inEventDesc, ",", &size);
-
-  if (size > 0) {
+  UibcInputEvent ev;
+  ssize_t len;
 
-    if (((int)size) % 3 != 0) {
-        log_error("getUIBCGenericKeyPacket (%s)", "bad input event");
-        return;
-    }
-    int i;
-    for (i = 0; i < size; i++) {
-      log_info("getUIBCGenericKeyPacket splitedStr tokens=[%s]\n", *(splitedStr + i));
-
-      switch (i) {
-        case 0: {
-                  typeId = atoi(*(splitedStr + i));
-                  log_info("getUIBCGenericKeyPacket typeId=[%d]\n", typeId);
-                  genericPacketLen = 5;
-                  uibcBodyLen = genericPacketLen + 7; // Generic header legth = 7
-                  outData = (char*)malloc(uibcBodyLen + 1);
-                  // UIBC header
-                  outData[0] = 0x00; //Version (3 bits),T (1 bit),Reserved(8 bits),Input Category (4 bits)
-                  outData[1] = 0x00; //Version (3 bits),T (1 bit),Reserved(8 bits),Input Category (4 bits)
-                  outData[2] = (uibcBodyLen >> 8) & 0xFF; //Length(16 bits)
-                  outData[3] = uibcBodyLen & 0xFF; //Length(16 bits)
-                  //Generic Input Body Format
-                  outData[4] = typeId & 0xFF; // Tyoe ID, 1 octet
-                  outData[5] = (genericPacketLen >> 8) & 0xFF; // Length, 2 octets
-                  outData[6] = genericPacketLen & 0xFF; // Length, 2 octets
-                  outData[7] = 0x00; // reserved
-                  break;
-                }
-        case 1: {
-                  sscanf(*(splitedStr + i), " 0x%04X", &temp);
-                  if (temp == 0) {
-                    outData[8] = 0x00;
-                    outData[9] = 0x00;
-                  }
-                  log_info("getUIBCGenericKeyPacket key code 1=[%d]\n", temp);
-                  outData[8] = (temp >> 8) & 0xFF;
-                  outData[9] = temp & 0xFF;
+  if (uibcParseEvent(inEventDesc, &ev) < 0 || ev.type < GENERIC_KEY_DOWN) {
+    log_error("getUIBCGenericKeyPacket (%s)", "bad input event");
+    return;
+  }
 
-                  break;
-                }
-        case 2: {
-                  sscanf(*(splitedStr + i), " 0x%04X", &temp);
-                  if (temp == 0) {
-                    outData[10] = 0x00;
-                    outData[11] = 0x00;
-                  }
-                  log_info("getUIBCGenericKeyPacket key code 2=[%d]\n", temp);
-                  outData[10] = (temp >> 8) & 0xFF;
-                  outData[11] = temp & 0xFF;
+  uibcmessage->m_PacketData = malloc(UIBC_PACKET_MAX);
+  if (!uibcmessage->m_PacketData)
+    return;
 
-                  break;
-                }
-        default: {
-                 }
-                 break;
-      }
-      free(*(splitedStr + i));
-    }
+  len = uibcEncodeEvent(&ev, (uint8_t*)uibcmessage->m_PacketData,
+      UIBC_PACKET_MAX, 1, 1);
+  if (len < 0) {
+    free(uibcmessage->m_PacketData);
+    uibcmessage->m_PacketData = NULL;
+    return;
   }
-  free(splitedStr);
 
-  binarydump(outData, uibcBodyLen);
+  if (log_max_sev >= LOG_DEBUG)
+    binarydump(uibcmessage->m_PacketData, len);
   uibcmessage->m_DataValid = true;
-  uibcmessage->m_PacketData = outData;
-  uibcmessage->m_PacketDataLen = uibcBodyLen;
+  uibcmessage->m_PacketDataLen = len;
 }
 
 // format: "typeId,  X coordnate, Y coordnate, integer part, fraction part"
@@ -9,8 +9,11 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <netdb.h>
+#include <sys/uio.h>
 #include<arpa/inet.h>
 #include <math.h>
+#include "metrics.h"
+#include <sys/types.h>
 #include "shl_log.h"
 
 typedef enum {
@@ -25,6 +28,104 @@ typedef enum {
         GENERIC_ROTATE
 } MessageType;
 
+#define UIBC_MAX_POINTERS 10
+#define UIBC_PACKET_MAX 128
+#define UIBC_BATCH_MAX 16
+#define UIBC_QUEUE_MAX 64
+#define UIBC_DEFAULT_RATE 60
+#define UIBC_MAX_HID 8
+#define UIBC_HIDC_HEADER_LEN 9
+#define UIBC_HID_REPORT_MAX 4096	/* HID_MAX_BUFFER_SIZE of hidraw */
+
+/*
+ * Binary input event
+ * Viewers write one of these per SOCK_SEQPACKET datagram to the --input
+ * socket. Fields are in host byte order, the layout is fixed (80 bytes).
+ * @timestamp is CLOCK_MONOTONIC in usecs when the viewer saw the input, 0 if
+ * unknown. It is used to measure input-to-wire latency.
+ */
+typedef struct {
+  uint64_t timestamp;
+  uint8_t type;                 /* MessageType */
+  uint8_t count;                /* valid entries in pointers[] */
+  uint16_t keys[2];             /* key codes for GENERIC_KEY_* */
+  uint16_t reserved;
+  struct {
+    uint8_t id;
+    uint8_t reserved;
+    uint16_t x;
+    uint16_t y;
+  } pointers[UIBC_MAX_POINTERS];
+} UibcInputEvent;
+
+/* encoded packets waiting for a single writev() */
+typedef struct {
+  uint8_t buf[UIBC_BATCH_MAX][UIBC_PACKET_MAX];
+  struct iovec iov[UIBC_BATCH_MAX];
+  uint64_t stamp[UIBC_BATCH_MAX];
+  size_t n;
+} UibcBatch;
+
+
+/*
+ * Input scheduler
+ * Events are queued before they're encoded. Consecutive GENERIC_TOUCH_MOVE
+ * events for the same pointer IDs are merged into the latest position and
+ * flushed on a fixed tick (usually the video frame rate). Any other event
+ * flushes the queue right away, so downs/ups are never delayed or reordered.
+ */
+typedef struct {
+  UibcInputEvent queue[UIBC_QUEUE_MAX];
+  size_t queued;
+  uint64_t interval;            /* usecs between move flushes, 0 = no shaping */
+  uint64_t deadline;            /* next flush, 0 if nothing is queued */
+
+  uint64_t received;
+  uint64_t merged;
+  uint64_t sent;
+} UibcScheduler;
+
+typedef struct {
+  int sockfd;
+  UibcScheduler sched;
+  UibcBatch batch;
+  struct metrics_hist encode;   /* usecs from input until it is encoded */
+  struct metrics_hist latency;  /* usecs from input until writev() sent it */
+} UibcClient;
+
+/* UIBC input categories, low nibble of the second header octet */
+enum {
+  UIBC_CATEGORY_GENERIC = 0,
+  UIBC_CATEGORY_HIDC = 1,
+};
+
+/* HIDC body fields */
+enum {
+  UIBC_HIDC_PATH_USB = 1,
+};
+
+enum {
+  UIBC_HIDC_TYPE_KEYBOARD = 0,
+  UIBC_HIDC_TYPE_MOUSE = 1,
+  UIBC_HIDC_TYPE_SINGLE_TOUCH = 2,
+  UIBC_HIDC_TYPE_MULTI_TOUCH = 3,
+  UIBC_HIDC_TYPE_JOYSTICK = 4,
+  UIBC_HIDC_TYPE_REMOTE_CONTROL = 7,
+};
+
+enum {
+  UIBC_HIDC_USAGE_REPORT = 0,
+  UIBC_HIDC_USAGE_REPORT_DESCRIPTOR = 1,
+};
+
+/* local hidraw device whose reports are passed through as HIDC */
+typedef struct {
+  int fd;
+  uint8_t type;
+  char *path;
+  bool dropping;                /* warned about oversized reports */
+} UibcHidDevice;
+
 typedef struct {
    char* m_PacketData;
    size_t m_PacketDataLen;
@@ -33,7 +134,7 @@ typedef struct {
 
 UibcMessage buildUibcMessage(MessageType type, const char* inEventDesc, double widthRatio, double heightRatio);
 
-static char** str_split(char* pStr, const char* pDelim, size_t* size);
+char** str_split(char* pStr, const char* pDelim, size_t* size);
 
 void getUIBCGenericTouchPacket(const char *inEventDesc, UibcMessage* uibcmessage, double widthRatio, double heightRatio);
 void getUIBCGenericKeyPacket(const char *inEventDesc, UibcMessage* uibcmessage);
@@ -45,4 +146,22 @@ void hexdump(void *_data, size_t len);
 void binarydump(void *_data, size_t len);
 
 int sendUibcMessage(UibcMessage* uibcmessage, int sockfd);
+
+int uibcParseEvent(const char *inEventDesc, UibcInputEvent *ev);
+ssize_t uibcEncodeEvent(const UibcInputEvent *ev, uint8_t *buf, size_t size,
+    double widthRatio, double heightRatio);
+int uibcBatchFlush(UibcBatch *batch, int sockfd, struct metrics_hist *latency);
+void uibcLatencyAdd(struct metrics_hist *latency, uint64_t stamp, uint64_t now);
+void uibcLatencyReport(struct metrics_hist *latency, const char *name);
+
+void uibcSchedulerInit(UibcScheduler *s, unsigned int rate);
+int uibcClientPush(UibcClient *c, const UibcInputEvent *ev);
+int uibcClientFlush(UibcClient *c);
+
+size_t uibcEncodeHidcHeader(uint8_t *buf, uint8_t type, uint8_t usage,
+    size_t len);
+int uibcHidAttach(UibcHidDevice *d, const char *path, int sockfd,
+    unsigned int types);
+void uibcHidDetach(UibcHidDevice *d);
+int uibcHidRead(UibcHidDevice *d, UibcClient *c);
 #endif
@@ -24,6 +24,8 @@
 #include <string.h>
 #include <systemd/sd-bus.h>
 #include <systemd/sd-event.h>
+#include "loopstat.h"
+#include "metrics.h"
 #include "shl_log.h"
 #include "shl_util.h"
 #include "util.h"
@@ -47,6 +49,35 @@ static char *peer_dbus_get_path(struct peer *p)
 	return node;
 }
 
+static uint64_t manager_dbus_bump(struct manager *m)
+{
+	return ++m->generation;
+}
+
+static void manager_dbus_log_removed(struct manager *m, const char *node)
+{
+	struct manager_removed *e;
+	char *path;
+
+	path = strdup(node);
+	if (!path) {
+		/* clients can no longer trust their deltas */
+		m->removed_floor = m->generation;
+		log_vENOMEM();
+		return;
+	}
+
+	e = &m->removed[m->removed_pos];
+	if (e->path) {
+		m->removed_floor = e->generation;
+		free(e->path);
+	}
+
+	e->generation = m->generation;
+	e->path = path;
+	m->removed_pos = (m->removed_pos + 1) % MANAGER_REMOVED_MAX;
+}
+
 static char *link_dbus_get_path(struct link *l)
 {
 	char buf[128], *node;
@@ -72,6 +103,7 @@ static char *link_dbus_get_path(struct link *l)
 static int peer_dbus_connect(sd_bus_message *msg,
 			     void *data, sd_bus_error *err)
 {
+	LOOPSTAT("dbus.peer_connect");
 	struct peer *p = data;
 	const char *prov, *pin;
 	int r;
@@ -95,6 +127,7 @@ static int peer_dbus_connect(sd_bus_message *msg,
 static int peer_dbus_disconnect(sd_bus_message *msg,
 				void *data, sd_bus_error *err)
 {
+	LOOPSTAT("dbus.peer_disconnect");
 	struct peer *p = data;
 
 	peer_disconnect(p);
@@ -372,6 +405,8 @@ void peer_dbus_properties_changed(struct peer *p, const char *prop, ...)
 	if (!p->public)
 		return;
 
+	p->generation = manager_dbus_bump(p->l->m);
+
 	node = peer_dbus_get_path(p);
 	if (!node)
 		return;
@@ -458,6 +493,8 @@ void peer_dbus_added(struct peer *p)
 	_shl_free_ char *node = NULL;
 	int r;
 
+	p->generation = manager_dbus_bump(p->l->m);
+
 	node = peer_dbus_get_path(p);
 	if (!node)
 		return;
@@ -479,6 +516,9 @@ void peer_dbus_removed(struct peer *p)
 	if (!node)
 		return;
 
+	manager_dbus_bump(p->l->m);
+	manager_dbus_log_removed(p->l->m, node);
+
 	r = sd_bus_emit_interfaces_removed(p->l->m->bus,
 					   node,
 					   /*
@@ -597,6 +637,7 @@ static int link_dbus_set_managed(sd_bus *bus,
 				      void *data,
 				      sd_bus_error *err)
 {
+	LOOPSTAT("dbus.link_managed");
 	struct link *l = data;
 	int val, r;
 
@@ -633,6 +674,7 @@ static int link_dbus_set_p2p_scanning(sd_bus *bus,
 				      void *data,
 				      sd_bus_error *err)
 {
+	LOOPSTAT("dbus.link_p2p_scanning");
 	struct link *l = data;
 	int val, r;
 
@@ -643,6 +685,151 @@ static int link_dbus_set_p2p_scanning(sd_bus *bus,
 	return link_set_p2p_scanning(l, val);
 }
 
+static int link_dbus_get_streaming(sd_bus *bus,
+				   const char *path,
+				   const char *interface,
+				   const char *property,
+				   sd_bus_message *reply,
+				   void *data,
+				   sd_bus_error *err)
+{
+	struct link *l = data;
+	int r;
+
+	r = sd_bus_message_append(reply, "b", link_get_streaming(l));
+	if (r < 0)
+		return r;
+
+	return 1;
+}
+
+static int link_dbus_streaming_released(sd_bus_track *track, void *data)
+{
+	struct link *l = data;
+
+	log_debug("no streaming application left on %s", l->ifname);
+	link_set_streaming(l, false);
+	return 0;
+}
+
+/*
+ * Streaming is held by the bus names that set it. It stays set while any of
+ * them does and is cleared once the last one resets it or leaves the bus, so
+ * a crashed player cannot keep P2P discovery paused.
+ */
+static int link_dbus_set_streaming(sd_bus *bus,
+				   const char *path,
+				   const char *interface,
+				   const char *property,
+				   sd_bus_message *value,
+				   void *data,
+				   sd_bus_error *err)
+{
+	LOOPSTAT("dbus.link_streaming");
+	struct link *l = data;
+	const char *sender;
+	int val, r;
+
+	r = sd_bus_message_read(value, "b", &val);
+	if (r < 0)
+		return r;
+
+	sender = sd_bus_message_get_sender(sd_bus_get_current_message(bus));
+	if (!sender)
+		return link_set_streaming(l, val);
+
+	if (!l->streaming_owners) {
+		r = sd_bus_track_new(bus, &l->streaming_owners,
+				     link_dbus_streaming_released, l);
+		if (r < 0)
+			return r;
+	}
+
+	if (val) {
+		r = sd_bus_track_add_name(l->streaming_owners, sender);
+		if (r < 0)
+			return r;
+	} else {
+		sd_bus_track_remove_name(l->streaming_owners, sender);
+		if (sd_bus_track_count(l->streaming_owners))
+			return 0;
+	}
+
+	return link_set_streaming(l, val);
+}
+
+static int link_dbus_get_group_frequency(sd_bus *bus,
+                                         const char *path,
+                                         const char *interface,
+                                         const char *property,
+                                         sd_bus_message *reply,
+                                         void *data,
+                                         sd_bus_error *err)
+{
+	struct link *l = data;
+	int r;
+
+	r = sd_bus_message_append_basic(reply, 'u', &l->group_freq);
+	if (r < 0)
+		return r;
+
+	return 1;
+}
+
+static int link_dbus_get_group_channel_width(sd_bus *bus,
+                                             const char *path,
+                                             const char *interface,
+                                             const char *property,
+                                             sd_bus_message *reply,
+                                             void *data,
+                                             sd_bus_error *err)
+{
+	struct link *l = data;
+	int r;
+
+	r = sd_bus_message_append_basic(reply, 'u', &l->group_width);
+	if (r < 0)
+		return r;
+
+	return 1;
+}
+
+static int link_dbus_get_group_phy_rate(sd_bus *bus,
+                                        const char *path,
+                                        const char *interface,
+                                        const char *property,
+                                        sd_bus_message *reply,
+                                        void *data,
+                                        sd_bus_error *err)
+{
+	struct link *l = data;
+	int r;
+
+	r = sd_bus_message_append_basic(reply, 'u', &l->group_rate);
+	if (r < 0)
+		return r;
+
+	return 1;
+}
+
+static int link_dbus_get_group_multi_channel(sd_bus *bus,
+					     const char *path,
+					     const char *interface,
+					     const char *property,
+					     sd_bus_message *reply,
+					     void *data,
+					     sd_bus_error *err)
+{
+	struct link *l = data;
+	int r;
+
+	r = sd_bus_message_append(reply, "b", l->group_mcc);
+	if (r < 0)
+		return r;
+
+	return 1;
+}
+
 static int link_dbus_get_wfd_subelements(sd_bus *bus,
 					 const char *path,
 					 const char *interface,
@@ -710,6 +897,32 @@ static const sd_bus_vtable link_dbus_vtable[] = {
 				 link_dbus_set_p2p_scanning,
 				 0,
 				 SD_BUS_VTABLE_PROPERTY_EMITS_CHANGE),
+	SD_BUS_WRITABLE_PROPERTY("Streaming",
+				 "b",
+				 link_dbus_get_streaming,
+				 link_dbus_set_streaming,
+				 0,
+				 SD_BUS_VTABLE_PROPERTY_EMITS_CHANGE),
+	SD_BUS_PROPERTY("GroupFrequency",
+			"u",
+			link_dbus_get_group_frequency,
+			0,
+			SD_BUS_VTABLE_PROPERTY_EMITS_CHANGE),
+	SD_BUS_PROPERTY("GroupChannelWidth",
+			"u",
+			link_dbus_get_group_channel_width,
+			0,
+			SD_BUS_VTABLE_PROPERTY_EMITS_CHANGE),
+	SD_BUS_PROPERTY("GroupPhyRate",
+			"u",
+			link_dbus_get_group_phy_rate,
+			0,
+			SD_BUS_VTABLE_PROPERTY_EMITS_CHANGE),
+	SD_BUS_PROPERTY("GroupMultiChannel",
+			"b",
+			link_dbus_get_group_multi_channel,
+			0,
+			SD_BUS_VTABLE_PROPERTY_EMITS_CHANGE),
 	SD_BUS_WRITABLE_PROPERTY("WfdSubelements",
 				 "s",
 				 link_dbus_get_wfd_subelements,
@@ -754,6 +967,8 @@ void link_dbus_properties_changed(struct link *l, const char *prop, ...)
 	if (!l->public)
 		return;
 
+	l->generation = manager_dbus_bump(l->m);
+
 	node = link_dbus_get_path(l);
 	if (!node)
 		return;
@@ -772,6 +987,8 @@ void link_dbus_added(struct link *l)
 	_shl_free_ char *node = NULL;
 	int r;
 
+	l->generation = manager_dbus_bump(l->m);
+
 	node = link_dbus_get_path(l);
 	if (!node)
 		return;
@@ -797,6 +1014,9 @@ void link_dbus_removed(struct link *l)
 	if (!node)
 		return;
 
+	manager_dbus_bump(l->m);
+	manager_dbus_log_removed(l->m, node);
+
 	r = sd_bus_emit_interfaces_removed(l->m->bus,
 					   node,
 					   /*
@@ -813,8 +1033,217 @@ void link_dbus_removed(struct link *l)
  * Manager DBus
  */
 
+static int manager_dbus_append_object(sd_bus_message *reply,
+				      const char *node,
+				      const char *interface,
+				      const sd_bus_vtable *vtable,
+				      void *data)
+{
+	_sd_bus_error_free_ sd_bus_error err = SD_BUS_ERROR_NULL;
+	sd_bus *bus = sd_bus_message_get_bus(reply);
+	const sd_bus_vtable *v;
+	int r;
+
+	r = sd_bus_message_open_container(reply, 'e', "oa{sa{sv}}");
+	if (r < 0)
+		return r;
+
+	r = sd_bus_message_append(reply, "o", node);
+	if (r < 0)
+		return r;
+
+	r = sd_bus_message_open_container(reply, 'a', "{sa{sv}}");
+	if (r < 0)
+		return r;
+
+	r = sd_bus_message_open_container(reply, 'e', "sa{sv}");
+	if (r < 0)
+		return r;
+
+	r = sd_bus_message_append(reply, "s", interface);
+	if (r < 0)
+		return r;
+
+	r = sd_bus_message_open_container(reply, 'a', "{sv}");
+	if (r < 0)
+		return r;
+
+	/* same getters as used for org.freedesktop.DBus.Properties */
+	for (v = vtable; v->type != _SD_BUS_VTABLE_END; ++v) {
+		if (v->type != _SD_BUS_VTABLE_PROPERTY &&
+		    v->type != _SD_BUS_VTABLE_WRITABLE_PROPERTY)
+			continue;
+
+		r = sd_bus_message_open_container(reply, 'e', "sv");
+		if (r < 0)
+			return r;
+
+		r = sd_bus_message_append(reply, "s", v->x.property.member);
+		if (r < 0)
+			return r;
+
+		r = sd_bus_message_open_container(reply, 'v',
+						  v->x.property.signature);
+		if (r < 0)
+			return r;
+
+		r = v->x.property.get(bus, node, interface,
+				      v->x.property.member,
+				      reply, data, &err);
+		if (r < 0)
+			return r;
+
+		r = sd_bus_message_close_container(reply);
+		if (r < 0)
+			return r;
+
+		r = sd_bus_message_close_container(reply);
+		if (r < 0)
+			return r;
+	}
+
+	r = sd_bus_message_close_container(reply);
+	if (r < 0)
+		return r;
+
+	r = sd_bus_message_close_container(reply);
+	if (r < 0)
+		return r;
+
+	r = sd_bus_message_close_container(reply);
+	if (r < 0)
+		return r;
+
+	return sd_bus_message_close_container(reply);
+}
+
+static int manager_dbus_get_changed_objects(sd_bus_message *msg,
+					    void *data,
+					    sd_bus_error *err)
+{
+	_sd_bus_message_unref_ sd_bus_message *reply = NULL;
+	struct manager *m = data;
+	struct manager_removed *e;
+	struct link *l;
+	struct peer *p;
+	uint64_t since;
+	unsigned int i;
+	bool reset;
+	int r;
+
+	r = sd_bus_message_read(msg, "t", &since);
+	if (r < 0)
+		return r;
+
+	/* Generations start at the daemon's startup time, so a client coming
+	 * from a previous instance always ends up below the floor. */
+	reset = since < m->removed_floor || since > m->generation;
+
+	r = sd_bus_message_new_method_return(msg, &reply);
+	if (r < 0)
+		return r;
+
+	r = sd_bus_message_append(reply, "tb", m->generation, reset);
+	if (r < 0)
+		return r;
+
+	r = sd_bus_message_open_container(reply, 'a', "o");
+	if (r < 0)
+		return r;
+
+	for (i = 0; i < MANAGER_REMOVED_MAX && !reset; ++i) {
+		e = &m->removed[i];
+		if (!e->path || e->generation <= since)
+			continue;
+
+		r = sd_bus_message_append(reply, "o", e->path);
+		if (r < 0)
+			return r;
+	}
+
+	r = sd_bus_message_close_container(reply);
+	if (r < 0)
+		return r;
+
+	r = sd_bus_message_open_container(reply, 'a', "{oa{sa{sv}}}");
+	if (r < 0)
+		return r;
+
+	MANAGER_FOREACH_LINK(l, m) {
+		_shl_free_ char *node = NULL;
+
+		if (!l->public)
+			continue;
+
+		if (reset || l->generation > since) {
+			node = link_dbus_get_path(l);
+			if (!node)
+				return -ENOMEM;
+
+			r = manager_dbus_append_object(reply, node,
+						"org.freedesktop.miracle.wifi.Link",
+						link_dbus_vtable, l);
+			if (r < 0)
+				return r;
+		}
+
+		LINK_FOREACH_PEER(p, l) {
+			_shl_free_ char *pnode = NULL;
+
+			if (!p->public)
+				continue;
+			if (!reset && p->generation <= since)
+				continue;
+
+			pnode = peer_dbus_get_path(p);
+			if (!pnode)
+				return -ENOMEM;
+
+			r = manager_dbus_append_object(reply, pnode,
+						"org.freedesktop.miracle.wifi.Peer",
+						peer_dbus_vtable, p);
+			if (r < 0)
+				return r;
+		}
+	}
+
+	r = sd_bus_message_close_container(reply);
+	if (r < 0)
+		return r;
+
+	return sd_bus_send(NULL, reply, NULL);
+}
+
+static int manager_dbus_get_generation(sd_bus *bus,
+				       const char *path,
+				       const char *interface,
+				       const char *property,
+				       sd_bus_message *reply,
+				       void *data,
+				       sd_bus_error *err)
+{
+	struct manager *m = data;
+	int r;
+
+	r = sd_bus_message_append(reply, "t", m->generation);
+	if (r < 0)
+		return r;
+
+	return 1;
+}
+
 static const sd_bus_vtable manager_dbus_vtable[] = {
 	SD_BUS_VTABLE_START(0),
+	SD_BUS_METHOD("GetChangedObjects",
+		      "t",
+		      "tbaoa{oa{sa{sv}}}",
+		      manager_dbus_get_changed_objects,
+		      0),
+	SD_BUS_PROPERTY("Generation",
+			"t",
+			manager_dbus_get_generation,
+			0,
+			0),
 	SD_BUS_VTABLE_END
 };
 
@@ -894,10 +1323,54 @@ error:
 	return r;
 }
 
+/*
+ * Metrics DBus
+ * Text dump of the metrics registry. With miracled this includes the DHCP
+ * and sink metrics, as they run in our process.
+ */
+
+static int metrics_dbus_dump(sd_bus_message *msg,
+			     void *data, sd_bus_error *err)
+{
+	_shl_free_ char *dump = NULL;
+	int r;
+
+	r = metrics_format(&dump);
+	if (r < 0)
+		return r;
+
+	return sd_bus_reply_method_return(msg, "s", dump);
+}
+
+static int metrics_dbus_reset(sd_bus_message *msg,
+			      void *data, sd_bus_error *err)
+{
+	metrics_reset();
+	return sd_bus_reply_method_return(msg, NULL);
+}
+
+static const sd_bus_vtable metrics_dbus_vtable[] = {
+	SD_BUS_VTABLE_START(0),
+	SD_BUS_METHOD("Dump",
+		      NULL,
+		      "s",
+		      metrics_dbus_dump,
+		      0),
+	SD_BUS_METHOD("Reset",
+		      NULL,
+		      NULL,
+		      metrics_dbus_reset,
+		      0),
+	SD_BUS_VTABLE_END
+};
+
 int manager_dbus_connect(struct manager *m)
 {
 	int r;
 
+	m->generation = shl_now(CLOCK_REALTIME);
+	m->removed_floor = m->generation;
+
 	r = sd_bus_add_object_vtable(m->bus, NULL,
 				     "/org/freedesktop/miracle/wifi",
 				     "org.freedesktop.miracle.wifi.Manager",
@@ -906,6 +1379,14 @@ int manager_dbus_connect(struct manager *m)
 	if (r < 0)
 		goto error;
 
+	r = sd_bus_add_object_vtable(m->bus, NULL,
+				     "/org/freedesktop/miracle/wifi",
+				     "org.freedesktop.miracle.Metrics",
+				     metrics_dbus_vtable,
+				     m);
+	if (r < 0)
+		goto error;
+
 	r = sd_bus_add_node_enumerator(m->bus, NULL,
 				       "/org/freedesktop/miracle/wifi",
 				       manager_dbus_enumerate,
@@ -953,7 +1434,17 @@ error_silent:
 
 void manager_dbus_disconnect(struct manager *m)
 {
-	if (!m || !m->bus)
+	unsigned int i;
+
+	if (!m)
+		return;
+
+	for (i = 0; i < MANAGER_REMOVED_MAX; ++i) {
+		free(m->removed[i].path);
+		m->removed[i].path = NULL;
+	}
+
+	if (!m->bus)
 		return;
 
 	sd_bus_release_name(m->bus, "org.freedesktop.miracle.wifi");
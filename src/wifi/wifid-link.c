@@ -23,6 +23,7 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <systemd/sd-bus.h>
+#include "metrics.h"
 #include "shl_dlist.h"
 #include "shl_log.h"
 #include "shl_util.h"
@@ -33,6 +34,8 @@
  * Link Handling
  */
 
+static METRICS_GAUGE(wifid_links, "wifid.links", "links currently known");
+
 struct peer *link_find_peer(struct link *l, const char *p2p_mac)
 {
 	char **elem;
@@ -95,6 +98,7 @@ int link_new(struct manager *m,
 	}
 
 	++m->link_cnt;
+	metrics_gauge_add(&wifid_links, 1);
 	log_info("add link: %s", l->ifname);
 
 	if (out)
@@ -117,6 +121,7 @@ void link_free(struct link *l)
 	log_debug("free link: %s (%u)", l->ifname, l->ifindex);
 
 	link_set_managed(l, false);
+	wifid_hook(link_stopped, l);
 
 	link_dbus_removed(l);
 	l->public = false;
@@ -124,9 +129,11 @@ void link_free(struct link *l)
 	if (shl_htable_remove_uint(&l->m->links, l->ifindex, NULL)) {
 		log_info("remove link: %s", l->ifname);
 		--l->m->link_cnt;
+		metrics_gauge_add(&wifid_links, -1);
 	}
 
 	supplicant_free(l->s);
+	sd_bus_track_unref(l->streaming_owners);
 
 	/* link_set_managed(l, false) already removed all peers */
 	shl_htable_clear_str(&l->peers, NULL, NULL);
@@ -325,9 +332,42 @@ bool link_get_p2p_scanning(struct link *l)
 	return supplicant_p2p_scanning(l->s);
 }
 
+/* a hint by the application, video streaming pauses P2P discovery; D-Bus
+ * callers own it, see link_dbus_set_streaming() */
+int link_set_streaming(struct link *l, bool set)
+{
+	if (!l)
+		return log_EINVAL();
+
+	if (l->streaming == set)
+		return 0;
+
+	l->streaming = set;
+	link_dbus_properties_changed(l, "Streaming", NULL);
+
+	if (l->managed)
+		supplicant_p2p_scan_update(l->s);
+
+	return 0;
+}
+
+bool link_get_streaming(struct link *l)
+{
+	if (!l) {
+		log_vEINVAL();
+		return false;
+	}
+
+	return l->streaming;
+}
+
 void link_supplicant_started(struct link *l)
 {
-	if (!l || l->public)
+	if (!l)
+		return;
+
+	wifid_hook(link_started, l);
+	if (l->public)
 		return;
 
    if (l->m->friendly_name && l->managed)
@@ -337,7 +377,11 @@ void link_supplicant_started(struct link *l)
 
 void link_supplicant_stopped(struct link *l)
 {
-	if (!l || !l->public)
+	if (!l)
+		return;
+
+	wifid_hook(link_stopped, l);
+	if (!l->public)
 		return;
 
 	log_info("link %s unmanaged", l->ifname);
@@ -350,3 +394,36 @@ void link_supplicant_p2p_scan_changed(struct link *l, bool new_value)
 
 	link_dbus_properties_changed(l, "P2PScanning", NULL);
 }
+
+void link_supplicant_group_changed(struct link *l,
+				   unsigned int freq,
+				   unsigned int width,
+				   unsigned int rate)
+{
+	if (!l)
+		return;
+
+	if (l->group_freq != freq) {
+		l->group_freq = freq;
+		link_dbus_properties_changed(l, "GroupFrequency", NULL);
+	}
+
+	if (l->group_width != width) {
+		l->group_width = width;
+		link_dbus_properties_changed(l, "GroupChannelWidth", NULL);
+	}
+
+	if (l->group_rate != rate) {
+		l->group_rate = rate;
+		link_dbus_properties_changed(l, "GroupPhyRate", NULL);
+	}
+}
+
+void link_supplicant_group_mcc_changed(struct link *l, bool mcc)
+{
+	if (!l)
+		return;
+
+	l->group_mcc = mcc;
+	link_dbus_properties_changed(l, "GroupMultiChannel", NULL);
+}
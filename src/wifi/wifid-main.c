@@ -0,0 +1,233 @@
+/*
+ * MiracleCast - Wifi-Display/Miracast Implementation
+ *
+ * Copyright (c) 2013-2014 David Herrmann <dh.herrmann@gmail.com>
+ *
+ * MiracleCast is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * MiracleCast is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with MiracleCast; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <glib.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <systemd/sd-daemon.h>
+#include <time.h>
+#include <unistd.h>
+#include "loopstat.h"
+#include "shl_log.h"
+#include "trace.h"
+#include "util.h"
+#include "wifid.h"
+#include "config.h"
+
+static int help(void)
+{
+	/*
+	 * 80-char barrier:
+	 *      01234567890123456789012345678901234567890123456789012345678901234567890123456789
+	 */
+	printf("%s [OPTIONS...] ...\n\n"
+	       "Wifi Management Daemon.\n\n"
+	       "  -h --help                Show this help\n"
+	       "     --version             Show package version\n"
+	       "     --log-level <lvl>     Maximum level for log messages\n"
+	       "     --log-time            Prefix log-messages with timestamp\n"
+	       "     --stall-threshold <ms>\n"
+	       "                           Log event-loop stalls above this [default: 50]\n"
+	       "\n"
+	       "  -i --interface           Choose the interface to use\n"
+	       "     --config-methods      Define config methods for pairing, default 'pbc'\n"
+	       "\n"
+	       "     --wpa-loglevel <lvl   wpa_supplicant log-level\n"
+	       "     --use-dev             enable workaround for 'no ifname' issue\n"
+	       "     --lazy-managed        manage interface only when user decide to do\n"
+	       "     --p2p-scan <mode>=<find>,<listen>,<off>[,social]\n"
+	       "                           P2P discovery duty cycle in seconds for mode\n"
+	       "                           'idle', 'session' or 'video'\n"
+	       "                           [default: idle=10,5,0 session=2,0,28,social\n"
+	       "                            video=0,0,0]\n"
+	       "     --go-band <band>      Band of local P2P groups: auto, 2.4 or 5\n"
+	       "                           [default: auto, 5GHz if possible]\n"
+	       "     --go-width <mhz>      Widest channel of local P2P groups: 20, 40, 80\n"
+	       "                           [default: 80]\n"
+	       , program_invocation_short_name);
+	/*
+	 * 80-char barrier:
+	 *      01234567890123456789012345678901234567890123456789012345678901234567890123456789
+	 */
+
+	return 0;
+}
+
+static int parse_argv(int argc, char *argv[])
+{
+	enum {
+		ARG_VERSION = 0x100,
+		ARG_LOG_LEVEL,
+		ARG_LOG_TIME,
+		ARG_STALL_THRESHOLD,
+		ARG_WPA_LOGLEVEL,
+		ARG_USE_DEV,
+		ARG_CONFIG_METHODS,
+		ARG_LAZY_MANAGED,
+		ARG_P2P_SCAN,
+		ARG_GO_BAND,
+		ARG_GO_WIDTH,
+	};
+	static const struct option options[] = {
+		{ "help",	no_argument,		NULL,	'h' },
+		{ "version",	no_argument,		NULL,	ARG_VERSION },
+		{ "log-level",	required_argument,	NULL,	ARG_LOG_LEVEL },
+		{ "log-time",	no_argument,		NULL,	ARG_LOG_TIME },
+		{ "stall-threshold",	required_argument,	NULL,	ARG_STALL_THRESHOLD },
+
+		{ "wpa-loglevel",	required_argument,	NULL,	ARG_WPA_LOGLEVEL },
+		{ "interface",	required_argument,	NULL,	'i' },
+		{ "use-dev",	no_argument,	NULL,	ARG_USE_DEV },
+		{ "config-methods",	required_argument,	NULL,	ARG_CONFIG_METHODS },
+		{ "lazy-managed",	no_argument,	NULL,	ARG_LAZY_MANAGED },
+		{ "p2p-scan",	required_argument,	NULL,	ARG_P2P_SCAN },
+		{ "go-band",	required_argument,	NULL,	ARG_GO_BAND },
+		{ "go-width",	required_argument,	NULL,	ARG_GO_WIDTH },
+		{}
+	};
+	int c;
+
+	while ((c = getopt_long(argc, argv, "hi:", options, NULL)) >= 0) {
+		switch (c) {
+		case 'h':
+			return help();
+		case 'i':
+			interface_name = optarg;
+			break;
+		case ARG_VERSION:
+			puts(PACKAGE_STRING);
+			return 0;
+		case ARG_LOG_LEVEL:
+			log_max_sev = log_parse_arg(optarg);
+			break;
+		case ARG_LOG_TIME:
+			log_init_time();
+			break;
+		case ARG_STALL_THRESHOLD:
+			loopstat_set_threshold(atoi(optarg));
+			break;
+		case ARG_USE_DEV:
+			use_dev = true;
+			break;
+		case ARG_CONFIG_METHODS:
+			config_methods = optarg;
+		case ARG_LAZY_MANAGED:
+			lazy_managed = true;
+			break;
+		case ARG_P2P_SCAN:
+			if (p2p_scan_parse(optarg) < 0) {
+				log_error("invalid --p2p-scan: %s", optarg);
+				return -EINVAL;
+			}
+			break;
+		case ARG_GO_BAND:
+			if (p2p_go_band_parse(optarg) < 0) {
+				log_error("invalid --go-band: %s", optarg);
+				return -EINVAL;
+			}
+			break;
+		case ARG_GO_WIDTH:
+			if (p2p_go_width_parse(optarg) < 0) {
+				log_error("invalid --go-width: %s", optarg);
+				return -EINVAL;
+			}
+			break;
+
+		case ARG_WPA_LOGLEVEL:
+			arg_wpa_loglevel = log_parse_arg(optarg);
+			break;
+		case '?':
+			return -EINVAL;
+		}
+	}
+
+	if (optind < argc) {
+		log_error("unparsed remaining arguments starting with: %s",
+			  argv[optind]);
+		return -EINVAL;
+	}
+
+	log_format(LOG_DEFAULT_BASE, NULL, LOG_INFO,
+		   "miracle-wifid - revision %s %s %s",
+		   "1.0", __DATE__, __TIME__);
+
+	return 1;
+}
+
+int main(int argc, char **argv)
+{
+	struct manager *m = NULL;
+	int r;
+
+	srand(time(NULL));
+
+   GKeyFile* gkf = load_ini_file();
+
+   if (gkf) {
+      gchar* log_level;
+      log_level = g_key_file_get_string (gkf, "wifid", "log-level", NULL);
+      if (log_level) {
+         log_max_sev = log_parse_arg(log_level);
+         g_free(log_level);
+      }
+      g_key_file_free(gkf);
+   }
+
+	r = parse_argv(argc, argv);
+	if (r < 0)
+		return EXIT_FAILURE;
+	if (!r)
+		return EXIT_SUCCESS;
+
+	/* best effort, MIRACLE_TRACE is for debugging only */
+	trace_init("miracle-wifid");
+
+	if (getuid() != 0) {
+      r = EACCES;
+		log_notice("Must run as root");
+      goto finish;
+	}
+
+	r = manager_new(&m);
+	if (r < 0)
+		goto finish;
+
+	r = manager_startup(m);
+	if (r < 0)
+		goto finish;
+
+	r = sd_notify(false, "READY=1\n"
+			     "STATUS=Running..");
+	if (r < 0) {
+		log_vERR(r);
+		goto finish;
+	}
+
+	r = manager_run(m);
+
+finish:
+	sd_notify(false, "STATUS=Exiting..");
+	manager_free(m);
+
+	log_debug("exiting..");
+	return abs(r);
+}
@@ -21,11 +21,14 @@
 
 #include <errno.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <systemd/sd-bus.h>
+#include "metrics.h"
 #include "shl_dlist.h"
 #include "shl_log.h"
 #include "shl_util.h"
+#include "trace.h"
 #include "util.h"
 #include "wifid.h"
 
@@ -33,6 +36,18 @@
  * Peer Handling
  */
 
+static METRICS_GAUGE(wifid_peers, "wifid.peers", "peers currently known");
+
+/* group formation is traced as one "p2p" span per peer, stages as steps */
+static void peer_trace_formation_end(struct peer *p, const char *result)
+{
+	if (!p->formation_traced)
+		return;
+
+	trace_end("p2p", "formation", (uintptr_t)p, result);
+	p->formation_traced = false;
+}
+
 int peer_new(struct link *l,
 	     const char *p2p_mac,
 	     struct peer **out)
@@ -70,6 +85,7 @@ int peer_new(struct link *l,
 	}
 
 	++l->peer_cnt;
+	metrics_gauge_add(&wifid_peers, 1);
 	log_info("add peer: %s", p->p2p_mac);
 
 	if (out)
@@ -88,10 +104,13 @@ void peer_free(struct peer *p)
 		return;
 
 	log_debug("free peer: %s @ %s", p->p2p_mac, p->l->ifname);
+	peer_trace_formation_end(p, "removed");
+	wifid_hook(peer_removed, p);
 
 	if (shl_htable_remove_str(&p->l->peers, p->p2p_mac, NULL, NULL)) {
 		log_info("remove peer: %s", p->p2p_mac);
 		--p->l->peer_cnt;
+		metrics_gauge_add(&wifid_peers, -1);
 	}
 
 	free(p->p2p_mac);
@@ -143,6 +162,8 @@ int peer_connect(struct peer *p, const char *prov, const char *pin)
 	if (!p)
 		return log_EINVAL();
 
+	peer_supplicant_formation_step(p, "connect");
+
 	return supplicant_peer_connect(p->sp, prov, pin);
 }
 
@@ -197,6 +218,7 @@ void peer_supplicant_provision_discovery(struct peer *p,
 	if (!p || !p->public)
 		return;
 
+	peer_supplicant_formation_step(p, "prov-disc");
 	peer_dbus_provision_discovery(p, prov, pin);
 }
 
@@ -207,16 +229,36 @@ void peer_supplicant_go_neg_request(struct peer *p,
 	if (!p || !p->public)
 		return;
 
+	peer_supplicant_formation_step(p, "go-neg-request");
 	peer_dbus_go_neg_request(p, prov, pin);
+	wifid_hook(peer_go_neg_request, p, prov, pin);
+}
+
+void peer_supplicant_formation_step(struct peer *p, const char *stage)
+{
+	if (!p || !trace_enabled())
+		return;
+
+	if (!p->formation_traced) {
+		trace_begin("p2p", "formation", (uintptr_t)p, p->p2p_mac);
+		p->formation_traced = true;
+	}
+
+	trace_step("p2p", stage, (uintptr_t)p, NULL);
 }
 
 void peer_supplicant_formation_failure(struct peer *p,
 					 const char *reason)
 {
-	if (!p || !p->public)
+	if (!p)
+		return;
+
+	peer_trace_formation_end(p, reason);
+	if (!p->public)
 		return;
 
 	peer_dbus_formation_failure(p, reason);
+	wifid_hook(peer_formation_failure, p, reason);
 }
 
 void peer_supplicant_connected_changed(struct peer *p, bool connected)
@@ -225,9 +267,12 @@ void peer_supplicant_connected_changed(struct peer *p, bool connected)
 		return;
 
 	p->connected = connected;
+	if (connected)
+		peer_trace_formation_end(p, "connected");
 	peer_dbus_properties_changed(p, "Connected",
 					"Interface",
 					"LocalAddress",
 					"RemoteAddress",
 					NULL);
+	wifid_hook(peer_connected_changed, p);
 }
@@ -29,9 +29,13 @@
 #include <systemd/sd-event.h>
 #include <systemd/sd-journal.h>
 #include <unistd.h>
+#include "loopstat.h"
+#include "metrics.h"
+#include "probes.h"
 #include "shl_dlist.h"
 #include "shl_log.h"
 #include "shl_util.h"
+#include "trace.h"
 #include "util.h"
 #include "wifid.h"
 #include "wpas.h"
@@ -51,6 +55,11 @@ struct supplicant_group {
 	sd_event_source *dhcp_comm_source;
 	pid_t dhcp_pid;
 	sd_event_source *dhcp_pid_source;
+	void *dhcp;			/* in-process, see wifid_hooks */
+	uint64_t dhcp_start;		/* until the first lease */
+
+	unsigned int freq;		/* MHz, from P2P-GROUP-STARTED */
+	uint64_t poll_cookie;		/* SIGNAL_POLL/STA in flight */
 
 	bool go : 1;
 };
@@ -63,9 +72,16 @@ struct supplicant_peer {
 	char *friendly_name;
 	char *remote_addr;
 	char *wfd_subelements;
+	char *wfd_dev_info;		/* from P2P-DEVICE-FOUND */
 	char *prov;
 	char *pin;
 	char *sta_mac;
+
+	uint64_t peer_cookie;		/* P2P_PEER in flight */
+	uint64_t peer_time;		/* last P2P_PEER reply */
+	uint32_t found_hash;		/* P2P-DEVICE-FOUND fields at that time */
+
+	bool wfd_full : 1;		/* wfd_subelements came from P2P_PEER */
 };
 
 struct supplicant {
@@ -85,15 +101,40 @@ struct supplicant {
 	struct wpas *bus_dev;
 
 	size_t setup_cnt;
+	uint64_t setup_start;
+
+	/* initial P2P_PEER FIRST/NEXT- walk, runs after we are ready */
+	char *walk_mac;
+	uint64_t walk_start;
+	unsigned int walk_cnt;
+	unsigned int walk_restarts;
 
 	char *p2p_mac;
 	struct shl_dlist groups;
 	struct supplicant_peer *pending;
 
+	/* GO channel policy, see supplicant_update_channels() */
+	unsigned int sta_freq;		/* MHz, 0 if not associated */
+	char *pref_chan;		/* last p2p_pref_chan we set */
+
+	/* P2P discovery scheduler, see supplicant_scan_phase() */
+	sd_event_source *scan_source;
+	unsigned int scan_mode;
+	unsigned int scan_phase;
+	uint64_t scan_time;
+
 	bool running : 1;
 	bool has_p2p : 1;
 	bool has_wfd : 1;
 	bool p2p_scanning : 1;
+	bool scc_relaxed : 1;		/* a peer could not use sta_freq */
+};
+
+enum {
+	SCAN_PHASE_FIND,
+	SCAN_PHASE_LISTEN,
+	SCAN_PHASE_OFF,
+	SCAN_PHASE_CNT,
 };
 
 /* Device Password ID */
@@ -109,6 +150,50 @@ enum wps_dev_password_id {
 
 static void supplicant_failed(struct supplicant *s);
 static void supplicant_peer_drop_group(struct supplicant_peer *sp);
+static void supplicant_scan_cancel(struct supplicant *s);
+static void supplicant_update_channels(struct supplicant *s);
+static void supplicant_send_disallow_freq(struct supplicant *s);
+
+static METRICS_COUNTER(wifid_events, "wifid.events",
+		       "wpa_supplicant events handled");
+static METRICS_COUNTER(dhcp_leases, "dhcp.leases",
+		       "addresses leased on P2P groups, as client or GO");
+static METRICS_HIST(dhcp_lease_time, "dhcp.lease_time", "us",
+		    "time from starting DHCP on a group to its first lease");
+static METRICS_HIST(wifid_ready_time, "wifid.ready_time", "us",
+		    "time from wpas connection to a ready link");
+static METRICS_HIST(peer_walk_time, "wifid.peer_walk_time", "us",
+		    "time to enumerate the initial P2P peers of wpas");
+static METRICS_COUNTER(peer_walk_peers, "wifid.peer_walk.peers",
+		       "peers found by the initial P2P peer enumeration");
+static METRICS_COUNTER(p2p_scan_find_time, "wifid.p2p_scan.find_time",
+		       "us spent in P2P_FIND phases of P2P discovery");
+static METRICS_COUNTER(p2p_scan_listen_time, "wifid.p2p_scan.listen_time",
+		       "us spent in P2P_LISTEN phases of P2P discovery");
+static METRICS_COUNTER(p2p_scan_off_time, "wifid.p2p_scan.off_time",
+		       "us spent quiet while P2P discovery is enabled");
+static METRICS_COUNTER(peer_updates_emitted, "wifid.peer_updates.emitted",
+		       "peer properties changed by wpas peer reports");
+static METRICS_COUNTER(peer_updates_suppressed, "wifid.peer_updates.suppressed",
+		       "peer properties repeated unchanged by wpas peer reports");
+static METRICS_COUNTER(peer_refresh_sent, "wifid.peer_refresh.sent",
+		       "P2P_PEER requests sent for P2P-DEVICE-FOUND");
+static METRICS_COUNTER(peer_refresh_cached, "wifid.peer_refresh.cached",
+		       "P2P_PEER requests saved by fresh, unchanged peer data");
+static METRICS_COUNTER(group_single_channel, "wifid.group.single_channel",
+		       "P2P groups started on the channel of the link's AP");
+static METRICS_COUNTER(group_multi_channel, "wifid.group.multi_channel",
+		       "P2P groups started off the channel of the link's AP");
+static METRICS_HIST(group_phy_rate, "wifid.group.phy_rate", "Mbit/s",
+		    "PHY rate towards the peer when a P2P group is up");
+static METRICS_COUNTER(peer_refresh_collapsed, "wifid.peer_refresh.collapsed",
+		       "P2P_PEER requests saved by one already in flight");
+
+/* a peer lost during the initial peer walk truncates it, restart this often */
+#define SUPPLICANT_WALK_RESTARTS 3
+
+/* peer data from P2P_PEER is reused this long if P2P-DEVICE-FOUND agrees */
+#define SUPPLICANT_PEER_TTL (30ULL * 1000ULL * 1000ULL)
 
 static struct supplicant_peer *find_peer_by_p2p_mac(struct supplicant *s,
 						    const char *p2p_mac)
@@ -150,6 +235,28 @@ static struct supplicant_group *find_group_by_ifname(struct supplicant *s,
 	return NULL;
 }
 
+/*
+ * A group off the channel of the link's AP makes the radio time-slice between
+ * both (multi-channel concurrency). Either side gets about half the airtime.
+ */
+static void supplicant_update_mcc(struct supplicant *s)
+{
+	bool mcc;
+
+	mcc = s->sta_freq && s->l->group_freq &&
+	      s->sta_freq != s->l->group_freq;
+	if (mcc == s->l->group_mcc)
+		return;
+
+	if (mcc)
+		log_info("P2P group on %s runs multi-channel: %u MHz, AP on %u MHz",
+			 s->l->ifname, s->l->group_freq, s->sta_freq);
+	else
+		log_debug("P2P group on %s runs single-channel", s->l->ifname);
+
+	link_supplicant_group_mcc_changed(s->l, mcc);
+}
+
 /*
  * Supplicant Groups
  * The wpas daemon can create separate interfaces on-the-fly. Usually, they're
@@ -173,6 +280,9 @@ static void supplicant_group_free(struct supplicant_group *g)
 
 	log_debug("free group %s", g->ifname);
 
+	if (g->poll_cookie)
+		wpas_call_async_cancel(g->s->bus_global, g->poll_cookie);
+
 	r = wpas_message_new_request(g->s->bus_global,
 				     "P2P_GROUP_REMOVE",
 				     &m);
@@ -205,6 +315,11 @@ static void supplicant_group_free(struct supplicant_group *g)
 		g->dhcp_pid = 0;
 	}
 
+	if (g->dhcp) {
+		wifid_hooks->dhcp_stop(g->dhcp);
+		g->dhcp = NULL;
+	}
+
 	if (g->dhcp_comm >= 0) {
 		sd_event_source_unref(g->dhcp_comm_source);
 		g->dhcp_comm_source = NULL;
@@ -217,56 +332,51 @@ static void supplicant_group_free(struct supplicant_group *g)
 			supplicant_peer_drop_group(p->sp);
 
 	shl_dlist_unlink(&g->list);
+	supplicant_p2p_scan_update(g->s);
+	if (shl_dlist_empty(&g->s->groups)) {
+		link_supplicant_group_changed(g->s->l, 0, 0, 0);
+		supplicant_update_mcc(g->s);
+	}
 
 	free(g->local_addr);
 	free(g->ifname);
 	free(g);
 }
 
-static int supplicant_group_comm_fn(sd_event_source *source,
-				    int fd,
-				    uint32_t mask,
-				    void *data)
+static void supplicant_group_dhcp_leased(struct supplicant_group *g)
+{
+	metrics_counter_inc(&dhcp_leases);
+	if (g->dhcp_start) {
+		metrics_hist_record(&dhcp_lease_time,
+				    shl_now(CLOCK_MONOTONIC) - g->dhcp_start);
+		g->dhcp_start = 0;
+	}
+}
+
+static void supplicant_group_dhcp_msg(struct supplicant_group *g,
+				      const char *msg)
 {
-	struct supplicant_group *g = data;
 	struct supplicant_peer *sp;
 	struct peer *p;
-	char buf[512], *t, *ip;
-	ssize_t l;
+	char *t, *ip;
 	char mac[MAC_STRLEN];
 
-	l = recv(fd, buf, sizeof(buf) - 1, MSG_DONTWAIT);
-	if (l < 0) {
-		l = -errno;
-		if (l == -EAGAIN || l == -EINTR)
-			return 0;
-
-		log_vERRNO();
-		goto error;
-	} else if (!l) {
-		log_error("HUP on dhcp-comm socket on %s", g->ifname);
-		goto error;
-	} else if (l > sizeof(buf) - 1) {
-		l = sizeof(buf) - 1;
-	}
-
-	buf[l] = 0;
-	log_debug("dhcp-comm-%s: %s", g->ifname, buf);
+	log_debug("dhcp-comm-%s: %s", g->ifname, msg);
 
 	/* we only parse "X:<addr>" right now */
-	if (l < 3 || buf[1] != ':' || !buf[2])
-		return 0;
+	if (strlen(msg) < 3 || msg[1] != ':')
+		return;
 
-	t = strdup(&buf[2]);
-	if (!t) {
-		log_vENOMEM();
-		return 0;
-	}
+	t = strdup(&msg[2]);
+	if (!t)
+		return log_vENOMEM();
 
-	switch (buf[0]) {
+	switch (msg[0]) {
 	case 'L':
 		free(g->local_addr);
 		g->local_addr = t;
+		if (!g->go)
+			supplicant_group_dhcp_leased(g);
 		break;
 	case 'G':
 		if (g->sp) {
@@ -299,6 +409,7 @@ static int supplicant_group_comm_fn(sd_event_source *source,
 
 			free(sp->remote_addr);
 			sp->remote_addr = ip;
+			supplicant_group_dhcp_leased(g);
 		} else {
 			log_debug("ignore 'R' line for unknown mac");
 			free(t);
@@ -324,6 +435,35 @@ static int supplicant_group_comm_fn(sd_event_source *source,
 			}
 		}
 	}
+}
+
+static int supplicant_group_comm_fn(sd_event_source *source,
+				    int fd,
+				    uint32_t mask,
+				    void *data)
+{
+	LOOPSTAT("supplicant.group_comm");
+	struct supplicant_group *g = data;
+	char buf[512];
+	ssize_t l;
+
+	l = recv(fd, buf, sizeof(buf) - 1, MSG_DONTWAIT);
+	if (l < 0) {
+		l = -errno;
+		if (l == -EAGAIN || l == -EINTR)
+			return 0;
+
+		log_vERRNO();
+		goto error;
+	} else if (!l) {
+		log_error("HUP on dhcp-comm socket on %s", g->ifname);
+		goto error;
+	} else if (l > sizeof(buf) - 1) {
+		l = sizeof(buf) - 1;
+	}
+
+	buf[l] = 0;
+	supplicant_group_dhcp_msg(g, buf);
 
 	return 0;
 
@@ -332,10 +472,25 @@ error:
 	return 0;
 }
 
+static void supplicant_group_dhcp_fn(void *data, const char *msg)
+{
+	struct supplicant_group *g = data;
+
+	if (msg) {
+		supplicant_group_dhcp_msg(g, msg);
+		return;
+	}
+
+	log_error("DHCP client/server for %s failed, stopping connection",
+		  g->ifname);
+	supplicant_group_free(g);
+}
+
 static int supplicant_group_pid_fn(sd_event_source *source,
 				   const siginfo_t *info,
 				   void *data)
 {
+	LOOPSTAT("supplicant.group_pid");
 	struct supplicant_group *g = data;
 
 	log_error("DHCP client/server for %s died, stopping connection",
@@ -359,6 +514,7 @@ static int supplicant_group_spawn_dhcp_server(struct supplicant_group *g,
 	if (r < 0)
 		return log_ERRNO();
 
+	trace_flush();
 	pid = fork();
 	if (pid < 0) {
 		close(fds[0]);
@@ -424,6 +580,7 @@ static int supplicant_group_spawn_dhcp_client(struct supplicant_group *g)
 	if (r < 0)
 		return log_ERRNO();
 
+	trace_flush();
 	pid = fork();
 	if (pid < 0) {
 		close(fds[0]);
@@ -473,6 +630,38 @@ static int supplicant_group_spawn_dhcp_client(struct supplicant_group *g)
 	return 0;
 }
 
+static int supplicant_group_spawn_dhcp(struct supplicant_group *g)
+{
+	int r;
+
+	if (g->go)
+		r = supplicant_group_spawn_dhcp_server(g, g->subnet);
+	else
+		r = supplicant_group_spawn_dhcp_client(g);
+	if (r < 0)
+		return r;
+
+	r = sd_event_add_io(g->s->l->m->event,
+			    &g->dhcp_comm_source,
+			    g->dhcp_comm,
+			    EPOLLHUP | EPOLLERR | EPOLLIN,
+			    supplicant_group_comm_fn,
+			    g);
+	if (r < 0)
+		return log_ERR(r);
+
+	r = sd_event_add_child(g->s->l->m->event,
+			       &g->dhcp_pid_source,
+			       g->dhcp_pid,
+			       WEXITED,
+			       supplicant_group_pid_fn,
+			       g);
+	if (r < 0)
+		return log_ERR(r);
+
+	return 0;
+}
+
 static int supplicant_group_new(struct supplicant *s,
 				struct supplicant_group **out,
 				const char *ifname,
@@ -519,41 +708,24 @@ static int supplicant_group_new(struct supplicant *s,
 			}
 		}
 
-		if (g->subnet) {
-			r = supplicant_group_spawn_dhcp_server(g, g->subnet);
-		} else {
+		if (!g->subnet) {
 			log_warning("out of free subnets for local groups");
 			r = -EINVAL;
+			goto error;
 		}
-	} else {
-		r = supplicant_group_spawn_dhcp_client(g);
 	}
+
+	g->dhcp_start = shl_now(CLOCK_MONOTONIC);
+	if (wifid_hooks && wifid_hooks->dhcp_start)
+		r = wifid_hooks->dhcp_start(&g->dhcp, g->ifname, g->subnet,
+					    supplicant_group_dhcp_fn, g);
+	else
+		r = supplicant_group_spawn_dhcp(g);
 	if (r < 0)
 		goto error;
 
-	r = sd_event_add_io(s->l->m->event,
-			    &g->dhcp_comm_source,
-			    g->dhcp_comm,
-			    EPOLLHUP | EPOLLERR | EPOLLIN,
-			    supplicant_group_comm_fn,
-			    g);
-	if (r < 0) {
-		log_vERR(r);
-		goto error;
-	}
-
-	r = sd_event_add_child(s->l->m->event,
-			       &g->dhcp_pid_source,
-			       g->dhcp_pid,
-			       WEXITED,
-			       supplicant_group_pid_fn,
-			       g);
-	if (r < 0) {
-		log_vERR(r);
-		goto error;
-	}
-
 	shl_dlist_link(&s->groups, &g->list);
+	supplicant_p2p_scan_update(s);
 	if (out)
 		*out = g;
 	return 0;
@@ -579,6 +751,133 @@ static void supplicant_group_drop(struct supplicant_group *g)
 	supplicant_group_free(g);
 }
 
+/*
+ * First and last channel (center frequency) of the --go-width block @freq is
+ * in. 40/80MHz blocks start at channel 36 and 149 respectively; a GO on
+ * 2.4GHz only runs 20MHz.
+ */
+static void supplicant_freq_block(unsigned int freq,
+				  unsigned int *first,
+				  unsigned int *last)
+{
+	unsigned int base, width;
+
+	if (freq < 3000) {
+		*first = *last = freq;
+		return;
+	}
+
+	base = freq < 5500 ? 5170 : 5735;
+	width = shl_max(arg_go_width, 20U);
+	*first = base + (freq - base) / width * width + 10;
+	*last = *first + width - 20;
+}
+
+/*
+ * wpas does not report the channel width of a GO. Derive what the link to
+ * station @sta actually uses from its STA reply: the GO's --go-width block
+ * (20MHz on 2.4GHz) narrowed by what the station associated with. 0 while
+ * unknown.
+ */
+static unsigned int supplicant_group_go_width(struct supplicant_group *g,
+					      struct wpas_message *sta)
+{
+	unsigned int first, last, width;
+	const char *flags, *caps;
+
+	if (!g->freq || !sta)
+		return 0;
+	if (wpas_message_dict_read(sta, "flags", 's', &flags) < 0)
+		return 0;
+
+	supplicant_freq_block(g->freq, &first, &last);
+	width = last - first + 20;
+
+	if (!strstr(flags, "[HT]"))
+		return 20;
+	/* HT capabilities bit 1: 20/40MHz supported */
+	if (wpas_message_dict_read(sta, "ht_caps_info", 's', &caps) >= 0 &&
+	    !(strtoul(caps, NULL, 16) & 0x2))
+		return 20;
+	if (!strstr(flags, "[VHT]"))
+		return shl_min(width, 40U);
+
+	return width;
+}
+
+static int supplicant_group_poll_fn(struct wpas *w,
+				    struct wpas_message *reply,
+				    void *data)
+{
+	struct supplicant_group *g = data;
+	unsigned int width = 0, rate = 0;
+
+	g->poll_cookie = 0;
+	if (wpas_message_is_fail(reply))
+		return 0;
+
+	if (g->go) {
+		/* STA reports tx_rate_info in 100kbit/s */
+		wpas_message_dict_read(reply, "tx_rate_info", 'u', &rate);
+		rate /= 10;
+		width = supplicant_group_go_width(g, reply);
+	} else {
+		/* WIDTH is "20 MHz", "80 MHz" and the like */
+		wpas_message_dict_read_many(reply,
+					    "LINKSPEED", 'u', &rate,
+					    "WIDTH", 'u', &width,
+					    "FREQUENCY", 'u', &g->freq,
+					    NULL);
+	}
+
+	log_debug("group %s on %u MHz, %u MHz wide, %u Mbit/s",
+		  g->ifname, g->freq, width, rate);
+
+	if (rate)
+		metrics_hist_record(&group_phy_rate, rate);
+	link_supplicant_group_changed(g->s->l, g->freq, width, rate);
+	supplicant_update_mcc(g->s);
+	return 0;
+}
+
+/*
+ * Ask wpas for the channel width and PHY rate of a group: SIGNAL_POLL as
+ * client, STA @sta_mac as GO.
+ */
+static void supplicant_group_poll(struct supplicant_group *g,
+				  const char *sta_mac)
+{
+	_wpas_message_unref_ struct wpas_message *m = NULL;
+	struct wpas *w = g->s->bus_global;
+	int r;
+
+	if (g->poll_cookie)
+		wpas_call_async_cancel(w, g->poll_cookie);
+	g->poll_cookie = 0;
+
+	if (g->go && !sta_mac)
+		return;
+
+	r = wpas_message_new_request(w, g->go ? "STA" : "SIGNAL_POLL", &m);
+	if (r < 0)
+		return log_vERR(r);
+
+	r = wpas_message_set_ifname(m, g->ifname);
+	if (r < 0)
+		return log_vERR(r);
+
+	if (g->go) {
+		r = wpas_message_append(m, "s", sta_mac);
+		if (r < 0)
+			return log_vERR(r);
+	}
+
+	r = wpas_call_async(w, m, supplicant_group_poll_fn, g, 0,
+			    &g->poll_cookie);
+	if (r < 0)
+		log_vERR(r);
+}
+
 /*
  * Supplicant Peers
  * Wpas has a quite high-level P2P interface, which makes it impossible to deal
@@ -663,6 +962,8 @@ static void supplicant_peer_free(struct supplicant_peer *sp)
 		peer_supplicant_formation_failure(sp->p, "lost");
 	}
 
+	wpas_call_async_cancel(sp->s->bus_global, sp->peer_cookie);
+
 	supplicant_peer_drop_group(sp);
 	peer_supplicant_stopped(sp->p);
 	peer_free(sp->p);
@@ -673,6 +974,7 @@ static void supplicant_peer_free(struct supplicant_peer *sp)
 	free(sp->prov);
 	free(sp->friendly_name);
 	free(sp->wfd_subelements);
+	free(sp->wfd_dev_info);
 	free(sp);
 }
 
@@ -781,7 +1083,9 @@ int supplicant_peer_connect(struct supplicant_peer *sp,
 	if (r < 0)
 		return log_ERR(r);
 
+	/* wpas stops P2P_FIND for P2P_CONNECT, stay off until asked again */
 	sp->s->pending = sp;
+	supplicant_scan_cancel(sp->s);
 
 	return 0;
 }
@@ -821,12 +1125,43 @@ void supplicant_peer_disconnect(struct supplicant_peer *sp)
  * schedule a restart.
  */
 
+/*
+ * Peer reports repeat the same data over and over again. Replace *@dst by a
+ * copy of @val only if they differ, so callers send PropertiesChanged only for
+ * real changes. Returns 1 if changed, 0 if not, negative error code on failure.
+ */
+static int supplicant_peer_update(char **dst, const char *val)
+{
+	char *t;
+
+	if (*dst && !strcmp(*dst, val))
+		return 0;
+
+	t = strdup(val);
+	if (!t)
+		return log_ENOMEM();
+
+	free(*dst);
+	*dst = t;
+	return 1;
+}
+
+/* count a property signal we sent (@changed > 0) or skipped (== 0) */
+static bool supplicant_peer_signal(int changed)
+{
+	if (changed > 0)
+		metrics_counter_inc(&peer_updates_emitted);
+	else if (!changed)
+		metrics_counter_inc(&peer_updates_suppressed);
+
+	return changed > 0;
+}
+
 static void supplicant_parse_peer(struct supplicant *s,
 				  struct wpas_message *m)
 {
 	struct supplicant_peer *sp;
 	const char *mac, *name, *val;
-	char *t;
 	int r;
 
 	r = wpas_message_read(m, "s", &mac);
@@ -849,14 +1184,9 @@ static void supplicant_parse_peer(struct supplicant *s,
 	if (r < 0)
 		r = wpas_message_dict_read(m, "name", 's', &name);
 	if (r >= 0) {
-		t = strdup(name);
-		if (!t) {
-			log_vENOMEM();
-		} else {
-			free(sp->friendly_name);
-			sp->friendly_name = t;
+		r = supplicant_peer_update(&sp->friendly_name, name);
+		if (supplicant_peer_signal(r))
 			peer_supplicant_friendly_name_changed(sp->p);
-		}
 	} else {
 		log_debug("no device-name in P2P_PEER information: %s",
 			  wpas_message_get_raw(m));
@@ -864,31 +1194,21 @@ static void supplicant_parse_peer(struct supplicant *s,
 
 	r = wpas_message_dict_read(m, "wfd_subelems", 's', &val);
 	if (r >= 0) {
-		t = strdup(val);
-		if (!t) {
-			log_vENOMEM();
-		} else {
-			free(sp->wfd_subelements);
-			sp->wfd_subelements = t;
+		sp->wfd_full = true;
+		r = supplicant_peer_update(&sp->wfd_subelements, val);
+		if (supplicant_peer_signal(r))
+			peer_supplicant_wfd_subelements_changed(sp->p);
+	} else if (wpas_message_dict_read(m, "wfd_dev_info", 's', &val) >= 0) {
+		/* P2P-DEVICE-FOUND only carries the dev-info sub-element, so
+		 * compare it with the last dev-info, never with the full set.
+		 * It stands in for the full set until P2P_PEER delivers one;
+		 * after that a change only triggers a new P2P_PEER through
+		 * supplicant_found_hash(), and is no signal to count. */
+		r = supplicant_peer_update(&sp->wfd_dev_info, val);
+		if (r > 0 && !sp->wfd_full)
+			r = supplicant_peer_update(&sp->wfd_subelements, val);
+		if (!sp->wfd_full && supplicant_peer_signal(r))
 			peer_supplicant_wfd_subelements_changed(sp->p);
-		}
-	} else {
-		/* TODO: wfd_dev_info only contains the dev-info sub-elem,
-		 * while wfd_sublemens contains all. Fix that! The user has no
-		 * chance to distinguish both.
-		 * We currently use it only as boolen (set/unset) but once we
-		 * parse it we _definitely_ have to provide proper data. */
-		r = wpas_message_dict_read(m, "wfd_dev_info", 's', &val);
-		if (r >= 0) {
-			t = strdup(val);
-			if (!t) {
-				log_vENOMEM();
-			} else {
-				free(sp->wfd_subelements);
-				sp->wfd_subelements = t;
-				peer_supplicant_wfd_subelements_changed(sp->p);
-			}
-		}
 	}
 
 	if (s->running)
@@ -898,37 +1218,59 @@ static void supplicant_parse_peer(struct supplicant *s,
 static void supplicant_event_p2p_find_stopped(struct supplicant *s,
 					      struct wpas_message *m)
 {
-	if (!s->p2p_scanning)
-		return;
-
-	log_debug("p2p-scanning stopped on %s", s->l->ifname);
-	s->p2p_scanning = false;
-	link_supplicant_p2p_scan_changed(s->l, false);
+	/* expected at the end of each phase, the scheduler starts the next */
+	log_debug("p2p-find stopped on %s", s->l->ifname);
 }
 
 static int supplicant_p2p_peer_fn(struct wpas *w,
 				  struct wpas_message *reply,
 				  void *data)
 {
-	struct supplicant *s = data;
+	struct supplicant_peer *sp = data;
 
+	sp->peer_cookie = 0;
 	if (wpas_message_is_fail(reply))
 		return 0;
 
-	supplicant_parse_peer(s, reply);
+	sp->peer_time = shl_now(CLOCK_MONOTONIC);
+	supplicant_parse_peer(sp->s, reply);
 	return 0;
 }
 
+/* FNV-1a over the P2P-DEVICE-FOUND fields that P2P_PEER would refresh */
+static uint32_t supplicant_found_hash(struct wpas_message *ev)
+{
+	static const char *keys[] = { "name", "config_methods", "wfd_dev_info" };
+	const char *val;
+	uint32_t h = 2166136261U;
+	size_t i;
+
+	for (i = 0; i < SHL_ARRAY_LENGTH(keys); ++i) {
+		if (wpas_message_dict_read(ev, keys[i], 's', &val) < 0)
+			val = "";
+
+		do
+			h = (h ^ (unsigned char)*val) * 16777619U;
+		while (*val++);
+	}
+
+	return h;
+}
+
 static void supplicant_event_p2p_device_found(struct supplicant *s,
 					      struct wpas_message *ev)
 {
 	_wpas_message_unref_ struct wpas_message *m = NULL;
+	struct supplicant_peer *sp;
 	const char *mac;
+	uint32_t hash;
 	int r;
 
 	/*
 	 * The P2P-DEVICE-FOUND event is quite small. Request a full
-	 * peer-report.
+	 * peer-report, unless the last one is recent and the event does not
+	 * differ from what we saw back then. wpas repeats this event for
+	 * every peer on each discovery round.
 	 */
 
 	r = wpas_message_dict_read(ev, "p2p_dev_addr", 's', &mac);
@@ -940,6 +1282,23 @@ static void supplicant_event_p2p_device_found(struct supplicant *s,
 
 	supplicant_parse_peer(s, ev);
 
+	sp = find_peer_by_p2p_mac(s, mac);
+	if (!sp)
+		return;
+
+	/* a change during the request is caught by the next event */
+	if (sp->peer_cookie) {
+		metrics_counter_inc(&peer_refresh_collapsed);
+		return;
+	}
+
+	hash = supplicant_found_hash(ev);
+	if (sp->peer_time && hash == sp->found_hash &&
+	    shl_now(CLOCK_MONOTONIC) - sp->peer_time < SUPPLICANT_PEER_TTL) {
+		metrics_counter_inc(&peer_refresh_cached);
+		return;
+	}
+
 	r = wpas_message_new_request(s->bus_global,
 				     "P2P_PEER",
 				     &m);
@@ -953,13 +1312,15 @@ static void supplicant_event_p2p_device_found(struct supplicant *s,
 	r = wpas_call_async(s->bus_global,
 			    m,
 			    supplicant_p2p_peer_fn,
-			    s,
+			    sp,
 			    0,
-			    NULL);
+			    &sp->peer_cookie);
 	if (r < 0)
 		goto error;
 
-	log_debug("requesting data for new peer %s", mac);
+	sp->found_hash = hash;
+	metrics_counter_inc(&peer_refresh_sent);
+	log_debug("requesting data for peer %s", mac);
 	return;
 
 error:
@@ -1197,6 +1558,8 @@ static void supplicant_event_p2p_go_neg_success(struct supplicant *s,
 		free(sp->sta_mac);
 		sp->sta_mac = t;
 	}
+
+	peer_supplicant_formation_step(sp->p, "go-neg-success");
 }
 
 static void supplicant_event_p2p_group_started(struct supplicant *s,
@@ -1258,7 +1621,22 @@ static void supplicant_event_p2p_group_started(struct supplicant *s,
 			  sp ? "remote" : "local", g->ifname, go, is_go);
 	}
 
+	wpas_message_dict_read(ev, "freq", 'u', &g->freq);
+	/* the width is known once the group is polled */
+	link_supplicant_group_changed(s->l, g->freq, 0, 0);
+	if (!is_go)
+		supplicant_group_poll(g, NULL);
+
+	supplicant_update_mcc(s);
+	if (s->sta_freq && g->freq) {
+		if (g->freq == s->sta_freq)
+			metrics_counter_inc(&group_single_channel);
+		else
+			metrics_counter_inc(&group_multi_channel);
+	}
+
 	if (sp) {
+		peer_supplicant_formation_step(sp->p, "group-started");
 		supplicant_peer_set_group(sp, g);
 		g->sp = sp;
 	}
@@ -1296,6 +1674,18 @@ static void supplicant_event_p2p_go_neg_failure(struct supplicant *s,
 					       struct wpas_message *ev)
 {
 	struct peer *p;
+	unsigned int status;
+	int r;
+
+	/* status 7 is "no common channels", the peer cannot join the AP's
+	 * channel. Allow all channels again, MCC beats no connection. */
+	r = wpas_message_dict_read(ev, "status", 'u', &status);
+	if (r >= 0 && status == 7 && s->sta_freq && !s->scc_relaxed) {
+		log_info("peer cannot use %u MHz, allowing other channels on %s",
+			 s->sta_freq, s->l->ifname);
+		s->scc_relaxed = true;
+		supplicant_send_disallow_freq(s);
+	}
 
 	if (s->pending) {
 		log_debug("peer %s group owner negotiation failed",
@@ -1387,6 +1777,7 @@ static void supplicant_event_ap_sta_connected(struct supplicant *s,
 
 	log_debug("bind peer %s to existing local group %s", p2p_mac, ifname);
 	supplicant_peer_set_group(sp, g);
+	supplicant_group_poll(g, sp->sta_mac);
 }
 
 static void supplicant_event_ap_sta_disconnected(struct supplicant *s,
@@ -1422,6 +1813,28 @@ static void supplicant_event_ap_sta_disconnected(struct supplicant *s,
 	supplicant_peer_drop_group(sp);
 }
 
+/*
+ * Events of the link's STA side, i.e. its infrastructure connection. Only the
+ * global interface reports these, prefixed with the link's ifname. Neither
+ * CONNECTED nor DISCONNECTED carry the channel, so re-read it via STATUS.
+ */
+static void supplicant_event_sta(struct supplicant *s, struct wpas_message *m)
+{
+	const char *name;
+
+	if (!s->running || !wpas_message_is_event(m, NULL))
+		return;
+
+	name = wpas_message_get_name(m);
+	if (!name)
+		return;
+
+	if (!strcmp(name, "CTRL-EVENT-CONNECTED") ||
+	    !strcmp(name, "CTRL-EVENT-DISCONNECTED") ||
+	    !strcmp(name, "CTRL-EVENT-CHANNEL-SWITCH"))
+		supplicant_update_channels(s);
+}
+
 static void supplicant_event(struct supplicant *s, struct wpas_message *m)
 {
 	const char *name;
@@ -1444,6 +1857,7 @@ static void supplicant_event(struct supplicant *s, struct wpas_message *m)
 		    !strcmp(name, "CTRL-EVENT-BSS-ADDED") ||
 		    !strcmp(name, "CTRL-EVENT-CONNECTED") ||
 		    !strcmp(name, "CTRL-EVENT-DISCONNECTED") ||
+		    !strcmp(name, "CTRL-EVENT-CHANNEL-SWITCH") ||
 		    !strcmp(name, "WPS-PBC-ACTIVE") ||
 		    !strcmp(name, "WPS-PBC-DISABLE") ||
 		    !strcmp(name, "WPS-AP-AVAILABLE-PBC") ||
@@ -1466,6 +1880,9 @@ static void supplicant_event(struct supplicant *s, struct wpas_message *m)
 		    !strcmp(name, "Associated"))
 			return;
 
+		metrics_counter_inc(&wifid_events);
+		MIRACLE_PROBE2(supplicant_event, name, s->l->ifname);
+
 		if (!strcmp(name, "P2P-FIND-STOPPED"))
 			supplicant_event_p2p_find_stopped(s, m);
 		else if (!strcmp(name, "P2P-DEVICE-FOUND"))
@@ -1503,6 +1920,311 @@ static void supplicant_event(struct supplicant *s, struct wpas_message *m)
 	}
 }
 
+/*
+ * Operating Channels
+ * wpas picks the channel of a local GO from p2p_pref_chan. We rank our
+ * candidates by band and by how busy they are according to the scan results
+ * wpas has for the link (the control interface offers no channel survey). If
+ * the link is associated, the channel of its AP goes first: one radio serving
+ * two channels has to time-slice between them (MCC), which costs more airtime
+ * than any neighbour network.
+ */
+
+/* non-DFS 5GHz channels of UNII-1 and UNII-3, then 2.4GHz channels 1/6/11 */
+static const unsigned int supplicant_go_freqs[] = {
+	5180, 5200, 5220, 5240, 5745, 5765, 5785, 5805,
+	2412, 2437, 2462,
+};
+
+struct supplicant_chan {
+	unsigned int freq;
+	unsigned int rank;
+	unsigned int load;
+	unsigned int pos;
+};
+
+/* 20MHz operating class of @freq for p2p_pref_chan, 0 if a GO cannot use it */
+static unsigned int supplicant_freq_class(unsigned int freq,
+					  unsigned int *chan)
+{
+	if (freq >= 2412 && freq <= 2472) {
+		*chan = (freq - 2407) / 5;
+		return 81;
+	} else if (freq >= 5180 && freq <= 5240) {
+		*chan = (freq - 5000) / 5;
+		return 115;
+	} else if (freq >= 5745 && freq <= 5805) {
+		*chan = (freq - 5000) / 5;
+		return 124;
+	}
+
+	return 0;
+}
+
+static bool supplicant_freq_allowed(unsigned int freq)
+{
+	if (freq < 3000)
+		return arg_go_band != P2P_GO_BAND_5GHZ;
+	else
+		return arg_go_band != P2P_GO_BAND_2GHZ;
+}
+
+/*
+ * While the link is associated, only the block of the AP's channel is left to
+ * new groups, so they run single-channel at their full width. Otherwise DFS
+ * channels are excluded, as they need radar detection which a P2P GO does not
+ * do.
+ */
+static const char *supplicant_disallow_freq(struct supplicant *s,
+					    char *buf,
+					    size_t size)
+{
+	unsigned int chan, first, last;
+
+	if (s->sta_freq && !s->scc_relaxed &&
+	    supplicant_freq_allowed(s->sta_freq) &&
+	    supplicant_freq_class(s->sta_freq, &chan)) {
+		supplicant_freq_block(s->sta_freq, &first, &last);
+		snprintf(buf, size, "2400-%u,%u-5900", first - 1, last + 1);
+		return buf;
+	}
+
+	switch (arg_go_band) {
+	case P2P_GO_BAND_2GHZ:
+		return "5180-5900";
+	case P2P_GO_BAND_5GHZ:
+		return "2400-2500,5250-5730";
+	default:
+		return "5250-5730";
+	}
+}
+
+static int supplicant_disallow_freq_fn(struct wpas *w,
+				       struct wpas_message *reply,
+				       void *data)
+{
+	if (!wpas_message_is_ok(reply))
+		log_warning("cannot update p2p disallow_freq field");
+
+	return 0;
+}
+
+/* setup sends the initial value, see supplicant_status_fn() */
+static void supplicant_send_disallow_freq(struct supplicant *s)
+{
+	_wpas_message_unref_ struct wpas_message *m = NULL;
+	char buf[32];
+	int r;
+
+	if (!s->running || !s->has_p2p)
+		return;
+
+	r = wpas_message_new_request(s->bus_global, "P2P_SET", &m);
+	if (r < 0)
+		return log_vERR(r);
+
+	r = wpas_message_append(m, "ss", "disallow_freq",
+				supplicant_disallow_freq(s, buf, sizeof(buf)));
+	if (r < 0)
+		return log_vERR(r);
+
+	r = wpas_call_async(s->bus_global, m, supplicant_disallow_freq_fn,
+			    s, 0, NULL);
+	if (r < 0)
+		log_vERR(r);
+}
+
+/* the AP's channel decides the GO channel policy, see above */
+static void supplicant_set_sta_freq(struct supplicant *s, unsigned int freq)
+{
+	if (s->sta_freq == freq)
+		return;
+
+	log_debug("STA on %s moved from %u MHz to %u MHz",
+		  s->l->ifname, s->sta_freq, freq);
+
+	s->sta_freq = freq;
+	s->scc_relaxed = false;
+	supplicant_send_disallow_freq(s);
+	supplicant_update_mcc(s);
+}
+
+/* whether a network on @bss shares spectrum with a GO on @freq */
+static bool supplicant_freq_overlaps(unsigned int freq, unsigned int bss)
+{
+	unsigned int first, last;
+
+	if (freq < 3000)
+		return bss < 3000 && (bss > freq ? bss - freq : freq - bss) < 25;
+
+	supplicant_freq_block(freq, &first, &last);
+	return bss + 10 >= first && bss < last + 10;
+}
+
+static int supplicant_chan_cmp(const void *a, const void *b)
+{
+	const struct supplicant_chan *ca = a, *cb = b;
+
+	if (ca->rank != cb->rank)
+		return ca->rank < cb->rank ? -1 : 1;
+	if (ca->load != cb->load)
+		return ca->load < cb->load ? -1 : 1;
+
+	return ca->pos < cb->pos ? -1 : ca->pos > cb->pos;
+}
+
+static void supplicant_set_pref_chan(struct supplicant *s, const char *val)
+{
+	_wpas_message_unref_ struct wpas_message *m = NULL;
+	char *t;
+	int r;
+
+	if (s->pref_chan && !strcmp(s->pref_chan, val))
+		return;
+
+	log_debug("p2p_pref_chan on %s: %s", s->l->ifname, val);
+
+	t = strdup(val);
+	if (!t)
+		return log_vENOMEM();
+
+	free(s->pref_chan);
+	s->pref_chan = t;
+
+	r = wpas_message_new_request(s->bus_global, "SET", &m);
+	if (r < 0)
+		return log_vERR(r);
+
+	r = wpas_message_append(m, "ss", "p2p_pref_chan", val);
+	if (r < 0)
+		return log_vERR(r);
+
+	r = wpas_call_async(s->bus_global, m, NULL, NULL, 0, NULL);
+	if (r < 0)
+		log_vERR(r);
+}
+
+static int supplicant_scan_results_fn(struct wpas *w,
+				      struct wpas_message *reply,
+				      void *data)
+{
+	struct supplicant *s = data;
+	struct supplicant_chan chans[SHL_ARRAY_LENGTH(supplicant_go_freqs) + 1];
+	unsigned int i, n = 0, freq, op_class, chan;
+	const char *line;
+	char buf[256];
+	size_t len = 0;
+	int signal;
+
+	for (i = 0; i < SHL_ARRAY_LENGTH(supplicant_go_freqs); ++i) {
+		freq = supplicant_go_freqs[i];
+		if (!supplicant_freq_allowed(freq))
+			continue;
+
+		chans[n].freq = freq;
+		chans[n].rank = freq < 3000 ? 2 : 1;
+		chans[n].load = 0;
+		chans[n].pos = n;
+		if (freq == s->sta_freq)
+			chans[n].rank = 0;
+		++n;
+	}
+
+	/* the AP may sit on a channel we would not pick ourselves */
+	if (s->sta_freq && supplicant_freq_allowed(s->sta_freq) &&
+	    supplicant_freq_class(s->sta_freq, &chan)) {
+		for (i = 0; i < n; ++i)
+			if (chans[i].freq == s->sta_freq)
+				break;
+		if (i >= n) {
+			chans[n].freq = s->sta_freq;
+			chans[n].rank = 0;
+			chans[n].load = 0;
+			chans[n].pos = n;
+			++n;
+		}
+	}
+
+	/* "bssid / frequency / signal level / flags / ssid" */
+	for (i = 0; wpas_message_argv_read(reply, i, 's', &line) >= 0; ++i) {
+		if (sscanf(line, "%*s\t%u\t%d", &freq, &signal) != 2)
+			continue;
+
+		signal = shl_clamp(100 + signal, 1, 100);
+		for (chan = 0; chan < n; ++chan)
+			if (supplicant_freq_overlaps(chans[chan].freq, freq))
+				chans[chan].load += signal;
+	}
+
+	qsort(chans, n, sizeof(*chans), supplicant_chan_cmp);
+
+	buf[0] = 0;
+	for (i = 0; i < n; ++i) {
+		op_class = supplicant_freq_class(chans[i].freq, &chan);
+		len += snprintf(buf + len, sizeof(buf) - len, "%s%u:%u",
+				i ? "," : "", op_class, chan);
+		if (len >= sizeof(buf))
+			return 0;
+	}
+
+	if (n)
+		supplicant_set_pref_chan(s, buf);
+
+	return 0;
+}
+
+static int supplicant_sta_status_fn(struct wpas *w,
+				    struct wpas_message *reply,
+				    void *data)
+{
+	struct supplicant *s = data;
+	const char *state = NULL;
+	unsigned int freq = 0;
+
+	wpas_message_dict_read_many(reply,
+				    "wpa_state", 's', &state,
+				    "freq", 'u', &freq,
+				    NULL);
+
+	if (!state || strcmp(state, "COMPLETED"))
+		freq = 0;
+
+	supplicant_set_sta_freq(s, freq);
+	return 0;
+}
+
+/*
+ * Re-rank the GO channels. STATUS and SCAN_RESULTS of the link are queued
+ * back to back, so the STA channel is known by the time we rank.
+ */
+static void supplicant_update_channels(struct supplicant *s)
+{
+	_wpas_message_unref_ struct wpas_message *st = NULL;
+	_wpas_message_unref_ struct wpas_message *sr = NULL;
+	int r;
+
+	if (!s->has_p2p)
+		return;
+
+	r = wpas_message_new_request(s->bus_global, "STATUS", &st);
+	if (r >= 0)
+		r = wpas_message_set_ifname(st, s->l->ifname);
+	if (r >= 0)
+		r = wpas_call_async(s->bus_global, st,
+				    supplicant_sta_status_fn, s, 0, NULL);
+	if (r < 0)
+		return log_vERR(r);
+
+	r = wpas_message_new_request(s->bus_global, "SCAN_RESULTS", &sr);
+	if (r >= 0)
+		r = wpas_message_set_ifname(sr, s->l->ifname);
+	if (r >= 0)
+		r = wpas_call_async(s->bus_global, sr,
+				    supplicant_scan_results_fn, s, 0, NULL);
+	if (r < 0)
+		log_vERR(r);
+}
+
 static void supplicant_try_ready(struct supplicant *s)
 {
 	struct peer *p;
@@ -1518,10 +2240,14 @@ static void supplicant_try_ready(struct supplicant *s)
 		s->has_wfd = false;
 
 	s->running = true;
+	metrics_hist_record(&wifid_ready_time,
+			    shl_now(CLOCK_MONOTONIC) - s->setup_start);
 	link_supplicant_started(s->l);
 
 	LINK_FOREACH_PEER(p, s->l)
 		peer_supplicant_started(p);
+
+	supplicant_update_channels(s);
 }
 
 static int supplicant_p2p_set_disallow_freq_fn(struct wpas *w,
@@ -1542,25 +2268,75 @@ static int supplicant_p2p_set_disallow_freq_fn(struct wpas *w,
 
 static int supplicant_init_p2p_peer_fn(struct wpas *w,
 				       struct wpas_message *reply,
-				       void *data)
+				       void *data);
+
+static int supplicant_walk_peers(struct supplicant *s, const char *mac)
 {
 	_wpas_message_unref_ struct wpas_message *m = NULL;
 	_shl_free_ char *next = NULL;
+	int r;
+
+	if (mac) {
+		next = shl_strcat("NEXT-", mac);
+		if (!next)
+			return -ENOMEM;
+	}
+
+	r = wpas_message_new_request(s->bus_global,
+				     "P2P_PEER",
+				     &m);
+	if (r < 0)
+		return r;
+
+	r = wpas_message_append(m, "s", next ? : "FIRST");
+	if (r < 0)
+		return r;
+
+	r = wpas_call_async(s->bus_global,
+			    m,
+			    supplicant_init_p2p_peer_fn,
+			    s,
+			    0,
+			    NULL);
+	if (r < 0)
+		return r;
+
+	if (mac) {
+		free(s->walk_mac);
+		s->walk_mac = strdup(mac);
+		if (!s->walk_mac)
+			return -ENOMEM;
+	} else {
+		free(s->walk_mac);
+		s->walk_mac = NULL;
+		s->walk_start = shl_now(CLOCK_MONOTONIC);
+		s->walk_cnt = 0;
+	}
+
+	return 0;
+}
+
+static int supplicant_init_p2p_peer_fn(struct wpas *w,
+				       struct wpas_message *reply,
+				       void *data)
+{
 	struct supplicant *s = data;
+	uint64_t t;
 	const char *mac;
 	int r;
 
 	/*
-	 * Using P2P_PEER to get a list of initial peers is racy. If a peer
-	 * exits while we iterate over the list, a "P2P_PEER NEXT-<addr>"
-	 * command will fail. Furthermore, if we get a P2P-DEVICE-LOST event
-	 * for a peer before we could add it, we will never handle the event.
-	 * Blame whoever wrote that stupid wpas interface..
+	 * wpas can only list peers one P2P_PEER FIRST/NEXT-<addr> round trip
+	 * at a time, each reply carrying the full peer data. There is no bulk
+	 * variant, so the walk runs after the link is ready and each peer is
+	 * published as soon as its reply arrives. P2P-DEVICE-FOUND covers
+	 * anything we miss.
+	 *
+	 * The walk is racy. If a peer exits while we iterate over the list,
+	 * "P2P_PEER NEXT-<addr>" fails just like at the end of the list. We
+	 * restart the walk if the last peer we saw got lost meanwhile.
 	 */
 
-	/* got P2P_PEER response */
-	--s->setup_cnt;
-
 	/* FAIL means end-of-list */
 	if (!wpas_message_is_fail(reply)) {
 		r = wpas_message_read(reply, "s", &mac);
@@ -1571,48 +2347,45 @@ static int supplicant_init_p2p_peer_fn(struct wpas *w,
 
 		wpas_message_rewind(reply);
 		supplicant_parse_peer(s, reply);
+		++s->walk_cnt;
 
-		r = wpas_message_new_request(s->bus_global,
-					     "P2P_PEER",
-					     &m);
+		r = supplicant_walk_peers(s, mac);
 		if (r < 0) {
 			log_vERR(r);
 			goto error;
 		}
 
-		next = shl_strcat("NEXT-", mac);
-		if (!next) {
-			r = log_ENOMEM();
-			goto error;
-		}
-
-		r = wpas_message_append(m, "s", next);
-		if (r < 0) {
-			log_vERR(r);
-			goto error;
-		}
+		return 0;
+	}
 
-		r = wpas_call_async(s->bus_global,
-				    m,
-				    supplicant_init_p2p_peer_fn,
-				    s,
-				    0,
-				    NULL);
+	if (s->walk_mac && !find_peer_by_p2p_mac(s, s->walk_mac) &&
+	    s->walk_restarts < SUPPLICANT_WALK_RESTARTS) {
+		log_debug("peer %s lost during initial peer walk, restarting",
+			  s->walk_mac);
+		++s->walk_restarts;
+		r = supplicant_walk_peers(s, NULL);
 		if (r < 0) {
 			log_vERR(r);
 			goto error;
 		}
 
-		/* require next P2P_PEER listing */
-		++s->setup_cnt;
+		return 0;
 	}
 
-	supplicant_try_ready(s);
+	t = shl_now(CLOCK_MONOTONIC) - s->walk_start;
+	metrics_hist_record(&peer_walk_time, t);
+	metrics_counter_add(&peer_walk_peers, s->walk_cnt);
+	log_debug("initial peer walk on %s found %u peers in %llums",
+		  s->l->ifname, s->walk_cnt, (unsigned long long)t / 1000ULL);
+
+	free(s->walk_mac);
+	s->walk_mac = NULL;
 	return 0;
 
 error:
 	log_warning("cannot read some initial P2P peers, ignoring");
-	supplicant_try_ready(s);
+	free(s->walk_mac);
+	s->walk_mac = NULL;
 	return 0;
 }
 
@@ -1684,15 +2457,17 @@ static int supplicant_status_fn(struct wpas *w,
 	_wpas_message_unref_ struct wpas_message *m = NULL;
 	struct supplicant *s = data;
 	const char *p2p_state = NULL, *wifi_display = NULL, *p2p_mac = NULL;
-	char *t;
+	char *t, buf[32];
 	int r;
 
 	/* STATUS received */
 	--s->setup_cnt;
 
-	wpas_message_dict_read(reply, "p2p_state", 's', &p2p_state);
-	wpas_message_dict_read(reply, "wifi_display", 's', &wifi_display);
-	wpas_message_dict_read(reply, "p2p_device_address", 's', &p2p_mac);
+	wpas_message_dict_read_many(reply,
+				    "p2p_state", 's', &p2p_state,
+				    "wifi_display", 's', &wifi_display,
+				    "p2p_device_address", 's', &p2p_mac,
+				    NULL);
 
 	if (!p2p_state) {
 		log_warning("wpa_supplicant or driver does not support P2P");
@@ -1739,7 +2514,9 @@ static int supplicant_status_fn(struct wpas *w,
 			goto error;
 		}
 
-		r = wpas_message_append(m, "ss", "disallow_freq", "5180-5900");
+		r = wpas_message_append(m, "ss", "disallow_freq",
+					supplicant_disallow_freq(s, buf,
+								 sizeof(buf)));
 		if (r < 0) {
 			log_vERR(r);
 			goto error;
@@ -1756,29 +2533,9 @@ static int supplicant_status_fn(struct wpas *w,
 			goto error;
 		}
 
-		/* require P2P_PEER listing */
-		++s->setup_cnt;
-
-		r = wpas_message_new_request(s->bus_global,
-					     "P2P_PEER",
-					     &m);
-		if (r < 0) {
-			log_vERR(r);
-			goto error;
-		}
-
-		r = wpas_message_append(m, "s", "FIRST");
-		if (r < 0) {
-			log_vERR(r);
-			goto error;
-		}
-
-		r = wpas_call_async(s->bus_global,
-				    m,
-				    supplicant_init_p2p_peer_fn,
-				    s,
-				    0,
-				    NULL);
+		/* not part of the setup, see supplicant_init_p2p_peer_fn() */
+		s->walk_restarts = 0;
+		r = supplicant_walk_peers(s, NULL);
 		if (r < 0) {
 			log_vERR(r);
 			goto error;
@@ -1845,6 +2602,7 @@ static void supplicant_started(struct supplicant *s)
 
 	/* clear left-overs from previous runs */
 	s->p2p_scanning = false;
+	s->setup_start = shl_now(CLOCK_MONOTONIC);
 
 	/* require STATUS response */
 	++s->setup_cnt;
@@ -1880,6 +2638,10 @@ static void supplicant_stopped(struct supplicant *s)
 	struct supplicant_group *g;
 	struct peer *p;
 
+	supplicant_scan_cancel(s);
+	sd_event_source_unref(s->scan_source);
+	s->scan_source = NULL;
+
 	while ((p = LINK_FIRST_PEER(s->l)))
 		supplicant_peer_free(p->sp);
 
@@ -1892,6 +2654,12 @@ static void supplicant_stopped(struct supplicant *s)
 
 	free(s->p2p_mac);
 	s->p2p_mac = NULL;
+	free(s->walk_mac);
+	s->walk_mac = NULL;
+	free(s->pref_chan);
+	s->pref_chan = NULL;
+	s->sta_freq = 0;
+	s->scc_relaxed = false;
 
 	if (s->running) {
 		s->running = false;
@@ -1899,28 +2667,6 @@ static void supplicant_stopped(struct supplicant *s)
 	}
 }
 
-static int supplicant_p2p_find_fn(struct wpas *w,
-				  struct wpas_message *reply,
-				  void *data)
-{
-	struct supplicant *s = data;
-
-	/* if already scanning, ignore any failures */
-	if (s->p2p_scanning)
-		return 0;
-
-	if (!wpas_message_is_ok(reply)) {
-		log_warning("P2P_FIND failed");
-		return 0;
-	}
-
-	log_debug("p2p-scanning now active on %s", s->l->ifname);
-	s->p2p_scanning = true;
-	link_supplicant_p2p_scan_changed(s->l, true);
-
-	return 0;
-}
-
 int supplicant_set_friendly_name(struct supplicant *s, const char *name)
 {
 	_wpas_message_unref_ struct wpas_message *m = NULL;
@@ -1993,81 +2739,245 @@ int supplicant_set_wfd_subelements(struct supplicant *s, const char *val)
 	return 0;
 }
 
-int supplicant_p2p_start_scan(struct supplicant *s)
+/*
+ * P2P Discovery Scheduler
+ * An open-ended P2P_FIND keeps the radio hopping between channels and costs
+ * any concurrent connection on the same radio half its throughput. While the
+ * link wants discovery, we run the duty cycle of p2p_scan_duty[] that fits
+ * what the link is busy with instead, switching as groups come and go or the
+ * application flags video streaming. "P2PScanning" tells whether the scheduler
+ * runs, not whether wpas is searching right now.
+ */
+
+static unsigned int supplicant_scan_mode(struct supplicant *s)
 {
-	_wpas_message_unref_ struct wpas_message *m = NULL;
-	int r;
+	if (s->l->streaming)
+		return P2P_SCAN_VIDEO;
+	if (!shl_dlist_empty(&s->groups))
+		return P2P_SCAN_SESSION;
 
-	if (!s->running || !s->has_p2p)
-		return log_EINVAL();
+	return P2P_SCAN_IDLE;
+}
 
-	s->pending = NULL;
+static void supplicant_scan_account(struct supplicant *s)
+{
+	static struct metrics_counter *phase_time[SCAN_PHASE_CNT] = {
+		[SCAN_PHASE_FIND] = &p2p_scan_find_time,
+		[SCAN_PHASE_LISTEN] = &p2p_scan_listen_time,
+		[SCAN_PHASE_OFF] = &p2p_scan_off_time,
+	};
+	uint64_t now;
 
-	/*
-	 * This call is asynchronous. You can safely issue multiple of these
-	 * in parallel. You're supposed to track the "p2p_scanning" boolean
-	 * value to see whether scanning really is active or not.
-	 *
-	 * Note that we could make this synchronous, but there's no real gain.
-	 * You still don't get any meaningful errors from wpa_supplicant, so
-	 * there's really no use to it. Moreover, wpas' state tracking is quite
-	 * unreliable so we can never know whether we're really still scanning.
-	 * Therefore, we send the P2P_FIND on _each_ start_scan() request. It's
-	 * the callers responsibility to send it in proper intervals or after
-	 * they issues other wpas calls. Yes, this is ugly but currently the
-	 * only way to make this work reliably.
-	 */
+	now = shl_now(CLOCK_MONOTONIC);
+	if (s->scan_time)
+		metrics_counter_add(phase_time[s->scan_phase],
+				    now - s->scan_time);
+	s->scan_time = now;
+}
 
-	r = wpas_message_new_request(s->bus_global,
-				     "P2P_FIND",
-				     &m);
+static int supplicant_p2p_find_fn(struct wpas *w,
+				  struct wpas_message *reply,
+				  void *data)
+{
+	struct supplicant *s = data;
+
+	if (!wpas_message_is_ok(reply))
+		log_warning("P2P_FIND failed on %s", s->l->ifname);
+
+	return 0;
+}
+
+static int supplicant_scan_send(struct supplicant *s,
+				unsigned int phase,
+				unsigned int sec,
+				bool social)
+{
+	_wpas_message_unref_ struct wpas_message *m = NULL;
+	static const char *cmds[SCAN_PHASE_CNT] = {
+		[SCAN_PHASE_FIND] = "P2P_FIND",
+		[SCAN_PHASE_LISTEN] = "P2P_LISTEN",
+		[SCAN_PHASE_OFF] = "P2P_STOP_FIND",
+	};
+	int r;
+
+	r = wpas_message_new_request(s->bus_global, cmds[phase], &m);
 	if (r < 0)
-		return log_ERR(r);
+		return r;
+
+	if (phase != SCAN_PHASE_OFF) {
+		r = wpas_message_append(m, "u", sec);
+		if (r < 0)
+			return r;
+	}
+
+	if (phase == SCAN_PHASE_FIND && social) {
+		r = wpas_message_append(m, "s", "type=social");
+		if (r < 0)
+			return r;
+	}
 
 	r = wpas_call_async(s->bus_global,
 			    m,
-			    supplicant_p2p_find_fn,
+			    phase == SCAN_PHASE_FIND ? supplicant_p2p_find_fn : NULL,
 			    s,
 			    0,
 			    NULL);
+	if (r < 0)
+		return r;
+
+	log_debug("sent %s %u to wpas on %s", cmds[phase], sec, s->l->ifname);
+	return 0;
+}
+
+static int supplicant_scan_fn(sd_event_source *source,
+			      uint64_t usec,
+			      void *data);
+
+/*
+ * Enter @phase of the current mode's cycle, or the next phase with a non-zero
+ * length. If all are zero, discovery is stopped until the mode changes.
+ */
+static int supplicant_scan_phase(struct supplicant *s, unsigned int phase)
+{
+	const struct p2p_scan_duty *d;
+	unsigned int i, sec = 0;
+	int r;
+
+	supplicant_scan_account(s);
+	s->scan_mode = supplicant_scan_mode(s);
+	d = &p2p_scan_duty[s->scan_mode];
+
+	for (i = 0; i < SCAN_PHASE_CNT; ++i) {
+		if (phase == SCAN_PHASE_FIND)
+			sec = d->find;
+		else if (phase == SCAN_PHASE_LISTEN)
+			sec = d->listen;
+		else
+			sec = d->off;
+		if (sec)
+			break;
+
+		phase = (phase + 1) % SCAN_PHASE_CNT;
+	}
+
+	if (!sec)
+		phase = SCAN_PHASE_OFF;
+
+	s->scan_phase = phase;
+
+	r = supplicant_scan_send(s, phase, sec, d->social);
 	if (r < 0)
 		return log_ERR(r);
 
-	log_debug("sent P2P_FIND to wpas on %s", s->l->ifname);
+	if (!sec) {
+		if (s->scan_source)
+			sd_event_source_set_enabled(s->scan_source,
+						    SD_EVENT_OFF);
+		return 0;
+	}
+
+	if (!s->scan_source) {
+		r = sd_event_add_time(s->l->m->event,
+				      &s->scan_source,
+				      CLOCK_MONOTONIC,
+				      0,
+				      0,
+				      supplicant_scan_fn,
+				      s);
+		if (r < 0)
+			return log_ERR(r);
+	}
+
+	sd_event_source_set_time(s->scan_source,
+				 shl_now(CLOCK_MONOTONIC) + sec * 1000ULL * 1000ULL);
+	sd_event_source_set_enabled(s->scan_source, SD_EVENT_ONESHOT);
+	return 0;
+}
+
+static int supplicant_scan_fn(sd_event_source *source,
+			      uint64_t usec,
+			      void *data)
+{
+	LOOPSTAT("supplicant.scan");
+	struct supplicant *s = data;
+
+	/* a search just ended, it is a good time to re-rank GO channels */
+	if (s->scan_phase == SCAN_PHASE_FIND && s->scan_mode == P2P_SCAN_IDLE)
+		supplicant_update_channels(s);
 
+	supplicant_scan_phase(s, (s->scan_phase + 1) % SCAN_PHASE_CNT);
 	return 0;
 }
 
+/* stop the scheduler without telling wpas */
+static void supplicant_scan_cancel(struct supplicant *s)
+{
+	if (!s->p2p_scanning)
+		return;
+
+	supplicant_scan_account(s);
+	s->scan_time = 0;
+	if (s->scan_source)
+		sd_event_source_set_enabled(s->scan_source, SD_EVENT_OFF);
+
+	s->p2p_scanning = false;
+	link_supplicant_p2p_scan_changed(s->l, false);
+}
+
+/* restart the cycle if the link switched modes */
+void supplicant_p2p_scan_update(struct supplicant *s)
+{
+	if (!s || !s->running || !s->p2p_scanning)
+		return;
+
+	if (supplicant_scan_mode(s) == s->scan_mode)
+		return;
+
+	log_debug("p2p-scan mode %u on %s", supplicant_scan_mode(s),
+		  s->l->ifname);
+	supplicant_scan_phase(s, SCAN_PHASE_FIND);
+}
+
+int supplicant_p2p_start_scan(struct supplicant *s)
+{
+	if (!s->running || !s->has_p2p)
+		return log_EINVAL();
+
+	s->pending = NULL;
+
+	/*
+	 * wpas' state tracking is quite unreliable so we can never know
+	 * whether we're really still scanning. Therefore, each start_scan()
+	 * request restarts the cycle with a fresh P2P_FIND. It's the callers
+	 * responsibility to send it after they issued other wpas calls.
+	 */
+
+	if (!s->p2p_scanning) {
+		s->p2p_scanning = true;
+		link_supplicant_p2p_scan_changed(s->l, true);
+	}
+
+	return supplicant_scan_phase(s, SCAN_PHASE_FIND);
+}
+
 void supplicant_p2p_stop_scan(struct supplicant *s)
 {
-	_wpas_message_unref_ struct wpas_message *m = NULL;
 	int r;
 
 	if (!s->running || !s->has_p2p)
 		return log_vEINVAL();
 
+	supplicant_scan_cancel(s);
+
 	/*
 	 * Always send the P2P_STOP_FIND message even if we think we're not
 	 * scanning right now. There might be an asynchronous p2p_find pending,
 	 * so abort that by a later p2p_stop_find.
 	 */
 
-	r = wpas_message_new_request(s->bus_global,
-				     "P2P_STOP_FIND",
-				     &m);
-	if (r < 0)
-		return log_vERR(r);
-
-	r = wpas_call_async(s->bus_global,
-			    m,
-			    NULL,
-			    NULL,
-			    0,
-			    NULL);
+	r = supplicant_scan_send(s, SCAN_PHASE_OFF, 0, false);
 	if (r < 0)
 		return log_vERR(r);
-
-	log_debug("sent P2P_STOP_FIND to wpas on %s", s->l->ifname);
 }
 
 bool supplicant_p2p_scanning(struct supplicant *s)
@@ -2156,12 +3066,17 @@ static int supplicant_global_fn(struct wpas *w,
 				void *data)
 {
 	struct supplicant *s = data;
+	const char *ifname;
 
 	if (!m) {
 		log_error("HUP on supplicant socket of %s", s->l->ifname);
 		goto error;
 	}
 
+	ifname = wpas_message_get_ifname(m);
+	if (ifname && !strcmp(ifname, s->l->ifname))
+		supplicant_event_sta(s, m);
+
 	/* ignore events on the global-iface, we only listen on dev-iface */
 	if(link_is_using_dev(s->l) && wpas_message_get_ifname(m)) {
         supplicant_event(s, m);
@@ -2364,6 +3279,7 @@ static int supplicant_child_fn(sd_event_source *source,
 			       const siginfo_t *si,
 			       void *data)
 {
+	LOOPSTAT("supplicant.child");
 	struct supplicant *s = data;
 
 	supplicant_failed(s);
@@ -2417,7 +3333,7 @@ static void supplicant_run(struct supplicant *s, const char *binary)
 	argv[i++] = s->global_ctrl;
 	argv[i] = NULL;
 
-	/* execute wpa_supplicant; if it fails, the caller issues exit(1) */
+	/* execute wpa_supplicant; if it fails, the caller issues _exit(1) */
 	execve(argv[0], argv, environ);
 }
 
@@ -2484,12 +3400,13 @@ static int supplicant_spawn(struct supplicant *s)
 
     log_info("wpa_supplicant found: %s", binary);
 
+	trace_flush();
 	pid = fork();
 	if (pid < 0) {
 		return log_ERRNO();
 	} else if (!pid) {
 		supplicant_run(s, binary);
-		exit(1);
+		_exit(1);
 	}
 
 	s->pid = pid;
@@ -2515,6 +3432,7 @@ static int supplicant_timer_fn(sd_event_source *source,
 			       uint64_t usec,
 			       void *data)
 {
+	LOOPSTAT("supplicant.timer");
 	struct supplicant *s = data;
 	uint64_t ms;
 	int r;
@@ -2596,12 +3514,16 @@ static int supplicant_write_config(struct supplicant *s)
 		    "config_methods=%s\n"
 		    "driver_param=%s\n"
 		    "ap_scan=%s\n"
+		    "p2p_go_ht40=%d\n"
+		    "p2p_go_vht=%d\n"
 		    "# End of configuration\n",
 		    s->l->friendly_name ?: "unknown",
 		    "1-0050F204-1",
 		    s->l->config_methods ?: "pbc",
 		    "p2p_device=1",
-		    "1");
+		    "1",
+		    arg_go_width >= 40,
+		    arg_go_width >= 80);
 	if (r < 0) {
 		r = log_ERRNO();
 		fclose(f);
@@ -18,7 +18,6 @@
  */
 
 #include <errno.h>
-#include <getopt.h>
 #include <libudev.h>
 #include <signal.h>
 #include <stdbool.h>
@@ -28,10 +27,9 @@
 #include <sys/signalfd.h>
 #include <sys/wait.h>
 #include <systemd/sd-bus.h>
-#include <systemd/sd-daemon.h>
 #include <systemd/sd-event.h>
-#include <time.h>
 #include <unistd.h>
+#include "loopstat.h"
 #include "shl_htable.h"
 #include "shl_macro.h"
 #include "shl_log.h"
@@ -45,6 +43,97 @@ const char *config_methods = NULL;
 unsigned int arg_wpa_loglevel = LOG_NOTICE;
 bool use_dev = false;
 bool lazy_managed = false;
+const struct wifid_hooks *wifid_hooks = NULL;
+struct p2p_scan_duty p2p_scan_duty[P2P_SCAN_MODE_CNT] = {
+	/* search bursts, listen in between to stay visible */
+	[P2P_SCAN_IDLE] = { .find = 10, .listen = 5 },
+	/* short social-channel scans to leave airtime to the session */
+	[P2P_SCAN_SESSION] = { .find = 2, .off = 28, .social = true },
+	[P2P_SCAN_VIDEO] = { },
+};
+unsigned int arg_go_band = P2P_GO_BAND_AUTO;
+unsigned int arg_go_width = 80;
+
+static int p2p_scan_parse_sec(const char **arg, unsigned int *out)
+{
+	const char *next;
+	int r;
+
+	r = shl_atoi_u(*arg, 10, &next, out);
+	if (r < 0 || next == *arg || *out > P2P_SCAN_PHASE_MAX)
+		return -EINVAL;
+
+	*arg = next;
+	return 0;
+}
+
+/* parse --p2p-scan <mode>=<find>,<listen>,<off>[,social] */
+int p2p_scan_parse(const char *arg)
+{
+	static const char *modes[P2P_SCAN_MODE_CNT] = {
+		[P2P_SCAN_IDLE] = "idle",
+		[P2P_SCAN_SESSION] = "session",
+		[P2P_SCAN_VIDEO] = "video",
+	};
+	struct p2p_scan_duty d = { };
+	const char *val;
+	unsigned int i;
+
+	val = strchr(arg, '=');
+	if (!val)
+		return -EINVAL;
+
+	for (i = 0; i < P2P_SCAN_MODE_CNT; ++i)
+		if (!strncmp(arg, modes[i], val - arg) && !modes[i][val - arg])
+			break;
+	if (i >= P2P_SCAN_MODE_CNT)
+		return -EINVAL;
+
+	/* digits only, no signs, blanks or trailing garbage */
+	++val;
+	if (p2p_scan_parse_sec(&val, &d.find) < 0 || *val++ != ',' ||
+	    p2p_scan_parse_sec(&val, &d.listen) < 0 || *val++ != ',' ||
+	    p2p_scan_parse_sec(&val, &d.off) < 0)
+		return -EINVAL;
+
+	if (!strcmp(val, ",social"))
+		d.social = true;
+	else if (*val)
+		return -EINVAL;
+
+	p2p_scan_duty[i] = d;
+	return 0;
+}
+
+/* parse --go-band auto|2.4|5 */
+int p2p_go_band_parse(const char *arg)
+{
+	if (!strcmp(arg, "auto"))
+		arg_go_band = P2P_GO_BAND_AUTO;
+	else if (!strcmp(arg, "2.4"))
+		arg_go_band = P2P_GO_BAND_2GHZ;
+	else if (!strcmp(arg, "5"))
+		arg_go_band = P2P_GO_BAND_5GHZ;
+	else
+		return -EINVAL;
+
+	return 0;
+}
+
+/* parse --go-width 20|40|80 */
+int p2p_go_width_parse(const char *arg)
+{
+	if (!strcmp(arg, "20"))
+		arg_go_width = 20;
+	else if (!strcmp(arg, "40"))
+		arg_go_width = 40;
+	else if (!strcmp(arg, "80"))
+		arg_go_width = 80;
+	else
+		return -EINVAL;
+
+	return 0;
+}
 
 /*
  * Manager Handling
@@ -128,6 +217,7 @@ static int manager_udev_fn(sd_event_source *source,
 			   uint32_t mask,
 			   void *data)
 {
+	LOOPSTAT("wifid.udev");
 	_cleanup_udev_device_ struct udev_device *d = NULL;
 	struct manager *m = data;
 	const char *action, *ifname;
@@ -178,11 +268,15 @@ static int manager_signal_fn(sd_event_source *source,
 			     const struct signalfd_siginfo *ssi,
 			     void *data)
 {
+	LOOPSTAT("wifid.signal");
 	struct manager *m = data;
+	siginfo_t si = { };
 
 	if (ssi->ssi_signo == SIGCHLD) {
 		log_debug("caught SIGCHLD for %ld, reaping child", (long)ssi->ssi_pid);
-		waitid(P_PID, ssi->ssi_pid, NULL, WNOHANG|WEXITED);
+		if (!waitid(P_PID, ssi->ssi_pid, &si, WNOHANG|WEXITED) &&
+		    si.si_pid)
+			wifid_hook(child_exited, si.si_pid);
 		return 0;
 	} else if (ssi->ssi_signo == SIGPIPE) {
 		/* ignore SIGPIPE */
@@ -195,7 +289,7 @@ static int manager_signal_fn(sd_event_source *source,
 	return 0;
 }
 
-static void manager_free(struct manager *m)
+void manager_free(struct manager *m)
 {
 	unsigned int i;
 	struct link *l;
@@ -225,7 +319,7 @@ static void manager_free(struct manager *m)
 	free(m);
 }
 
-static int manager_new(struct manager **out)
+int manager_new(struct manager **out)
 {
 	struct manager *m;
 	static const int sigs[] = {
@@ -437,7 +531,7 @@ error:
 	log_warning("cannot enumerate links via udev");
 }
 
-static int manager_startup(struct manager *m)
+int manager_startup(struct manager *m)
 {
 	int r;
 
@@ -458,163 +552,7 @@ static int manager_startup(struct manager *m)
 	return 0;
 }
 
-static int manager_run(struct manager *m)
+int manager_run(struct manager *m)
 {
 	return sd_event_loop(m->event);
 }
-
-static int help(void)
-{
-	/*
-	 * 80-char barrier:
-	 *      01234567890123456789012345678901234567890123456789012345678901234567890123456789
-	 */
-	printf("%s [OPTIONS...] ...\n\n"
-	       "Wifi Management Daemon.\n\n"
-	       "  -h --help                Show this help\n"
-	       "     --version             Show package version\n"
-	       "     --log-level <lvl>     Maximum level for log messages\n"
-	       "     --log-time            Prefix log-messages with timestamp\n"
-	       "\n"
-	       "  -i --interface           Choose the interface to use\n"
-	       "     --config-methods      Define config methods for pairing, default 'pbc'\n"
-	       "\n"
-	       "     --wpa-loglevel <lvl   wpa_supplicant log-level\n"
-	       "     --use-dev             enable workaround for 'no ifname' issue\n"
-	       "     --lazy-managed        manage interface only when user decide to do\n"
-	       , program_invocation_short_name);
-	/*
-	 * 80-char barrier:
-	 *      01234567890123456789012345678901234567890123456789012345678901234567890123456789
-	 */
-
-	return 0;
-}
-
-static int parse_argv(int argc, char *argv[])
-{
-	enum {
-		ARG_VERSION = 0x100,
-		ARG_LOG_LEVEL,
-		ARG_LOG_TIME,
-		ARG_WPA_LOGLEVEL,
-		ARG_USE_DEV,
-		ARG_CONFIG_METHODS,
-		ARG_LAZY_MANAGED,
-	};
-	static const struct option options[] = {
-		{ "help",	no_argument,		NULL,	'h' },
-		{ "version",	no_argument,		NULL,	ARG_VERSION },
-		{ "log-level",	required_argument,	NULL,	ARG_LOG_LEVEL },
-		{ "log-time",	no_argument,		NULL,	ARG_LOG_TIME },
-
-		{ "wpa-loglevel",	required_argument,	NULL,	ARG_WPA_LOGLEVEL },
-		{ "interface",	required_argument,	NULL,	'i' },
-		{ "use-dev",	no_argument,	NULL,	ARG_USE_DEV },
-		{ "config-methods",	required_argument,	NULL,	ARG_CONFIG_METHODS },
-		{ "lazy-managed",	no_argument,	NULL,	ARG_LAZY_MANAGED },
-		{}
-	};
-	int c;
-
-	while ((c = getopt_long(argc, argv, "hi:", options, NULL)) >= 0) {
-		switch (c) {
-		case 'h':
-			return help();
-		case 'i':
-			interface_name = optarg;
-			break;
-		case ARG_VERSION:
-			puts(PACKAGE_STRING);
-			return 0;
-		case ARG_LOG_LEVEL:
-			log_max_sev = log_parse_arg(optarg);
-			break;
-		case ARG_LOG_TIME:
-			log_init_time();
-			break;
-		case ARG_USE_DEV:
-			use_dev = true;
-			break;
-		case ARG_CONFIG_METHODS:
-			config_methods = optarg;
-		case ARG_LAZY_MANAGED:
-			lazy_managed = true;
-			break;
-
-		case ARG_WPA_LOGLEVEL:
-			arg_wpa_loglevel = log_parse_arg(optarg);
-			break;
-		case '?':
-			return -EINVAL;
-		}
-	}
-
-	if (optind < argc) {
-		log_error("unparsed remaining arguments starting with: %s",
-			  argv[optind]);
-		return -EINVAL;
-	}
-
-	log_format(LOG_DEFAULT_BASE, NULL, LOG_INFO,
-		   "miracle-wifid - revision %s %s %s",
-		   "1.0", __DATE__, __TIME__);
-
-	return 1;
-}
-
-int main(int argc, char **argv)
-{
-	struct manager *m = NULL;
-	int r;
-
-	srand(time(NULL));
-
-   GKeyFile* gkf = load_ini_file();
-
-   if (gkf) {
-      gchar* log_level;
-      log_level = g_key_file_get_string (gkf, "wifid", "log-level", NULL);
-      if (log_level) {
-         log_max_sev = log_parse_arg(log_level);
-         g_free(log_level);
-      }
-      g_key_file_free(gkf);
-   }
-
-	r = parse_argv(argc, argv);
-	if (r < 0)
-		return EXIT_FAILURE;
-	if (!r)
-		return EXIT_SUCCESS;
-
-	if (getuid() != 0) {
-      r = EACCES;
-		log_notice("Must run as root");
-      goto finish;
-	}
-
-	r = manager_new(&m);
-	if (r < 0)
-		goto finish;
-
-	r = manager_startup(m);
-	if (r < 0)
-		goto finish;
-
-	r = sd_notify(false, "READY=1\n"
-			     "STATUS=Running..");
-	if (r < 0) {
-		log_vERR(r);
-		goto finish;
-	}
-
-	r = manager_run(m);
-
-finish:
-	sd_notify(false, "STATUS=Exiting..");
-	manager_free(m);
-
-	log_debug("exiting..");
-	return abs(r);
-}
@@ -21,6 +21,7 @@
 #include <libudev.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <sys/types.h>
 #include <systemd/sd-bus.h>
 #include <systemd/sd-event.h>
 #include "shl_dlist.h"
@@ -51,6 +52,7 @@ int supplicant_set_wfd_subelements(struct supplicant *s, const char *val);
 int supplicant_p2p_start_scan(struct supplicant *s);
 void supplicant_p2p_stop_scan(struct supplicant *s);
 bool supplicant_p2p_scanning(struct supplicant *s);
+void supplicant_p2p_scan_update(struct supplicant *s);
 
 /* supplicant peer */
 
@@ -71,8 +73,12 @@ struct peer {
 	char *p2p_mac;
 	struct supplicant_peer *sp;
 
+	/* manager generation of the last change visible on the bus */
+	uint64_t generation;
+
 	bool public : 1;
 	bool connected : 1;
+	bool formation_traced : 1;
 };
 
 #define peer_from_htable(_p) \
@@ -104,6 +110,7 @@ void peer_supplicant_provision_discovery(struct peer *p,
 void peer_supplicant_go_neg_request(struct peer *p,
 				    const char *prov,
 				    const char *pin);
+void peer_supplicant_formation_step(struct peer *p, const char *stage);
 void peer_supplicant_formation_failure(struct peer *p, const char *reason);
 void peer_supplicant_connected_changed(struct peer *p, bool connected);
 
@@ -134,9 +141,22 @@ struct link {
 	size_t peer_cnt;
 	struct shl_htable peers;
 
+	/* manager generation of the last change visible on the bus */
+	uint64_t generation;
+
+	/* operating channel of the current P2P group, 0 without one */
+	unsigned int group_freq;	/* MHz */
+	unsigned int group_width;	/* MHz */
+	unsigned int group_rate;	/* PHY rate towards the peer, Mbit/s */
+
+	/* bus names that set Streaming, see link_dbus_set_streaming() */
+	sd_bus_track *streaming_owners;
+
 	bool managed : 1;
 	bool public : 1;
 	bool use_dev : 1;
+	bool streaming : 1;
+	bool group_mcc : 1;		/* group and AP on different channels */
 };
 
 #define link_from_htable(_l) \
@@ -170,10 +190,17 @@ int link_set_wfd_subelements(struct link *l, const char *val);
 const char *link_get_wfd_subelements(struct link *l);
 int link_set_p2p_scanning(struct link *l, bool set);
 bool link_get_p2p_scanning(struct link *l);
+int link_set_streaming(struct link *l, bool set);
+bool link_get_streaming(struct link *l);
 
 void link_supplicant_started(struct link *l);
 void link_supplicant_stopped(struct link *l);
 void link_supplicant_p2p_scan_changed(struct link *l, bool new_value);
+void link_supplicant_group_changed(struct link *l,
+				   unsigned int freq,
+				   unsigned int width,
+				   unsigned int rate);
+void link_supplicant_group_mcc_changed(struct link *l, bool mcc);
 
 _shl_sentinel_
 void link_dbus_properties_changed(struct link *l, const char *prop, ...);
@@ -182,6 +209,14 @@ void link_dbus_removed(struct link *l);
 
 /* manager */
 
+/* number of removed objects remembered for GetChangedObjects() */
+#define MANAGER_REMOVED_MAX 64
+
+struct manager_removed {
+	uint64_t generation;
+	char *path;
+};
+
 struct manager {
 	sd_event *event;
 	sd_bus *bus;
@@ -195,6 +230,14 @@ struct manager {
 
 	size_t link_cnt;
 	struct shl_htable links;
+
+	/* Every change of a public object bumps the generation, which clients
+	 * use to fetch deltas. Removals are kept in a ring; a client whose
+	 * last generation is older than removed_floor needs a full resync. */
+	uint64_t generation;
+	uint64_t removed_floor;
+	struct manager_removed removed[MANAGER_REMOVED_MAX];
+	unsigned int removed_pos;
 };
 
 #define MANAGER_FIRST_LINK(_m) \
@@ -202,6 +245,11 @@ struct manager {
 #define MANAGER_FOREACH_LINK(_i, _m) \
 	SHL_HTABLE_FOREACH_MACRO(_i, &(_m)->links, link_from_htable)
 
+int manager_new(struct manager **out);
+void manager_free(struct manager *m);
+int manager_startup(struct manager *m);
+int manager_run(struct manager *m);
+
 struct link *manager_find_link(struct manager *m, unsigned int ifindex);
 struct link *manager_find_link_by_label(struct manager *m, const char *label);
 
@@ -210,8 +258,88 @@ struct link *manager_find_link_by_label(struct manager *m, const char *label);
 int manager_dbus_connect(struct manager *m);
 void manager_dbus_disconnect(struct manager *m);
 
+/*
+ * In-process hooks
+ * miracle-wifid leaves these unset. miracled hosts the manager in its own
+ * process and uses them to follow links and peers without going through
+ * D-Bus, and to run DHCP in-process instead of spawning miracle-dhcp. Every
+ * hook is optional.
+ */
+
+/* @msg is a miracle-dhcp comm message, NULL if DHCP gave up */
+typedef void (*wifid_dhcp_fn) (void *data, const char *msg);
+
+struct wifid_hooks {
+	/* the supplicant came up or went away, or the link is freed */
+	void (*link_started) (struct link *l);
+	void (*link_stopped) (struct link *l);
+	void (*peer_removed) (struct peer *p);
+	void (*peer_go_neg_request) (struct peer *p,
+				     const char *prov,
+				     const char *pin);
+	void (*peer_formation_failure) (struct peer *p, const char *reason);
+	void (*peer_connected_changed) (struct peer *p);
+
+	/* @subnet is the 192.168.<subnet>.0/24 we serve, 0 for a client */
+	int (*dhcp_start) (void **out,
+			   const char *ifname,
+			   unsigned int subnet,
+			   wifid_dhcp_fn fn,
+			   void *data);
+	void (*dhcp_stop) (void *handle);
+
+	/* the manager reaped a child, e.g. a player the hook owner spawned */
+	void (*child_exited) (pid_t pid);
+};
+
+extern const struct wifid_hooks *wifid_hooks;
+
+#define wifid_hook(_name, ...) \
+	((wifid_hooks && wifid_hooks->_name) ? \
+	 wifid_hooks->_name(__VA_ARGS__) : (void)0)
+
+/*
+ * P2P discovery duty cycles, picked by what the link is busy with. A cycle
+ * runs P2P_FIND for @find seconds, P2P_LISTEN for @listen seconds and then
+ * stays quiet for @off seconds. All zero disables discovery in that mode.
+ */
+enum p2p_scan_mode {
+	P2P_SCAN_IDLE,			/* no P2P group */
+	P2P_SCAN_SESSION,		/* P2P group up */
+	P2P_SCAN_VIDEO,			/* link is streaming video */
+	P2P_SCAN_MODE_CNT,
+};
+
+/* longest phase --p2p-scan accepts, in seconds */
+#define P2P_SCAN_PHASE_MAX (24U * 60U * 60U)
+
+struct p2p_scan_duty {
+	unsigned int find;
+	unsigned int listen;
+	unsigned int off;
+	bool social;			/* find on social channels only */
+};
+
+/* bands a local GO may operate on, see --go-band */
+enum p2p_go_band {
+	P2P_GO_BAND_AUTO,		/* 5GHz if possible, else 2.4GHz */
+	P2P_GO_BAND_2GHZ,
+	P2P_GO_BAND_5GHZ,
+};
+
 /* cli arguments */
 
+extern const char *interface_name;
+extern const char *config_methods;
 extern unsigned int arg_wpa_loglevel;
+extern bool use_dev;
+extern bool lazy_managed;
+extern struct p2p_scan_duty p2p_scan_duty[P2P_SCAN_MODE_CNT];
+extern unsigned int arg_go_band;
+extern unsigned int arg_go_width;
+
+int p2p_scan_parse(const char *arg);
+int p2p_go_band_parse(const char *arg);
+int p2p_go_width_parse(const char *arg);
 
 #endif /* WIFID_H */
@@ -0,0 +1,48 @@
+/*
+ * MiracleCast - Wifi-Display/Miracast Implementation
+ *
+ * MiracleCast is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * MiracleCast is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with MiracleCast; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Benchmark Helper
+ * Latencies of the benchmarks are kept in metrics histograms, see metrics.h.
+ * They are local to each benchmark and never registered.
+ */
+
+#ifndef BENCH_COMMON_H
+#define BENCH_COMMON_H
+
+#include <inttypes.h>
+#include <stdio.h>
+#include "metrics.h"
+
+/* one line summary of @h in usecs, @unit names what was counted */
+static inline void bench_hist_print(struct metrics_hist *h,
+				    const char *name,
+				    const char *unit)
+{
+	if (!h->count) {
+		printf("%s: no samples\n", name);
+		return;
+	}
+
+	printf("%s: %" PRIu64 " %s, avg %" PRIu64 "us, p50 %" PRIu64
+	       "us, p90 %" PRIu64 "us, p99 %" PRIu64 "us, max %" PRIu64 "us\n",
+	       name, h->count, unit, h->sum / h->count,
+	       metrics_hist_percentile(h, 50), metrics_hist_percentile(h, 90),
+	       metrics_hist_percentile(h, 99), h->max);
+}
+
+#endif /* BENCH_COMMON_H */
@@ -0,0 +1,315 @@
+/*
+ * MiracleCast - Wifi-Display/Miracast Implementation
+ *
+ * MiracleCast is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * MiracleCast is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with MiracleCast; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * WFD Source Pipeline Benchmark
+ * Pushes test pattern frames through encode, TS mux and RTP as fast as the
+ * pipeline goes, to a UDP socket on 127.0.0.1 that we drain after every
+ * frame. Runs once with UDP GSO (if the kernel has it) and once with plain
+ * sendmmsg, and checks that every RTP packet arrived in sequence.
+ *
+ * With -k, it then feeds k sinks, first with a pipeline per sink and then
+ * with one fan-out pipeline, and compares the CPU time per frame.
+ *
+ * Usage: bench_pipeline [-n <frames>] [-s <w>x<h>] [-e <encoder>] [-k <sinks>]
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <systemd/sd-event.h>
+#include <unistd.h>
+#include "ctl.h"
+#include "src-pipeline.h"
+#include "shl_macro.h"
+#include "shl_util.h"
+
+#define BENCH_MAX_SINKS 16
+
+/* globals ctl-cli.c normally provides */
+unsigned int cli_max_sev = LOG_WARNING;
+
+void cli_printv(const char *fmt, va_list args)
+{
+	vprintf(fmt, args);
+}
+
+void cli_printf(const char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	cli_printv(fmt, args);
+	va_end(args);
+}
+
+struct bench_rx {
+	int fd;
+	struct sockaddr_in addr;
+	bool started;
+	uint16_t seq;
+	uint32_t ssrc;
+	uint64_t packets;
+	uint64_t lost;
+};
+
+static void bench_rx_drain(struct bench_rx *rx)
+{
+	static uint8_t buf[UINT16_MAX];
+	uint16_t seq;
+	ssize_t l;
+
+	while ((l = recv(rx->fd, buf, sizeof(buf), MSG_DONTWAIT)) >= 0) {
+		if (l < SRC_RTP_HEADER || (l - SRC_RTP_HEADER) % SRC_TS_SIZE) {
+			++rx->lost;
+			continue;
+		}
+
+		seq = buf[2] << 8 | buf[3];
+		if (rx->started && seq != (uint16_t)(rx->seq + 1))
+			rx->lost += (uint16_t)(seq - rx->seq - 1);
+		rx->ssrc = (uint32_t)buf[8] << 24 | buf[9] << 16 |
+			   buf[10] << 8 | buf[11];
+		rx->started = true;
+		rx->seq = seq;
+		++rx->packets;
+	}
+}
+
+static int bench_rx_open(struct bench_rx *rx)
+{
+	socklen_t len = sizeof(rx->addr);
+	int r, val;
+
+	memset(rx, 0, sizeof(*rx));
+	rx->fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (rx->fd < 0)
+		return -errno;
+
+	val = 16 * 1024 * 1024;
+	setsockopt(rx->fd, SOL_SOCKET, SO_RCVBUF, &val, sizeof(val));
+
+	rx->addr.sin_family = AF_INET;
+	rx->addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	r = bind(rx->fd, (struct sockaddr*)&rx->addr, sizeof(rx->addr));
+	if (r >= 0)
+		r = getsockname(rx->fd, (struct sockaddr*)&rx->addr, &len);
+	if (r < 0) {
+		r = -errno;
+		close(rx->fd);
+		return r;
+	}
+
+	return 0;
+}
+
+static int bench_run(sd_event *event, struct src_pipeline_config *cfg,
+		     unsigned int frames, bool gso)
+{
+	struct src_pipeline *p;
+	struct bench_rx rx;
+	unsigned int i;
+	int r;
+
+	r = bench_rx_open(&rx);
+	if (r < 0)
+		return r;
+
+	cfg->dest = rx.addr;
+	r = src_pipeline_new(&p, event, cfg);
+	if (r < 0)
+		goto out_rx;
+
+	if (!gso && p->rtp->gso) {
+		src_rtp_disable_gso(p->rtp->fd);
+		p->rtp->gso = false;
+	} else if (gso && !p->rtp->gso) {
+		printf("%s, GSO: not supported here, skipped\n", p->encoder->ops->name);
+		r = 0;
+		goto out;
+	}
+
+	p->stats.start = shl_now(CLOCK_MONOTONIC);
+	for (i = 0; i < frames; ++i) {
+		r = src_pipeline_frame(p);
+		if (r < 0)
+			goto out;
+		bench_rx_drain(&rx);
+	}
+
+	printf("%s, %dx%d, GSO %s:\n", p->encoder->ops->name,
+	       cfg->width, cfg->height, gso ? "on" : "off");
+	src_pipeline_print_stats(p, "  ");
+	printf("  received %" PRIu64 " packets, %" PRIu64 " lost\n",
+	       rx.packets, rx.lost);
+
+	r = rx.lost || p->stats.send_errors ? -EPROTO : 0;
+
+out:
+	src_pipeline_free(p);
+out_rx:
+	close(rx.fd);
+	return r;
+}
+
+static uint64_t bench_cpu(struct src_pipeline *p)
+{
+	return p->stats.cpu.count ? p->stats.cpu.sum / p->stats.cpu.count : 0;
+}
+
+/* k sinks: k pipelines vs one fan-out pipeline */
+static int bench_fanout(sd_event *event, struct src_pipeline_config *cfg,
+			unsigned int frames, unsigned int k)
+{
+	struct src_pipeline *sep[BENCH_MAX_SINKS] = { }, *p = NULL;
+	struct src_fanout_sink *sink;
+	struct bench_rx rx[BENCH_MAX_SINKS];
+	uint64_t cpu_sep = 0;
+	unsigned int i, j, n_rx = 0;
+	int r = 0;
+
+	for (i = 0; i < k; ++i) {
+		r = bench_rx_open(&rx[i]);
+		if (r < 0)
+			goto out;
+		++n_rx;
+	}
+
+	for (i = 0; i < k; ++i) {
+		cfg->dest = rx[i].addr;
+		r = src_pipeline_new(&sep[i], event, cfg);
+		if (r < 0)
+			goto out;
+	}
+
+	for (i = 0; i < frames; ++i) {
+		for (j = 0; j < k; ++j) {
+			r = src_pipeline_frame(sep[j]);
+			if (r < 0)
+				goto out;
+			bench_rx_drain(&rx[j]);
+		}
+	}
+
+	for (j = 0; j < k; ++j)
+		cpu_sep += bench_cpu(sep[j]);
+
+	cfg->fanout = true;
+	r = src_pipeline_new(&p, event, cfg);
+	cfg->fanout = false;
+	if (r < 0)
+		goto out;
+
+	for (j = 0; j < k; ++j) {
+		r = src_pipeline_add_sink(p, &rx[j].addr, 0, &sink);
+		if (r < 0)
+			goto out;
+		rx[j].started = false;
+		rx[j].packets = 0;
+	}
+
+	p->stats.start = shl_now(CLOCK_MONOTONIC);
+	for (i = 0; i < frames; ++i) {
+		r = src_pipeline_frame(p);
+		if (r < 0)
+			goto out;
+		for (j = 0; j < k; ++j)
+			bench_rx_drain(&rx[j]);
+	}
+
+	printf("%s, %dx%d, fan-out to %u sinks:\n", p->encoder->ops->name,
+	       cfg->width, cfg->height, k);
+	src_pipeline_print_stats(p, "  ");
+	printf("  cpu/frame for all sinks: %" PRIu64 "us with one pipeline per sink, %"
+	       PRIu64 "us with fan-out\n", cpu_sep, bench_cpu(p));
+
+	for (j = 0; j < k; ++j) {
+		if (rx[j].lost || rx[j].packets != p->fanout->packets / k)
+			r = -EPROTO;
+		for (i = 0; i < j; ++i)
+			if (rx[i].ssrc == rx[j].ssrc)
+				r = -EPROTO;
+	}
+
+out:
+	src_pipeline_free(p);
+	for (i = 0; i < k; ++i)
+		src_pipeline_free(sep[i]);
+	for (i = 0; i < n_rx; ++i)
+		close(rx[i].fd);
+	return r;
+}
+
+int main(int argc, char **argv)
+{
+	struct src_pipeline_config cfg = {
+		.capture = "testsrc",
+		.width = 1920,
+		.height = 1080,
+		.fps = 30,
+		.bitrate = 8000,
+	};
+	unsigned int frames = 120, sinks = 0;
+	sd_event *event;
+	int r, c;
+
+	while ((c = getopt(argc, argv, "n:s:e:k:")) >= 0) {
+		switch (c) {
+		case 'n':
+			frames = atoi(optarg);
+			break;
+		case 's':
+			sscanf(optarg, "%dx%d", &cfg.width, &cfg.height);
+			break;
+		case 'e':
+			cfg.encoder = optarg;
+			break;
+		case 'k':
+			sinks = shl_min(atoi(optarg), BENCH_MAX_SINKS);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n <frames>] [-s <w>x<h>] [-e <encoder>] [-k <sinks>]\n",
+				argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	/* the benchmark runs without x264, too */
+	if (!cfg.encoder)
+		cfg.encoder = src_encoder_default() ? : "pcm";
+
+	r = sd_event_default(&event);
+	if (r < 0)
+		return EXIT_FAILURE;
+
+	r = bench_run(event, &cfg, frames, true);
+	if (r >= 0)
+		r = bench_run(event, &cfg, frames, false);
+	if (r >= 0 && sinks)
+		r = bench_fanout(event, &cfg, frames, sinks);
+	if (r < 0)
+		fprintf(stderr, "pipeline failed: %s\n", strerror(-r));
+
+	sd_event_unref(event);
+
+	return r < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,247 @@
+/*
+ * MiracleCast - Wifi-Display/Miracast Implementation
+ *
+ * MiracleCast is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * MiracleCast is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with MiracleCast; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * WFD Source Session Setup Benchmark
+ * Runs the source session engine and a batch of the sinkctl sink sessions on
+ * one event loop over 127.0.0.1, and measures the time from accept() to the
+ * M7 (PLAY) reply for each session. Batches of increasing size connect all
+ * at once, so the numbers include the cost of interleaving many handshakes.
+ *
+ * The sink side always connects to port 7236, which must be free.
+ *
+ * Each batch also reports the socket syscalls per session: recv()/send() of
+ * the epoll backend plus io_uring_enter() of the io_uring one, and the loop
+ * wakeups, each costing one epoll_wait(). Run with MIRACLE_URING=0 to compare
+ * against epoll when io_uring is built.
+ *
+ * Usage: bench_src [-r <rounds>] [-n <max sinks per batch>]
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <systemd/sd-event.h>
+#include <time.h>
+#include <unistd.h>
+#include "bench_common.h"
+#include "ctl.h"
+#include "ctl-sink.h"
+#include "ctl-src.h"
+#include "metrics.h"
+#include "shl_util.h"
+
+static sd_event *event;
+static unsigned int playing;
+static unsigned int wanted;
+static struct metrics_hist setup;
+
+/* globals ctl-sink.c and ctl-cli.c normally provide */
+unsigned int cli_max_sev = LOG_WARNING;
+unsigned int wfd_supported_res_cea  = 0x0001ffff;
+unsigned int wfd_supported_res_vesa = 0x1fffffff;
+unsigned int wfd_supported_res_hh   = 0x00001fff;
+int rstp_port = 1991;
+int uibc_port;
+bool uibc_option;
+bool uibc_enabled;
+char *uibc_hidc;
+
+void cli_printv(const char *fmt, va_list args)
+{
+	vprintf(fmt, args);
+}
+
+void cli_printf(const char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	cli_printv(fmt, args);
+	va_end(args);
+}
+
+static uint64_t bench_counter(const char *name)
+{
+	struct metric *m;
+
+	/* counters register on first use */
+	m = metrics_find(name);
+	if (!m)
+		return 0;
+
+	return shl_container_of(m, struct metrics_counter, m)->value;
+}
+
+void ctl_fn_src_session_new(struct ctl_src_session *ss)
+{
+}
+
+int ctl_fn_src_session_playing(struct ctl_src_session *ss)
+{
+	metrics_hist_add(&setup, ss->t_playing - ss->t_accept);
+	++playing;
+	return 0;
+}
+
+void ctl_fn_src_session_paused(struct ctl_src_session *ss)
+{
+}
+
+void ctl_fn_src_session_free(struct ctl_src_session *ss)
+{
+}
+
+void ctl_fn_sink_connected(struct ctl_sink *s)
+{
+}
+
+void ctl_fn_sink_disconnected(struct ctl_sink *s)
+{
+}
+
+void ctl_fn_sink_resolution_set(struct ctl_sink *s)
+{
+}
+
+static int bench_batch(struct ctl_src *src, unsigned int n)
+{
+	struct ctl_sink **sinks;
+	uint64_t start, t, failed, io, enter, wakeups = 0;
+	unsigned int i;
+	int r = 0;
+
+	failed = src->setup_failed;
+	sinks = calloc(n, sizeof(*sinks));
+	if (!sinks)
+		return -ENOMEM;
+
+	playing = 0;
+	wanted = n;
+	memset(&setup, 0, sizeof(setup));
+
+	io = bench_counter("rtsp.io_calls");
+	enter = bench_counter("uring.submits");
+	start = shl_now(CLOCK_MONOTONIC);
+	for (i = 0; i < n; ++i) {
+		r = ctl_sink_new(&sinks[i], event);
+		if (r < 0)
+			goto out;
+
+		r = ctl_sink_connect(sinks[i], "127.0.0.1");
+		if (r < 0)
+			goto out;
+	}
+
+	/* sessions that fail never reach PLAY, the source times them out */
+	while (playing < wanted && playing + src->setup_failed < wanted + failed) {
+		r = sd_event_run(event, (uint64_t)-1);
+		if (r < 0)
+			goto out;
+		++wakeups;
+	}
+	if (playing < wanted) {
+		r = -EPROTO;
+		goto out;
+	}
+
+	t = shl_now(CLOCK_MONOTONIC) - start;
+	printf("batch of %u: all playing after %" PRIu64 "us, %.0f sessions/s\n",
+	       n, t, n * 1000000.0 / t);
+	bench_hist_print(&setup, "  accept-to-PLAY", "sessions");
+
+	io = bench_counter("rtsp.io_calls") - io;
+	enter = bench_counter("uring.submits") - enter;
+	printf("  io: %.1f syscalls/session (%" PRIu64 " recv/send, %" PRIu64
+	       " io_uring_enter), %.1f wakeups/session\n",
+	       (double)(io + enter) / n, io, enter, (double)wakeups / n);
+
+out:
+	for (i = 0; i < n; ++i)
+		ctl_sink_free(sinks[i]);
+	free(sinks);
+
+	/* let the source notice the HUPs and reap its sessions */
+	while (src->n_sessions)
+		sd_event_run(event, 100 * 1000ULL);
+
+	return r;
+}
+
+int main(int argc, char **argv)
+{
+	struct ctl_src *src;
+	unsigned int rounds = 3, max = 64, n, i;
+	int r, c;
+
+	while ((c = getopt(argc, argv, "r:n:")) >= 0) {
+		switch (c) {
+		case 'r':
+			rounds = atoi(optarg);
+			break;
+		case 'n':
+			max = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-r <rounds>] [-n <max sinks>]\n",
+				argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	r = sd_event_default(&event);
+	if (r < 0)
+		return EXIT_FAILURE;
+
+	r = ctl_src_new(&src, event);
+	if (r < 0)
+		return EXIT_FAILURE;
+
+	src->max_sessions = max;
+	r = ctl_src_listen(src, "127.0.0.1", CTL_SRC_DEFAULT_PORT);
+	if (r < 0) {
+		fprintf(stderr, "cannot listen on port %u: %s\n",
+			CTL_SRC_DEFAULT_PORT, strerror(-r));
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < rounds; ++i) {
+		for (n = 1; n <= max; n *= 4) {
+			r = bench_batch(src, n);
+			if (r < 0) {
+				fprintf(stderr, "batch of %u failed: %s\n",
+					n, strerror(-r));
+				return EXIT_FAILURE;
+			}
+		}
+	}
+
+	printf("total: %" PRIu64 " set up, %" PRIu64 " failed, "
+	       "min %" PRIu64 "us, avg %" PRIu64 "us, max %" PRIu64 "us\n",
+	       src->setup_cnt, src->setup_failed, src->setup_min,
+	       src->setup_cnt ? src->setup_sum / src->setup_cnt : 0,
+	       src->setup_max);
+
+	r = src->setup_failed ? EXIT_FAILURE : EXIT_SUCCESS;
+	ctl_src_free(src);
+	sd_event_unref(event);
+
+	return r;
+}
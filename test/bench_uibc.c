@@ -0,0 +1,337 @@
+/*
+ * MiracleCast - Wifi-Display/Miracast Implementation
+ *
+ * MiracleCast is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * MiracleCast is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with MiracleCast; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * UIBC Loopback Benchmark
+ * Runs miracle-uibcctl against a fake WFD source on 127.0.0.1 and drives it
+ * through its binary --input socket. Every injected touch event carries its
+ * sequence number in the coordinates, so the fake source can match received
+ * packets to their injection time.
+ *
+ * Two phases are run: a paced one at --rate events/s which measures latency,
+ * and a flat-out one which measures the throughput limit. miracle-uibcctl
+ * itself reports its input-to-encoded and input-to-wire histograms on exit,
+ * the difference to the end-to-end numbers here is the transmit latency.
+ *
+ * Usage: bench_uibc [-n <events>] [-r <rate>] [path/to/miracle-uibcctl]
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "bench_common.h"
+#include "miracle-uibcctl.h"
+#include "shl_util.h"
+
+struct bench {
+	int srcfd;
+	int inputfd;
+	pid_t pid;
+
+	uint64_t *sent;
+	unsigned int events;
+	unsigned int received;
+	uint64_t bytes;
+
+	/* partial packet carried over between reads */
+	uint8_t buf[4096];
+	size_t len;
+
+	struct metrics_hist e2e;
+};
+
+/* fake source: split the stream into UIBC packets and timestamp them */
+static int bench_source_read(struct bench *b)
+{
+	uint64_t now;
+	size_t off, plen;
+	unsigned int seq;
+	ssize_t n;
+
+	n = recv(b->srcfd, b->buf + b->len, sizeof(b->buf) - b->len,
+		 MSG_DONTWAIT);
+	if (n < 0)
+		return (errno == EAGAIN || errno == EINTR) ? 0 : -errno;
+	else if (!n)
+		return -EPIPE;
+
+	now = shl_now(CLOCK_MONOTONIC);
+	b->len += n;
+	b->bytes += n;
+
+	for (off = 0; off + 4 <= b->len; off += plen) {
+		plen = (b->buf[off + 2] << 8) | b->buf[off + 3];
+		if (plen < 4)
+			return -EINVAL;
+		if (off + plen > b->len)
+			break;
+
+		/* generic touch with one pointer, seq is in x/y */
+		if ((b->buf[off + 1] & 0x0F) != UIBC_CATEGORY_GENERIC ||
+		    b->buf[off + 4] > GENERIC_TOUCH_MOVE || plen < 13)
+			continue;
+
+		seq = (b->buf[off + 9] << 8) | b->buf[off + 10];
+		seq |= ((b->buf[off + 11] << 8) | b->buf[off + 12]) << 16;
+		if (seq >= b->events || !b->sent[seq])
+			continue;
+
+		metrics_hist_add(&b->e2e, now - b->sent[seq]);
+		b->sent[seq] = 0;
+		++b->received;
+	}
+
+	b->len -= off;
+	memmove(b->buf, b->buf + off, b->len);
+
+	return 0;
+}
+
+/* driver: down, moves, up, repeated; with uibcctl's shaping disabled */
+static int bench_inject(struct bench *b, unsigned int seq, int flags)
+{
+	UibcInputEvent ev;
+	ssize_t n;
+
+	memset(&ev, 0, sizeof(ev));
+	switch (seq % 10) {
+	case 0:
+		ev.type = GENERIC_TOUCH_DOWN;
+		break;
+	case 9:
+		ev.type = GENERIC_TOUCH_UP;
+		break;
+	default:
+		ev.type = GENERIC_TOUCH_MOVE;
+		break;
+	}
+	ev.count = 1;
+	ev.pointers[0].x = seq & 0xFFFF;
+	ev.pointers[0].y = seq >> 16;
+	ev.timestamp = shl_now(CLOCK_MONOTONIC);
+	b->sent[seq] = ev.timestamp;
+
+	n = send(b->inputfd, &ev, sizeof(ev), flags);
+	if (n < 0) {
+		b->sent[seq] = 0;
+		return -errno;
+	}
+
+	return 0;
+}
+
+static int bench_run(struct bench *b, unsigned int first, unsigned int last,
+		     unsigned int rate)
+{
+	uint64_t start, next, now, interval;
+	struct pollfd fds[2];
+	unsigned int seq = first;
+	int timeout, r;
+
+	interval = rate ? 1000000ULL / rate : 0;
+	start = next = shl_now(CLOCK_MONOTONIC);
+
+	while (b->received < last) {
+		now = shl_now(CLOCK_MONOTONIC);
+
+		while (seq < last && now >= next) {
+			r = bench_inject(b, seq, interval ? 0 : MSG_DONTWAIT);
+			if (r == -EAGAIN)
+				break;
+			else if (r < 0)
+				return r;
+
+			++seq;
+			next += interval;
+		}
+
+		fds[0].fd = b->srcfd;
+		fds[0].events = POLLIN;
+		fds[1].fd = b->inputfd;
+		fds[1].events = (seq < last && !interval) ? POLLOUT : 0;
+
+		if (seq >= last)
+			timeout = 1000;
+		else if (!interval)
+			timeout = -1;
+		else
+			timeout = next > now ? (next - now + 999) / 1000 : 0;
+
+		r = poll(fds, 2, timeout);
+		if (r < 0 && errno != EINTR)
+			return -errno;
+		else if (r == 0 && seq >= last)
+			break;
+
+		if (fds[0].revents & (POLLIN | POLLHUP)) {
+			r = bench_source_read(b);
+			if (r < 0)
+				return r;
+		}
+	}
+
+	now = shl_now(CLOCK_MONOTONIC);
+	if (now > start)
+		printf("%u events in %" PRIu64 "us: %.0f events/s, %u lost\n",
+		       last - first, now - start,
+		       (last - first) * 1e6 / (now - start),
+		       last - first - (b->received - first));
+
+	b->received = last;
+	return 0;
+}
+
+static pid_t bench_spawn(const char *uibcctl, int port, const char *input)
+{
+	char portstr[16];
+	pid_t pid;
+	int fd;
+
+	sprintf(portstr, "%d", port);
+
+	pid = fork();
+	if (pid != 0)
+		return pid;
+
+	/* no text input, only the binary socket */
+	fd = open("/dev/null", O_RDONLY);
+	if (fd >= 0)
+		dup2(fd, STDIN_FILENO);
+
+	execlp(uibcctl, uibcctl, "127.0.0.1", portstr,
+	       "--input", input, "--rate", "0", NULL);
+	fprintf(stderr, "cannot execute %s: %m\n", uibcctl);
+	_exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	const char *uibcctl = "miracle-uibcctl";
+	struct sockaddr_in addr;
+	struct sockaddr_un un;
+	socklen_t alen = sizeof(addr);
+	struct bench b;
+	unsigned int events = 10000, rate = 1000, i;
+	int opt, listenfd, one = 1, r;
+
+	while ((opt = getopt(argc, argv, "n:r:")) >= 0) {
+		switch (opt) {
+		case 'n':
+			events = atoi(optarg);
+			break;
+		case 'r':
+			rate = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n <events>] [-r <rate>] [miracle-uibcctl]\n",
+				argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (optind < argc)
+		uibcctl = argv[optind];
+	if (!events || events >= (1U << 31))
+		return EXIT_FAILURE;
+
+	memset(&b, 0, sizeof(b));
+	b.events = events * 2;
+	b.sent = calloc(b.events, sizeof(*b.sent));
+	if (!b.sent)
+		return EXIT_FAILURE;
+
+	/* fake source on an ephemeral loopback port */
+	listenfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (listenfd < 0 ||
+	    bind(listenfd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+	    listen(listenfd, 1) < 0 ||
+	    getsockname(listenfd, (struct sockaddr*)&addr, &alen) < 0) {
+		perror("cannot set up fake source");
+		return EXIT_FAILURE;
+	}
+
+	memset(&un, 0, sizeof(un));
+	un.sun_family = AF_UNIX;
+	snprintf(un.sun_path, sizeof(un.sun_path), "/tmp/bench-uibc-%d.sock",
+		 (int)getpid());
+
+	b.pid = bench_spawn(uibcctl, ntohs(addr.sin_port), un.sun_path);
+	if (b.pid < 0)
+		return EXIT_FAILURE;
+
+	b.srcfd = accept4(listenfd, NULL, NULL, SOCK_CLOEXEC);
+	if (b.srcfd < 0) {
+		perror("fake source accept failed");
+		return EXIT_FAILURE;
+	}
+	setsockopt(b.srcfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	b.inputfd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	for (i = 0; i < 100; ++i) {
+		if (!connect(b.inputfd, (struct sockaddr*)&un, sizeof(un)))
+			break;
+		usleep(10000);
+	}
+	if (i == 100) {
+		perror("cannot connect to miracle-uibcctl");
+		kill(b.pid, SIGTERM);
+		return EXIT_FAILURE;
+	}
+
+	printf("== paced, %u events/s\n", rate);
+	r = bench_run(&b, 0, events, rate);
+	if (r >= 0) {
+		bench_hist_print(&b.e2e, "inject-to-source", "events");
+		printf("%.1f bytes/event on the wire\n",
+		       (double)b.bytes / events);
+
+		printf("== flat-out\n");
+		memset(&b.e2e, 0, sizeof(b.e2e));
+		r = bench_run(&b, events, b.events, 0);
+		if (r >= 0)
+			bench_hist_print(&b.e2e, "inject-to-source", "events");
+	}
+	if (r < 0)
+		fprintf(stderr, "benchmark failed: %s\n", strerror(-r));
+
+	fflush(stdout);
+
+	/* let miracle-uibcctl print its own stage histograms */
+	close(b.inputfd);
+	kill(b.pid, SIGTERM);
+	waitpid(b.pid, NULL, 0);
+
+	close(b.srcfd);
+	close(listenfd);
+	free(b.sent);
+
+	return r < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,186 @@
+/*
+ * MiracleCast - Wifi-Display/Miracast Implementation
+ *
+ * MiracleCast is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * MiracleCast is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with MiracleCast; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * WFD Parameter Codec Benchmark
+ * Parses and formats typical M3/M4 parameter values in a loop and reports the
+ * time per call. Every value is checked to survive a parse/format round trip
+ * unchanged first. For wfd_video_formats the sscanf()/snprintf() code the
+ * codec replaced is timed as well, for comparison.
+ *
+ * Usage: bench_wfd [-n <iterations>]
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "metrics.h"
+#include "shl_macro.h"
+#include "wfd-codec.h"
+
+struct bench_param {
+	const char *name;
+	const char *value;
+	int (*parse) (void *obj, const char *s);
+	int (*format) (const void *obj, char *buf, size_t size);
+};
+
+/* untyped wrappers, so all parameters fit in one table */
+#define BENCH_CODEC(_type, _struct) \
+	static int bench_ ## _type ## _parse(void *obj, const char *s) \
+	{ \
+		return _type ## _parse((_struct*)obj, s); \
+	} \
+	static int bench_ ## _type ## _format(const void *obj, char *buf, \
+					      size_t size) \
+	{ \
+		return _type ## _format((const _struct*)obj, buf, size); \
+	}
+
+BENCH_CODEC(wfd_video_formats, struct wfd_video_formats)
+BENCH_CODEC(wfd_audio_codecs, struct wfd_audio_codecs)
+BENCH_CODEC(wfd_client_rtp_ports, struct wfd_client_rtp_ports)
+BENCH_CODEC(wfd_uibc_capability, struct wfd_uibc_capability)
+BENCH_CODEC(wfd_presentation_url, struct wfd_presentation_url)
+
+#define BENCH_PARAM(_name, _type, _value) { \
+		.name = #_name, \
+		.value = (_value), \
+		.parse = bench_ ## _type ## _parse, \
+		.format = bench_ ## _type ## _format, \
+	}
+
+static const struct bench_param bench_params[] = {
+	BENCH_PARAM(wfd_video_formats, wfd_video_formats,
+		    "00 00 02 04 0001ffff 1fffffff 00000fff 00 0000 0000 11 none none, "
+		    "01 04 0001ffff 1fffffff 00000fff 00 0000 0000 11 none none"),
+	BENCH_PARAM(wfd_audio_codecs, wfd_audio_codecs,
+		    "LPCM 00000003 00, AAC 0000000f 00, AC3 00000007 00"),
+	BENCH_PARAM(wfd_client_rtp_ports, wfd_client_rtp_ports,
+		    "RTP/AVP/UDP;unicast 1991 0 mode=play"),
+	BENCH_PARAM(wfd_uibc_capability, wfd_uibc_capability,
+		    "input_category_list=GENERIC, HIDC;"
+		    "generic_cap_list=Mouse, SingleTouch;"
+		    "hidc_cap_list=Keyboard/USB, Mouse/USB;port=none"),
+	BENCH_PARAM(wfd_presentation_URL, wfd_presentation_url,
+		    "rtsp://192.168.77.1/wfd1.0/streamid=0 none"),
+};
+
+/* large enough for any of the codec structs */
+union bench_obj {
+	struct wfd_video_formats video;
+	struct wfd_audio_codecs audio;
+	struct wfd_client_rtp_ports ports;
+	struct wfd_uibc_capability uibc;
+	struct wfd_presentation_url url;
+};
+
+static void bench_report(const char *name, const char *op, uint64_t ns,
+			 unsigned int n)
+{
+	printf("  %-22s %-8s %7.1f ns/call\n", name, op, (double)ns / n);
+}
+
+static int bench_one(const struct bench_param *p, unsigned int n)
+{
+	union bench_obj obj;
+	char buf[512];
+	uint64_t start;
+	unsigned int i;
+	int r;
+
+	r = p->parse(&obj, p->value);
+	if (r < 0) {
+		fprintf(stderr, "%s: cannot parse \"%s\": %s\n",
+			p->name, p->value, strerror(-r));
+		return r;
+	}
+
+	r = p->format(&obj, buf, sizeof(buf));
+	if (r < 0 || strcmp(buf, p->value)) {
+		fprintf(stderr, "%s: round trip failed:\n  in:  %s\n  out: %s\n",
+			p->name, p->value, r < 0 ? strerror(-r) : buf);
+		return -EPROTO;
+	}
+
+	start = metrics_now_ns();
+	for (i = 0; i < n; ++i)
+		p->parse(&obj, p->value);
+	bench_report(p->name, "parse", metrics_now_ns() - start, n);
+
+	start = metrics_now_ns();
+	for (i = 0; i < n; ++i)
+		p->format(&obj, buf, sizeof(buf));
+	bench_report(p->name, "format", metrics_now_ns() - start, n);
+
+	return 0;
+}
+
+/* what ctl-sink/ctl-src did before, for the first H.264 entry only */
+static void bench_video_sscanf(unsigned int n)
+{
+	const char *value = bench_params[0].value;
+	unsigned int native, pref, profile, level, cea, vesa, hh;
+	char buf[512];
+	uint64_t start;
+	unsigned int i;
+
+	start = metrics_now_ns();
+	for (i = 0; i < n; ++i)
+		sscanf(value, "%x %x %x %x %x %x %x",
+		       &native, &pref, &profile, &level, &cea, &vesa, &hh);
+	bench_report("wfd_video_formats", "sscanf", metrics_now_ns() - start, n);
+
+	start = metrics_now_ns();
+	for (i = 0; i < n; ++i)
+		snprintf(buf, sizeof(buf),
+			 "%02x %02x %02x %02x %08x %08x %08x 00 0000 0000 00 none none",
+			 native, pref, profile, level, cea, vesa, hh);
+	bench_report("wfd_video_formats", "snprintf", metrics_now_ns() - start, n);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int n = 1000000, i;
+	int r, c;
+
+	while ((c = getopt(argc, argv, "n:")) >= 0) {
+		switch (c) {
+		case 'n':
+			n = shl_max(atoi(optarg), 1);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n <iterations>]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	printf("WFD parameter codec, %u iterations:\n", n);
+	for (i = 0; i < SHL_ARRAY_LENGTH(bench_params); ++i) {
+		r = bench_one(&bench_params[i], n);
+		if (r < 0)
+			return EXIT_FAILURE;
+	}
+
+	bench_video_sscanf(n);
+
+	return EXIT_SUCCESS;
+}
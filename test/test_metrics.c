@@ -0,0 +1,187 @@
+/*
+ * MiracleCast - Wifi-Display/Miracast Implementation
+ *
+ * MiracleCast is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * MiracleCast is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with MiracleCast; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <unistd.h>
+#include "test_common.h"
+#include "loopstat.h"
+#include "metrics.h"
+
+static METRICS_COUNTER(test_counter, "test.counter", "a counter");
+static METRICS_GAUGE(test_gauge, "test.gauge", "a gauge");
+static METRICS_HIST(test_hist, "test.hist", "us", "a histogram");
+
+START_TEST(hist_buckets)
+{
+	unsigned int b, prev = 0;
+	uint64_t v;
+
+	/* small values are exact */
+	for (v = 0; v < METRICS_HIST_SUB; ++v) {
+		ck_assert_int_eq(metrics_hist_bucket(v), v);
+		ck_assert_int_eq(metrics_hist_bucket_low(v), v);
+	}
+
+	/* buckets are monotonic and contain their values */
+	for (v = 1; v < 1ULL << METRICS_HIST_MAX_BITS; v += v / 3 + 1) {
+		b = metrics_hist_bucket(v);
+		ck_assert_int_ge(b, prev);
+		ck_assert_int_lt(b, METRICS_HIST_BUCKETS);
+		ck_assert(metrics_hist_bucket_low(b) <= v);
+		if (b < METRICS_HIST_BUCKETS - 1)
+			ck_assert(metrics_hist_bucket_low(b + 1) > v);
+		prev = b;
+	}
+
+	/* everything too large is clamped */
+	ck_assert_int_eq(metrics_hist_bucket(UINT64_MAX),
+			 METRICS_HIST_BUCKETS - 1);
+	ck_assert_int_eq(metrics_hist_bucket(1ULL << METRICS_HIST_MAX_BITS),
+			 METRICS_HIST_BUCKETS - 1);
+}
+END_TEST
+
+START_TEST(hist_percentile)
+{
+	uint64_t p;
+	unsigned int i;
+
+	metrics_reset();
+	ck_assert_int_eq(metrics_hist_percentile(&test_hist, 50), 0);
+
+	for (i = 1; i <= 1000; ++i)
+		metrics_hist_record(&test_hist, i);
+
+	ck_assert_int_eq(test_hist.count, 1000);
+	ck_assert_int_eq(test_hist.sum, 500500);
+	ck_assert_int_eq(test_hist.min, 1);
+	ck_assert_int_eq(test_hist.max, 1000);
+
+	/* within one bucket, i.e. 1/METRICS_HIST_SUB */
+	p = metrics_hist_percentile(&test_hist, 50);
+	ck_assert(p >= 500 && p < 500 + 500 / METRICS_HIST_SUB);
+	p = metrics_hist_percentile(&test_hist, 90);
+	ck_assert(p >= 900 && p < 900 + 900 / METRICS_HIST_SUB);
+	ck_assert_int_eq(metrics_hist_percentile(&test_hist, 100), 1000);
+	ck_assert_int_eq(metrics_hist_percentile(&test_hist, 0), 1);
+}
+END_TEST
+
+START_TEST(hist_private)
+{
+	struct metrics_hist h = { };
+
+	metrics_hist_add(&h, 5);
+	metrics_hist_add(&h, 3);
+
+	ck_assert_int_eq(h.count, 2);
+	ck_assert_int_eq(h.min, 3);
+	ck_assert_int_eq(h.max, 5);
+	ck_assert_int_eq(metrics_hist_percentile(&h, 50), 3);
+	ck_assert(!h.m.registered);
+}
+END_TEST
+
+START_TEST(registry)
+{
+	_shl_free_ char *dump = NULL;
+	int r;
+
+	metrics_reset();
+	metrics_counter_add(&test_counter, 5);
+	metrics_counter_inc(&test_counter);
+	metrics_gauge_set(&test_gauge, 3);
+	metrics_gauge_add(&test_gauge, -5);
+	metrics_hist_record(&test_hist, 7);
+
+	ck_assert(metrics_find("test.counter") == &test_counter.m);
+	ck_assert(metrics_find("test.gauge") == &test_gauge.m);
+	ck_assert(metrics_find("test.hist") == &test_hist.m);
+	ck_assert(!metrics_find("test.none"));
+
+	r = metrics_format(&dump);
+	ck_assert_int_ge(r, 0);
+	ck_assert(strstr(dump, "\ntest.counter 6\n"));
+	ck_assert(strstr(dump, "\ntest.gauge -2\n"));
+	ck_assert(strstr(dump, "\ntest.hist count=1 sum=7us min=7us"));
+	ck_assert(strstr(dump, "test.counter") < strstr(dump, "test.gauge"));
+
+	/* gauges keep their value */
+	metrics_reset();
+	ck_assert_int_eq(test_counter.value, 0);
+	ck_assert_int_eq(test_gauge.value, -2);
+	ck_assert_int_eq(test_hist.count, 0);
+}
+END_TEST
+
+static void loopstat_inner(void)
+{
+	LOOPSTAT("test.inner");
+
+	usleep(3000);
+}
+
+static void loopstat_outer(void)
+{
+	LOOPSTAT("test.outer");
+
+	loopstat_inner();
+}
+
+START_TEST(loopstat)
+{
+	_shl_free_ char *dump = NULL;
+	struct metrics_counter *stalls;
+	int r;
+
+	metrics_reset();
+	loopstat_set_threshold(2);
+	loopstat_outer();
+	loopstat_outer();
+	loopstat_set_threshold(LOOPSTAT_STALL_MSEC_DEFAULT);
+
+	/* nested stalls are reported once, by the outermost callback */
+	stalls = shl_container_of(metrics_find("loop.stalls"),
+				  struct metrics_counter, m);
+	ck_assert_int_eq(stalls->value, 2);
+
+	r = metrics_format(&dump);
+	ck_assert_int_ge(r, 0);
+	ck_assert(strstr(dump, "\nloop.top{test.outer} count=2 "));
+	ck_assert(strstr(dump, "\nloop.top{test.inner} count=2 "));
+	ck_assert(strstr(dump, " stalls=2\n"));
+	ck_assert(strstr(dump, "\nloop.dispatch_time count=2 "));
+}
+END_TEST
+
+TEST_DEFINE_CASE(hist)
+	TEST(hist_buckets)
+	TEST(hist_percentile)
+	TEST(hist_private)
+TEST_END_CASE
+
+TEST_DEFINE_CASE(registry)
+	TEST(registry)
+	TEST(loopstat)
+TEST_END_CASE
+
+TEST_DEFINE(
+	TEST_SUITE(metrics,
+		TEST_CASE(hist),
+		TEST_CASE(registry),
+		TEST_END
+	)
+)
@@ -123,9 +123,98 @@ START_TEST(bus_open)
 }
 END_TEST
 
+static void bus_limits_watermark_fn(struct rtsp *bus, bool high, void *data)
+{
+	int *level = data;
+
+	*level = high ? 1 : -1;
+}
+
+static int bus_limits_send(struct rtsp *bus, uint64_t *cookie)
+{
+	struct rtsp_message *m;
+	int r;
+
+	r = rtsp_message_new_request(bus, &m, "GET_PARAMETER", "*");
+	ck_assert_int_ge(r, 0);
+	r = rtsp_message_seal(m);
+	ck_assert_int_ge(r, 0);
+
+	r = rtsp_call_async(bus, m, NULL, NULL, 0, cookie);
+	rtsp_message_unref(m);
+
+	return r;
+}
+
+START_TEST(bus_limits)
+{
+	struct rtsp_limits l, def = RTSP_LIMITS_DEFAULT;
+	struct rtsp *bus;
+	uint64_t cookies[3];
+	int r, fd, level = 0;
+	size_t size;
+
+	fd = dup(0);
+	ck_assert_int_ge(fd, 0);
+
+	r = rtsp_open(&bus, fd);
+	ck_assert_int_ge(r, 0);
+
+	rtsp_get_limits(bus, &l);
+	ck_assert(!memcmp(&l, &def, sizeof(l)));
+
+	l.outgoing_low = l.outgoing_high;
+	ck_assert_int_eq(rtsp_set_limits(bus, &l), -EINVAL);
+
+	rtsp_set_watermark_fn(bus, bus_limits_watermark_fn, &level);
+
+	/* nothing is written without an event loop, so the queue only grows */
+	ck_assert_int_eq(rtsp_get_outgoing_size(bus), 0);
+	r = bus_limits_send(bus, &cookies[0]);
+	ck_assert_int_ge(r, 0);
+	size = rtsp_get_outgoing_size(bus);
+	ck_assert_int_gt(size, 0);
+
+	l = def;
+	l.max_outgoing = 3 * size;
+	l.outgoing_high = 2 * size;
+	l.outgoing_low = size;
+	r = rtsp_set_limits(bus, &l);
+	ck_assert_int_ge(r, 0);
+
+	r = bus_limits_send(bus, &cookies[1]);
+	ck_assert_int_ge(r, 0);
+	ck_assert_int_eq(level, 1);
+
+	r = bus_limits_send(bus, &cookies[2]);
+	ck_assert_int_ge(r, 0);
+	ck_assert_int_eq(rtsp_get_outgoing_size(bus), 3 * size);
+
+	r = bus_limits_send(bus, NULL);
+	ck_assert_int_eq(r, -ENOBUFS);
+	ck_assert_int_eq(rtsp_get_outgoing_size(bus), 3 * size);
+
+	/* cancelled requests leave the queue, too */
+	rtsp_call_async_cancel(bus, cookies[2]);
+	ck_assert_int_eq(level, 1);
+	rtsp_call_async_cancel(bus, cookies[1]);
+	ck_assert_int_eq(rtsp_get_outgoing_size(bus), size);
+	ck_assert_int_eq(level, -1);
+
+	r = bus_limits_send(bus, NULL);
+	ck_assert_int_ge(r, 0);
+	ck_assert_int_eq(level, 1);
+
+	/* no low watermark while tearing down */
+	rtsp_unref(bus);
+	ck_assert_int_eq(level, 1);
+}
+END_TEST
+
 TEST_DEFINE_CASE(bus)
 	TEST(bus_invalid_ops)
 	TEST(bus_open)
+	TEST(bus_limits)
 TEST_END_CASE
 
 START_TEST(msg_new_invalid)
@@ -605,9 +694,70 @@ START_TEST(msg_new)
 }
 END_TEST
 
+START_TEST(msg_types)
+{
+	static const struct rtsp_types header = RTSP_TYPES('<', 's', 'u', '>');
+	static const struct rtsp_types param = RTSP_TYPES('{', '<', '*', 'h', '>', '}');
+	static const struct rtsp_types line = RTSP_TYPES('{', '&', '}');
+	struct rtsp_types t;
+	struct rtsp *bus;
+	struct rtsp_message *m;
+	const char *str;
+	uint32_t u32;
+	int r, fd;
+
+	/* runtime compiled types match the build-time ones */
+	r = rtsp_types_compile(&t, "{<*h>}");
+	ck_assert_int_ge(r, 0);
+	ck_assert_int_eq(t.n, param.n);
+	ck_assert(!memcmp(t.ops, param.ops, t.n));
+
+	ck_assert_int_eq(rtsp_types_compile(&t, "<x>"), -EINVAL);
+	ck_assert_int_eq(rtsp_types_compile(&t, "<s"), -EINVAL);
+	ck_assert_int_eq(rtsp_types_compile(&t, "<<s>>"), -EINVAL);
+	ck_assert_int_eq(rtsp_types_compile(&t, "<{}>"), -EINVAL);
+	ck_assert_int_eq(rtsp_types_compile(&t, "s"), -EINVAL);
+	ck_assert_int_eq(rtsp_types_compile(&t, "{<************>}"), -E2BIG);
+	ck_assert_int_ge(rtsp_types_compile(&t, "&"), 0);
+
+	fd = dup(0);
+	ck_assert_int_ge(fd, 0);
+	r = rtsp_open(&bus, fd);
+	ck_assert_int_ge(r, 0);
+
+	r = rtsp_message_new_request(bus, &m, "SET_PARAMETER", "*");
+	ck_assert_int_ge(r, 0);
+	r = rtsp_message_append_types(m, &header, "Foo", "bar", 5);
+	ck_assert_int_ge(r, 0);
+	r = rtsp_message_append_types(m, &line, "wfd_test: 01 1f");
+	ck_assert_int_ge(r, 0);
+	r = rtsp_message_seal(m);
+	ck_assert_int_ge(r, 0);
+
+	r = rtsp_message_read_types(m, &header, "Foo", &str, &u32);
+	ck_assert_int_ge(r, 0);
+	ck_assert_str_eq(str, "bar");
+	ck_assert_int_eq(u32, 5);
+
+	r = rtsp_message_read_types(m, &param, "wfd_test", &u32);
+	ck_assert_int_ge(r, 0);
+	ck_assert_int_eq(u32, 0x1f);
+
+	/* failed reads leave no header or body entered */
+	r = rtsp_message_read_types(m, &param, "wfd_none", &u32);
+	ck_assert_int_lt(r, 0);
+	r = rtsp_message_read_types(m, &header, "Foo", &str, &u32);
+	ck_assert_int_ge(r, 0);
+
+	rtsp_message_unref(m);
+	rtsp_unref(bus);
+}
+END_TEST
+
 TEST_DEFINE_CASE(msg)
 	TEST(msg_new_invalid)
 	TEST(msg_new)
+	TEST(msg_types)
 TEST_END_CASE
 
 static struct rtsp *server, *client;
@@ -665,7 +815,7 @@ static int match_recipe(struct rtsp *bus,
 	return 0;
 }
 
-START_TEST(run_all)
+static void run_recipes(void)
 {
 	struct recipe *rec;
 	struct rtsp_message *m;
@@ -696,10 +846,76 @@ START_TEST(run_all)
 
 	stop_test_client();
 }
+
+START_TEST(run_all)
+{
+	run_recipes();
+}
+END_TEST
+
+/* same with io_uring disabled, if it is built at all */
+START_TEST(run_all_epoll)
+{
+	setenv("MIRACLE_URING", "0", 1);
+	run_recipes();
+	unsetenv("MIRACLE_URING");
+}
+END_TEST
+
+static int run_limits_reply_fn(struct rtsp *bus,
+			       struct rtsp_message *m,
+			       void *data)
+{
+	unsigned int *code = data;
+
+	ck_assert(!!m);
+	*code = rtsp_message_get_code(m);
+
+	return 0;
+}
+
+START_TEST(run_limits)
+{
+	struct rtsp_limits l;
+	struct rtsp_message *m;
+	unsigned int code = 0;
+	int r;
+
+	start_test_client();
+
+	rtsp_get_limits(server, &l);
+	l.max_body = 8;
+	r = rtsp_set_limits(server, &l);
+	ck_assert_int_ge(r, 0);
+
+	r = rtsp_message_new_request(client, &m, "SET_PARAMETER", "*");
+	ck_assert_int_ge(r, 0);
+	r = rtsp_message_append(m, "{&}", "wfd_trigger_method: SETUP");
+	ck_assert_int_ge(r, 0);
+	r = rtsp_message_seal(m);
+	ck_assert_int_ge(r, 0);
+
+	r = rtsp_call_async(client, m, run_limits_reply_fn, &code, 0, NULL);
+	ck_assert_int_ge(r, 0);
+	rtsp_message_unref(m);
+
+	do {
+		r = sd_event_run(event, (uint64_t)-1);
+		ck_assert_int_ge(r, 0);
+	} while (!code);
+
+	/* the server replies before it hangs up */
+	ck_assert_int_eq(code, RTSP_CODE_REQUEST_ENTITY_TOO_LARGE);
+	ck_assert(rtsp_is_dead(server));
+
+	stop_test_client();
+}
 END_TEST
 
 TEST_DEFINE_CASE(run)
 	TEST(run_all)
+	TEST(run_all_epoll)
+	TEST(run_limits)
 TEST_END_CASE
 
 TEST_DEFINE(
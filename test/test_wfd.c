@@ -0,0 +1,189 @@
+/*
+ * MiracleCast - Wifi-Display/Miracast Implementation
+ *
+ * MiracleCast is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * MiracleCast is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with MiracleCast; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "test_common.h"
+#include "wfd-codec.h"
+
+START_TEST(video_formats)
+{
+	struct wfd_video_formats v;
+	char buf[256];
+	int r;
+
+	/* what our sink sends in M3 */
+	r = wfd_video_formats_parse(&v, "00 00 03 10 0001ffff 1fffffff 00000fff 00 0000 0000 10 none none");
+	ck_assert_int_eq(r, 0);
+	ck_assert(!v.none);
+	ck_assert_int_eq(v.n_codecs, 1);
+	ck_assert_int_eq(v.codecs[0].profile, WFD_H264_CBP | WFD_H264_CHP);
+	ck_assert_int_eq(v.codecs[0].level, 0x10);
+	ck_assert_int_eq(v.codecs[0].cea, 0x0001ffff);
+	ck_assert_int_eq(v.codecs[0].vesa, 0x1fffffff);
+	ck_assert_int_eq(v.codecs[0].hh, 0x00000fff);
+	ck_assert_int_eq(v.codecs[0].frame_rate_control, 0x10);
+	ck_assert_int_eq(v.codecs[0].max_hres, 0);
+
+	/* multiple profiles, upper case and max resolutions */
+	r = wfd_video_formats_parse(&v, "40 00 01 02 0000001F 00000000 00000000 00 0000 0000 00 none none, "
+					"02 04 000001ff 00000000 00000000 00 0000 0000 00 0780 0438\r\n");
+	ck_assert_int_eq(r, 0);
+	ck_assert_int_eq(v.native, 0x40);
+	ck_assert_int_eq(v.n_codecs, 2);
+	ck_assert_int_eq(v.codecs[0].cea, 0x1f);
+	ck_assert_int_eq(v.codecs[1].profile, WFD_H264_CHP);
+	ck_assert_int_eq(v.codecs[1].max_hres, 1920);
+	ck_assert_int_eq(v.codecs[1].max_vres, 1080);
+
+	r = wfd_video_formats_format(&v, buf, sizeof(buf));
+	ck_assert_int_eq(r, strlen(buf));
+	ck_assert_str_eq(buf, "40 00 01 02 0000001f 00000000 00000000 00 0000 0000 00 none none, "
+			      "02 04 000001ff 00000000 00000000 00 0000 0000 00 0780 0438");
+
+	r = wfd_video_formats_format(&v, buf, 16);
+	ck_assert_int_eq(r, -ENOBUFS);
+	ck_assert_int_eq(strlen(buf), 15);
+
+	ck_assert_int_eq(wfd_video_formats_parse(&v, "none"), 0);
+	ck_assert(v.none);
+	r = wfd_video_formats_format(&v, buf, sizeof(buf));
+	ck_assert_str_eq(buf, "none");
+
+	ck_assert_int_eq(wfd_video_formats_parse(&v, ""), -EINVAL);
+	ck_assert_int_eq(wfd_video_formats_parse(&v, "00 00 01 02 0000001f"), -EINVAL);
+	ck_assert_int_eq(wfd_video_formats_parse(&v, "00 00 01 02 1000000001 00000000 00000000 00 0000 0000 00 none none"), -EINVAL);
+	ck_assert_int_eq(wfd_video_formats_parse(&v, "00 00 01 02 00000001 00000000 00000000 00 0000 0000 00 none none x"), -EINVAL);
+}
+END_TEST
+
+START_TEST(audio_codecs)
+{
+	const struct wfd_audio_codec *c;
+	struct wfd_audio_codecs a;
+	char buf[128];
+	int r;
+
+	r = wfd_audio_codecs_parse(&a, "LPCM 00000003 00, aac 0000000F 02");
+	ck_assert_int_eq(r, 0);
+	ck_assert_int_eq(a.n_codecs, 2);
+
+	c = wfd_audio_codecs_find(&a, WFD_AUDIO_AAC);
+	ck_assert(c == &a.codecs[1]);
+	ck_assert_int_eq(c->modes, 0xf);
+	ck_assert_int_eq(c->latency, 2);
+	ck_assert(!wfd_audio_codecs_find(&a, WFD_AUDIO_AC3));
+
+	r = wfd_audio_codecs_format(&a, buf, sizeof(buf));
+	ck_assert_str_eq(buf, "LPCM 00000003 00, AAC 0000000f 02");
+
+	ck_assert_int_eq(wfd_audio_codecs_parse(&a, "none"), 0);
+	ck_assert_int_eq(a.n_codecs, 0);
+	ck_assert_int_eq(wfd_audio_codecs_parse(&a, "MP3 00000001 00"), -EINVAL);
+	ck_assert_int_eq(wfd_audio_codecs_parse(&a, "AAC 1 00, AAC 1 00, AAC 1 00, AAC 1 00, AAC 1 00"), -E2BIG);
+}
+END_TEST
+
+START_TEST(client_rtp_ports)
+{
+	struct wfd_client_rtp_ports p;
+	char buf[128];
+	int r;
+
+	r = wfd_client_rtp_ports_parse(&p, "RTP/AVP/UDP;unicast 1991 0 mode=play");
+	ck_assert_int_eq(r, 0);
+	ck_assert_int_eq(p.profile, WFD_RTP_UDP);
+	ck_assert_int_eq(p.port0, 1991);
+	ck_assert_int_eq(p.port1, 0);
+
+	p.profile = WFD_RTP_TCP;
+	r = wfd_client_rtp_ports_format(&p, buf, sizeof(buf));
+	ck_assert_str_eq(buf, "RTP/AVP/TCP;unicast 1991 0 mode=play");
+
+	ck_assert_int_eq(wfd_client_rtp_ports_parse(&p, "RTP/AVP/UDP;unicast 70000 0 mode=play"), -ERANGE);
+	ck_assert_int_eq(wfd_client_rtp_ports_parse(&p, "RTP/AVP/UDP;unicast 1991 0"), -EINVAL);
+}
+END_TEST
+
+START_TEST(uibc_capability)
+{
+	struct wfd_uibc_capability u;
+	char buf[256];
+	int r;
+
+	r = wfd_uibc_capability_parse(&u, "input_category_list=GENERIC, HIDC;"
+					  "generic_cap_list=Mouse,SingleTouch;"
+					  "hidc_cap_list=Keyboard/USB, Mouse/USB;port=1100");
+	ck_assert_int_eq(r, 0);
+	ck_assert(!u.none);
+	ck_assert_int_eq(u.categories, WFD_UIBC_GENERIC | WFD_UIBC_HIDC);
+	ck_assert_int_eq(u.generic, 1U << WFD_UIBC_MOUSE | 1U << WFD_UIBC_SINGLETOUCH);
+	ck_assert_int_eq(u.n_hidc, 2);
+	ck_assert_int_eq(u.hidc[0].input, WFD_UIBC_KEYBOARD);
+	ck_assert_int_eq(u.hidc[0].path, WFD_UIBC_USB);
+	ck_assert_int_eq(u.port, 1100);
+
+	r = wfd_uibc_capability_format(&u, buf, sizeof(buf));
+	ck_assert_str_eq(buf, "input_category_list=GENERIC, HIDC;"
+			      "generic_cap_list=Mouse, SingleTouch;"
+			      "hidc_cap_list=Keyboard/USB, Mouse/USB;port=1100");
+
+	/* key order does not matter */
+	r = wfd_uibc_capability_parse(&u, "port=none;hidc_cap_list=none;input_category_list=GENERIC");
+	ck_assert_int_eq(r, 0);
+	ck_assert_int_eq(u.categories, WFD_UIBC_GENERIC);
+	ck_assert_int_eq(u.n_hidc, 0);
+	ck_assert_int_eq(u.port, 0);
+
+	ck_assert_int_eq(wfd_uibc_capability_parse(&u, "none"), 0);
+	ck_assert(u.none);
+	ck_assert_int_eq(wfd_uibc_capability_parse(&u, "hidc_cap_list=Keyboard"), -EINVAL);
+	ck_assert_int_eq(wfd_uibc_capability_parse(&u, "colour=red"), -EINVAL);
+}
+END_TEST
+
+START_TEST(presentation_url)
+{
+	struct wfd_presentation_url u;
+	char buf[128];
+	int r;
+
+	r = wfd_presentation_url_parse(&u, "rtsp://192.168.77.1/wfd1.0/streamid=0 none");
+	ck_assert_int_eq(r, 0);
+	ck_assert_str_eq(u.url0, "rtsp://192.168.77.1/wfd1.0/streamid=0");
+	ck_assert_str_eq(u.url1, "");
+
+	r = wfd_presentation_url_format(&u, buf, sizeof(buf));
+	ck_assert_str_eq(buf, "rtsp://192.168.77.1/wfd1.0/streamid=0 none");
+
+	ck_assert_int_eq(wfd_presentation_url_parse(&u, "rtsp://a"), -EINVAL);
+}
+END_TEST
+
+TEST_DEFINE_CASE(params)
+	TEST(video_formats)
+	TEST(audio_codecs)
+	TEST(client_rtp_ports)
+	TEST(uibc_capability)
+	TEST(presentation_url)
+TEST_END_CASE
+
+TEST_DEFINE(
+	TEST_SUITE(wfd,
+		TEST_CASE(params),
+		TEST_END
+	)
+)
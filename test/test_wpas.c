@@ -17,6 +17,8 @@
  * along with MiracleCast; If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <sys/epoll.h>
+#include <sys/un.h>
 #include "test_common.h"
 #include "wpas.h"
 
@@ -432,6 +434,113 @@ START_TEST(msg_append)
 }
 END_TEST
 
+START_TEST(msg_dict)
+{
+	const char *s = NULL, *t = NULL;
+	struct wpas_message *m;
+	struct wpas *w;
+	char key[32];
+	uint32_t u32;
+	int32_t i32;
+	int r, i;
+
+	w = start_test_client();
+
+	r = wpas_message_new_event(w, "name", 5, &m);
+	ck_assert_int_ge(r, 0);
+
+	r = wpas_message_append(m,
+				"seeeee",
+				"plain",
+				"key", "first",
+				"key", "second",
+				"keys", "prefix",
+				"num", "-5",
+				"unum", "7");
+	ck_assert_int_ge(r, 0);
+
+	/* plain arguments are no keys, duplicates keep their first value */
+	r = wpas_message_dict_read(m, "plain", 's', &s);
+	ck_assert_int_eq(r, -ENOENT);
+	r = wpas_message_dict_read(m, "key", 's', &s);
+	ck_assert_int_ge(r, 0);
+	ck_assert_str_eq(s, "first");
+	r = wpas_message_dict_read(m, "keys", 's', &s);
+	ck_assert_int_ge(r, 0);
+	ck_assert_str_eq(s, "prefix");
+	r = wpas_message_dict_read(m, "ke", 's', &s);
+	ck_assert_int_eq(r, -ENOENT);
+	r = wpas_message_dict_read(m, "num", WPAS_TYPE_INT32, &i32);
+	ck_assert_int_ge(r, 0);
+	ck_assert_int_eq(i32, -5);
+	r = wpas_message_dict_read(m, "key", WPAS_TYPE_UINT32, &u32);
+	ck_assert_int_eq(r, -EINVAL);
+
+	/* appending invalidates the index */
+	for (i = 0; i < 64; ++i) {
+		sprintf(key, "k%d", i);
+		r = wpas_message_append(m, "e", key, "v");
+		ck_assert_int_ge(r, 0);
+	}
+
+	for (i = 0; i < 64; ++i) {
+		sprintf(key, "k%d", i);
+		r = wpas_message_dict_read(m, key, 's', &s);
+		ck_assert_int_ge(r, 0);
+		ck_assert_str_eq(s, "v");
+	}
+
+	s = NULL;
+	r = wpas_message_dict_read_many(m,
+					"key", 's', &s,
+					"missing", 's', &t,
+					"unum", WPAS_TYPE_UINT32, &u32,
+					NULL);
+	ck_assert_int_eq(r, 2);
+	ck_assert_str_eq(s, "first");
+	ck_assert(!t);
+	ck_assert_int_eq(u32, 7);
+
+	r = wpas_message_dict_read_many(m, "keys", WPAS_TYPE_INT32, &i32, NULL);
+	ck_assert_int_eq(r, -EINVAL);
+
+	wpas_message_unref(m);
+
+	stop_test_client();
+}
+END_TEST
+
+START_TEST(msg_ifname)
+{
+	struct wpas_message *m;
+	struct wpas *w;
+	int r;
+
+	w = start_test_client();
+
+	r = wpas_message_new_request(w, "SCAN_RESULTS", &m);
+	ck_assert_int_ge(r, 0);
+
+	r = wpas_message_set_ifname(m, "");
+	ck_assert_int_eq(r, -EINVAL);
+	r = wpas_message_set_ifname(m, "wlan0");
+	ck_assert_int_ge(r, 0);
+	ck_assert_str_eq(wpas_message_get_ifname(m), "wlan0");
+
+	r = wpas_message_seal(m);
+	ck_assert_int_ge(r, 0);
+	ck_assert_str_eq(wpas_message_get_raw(m),
+			 "IFNAME=wlan0 SCAN_RESULTS");
+
+	r = wpas_message_set_ifname(m, "wlan1");
+	ck_assert_int_eq(r, -EBUSY);
+
+	wpas_message_unref(m);
+
+	stop_test_client();
+}
+END_TEST
+
 TEST_DEFINE_CASE(msg)
 	TEST(msg_invalid_new)
 	TEST(msg_new_event)
@@ -439,6 +548,8 @@ TEST_DEFINE_CASE(msg)
 	TEST(msg_new_reply)
 	TEST(msg_peer)
 	TEST(msg_append)
+	TEST(msg_dict)
+	TEST(msg_ifname)
 TEST_END_CASE
 
 START_TEST(run_invalid_msg)
@@ -685,11 +796,143 @@ START_TEST(run_parse)
 }
 END_TEST
 
+/*
+ * Scripted wpa_supplicant with WALK_PEERS peers. It answers P2P_PEER FIRST and
+ * NEXT-<addr> with raw replies like the real one, and FAIL past the last peer.
+ */
+#define WALK_PEERS 128
+
+static unsigned int walk_cnt;
+
+static int walk_server_fn(sd_event_source *source,
+			  int fd,
+			  uint32_t mask,
+			  void *data)
+{
+	struct sockaddr_un src;
+	socklen_t srclen = sizeof(src);
+	char req[256], rep[512];
+	unsigned int i, a, b;
+	ssize_t l;
+	int len;
+
+	l = recvfrom(fd, req, sizeof(req) - 1, MSG_DONTWAIT,
+		     (struct sockaddr*)&src, &srclen);
+	if (l < 0)
+		return 0;
+	req[l] = 0;
+
+	if (!strcmp(req, "P2P_PEER FIRST"))
+		i = 0;
+	else if (sscanf(req, "P2P_PEER NEXT-02:00:00:00:%x:%x", &a, &b) == 2)
+		i = (a << 8 | b) + 1;
+	else
+		i = WALK_PEERS;
+
+	if (i >= WALK_PEERS)
+		len = sprintf(rep, "FAIL\n");
+	else
+		len = sprintf(rep, "02:00:00:00:%02x:%02x\n"
+			      "pri_dev_type=7-0050F204-1\n"
+			      "device_name=Sink %u\n"
+			      "config_methods=0x188\n"
+			      "wfd_subelems=000006011c440032\n",
+			      i >> 8, i & 0xff, i);
+
+	sendto(fd, rep, len, 0, (struct sockaddr*)&src, srclen);
+	return 0;
+}
+
+static void walk_next(const char *arg);
+
+static int walk_reply_fn(struct wpas *w,
+			 struct wpas_message *m,
+			 void *data)
+{
+	const char *mac, *name;
+	char arg[64];
+	int r;
+
+	if (!m)
+		ck_assert_msg(0, "HUP not expected");
+
+	if (wpas_message_is_fail(m)) {
+		sd_event_exit(event, 0);
+		return 0;
+	}
+
+	r = wpas_message_read(m, "s", &mac);
+	ck_assert_int_ge(r, 0);
+	r = wpas_message_dict_read(m, "device_name", 's', &name);
+	ck_assert_int_ge(r, 0);
+	++walk_cnt;
+
+	sprintf(arg, "NEXT-%s", mac);
+	walk_next(arg);
+	return 0;
+}
+
+static void walk_next(const char *arg)
+{
+	struct wpas_message *m;
+	int r;
+
+	r = wpas_message_new_request(client, "P2P_PEER", &m);
+	ck_assert_int_ge(r, 0);
+	r = wpas_message_append(m, "s", arg);
+	ck_assert_int_ge(r, 0);
+	r = wpas_call_async(client, m, walk_reply_fn, NULL, 0, NULL);
+	ck_assert_int_ge(r, 0);
+	wpas_message_unref(m);
+}
+
+/* the FIRST/NEXT-<addr> walk wifid runs on startup, one round trip a peer */
+START_TEST(run_peer_walk)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	sd_event_source *source;
+	int r, fd;
+
+	sprintf(addr.sun_path, "/tmp/miracle-test-walk-%d", getpid());
+	unlink(addr.sun_path);
+
+	fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	ck_assert_int_ge(fd, 0);
+	r = bind(fd, (struct sockaddr*)&addr, sizeof(addr));
+	ck_assert_int_ge(r, 0);
+
+	r = sd_event_default(&event);
+	ck_assert_int_ge(r, 0);
+	r = sd_event_add_io(event, &source, fd, EPOLLIN, walk_server_fn, NULL);
+	ck_assert_int_ge(r, 0);
+
+	r = wpas_open(addr.sun_path, &client);
+	ck_assert_int_ge(r, 0);
+	r = wpas_attach_event(client, NULL, 0);
+	ck_assert_int_ge(r, 0);
+
+	walk_cnt = 0;
+	walk_next("FIRST");
+	r = sd_event_loop(event);
+	ck_assert_int_ge(r, 0);
+	ck_assert_int_eq(walk_cnt, WALK_PEERS);
+
+	wpas_unref(client);
+	client = NULL;
+	sd_event_source_unref(source);
+	close(fd);
+	unlink(addr.sun_path);
+	sd_event_unref(event);
+	event = NULL;
+}
+END_TEST
+
 TEST_DEFINE_CASE(run)
 	TEST(run_invalid_msg)
 	TEST(run_msg)
 	TEST(run_send)
 	TEST(run_parse)
+	TEST(run_peer_walk)
 TEST_END_CASE
 
 TEST_DEFINE(